@@ -0,0 +1,306 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "apic.h"
+#include "cpu.h"
+#include "drivers/acpi.h"
+#include "drivers/firmware.h"
+#include "idt.h"
+#include "paging.h"
+#include "pic.h"
+#include <stddef.h>
+
+#define MSR_APIC_BASE 0x1B
+#define APIC_BASE_ENABLE (1 << 11)
+
+// Local APIC registers
+#define LAPIC_ID 0x020
+#define LAPIC_TPR 0x080
+#define LAPIC_EOI 0x0B0
+#define LAPIC_SVR 0x0F0
+#define LAPIC_SVR_ENABLE (1 << 8)
+#define LAPIC_SIZE 0x400
+
+// I/O APIC registers
+#define IOAPIC_REGSEL 0x00
+#define IOAPIC_WINDOW 0x10
+#define IOAPIC_VERSION 0x01
+#define IOAPIC_REDTBL(n) (0x10 + 2 * (n))
+#define IOAPIC_SIZE 0x20
+
+// Redirection entry bits
+#define REDIR_ACTIVE_LOW (1 << 13)
+#define REDIR_LEVEL (1 << 15)
+#define REDIR_MASKED (1 << 16)
+
+typedef struct
+{
+  volatile uint32_t *base;
+  uint32_t gsi_base;
+  uint32_t pins;
+} ioapic_t;
+
+static volatile uint32_t *lapic = NULL;
+static ioapic_t ioapics[ACPI_MAX_IOAPICS];
+static uint32_t ioapic_count = 0;
+static madt_info_t madt;
+static uint8_t irq_affinity[IRQ_COUNT]; // CPU index per ISA IRQ
+static bool enabled = false;
+
+static inline uint32_t
+lapic_read (uint32_t reg)
+{
+  return lapic[reg / 4];
+}
+
+static inline void
+lapic_write (uint32_t reg, uint32_t value)
+{
+  lapic[reg / 4] = value;
+}
+
+static uint32_t
+ioapic_read (ioapic_t *ioapic, uint8_t reg)
+{
+  ioapic->base[IOAPIC_REGSEL / 4] = reg;
+  return ioapic->base[IOAPIC_WINDOW / 4];
+}
+
+static void
+ioapic_write (ioapic_t *ioapic, uint8_t reg, uint32_t value)
+{
+  ioapic->base[IOAPIC_REGSEL / 4] = reg;
+  ioapic->base[IOAPIC_WINDOW / 4] = value;
+}
+
+static ioapic_t *
+ioapic_for_gsi (uint32_t gsi, uint32_t *pin)
+{
+  for (uint32_t i = 0; i < ioapic_count; i++)
+    {
+      if (gsi >= ioapics[i].gsi_base
+          && gsi < ioapics[i].gsi_base + ioapics[i].pins)
+        {
+          *pin = gsi - ioapics[i].gsi_base;
+          return &ioapics[i];
+        }
+    }
+  return NULL;
+}
+
+static void
+ioapic_set_mask (uint32_t gsi, bool masked)
+{
+  uint32_t pin;
+  ioapic_t *ioapic = ioapic_for_gsi (gsi, &pin);
+  if (!ioapic)
+    return;
+
+  uint32_t low = ioapic_read (ioapic, IOAPIC_REDTBL (pin));
+  low = masked ? (low | REDIR_MASKED) : (low & ~REDIR_MASKED);
+  ioapic_write (ioapic, IOAPIC_REDTBL (pin), low);
+}
+
+void
+lapic_eoi (void)
+{
+  lapic_write (LAPIC_EOI, 0);
+}
+
+uint32_t
+lapic_id (void)
+{
+  return lapic_read (LAPIC_ID) >> 24;
+}
+
+bool
+apic_enabled (void)
+{
+  return enabled;
+}
+
+static void
+apic_chip_eoi (uint64_t vector)
+{
+  if (vector != APIC_SPURIOUS_VECTOR)
+    lapic_eoi ();
+}
+
+static bool isa_gsi_taken (int irq);
+
+static void
+apic_chip_mask (uint8_t irq)
+{
+  if (!isa_gsi_taken (irq))
+    ioapic_set_mask (madt.isa_irqs[irq].gsi, true);
+}
+
+static void
+apic_chip_unmask (uint8_t irq)
+{
+  if (!isa_gsi_taken (irq))
+    ioapic_set_mask (madt.isa_irqs[irq].gsi, false);
+}
+
+static const struct irq_chip apic_chip = {
+  .eoi = apic_chip_eoi,
+  .mask = apic_chip_mask,
+  .unmask = apic_chip_unmask,
+};
+
+/**
+ * @brief Programs an I/O APIC redirection entry, masked.
+ *
+ * @param gsi Global system interrupt to route.
+ * @param vector IDT vector to deliver.
+ * @param level Level triggered when true, edge triggered otherwise.
+ * @param active_low Active low polarity when true.
+ * @param cpu Index of the CPU to deliver to (fixed, physical mode).
+ *
+ * @return 0 on success, or a negative value on error.
+ */
+int
+ioapic_route_gsi (uint32_t gsi, uint8_t vector, bool level, bool active_low,
+                  uint32_t cpu)
+{
+  uint32_t pin;
+  ioapic_t *ioapic = ioapic_for_gsi (gsi, &pin);
+  struct cpu_local *target = cpu_get (cpu);
+  if (!ioapic || !target || !target->online)
+    return -1;
+
+  uint32_t low = vector | REDIR_MASKED;
+  if (level)
+    low |= REDIR_LEVEL;
+  if (active_low)
+    low |= REDIR_ACTIVE_LOW;
+
+  ioapic_write (ioapic, IOAPIC_REDTBL (pin), REDIR_MASKED);
+  ioapic_write (ioapic, IOAPIC_REDTBL (pin) + 1, target->apic_id << 24);
+  ioapic_write (ioapic, IOAPIC_REDTBL (pin), low);
+  return 0;
+}
+
+/**
+ * @brief Moves an ISA IRQ to another CPU.
+ *
+ * Only the destination field is rewritten, so the mask state is kept.
+ *
+ * @return 0 on success, or a negative value if the CPU cannot take
+ *         interrupts.
+ */
+int
+apic_set_irq_affinity (uint8_t irq, uint32_t cpu)
+{
+  struct cpu_local *target = cpu_get (cpu);
+  uint32_t pin;
+
+  if (!enabled || irq >= IRQ_COUNT || !target || !target->online)
+    return -1;
+
+  ioapic_t *ioapic = ioapic_for_gsi (madt.isa_irqs[irq].gsi, &pin);
+  if (!ioapic)
+    return -1;
+
+  ioapic_write (ioapic, IOAPIC_REDTBL (pin) + 1, target->apic_id << 24);
+  irq_affinity[irq] = cpu;
+  return 0;
+}
+
+int
+apic_get_irq_affinity (uint8_t irq)
+{
+  if (!enabled || irq >= IRQ_COUNT)
+    return -1;
+  return irq_affinity[irq];
+}
+
+// An override can move another ISA IRQ onto this IRQ's identity GSI
+// (IRQ 0 on GSI 2 is the usual case); the override wins.
+static bool
+isa_gsi_taken (int irq)
+{
+  if (madt.isa_irqs[irq].gsi != (uint32_t)irq)
+    return false;
+
+  for (int other = 0; other < IRQ_COUNT; other++)
+    {
+      if (other != irq && madt.isa_irqs[other].gsi == (uint32_t)irq)
+        return true;
+    }
+  return false;
+}
+
+/**
+ * @brief Switches interrupt delivery from the 8259 PIC to the APICs.
+ *
+ * ISA IRQs keep their vectors (IRQ_BASE + irq) and are routed to the
+ * boot CPU using the MADT overrides; the PIC is masked afterwards.
+ *
+ * @return false if the firmware describes no I/O APIC, in which case
+ *         the PIC stays in use.
+ */
+bool
+init_apic (void)
+{
+  if (!acpi_init (firmware_get_rsdp_address ()) || !acpi_parse_madt (&madt))
+    return false;
+
+  // Map every register window before touching the hardware, so that a
+  // failure leaves the 8259 PIC in charge
+  lapic = paging_map_mmio (madt.lapic_address, LAPIC_SIZE);
+  if (!lapic)
+    return false;
+
+  for (uint32_t i = 0; i < madt.ioapic_count; i++)
+    {
+      ioapic_t *ioapic = &ioapics[ioapic_count];
+      ioapic->base = paging_map_mmio (madt.ioapics[i].address, IOAPIC_SIZE);
+      if (!ioapic->base)
+        {
+          ioapic_count = 0;
+          return false;
+        }
+      ioapic_count++;
+    }
+
+  wrmsr (MSR_APIC_BASE, rdmsr (MSR_APIC_BASE) | APIC_BASE_ENABLE);
+  lapic_write (LAPIC_TPR, 0);
+  lapic_write (LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+
+  this_cpu ()->apic_id = lapic_id ();
+  for (uint32_t i = 0; i < madt.cpu_count; i++)
+    cpu_register (madt.cpu_apic_ids[i]);
+
+  for (uint32_t i = 0; i < madt.ioapic_count; i++)
+    {
+      ioapic_t *ioapic = &ioapics[i];
+      ioapic->gsi_base = madt.ioapics[i].gsi_base;
+      ioapic->pins = ((ioapic_read (ioapic, IOAPIC_VERSION) >> 16) & 0xFF) + 1;
+
+      for (uint32_t pin = 0; pin < ioapic->pins; pin++)
+        ioapic_write (ioapic, IOAPIC_REDTBL (pin), REDIR_MASKED);
+    }
+
+  for (int irq = 0; irq < IRQ_COUNT; irq++)
+    {
+      isa_irq_info_t *isa = &madt.isa_irqs[irq];
+      if (isa_gsi_taken (irq))
+        continue;
+
+      bool level = (isa->flags & ACPI_TRIGGER_MASK) == ACPI_TRIGGER_LEVEL;
+      bool active_low
+          = (isa->flags & ACPI_POLARITY_MASK) == ACPI_POLARITY_LOW;
+
+      ioapic_route_gsi (isa->gsi, IRQ_BASE + irq, level, active_low, 0);
+      irq_affinity[irq] = 0;
+    }
+
+  pic_disable ();
+  enabled = true;
+  set_irq_chip (&apic_chip);
+  return true;
+}
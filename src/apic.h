@@ -0,0 +1,24 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef APIC_H
+#define APIC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define APIC_SPURIOUS_VECTOR 0xFF
+
+bool init_apic (void);
+bool apic_enabled (void);
+void lapic_eoi (void);
+uint32_t lapic_id (void);
+int apic_set_irq_affinity (uint8_t irq, uint32_t cpu);
+int apic_get_irq_affinity (uint8_t irq);
+int ioapic_route_gsi (uint32_t gsi, uint8_t vector, bool level,
+                      bool active_low, uint32_t cpu);
+
+#endif
@@ -0,0 +1,161 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "clonebench.h"
+#include "drivers/timer.h"
+#include "klog.h"
+#include "memory.h"
+#include "paging.h"
+#include "process.h"
+#include "workqueue.h"
+#include <stddef.h>
+
+#define TEST_VA PAGING_PRIVATE_BASE // Private, and used by nothing else
+#define VALUE_BEFORE 0x1111111111111111ULL
+#define VALUE_PARENT 0x2222222222222222ULL
+#define VALUE_CHILD 0x3333333333333333ULL
+
+static void bench_work_fn (void *arg);
+static struct work bench_work = WORK_INIT (bench_work_fn, 0);
+
+// Reported by the child; kernel data is the same in every address space
+static volatile uint64_t child_start;
+static volatile uint64_t child_saw;  // Word 0, which only the parent set
+static volatile uint64_t child_kept; // Word 1 after the child set it
+static volatile uint8_t child_done;
+
+static void
+child_main (void)
+{
+  volatile uint64_t *word = (volatile uint64_t *)TEST_VA;
+
+  child_start = read_tsc ();
+  child_saw = word[0];
+  word[1] = VALUE_CHILD;
+  child_kept = word[1];
+
+  // Exit before the parent runs again, so the next clone reuses the slot
+  asm volatile ("cli" : : : "memory");
+  child_done = 1;
+  exit_process ();
+}
+
+/**
+ * @brief Clones the caller repeatedly and checks copy-on-write isolation.
+ *
+ * A page is mapped at the start of the private range for the run.
+ * After each clone the parent overwrites one word and the child the
+ * other; each must still see the old value in the word the other side
+ * wrote.
+ *
+ * @return 0 on success, or -1 if the page or a clone could not be made.
+ */
+int
+clonebench_run (struct clonebench_result *result)
+{
+  uint64_t *pml4 = paging_current ();
+  volatile uint64_t *word = (volatile uint64_t *)TEST_VA;
+  uint64_t clone_cycles = 0;
+  uint64_t start_cycles = 0;
+  uint64_t cow_cycles = 0;
+  uint32_t rounds = 0;
+  int ret = 0;
+
+  result->rounds = 0;
+  void *page = alloc_page ();
+  if (!page)
+    return -1;
+  if (paging_map (pml4, TEST_VA, paging_virt_to_phys (pml4, (uintptr_t)page),
+                  PAGE_WRITABLE)
+      < 0)
+    {
+      free_page (page);
+      return -1;
+    }
+
+  result->isolated = 1;
+  for (; rounds < CLONEBENCH_ROUNDS; rounds++)
+    {
+      word[0] = VALUE_BEFORE;
+      word[1] = VALUE_BEFORE;
+      child_done = 0;
+
+      uint64_t start = read_tsc ();
+      int64_t pid = clone_process (child_main);
+      uint64_t cloned = read_tsc ();
+      if (pid < 0)
+        {
+          ret = -1;
+          break;
+        }
+
+      word[0] = VALUE_PARENT;
+      cow_cycles += read_tsc () - cloned;
+      clone_cycles += cloned - start;
+
+      while (!child_done)
+        schedule ();
+      start_cycles += child_start - start;
+
+      if (child_saw != VALUE_BEFORE || child_kept != VALUE_CHILD
+          || word[0] != VALUE_PARENT || word[1] != VALUE_BEFORE)
+        result->isolated = 0;
+    }
+
+  // The page the parent ended up with; the children's go as they are
+  // reaped
+  uint64_t *pte = paging_lookup (pml4, TEST_VA);
+  void *mine = (void *)(uintptr_t)(*pte & PAGE_ADDR_MASK);
+  paging_unmap (pml4, TEST_VA);
+  free_page (mine);
+
+  uint32_t n = rounds ? rounds : 1;
+  result->rounds = rounds;
+  result->clone_cycles = clone_cycles / n;
+  result->start_cycles = start_cycles / n;
+  result->cow_cycles = cow_cycles / n;
+  return ret;
+}
+
+// Cycles as nanoseconds, or as cycles if the TSC was never calibrated
+static uint64_t
+to_time (uint64_t cycles, uint64_t hz)
+{
+  return hz ? cycles * 1000000000 / hz : cycles;
+}
+
+static void
+bench_work_fn (void *arg)
+{
+  struct clonebench_result r;
+  uint64_t hz = tsc_frequency ();
+  const char *unit = hz ? "ns" : "cycles";
+
+  if (clonebench_run (&r) < 0 && !r.rounds)
+    {
+      kprintf ("clonebench: clone failed\n");
+      return;
+    }
+
+  kprintf ("clonebench: %u clones, %lu %s each, child running after "
+           "%lu %s\n",
+           r.rounds, to_time (r.clone_cycles, hz), unit,
+           to_time (r.start_cycles, hz), unit);
+  kprintf ("clonebench: %lu %s per copy-on-write fault, %s\n",
+           to_time (r.cow_cycles, hz), unit,
+           r.isolated ? "isolated" : "ISOLATION BROKEN");
+}
+
+/**
+ * @brief Runs the clone test from a worker thread.
+ *
+ * Safe from interrupt context; results go to the kernel log.
+ */
+void
+clonebench_start (void)
+{
+  queue_work (&bench_work);
+}
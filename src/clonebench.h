@@ -0,0 +1,32 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef CLONEBENCH_H
+#define CLONEBENCH_H
+
+#include <stdint.h>
+
+#define CLONEBENCH_ROUNDS 16 // Clones per run
+
+/**
+ * Result of one run
+ * Each round clones the caller with clone_process, then parent and
+ * child write to a page they share copy-on-write. Times are average
+ * TSC cycles per round.
+ */
+struct clonebench_result
+{
+  uint32_t rounds;       // Clones made
+  uint8_t isolated;      // Neither side ever saw the other's writes
+  uint64_t clone_cycles; // Spent in clone_process
+  uint64_t start_cycles; // From calling clone_process to the child running
+  uint64_t cow_cycles;   // The parent's first write to the shared page
+};
+
+int clonebench_run (struct clonebench_result *result);
+void clonebench_start (void);
+
+#endif
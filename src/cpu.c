@@ -0,0 +1,93 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "cpu.h"
+
+#define KERNEL_STACK_SIZE 16384
+
+static struct cpu_local cpus[MAX_CPUS];
+static uint32_t cpus_registered = 1; // The boot CPU is always cpus[0]
+static uint32_t cpus_online = 1;
+static uint8_t boot_cpu_stack[KERNEL_STACK_SIZE]
+    __attribute__ ((aligned (16)));
+
+/**
+ * @brief Points GS at the boot CPU's per-CPU data.
+ *
+ * While running in the kernel GS_BASE holds the per-CPU pointer and
+ * KERNEL_GS_BASE the user value; entry paths from user mode swap them.
+ */
+void
+init_cpu_local (void)
+{
+  struct cpu_local *boot_cpu = &cpus[0];
+
+  boot_cpu->kernel_rsp = (uint64_t)(boot_cpu_stack + KERNEL_STACK_SIZE);
+  boot_cpu->user_rsp = 0;
+  boot_cpu->user_return_rsp = 0;
+  boot_cpu->self = boot_cpu;
+  boot_cpu->index = 0;
+  boot_cpu->online = 1;
+
+  wrmsr (MSR_GS_BASE, (uint64_t)boot_cpu);
+  wrmsr (MSR_KERNEL_GS_BASE, 0);
+}
+
+/**
+ * @brief Adds a CPU found in the firmware tables.
+ *
+ * The boot CPU keeps index 0 and only has its APIC ID filled in. Other
+ * CPUs stay offline until something starts them.
+ *
+ * @return The CPU index, or a negative value if the table is full.
+ */
+int
+cpu_register (uint32_t apic_id)
+{
+  if (apic_id == cpus[0].apic_id)
+    return 0;
+  if (cpus_registered >= MAX_CPUS)
+    return -1;
+
+  struct cpu_local *cpu = &cpus[cpus_registered];
+  cpu->self = cpu;
+  cpu->index = cpus_registered;
+  cpu->apic_id = apic_id;
+  cpu->online = 0;
+  return cpus_registered++;
+}
+
+uint32_t
+cpu_count (void)
+{
+  return cpus_registered;
+}
+
+/**
+ * @brief Marks a CPU as running; called by each AP once it has started.
+ */
+void
+cpu_set_online (struct cpu_local *cpu)
+{
+  if (!cpu->online)
+    {
+      __atomic_store_n (&cpu->online, 1, __ATOMIC_RELEASE);
+      __atomic_add_fetch (&cpus_online, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// CPUs that finished startup, the boot CPU included
+uint32_t
+cpu_online_count (void)
+{
+  return __atomic_load_n (&cpus_online, __ATOMIC_RELAXED);
+}
+
+struct cpu_local *
+cpu_get (uint32_t index)
+{
+  return index < cpus_registered ? &cpus[index] : 0;
+}
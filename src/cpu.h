@@ -0,0 +1,98 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+
+// Model specific registers
+#define MSR_EFER 0xC0000080
+#define MSR_STAR 0xC0000081
+#define MSR_LSTAR 0xC0000082
+#define MSR_SFMASK 0xC0000084
+#define MSR_GS_BASE 0xC0000101
+#define MSR_KERNEL_GS_BASE 0xC0000102
+
+#define EFER_SCE (1 << 0) // SYSCALL/SYSRET enable
+#define RFLAGS_IF (1 << 9)
+
+#define MAX_CPUS 16
+
+/**
+ * Per-CPU data reached through GS
+ * Field offsets are used from assembly, keep them in sync with the
+ * CPU_* definitions in syscall.asm.
+ */
+struct cpu_local
+{
+  uint64_t kernel_rsp;      // Stack loaded on SYSCALL entry
+  uint64_t user_rsp;        // Scratch slot for the user stack pointer
+  uint64_t user_return_rsp; // Kernel frame run_user returns to
+  struct cpu_local *self;   // Address of this structure
+  uint32_t index;           // Position in the CPU table
+  uint32_t apic_id;         // Local APIC ID
+  uint8_t online;           // Running and able to take interrupts
+};
+
+void init_cpu_local (void);
+int cpu_register (uint32_t apic_id);
+uint32_t cpu_count (void);
+void cpu_set_online (struct cpu_local *cpu);
+uint32_t cpu_online_count (void);
+struct cpu_local *cpu_get (uint32_t index);
+
+static inline uint64_t
+rdmsr (uint32_t msr)
+{
+  uint32_t lo, hi;
+  asm volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void
+wrmsr (uint32_t msr, uint64_t value)
+{
+  uint32_t lo = value, hi = value >> 32;
+  asm volatile ("wrmsr" : : "c"(msr), "a"(lo), "d"(hi));
+}
+
+static inline void
+cpuid (uint32_t leaf, uint32_t subleaf, uint32_t *a, uint32_t *b, uint32_t *c,
+       uint32_t *d)
+{
+  asm volatile ("cpuid"
+                : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d)
+                : "a"(leaf), "c"(subleaf));
+}
+
+// Disable interrupts, returning the previous RFLAGS for irq_restore
+static inline uint64_t
+irq_save (void)
+{
+  uint64_t flags;
+  asm volatile ("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+  return flags;
+}
+
+static inline void
+irq_restore (uint64_t flags)
+{
+  if (flags & RFLAGS_IF)
+    asm volatile ("sti" : : : "memory");
+}
+
+static inline struct cpu_local *
+this_cpu (void)
+{
+  struct cpu_local *cpu;
+  asm volatile ("mov %%gs:%c1, %0"
+                : "=r"(cpu)
+                : "i"(__builtin_offsetof (struct cpu_local, self)));
+  return cpu;
+}
+
+#endif
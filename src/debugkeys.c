@@ -0,0 +1,53 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "debugkeys.h"
+#include "clonebench.h"
+#include "fpu.h"
+#include "ipcbench.h"
+#include "klog.h"
+#include "syscall.h"
+#include "drivers/blkbench.h"
+#include <stddef.h>
+
+/*
+ * Function keys that start benchmarks and debugging aids. Each action
+ * must be safe from interrupt context; the benchmarks only queue work
+ * and report to the kernel log.
+ */
+struct debug_key
+{
+  uint8_t scancode;
+  void (*action) (void);
+};
+
+static const struct debug_key debug_keys[] = {
+  { 0x41, fpu_bench_start },     // F7 times FPU state switching
+  { 0x42, syscall_bench_start }, // F8 times the system call entry paths
+  { 0x43, clonebench_start },    // F9 tests and times clone_process
+  { 0x44, ipcbench_start },      // F10 benchmarks the IPC channels
+  { 0x57, blkbench_start },      // F11 benchmarks the block devices
+  { 0x58, klog_dump },           // F12 replays the kernel log
+};
+
+/**
+ * @brief Runs the action bound to a key press, if there is one.
+ *
+ * @return 1 if the scancode was a debug key, 0 otherwise.
+ */
+int
+debugkeys_handle (uint8_t scancode)
+{
+  for (size_t i = 0; i < sizeof (debug_keys) / sizeof (debug_keys[0]); i++)
+    {
+      if (debug_keys[i].scancode == scancode)
+        {
+          debug_keys[i].action ();
+          return 1;
+        }
+    }
+  return 0;
+}
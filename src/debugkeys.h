@@ -0,0 +1,14 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef DEBUGKEYS_H
+#define DEBUGKEYS_H
+
+#include <stdint.h>
+
+int debugkeys_handle (uint8_t scancode);
+
+#endif
@@ -0,0 +1,242 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "acpi.h"
+#include "../io.h"
+#include <stddef.h>
+
+#define EBDA_SEGMENT_PTR 0x40E
+#define BIOS_AREA_START 0xE0000
+#define BIOS_AREA_END 0x100000
+
+// MADT entry types
+#define MADT_LOCAL_APIC 0
+#define MADT_IO_APIC 1
+#define MADT_INTERRUPT_OVERRIDE 2
+#define MADT_LAPIC_ADDRESS_OVERRIDE 5
+
+#define MADT_PCAT_COMPAT (1 << 0)
+#define MADT_CPU_ENABLED (1 << 0)
+
+typedef struct
+{
+  char signature[8];
+  uint8_t checksum;
+  char oem_id[6];
+  uint8_t revision;
+  uint32_t rsdt_address;
+  // ACPI 2.0+
+  uint32_t length;
+  uint64_t xsdt_address;
+  uint8_t extended_checksum;
+  uint8_t reserved[3];
+} __attribute__ ((packed)) acpi_rsdp_t;
+
+typedef struct
+{
+  acpi_sdt_header_t header;
+  uint32_t lapic_address;
+  uint32_t flags;
+} __attribute__ ((packed)) acpi_madt_t;
+
+typedef struct
+{
+  uint8_t type;
+  uint8_t length;
+} __attribute__ ((packed)) madt_entry_t;
+
+static acpi_sdt_header_t *root_table = NULL;
+static bool root_is_xsdt = false;
+
+static bool
+checksum_ok (const void *data, uint32_t length)
+{
+  const uint8_t *bytes = data;
+  uint8_t sum = 0;
+
+  for (uint32_t i = 0; i < length; i++)
+    sum += bytes[i];
+  return sum == 0;
+}
+
+static bool
+signature_is (const char *a, const char *b, int length)
+{
+  for (int i = 0; i < length; i++)
+    {
+      if (a[i] != b[i])
+        return false;
+    }
+  return true;
+}
+
+static acpi_rsdp_t *
+scan_rsdp (uintptr_t start, uintptr_t end)
+{
+  for (uintptr_t addr = start; addr < end; addr += 16)
+    {
+      acpi_rsdp_t *rsdp = (acpi_rsdp_t *)addr;
+      if (signature_is (rsdp->signature, "RSD PTR ", 8)
+          && checksum_ok (rsdp, 20))
+        {
+          return rsdp;
+        }
+    }
+  return NULL;
+}
+
+/**
+ * @brief Locates the RSDP and the root system description table.
+ *
+ * @param rsdp_address RSDP reported by the firmware, or 0 to search the
+ *                     EBDA and the BIOS read-only area.
+ *
+ * @return true if a valid RSDT or XSDT was found.
+ */
+bool
+acpi_init (uint64_t rsdp_address)
+{
+  acpi_rsdp_t *rsdp = (acpi_rsdp_t *)(uintptr_t)rsdp_address;
+
+  if (!rsdp)
+    {
+      uintptr_t ebda = ((uintptr_t)read_memory (EBDA_SEGMENT_PTR)
+                        | (uintptr_t)read_memory (EBDA_SEGMENT_PTR + 1) << 8)
+                       << 4;
+      if (ebda)
+        rsdp = scan_rsdp (ebda, ebda + 1024);
+      if (!rsdp)
+        rsdp = scan_rsdp (BIOS_AREA_START, BIOS_AREA_END);
+    }
+
+  if (!rsdp)
+    return false;
+
+  if (rsdp->revision >= 2 && rsdp->xsdt_address
+      && checksum_ok (rsdp, rsdp->length))
+    {
+      root_table = (acpi_sdt_header_t *)(uintptr_t)rsdp->xsdt_address;
+      root_is_xsdt = true;
+    }
+  else
+    {
+      root_table = (acpi_sdt_header_t *)(uintptr_t)rsdp->rsdt_address;
+      root_is_xsdt = false;
+    }
+
+  if (!checksum_ok (root_table, root_table->length))
+    {
+      root_table = NULL;
+      return false;
+    }
+
+  return true;
+}
+
+/**
+ * @brief Finds a system description table by its signature.
+ *
+ * @return The table, or NULL if it is missing or fails its checksum.
+ */
+acpi_sdt_header_t *
+acpi_find_table (const char *signature)
+{
+  if (!root_table)
+    return NULL;
+
+  uint32_t entry_size = root_is_xsdt ? 8 : 4;
+  uint32_t count = (root_table->length - sizeof (acpi_sdt_header_t))
+                   / entry_size;
+  uint8_t *entries = (uint8_t *)(root_table + 1);
+
+  for (uint32_t i = 0; i < count; i++)
+    {
+      uint64_t address = root_is_xsdt
+                             ? *(uint64_t *)(entries + i * entry_size)
+                             : *(uint32_t *)(entries + i * entry_size);
+      acpi_sdt_header_t *table = (acpi_sdt_header_t *)(uintptr_t)address;
+
+      if (signature_is (table->signature, signature, 4)
+          && checksum_ok (table, table->length))
+        {
+          return table;
+        }
+    }
+
+  return NULL;
+}
+
+/**
+ * @brief Collects CPUs, I/O APICs and ISA IRQ routing from the MADT.
+ *
+ * ISA IRQs without an override are identity-mapped to GSIs, active high
+ * and edge triggered.
+ */
+bool
+acpi_parse_madt (madt_info_t *info)
+{
+  acpi_madt_t *madt = (acpi_madt_t *)acpi_find_table ("APIC");
+  if (!madt || !info)
+    return false;
+
+  info->lapic_address = madt->lapic_address;
+  info->cpu_count = 0;
+  info->ioapic_count = 0;
+  info->has_8259 = madt->flags & MADT_PCAT_COMPAT;
+
+  for (int i = 0; i < ACPI_ISA_IRQS; i++)
+    {
+      info->isa_irqs[i].gsi = i;
+      info->isa_irqs[i].flags = 0;
+    }
+
+  uint8_t *ptr = (uint8_t *)(madt + 1);
+  uint8_t *end = (uint8_t *)madt + madt->header.length;
+
+  while (ptr + sizeof (madt_entry_t) <= end)
+    {
+      madt_entry_t *entry = (madt_entry_t *)ptr;
+      if (entry->length < sizeof (madt_entry_t))
+        break;
+
+      switch (entry->type)
+        {
+        case MADT_LOCAL_APIC:
+          // acpi_processor_id, apic_id, flags
+          if ((*(uint32_t *)(ptr + 4) & MADT_CPU_ENABLED)
+              && info->cpu_count < ACPI_MAX_CPUS)
+            {
+              info->cpu_apic_ids[info->cpu_count++] = ptr[3];
+            }
+          break;
+        case MADT_IO_APIC:
+          // id, reserved, address, gsi_base
+          if (info->ioapic_count < ACPI_MAX_IOAPICS)
+            {
+              ioapic_info_t *ioapic = &info->ioapics[info->ioapic_count++];
+              ioapic->id = ptr[2];
+              ioapic->address = *(uint32_t *)(ptr + 4);
+              ioapic->gsi_base = *(uint32_t *)(ptr + 8);
+            }
+          break;
+        case MADT_INTERRUPT_OVERRIDE:
+          // bus, source, gsi, flags
+          if (ptr[3] < ACPI_ISA_IRQS)
+            {
+              info->isa_irqs[ptr[3]].gsi = *(uint32_t *)(ptr + 4);
+              info->isa_irqs[ptr[3]].flags = *(uint16_t *)(ptr + 8);
+            }
+          break;
+        case MADT_LAPIC_ADDRESS_OVERRIDE:
+          info->lapic_address = *(uint64_t *)(ptr + 4);
+          break;
+        }
+
+      ptr += entry->length;
+    }
+
+  return info->ioapic_count > 0;
+}
@@ -0,0 +1,66 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ACPI_MAX_CPUS 16
+#define ACPI_MAX_IOAPICS 4
+#define ACPI_ISA_IRQS 16
+
+// MPS INTI flags from interrupt source overrides
+#define ACPI_POLARITY_MASK 0x3
+#define ACPI_POLARITY_LOW 0x3
+#define ACPI_TRIGGER_MASK 0xC
+#define ACPI_TRIGGER_LEVEL 0xC
+
+// Common header of every ACPI system description table
+typedef struct
+{
+  char signature[4];
+  uint32_t length;
+  uint8_t revision;
+  uint8_t checksum;
+  char oem_id[6];
+  char oem_table_id[8];
+  uint32_t oem_revision;
+  uint32_t creator_id;
+  uint32_t creator_revision;
+} __attribute__ ((packed)) acpi_sdt_header_t;
+
+typedef struct
+{
+  uint8_t id;
+  uint32_t address;
+  uint32_t gsi_base;
+} ioapic_info_t;
+
+typedef struct
+{
+  uint32_t gsi;   // Global system interrupt the ISA IRQ is wired to
+  uint16_t flags; // Polarity and trigger mode
+} isa_irq_info_t;
+
+// Interrupt topology described by the MADT
+typedef struct
+{
+  uint64_t lapic_address;
+  uint32_t cpu_count;
+  uint8_t cpu_apic_ids[ACPI_MAX_CPUS];
+  uint32_t ioapic_count;
+  ioapic_info_t ioapics[ACPI_MAX_IOAPICS];
+  isa_irq_info_t isa_irqs[ACPI_ISA_IRQS];
+  bool has_8259; // PC-AT compatible PICs are present
+} madt_info_t;
+
+bool acpi_init (uint64_t rsdp_address);
+acpi_sdt_header_t *acpi_find_table (const char *signature);
+bool acpi_parse_madt (madt_info_t *info);
+
+#endif // ACPI_H
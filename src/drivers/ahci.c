@@ -0,0 +1,717 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "ahci.h"
+#include "pci.h"
+#include "../apic.h"
+#include "../cpu.h"
+#include "../idt.h"
+#include "../klog.h"
+#include "../memory.h"
+#include "../paging.h"
+#include "../process.h"
+#include <stddef.h>
+
+#define PCI_AHCI_PROG_IF 0x01
+#define AHCI_ABAR 5
+#define AHCI_ABAR_SIZE 0x1100
+
+// HBA registers
+#define HBA_CAP 0x00
+#define HBA_GHC 0x04
+#define HBA_IS 0x08
+#define HBA_PI 0x0C
+
+#define CAP_NCS_SHIFT 8
+#define CAP_NCS_MASK 0x1F
+#define CAP_SNCQ (1U << 30)
+
+#define GHC_IE (1U << 1)
+#define GHC_AE (1U << 31)
+
+// Port registers, relative to 0x100 + port * 0x80
+#define PORT_BASE(n) (0x100 + (n) * 0x80)
+#define PORT_CLB 0x00
+#define PORT_CLBU 0x04
+#define PORT_FB 0x08
+#define PORT_FBU 0x0C
+#define PORT_IS 0x10
+#define PORT_IE 0x14
+#define PORT_CMD 0x18
+#define PORT_TFD 0x20
+#define PORT_SIG 0x24
+#define PORT_SSTS 0x28
+#define PORT_SERR 0x30
+#define PORT_SACT 0x34
+#define PORT_CI 0x38
+
+#define CMD_ST (1U << 0)
+#define CMD_CLO (1U << 3)
+#define CMD_FRE (1U << 4)
+#define CMD_FR (1U << 14)
+#define CMD_CR (1U << 15)
+
+#define IS_DHRS (1U << 0)
+#define IS_PSS (1U << 1)
+#define IS_DSS (1U << 2)
+#define IS_SDBS (1U << 3)
+#define IS_IFS (1U << 27)
+#define IS_HBDS (1U << 28)
+#define IS_HBFS (1U << 29)
+#define IS_TFES (1U << 30)
+#define IS_ERRORS (IS_IFS | IS_HBDS | IS_HBFS | IS_TFES)
+
+#define TFD_ERR 0x01
+#define TFD_DRQ 0x08
+#define TFD_BSY 0x80
+
+#define SSTS_DET_MASK 0x0F
+#define SSTS_DET_PRESENT 0x03
+#define SIG_ATA 0x00000101
+
+#define FIS_TYPE_REG_H2D 0x27
+#define FIS_COMMAND 0x80
+#define FIS_DEV_LBA 0x40
+
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_READ_FPDMA 0x60
+#define ATA_CMD_WRITE_FPDMA 0x61
+#define ATA_CMD_IDENTIFY 0xEC
+#define ATA_CMD_FLUSH_CACHE_EXT 0xEA
+
+#define AHCI_PRDT_ENTRIES 56 // Fills a 1 KiB command table
+#define AHCI_PRD_MAX_BYTES 0x400000
+#define AHCI_MAX_SECTORS 256 // 33 pages at most, well under the table
+#define AHCI_TABLES_PER_PAGE (PAGE_SIZE / sizeof (struct ahci_cmd_table))
+#define AHCI_POLL_LIMIT 10000000
+
+// Cache flush progress, in struct ahci_port's flushing
+#define FLUSH_IDLE 0
+#define FLUSH_DRAINING 1 // Waiting for queued commands to finish
+#define FLUSH_RUNNING 2  // FLUSH CACHE is polled in slot 0
+
+struct ahci_cmd_header
+{
+  uint16_t flags; // FIS length in dwords, write bit
+  uint16_t prdtl;
+  volatile uint32_t prdbc;
+  uint32_t ctba;
+  uint32_t ctbau;
+  uint32_t reserved[4];
+};
+
+#define HEADER_WRITE (1U << 6)
+#define HEADER_CFL 5 // A register FIS is five dwords
+
+struct ahci_prd
+{
+  uint32_t dba;
+  uint32_t dbau;
+  uint32_t reserved;
+  uint32_t dbc; // Byte count minus one
+};
+
+struct ahci_cmd_table
+{
+  uint8_t cfis[64];
+  uint8_t acmd[16];
+  uint8_t reserved[48];
+  struct ahci_prd prdt[AHCI_PRDT_ENTRIES];
+};
+
+/*
+ * One SATA disk. Each command slot has its own table, so up to
+ * queue_depth requests can be handed to the drive at once; with NCQ the
+ * drive reorders them and reports each tag as it finishes. Requests that
+ * find every slot busy wait on the pending list and are started by the
+ * completion path. All slot state is changed with interrupts off.
+ */
+struct ahci_port
+{
+  uint32_t index;
+  volatile uint8_t *regs;
+  struct ahci_cmd_header *cmd_list;
+  struct ahci_cmd_table *tables[AHCI_SLOTS];
+  struct block_request *slots[AHCI_SLOTS];
+  uint32_t slot_mask;   // Slots this port may use
+  uint32_t outstanding; // Slots handed to the HBA
+  uint8_t ncq;
+  uint8_t flushing;     // FLUSH_*: new commands are held back unless idle
+  struct block_request *pending_head;
+  struct block_request *pending_tail;
+  struct block_device dev;
+  char name[8];
+  ahci_stats_t stats;
+};
+
+static volatile uint8_t *abar = NULL;
+static struct ahci_port ports[AHCI_MAX_PORTS];
+static uint32_t port_count = 0;
+static uint8_t ahci_polled = 0; // No completion interrupt could be set up
+
+static int ahci_submit (struct block_device *dev, struct block_request *req);
+static int ahci_flush (struct block_device *dev);
+static void ahci_poll (struct block_device *dev);
+
+static const struct block_ops ahci_ops = {
+  .submit = ahci_submit,
+  .flush = ahci_flush,
+};
+
+static const struct block_ops ahci_polled_ops = {
+  .submit = ahci_submit,
+  .flush = ahci_flush,
+  .poll = ahci_poll,
+};
+
+static inline uint32_t
+hba_read (uint32_t reg)
+{
+  return *(volatile uint32_t *)(abar + reg);
+}
+
+static inline void
+hba_write (uint32_t reg, uint32_t value)
+{
+  *(volatile uint32_t *)(abar + reg) = value;
+}
+
+static inline uint32_t
+port_read (struct ahci_port *port, uint32_t reg)
+{
+  return *(volatile uint32_t *)(port->regs + reg);
+}
+
+static inline void
+port_write (struct ahci_port *port, uint32_t reg, uint32_t value)
+{
+  *(volatile uint32_t *)(port->regs + reg) = value;
+}
+
+static inline uint64_t
+phys_of (const void *virt)
+{
+  return paging_virt_to_phys (paging_current (), (uintptr_t)virt);
+}
+
+static int
+wait_clear (struct ahci_port *port, uint32_t reg, uint32_t bits)
+{
+  for (uint32_t i = 0; i < AHCI_POLL_LIMIT; i++)
+    {
+      if (!(port_read (port, reg) & bits))
+        return 0;
+    }
+  return DISK_ERR_TIMEOUT;
+}
+
+static void
+port_stop (struct ahci_port *port)
+{
+  port_write (port, PORT_CMD, port_read (port, PORT_CMD) & ~CMD_ST);
+  wait_clear (port, PORT_CMD, CMD_CR);
+  port_write (port, PORT_CMD, port_read (port, PORT_CMD) & ~CMD_FRE);
+  wait_clear (port, PORT_CMD, CMD_FR);
+}
+
+static void
+port_start (struct ahci_port *port)
+{
+  port_write (port, PORT_SERR, 0xFFFFFFFF);
+  port_write (port, PORT_IS, 0xFFFFFFFF);
+  port_write (port, PORT_CMD, port_read (port, PORT_CMD) | CMD_FRE);
+
+  // A drive left busy by an error is released with command list override
+  if (port_read (port, PORT_TFD) & (TFD_BSY | TFD_DRQ))
+    {
+      port_write (port, PORT_CMD, port_read (port, PORT_CMD) | CMD_CLO);
+      wait_clear (port, PORT_CMD, CMD_CLO);
+    }
+  port_write (port, PORT_CMD, port_read (port, PORT_CMD) | CMD_ST);
+}
+
+// Describe a kernel buffer page by page, merging adjacent pieces
+static int
+build_prdt (struct ahci_cmd_table *table, uint8_t *buffer, uint64_t bytes)
+{
+  uint64_t *pml4 = paging_current ();
+  int entries = 0;
+  struct ahci_prd *last = NULL;
+
+  while (bytes)
+    {
+      uintptr_t virt = (uintptr_t)buffer;
+      uint64_t len = PAGE_SIZE - (virt & (PAGE_SIZE - 1));
+      if (len > bytes)
+        len = bytes;
+      uint64_t phys = paging_virt_to_phys (pml4, virt);
+      uint64_t last_phys
+          = last ? ((uint64_t)last->dbau << 32 | last->dba) : 0;
+
+      if (last && last_phys + last->dbc + 1 == phys
+          && last->dbc + 1 + len <= AHCI_PRD_MAX_BYTES)
+        last->dbc += len;
+      else
+        {
+          if (entries == AHCI_PRDT_ENTRIES)
+            return DISK_ERR_RANGE;
+          last = &table->prdt[entries++];
+          last->dba = phys & 0xFFFFFFFF;
+          last->dbau = phys >> 32;
+          last->reserved = 0;
+          last->dbc = len - 1;
+        }
+
+      buffer += len;
+      bytes -= len;
+    }
+
+  return entries;
+}
+
+static void
+build_fis (uint8_t *fis, uint8_t command, uint64_t lba, uint32_t count,
+           int tag)
+{
+  for (int i = 0; i < 20; i++)
+    fis[i] = 0;
+
+  fis[0] = FIS_TYPE_REG_H2D;
+  fis[1] = FIS_COMMAND;
+  fis[2] = command;
+  fis[4] = lba & 0xFF;
+  fis[5] = (lba >> 8) & 0xFF;
+  fis[6] = (lba >> 16) & 0xFF;
+  fis[7] = FIS_DEV_LBA;
+  fis[8] = (lba >> 24) & 0xFF;
+  fis[9] = (lba >> 32) & 0xFF;
+  fis[10] = (lba >> 40) & 0xFF;
+
+  if (tag >= 0)
+    {
+      // First-party DMA: the count moves to the features registers and
+      // the tag sits in the count register
+      fis[3] = count & 0xFF;
+      fis[11] = (count >> 8) & 0xFF;
+      fis[12] = tag << 3;
+    }
+  else
+    {
+      fis[12] = count & 0xFF;
+      fis[13] = (count >> 8) & 0xFF;
+    }
+}
+
+// Fill a slot's header and table. Returns 0 or a DISK_ERR_* value.
+static int
+prepare_slot (struct ahci_port *port, int slot, uint8_t command,
+              uint64_t lba, uint32_t count, void *buffer, uint32_t bytes,
+              int write, int queued)
+{
+  struct ahci_cmd_table *table = port->tables[slot];
+  struct ahci_cmd_header *header = &port->cmd_list[slot];
+  int entries = 0;
+
+  if (bytes)
+    {
+      entries = build_prdt (table, buffer, bytes);
+      if (entries < 0)
+        return entries;
+    }
+
+  build_fis (table->cfis, command, lba, count, queued ? slot : -1);
+  header->flags = HEADER_CFL | (write ? HEADER_WRITE : 0);
+  header->prdtl = entries;
+  header->prdbc = 0;
+  return 0;
+}
+
+static void
+issue (struct ahci_port *port, struct block_request *req, int slot)
+{
+  uint8_t command;
+  if (port->ncq)
+    command = req->write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA;
+  else
+    command = req->write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+
+  int ret = prepare_slot (port, slot, command, req->lba, req->count,
+                          req->buffer, req->count * SECTOR_SIZE, req->write,
+                          port->ncq);
+  if (ret < 0)
+    {
+      block_complete (req, ret);
+      return;
+    }
+
+  uint32_t bit = 1U << slot;
+  port->slots[slot] = req;
+  port->outstanding |= bit;
+  port->stats.commands++;
+
+  uint32_t inflight = __builtin_popcount (port->outstanding);
+  if (inflight > port->stats.max_inflight)
+    port->stats.max_inflight = inflight;
+
+  if (port->ncq)
+    port_write (port, PORT_SACT, bit);
+  port_write (port, PORT_CI, bit);
+}
+
+// Move pending requests into free slots; interrupts must be off
+static void
+start_pending (struct ahci_port *port)
+{
+  while (port->pending_head && !port->flushing)
+    {
+      uint32_t free = port->slot_mask & ~port->outstanding;
+      if (!free)
+        return;
+
+      struct block_request *req = port->pending_head;
+      port->pending_head = req->next;
+      if (!port->pending_head)
+        port->pending_tail = NULL;
+
+      issue (port, req, __builtin_ctz (free));
+    }
+}
+
+// Retire finished commands; interrupts must be off
+static void
+port_complete (struct ahci_port *port)
+{
+  // The polled flush owns the status bits until it has read them
+  if (port->flushing == FLUSH_RUNNING)
+    return;
+
+  uint32_t is = port_read (port, PORT_IS);
+  port_write (port, PORT_IS, is);
+
+  if (is & IS_ERRORS)
+    {
+      // The drive aborts every queued command after an error, so fail
+      // them all and restart the port
+      port->stats.errors++;
+      port_stop (port);
+      uint32_t failed = port->outstanding;
+      port->outstanding = 0;
+      port_start (port);
+
+      while (failed)
+        {
+          int slot = __builtin_ctz (failed);
+          failed &= failed - 1;
+          block_complete (port->slots[slot], DISK_ERR_DEVICE);
+        }
+    }
+  else
+    {
+      uint32_t busy = port_read (port, PORT_SACT) | port_read (port, PORT_CI);
+      uint32_t done = port->outstanding & ~busy;
+      port->outstanding &= ~done;
+
+      while (done)
+        {
+          int slot = __builtin_ctz (done);
+          done &= done - 1;
+          block_complete (port->slots[slot], 0);
+        }
+    }
+
+  start_pending (port);
+}
+
+static void
+ahci_interrupt (void)
+{
+  uint32_t is = hba_read (HBA_IS);
+
+  for (uint32_t i = 0; i < port_count; i++)
+    {
+      if (is & (1U << ports[i].index))
+        port_complete (&ports[i]);
+    }
+  hba_write (HBA_IS, is);
+}
+
+static void
+ahci_poll (struct block_device *dev)
+{
+  uint64_t flags = irq_save ();
+  port_complete (dev->priv);
+  irq_restore (flags);
+}
+
+static int
+ahci_submit (struct block_device *dev, struct block_request *req)
+{
+  struct ahci_port *port = dev->priv;
+  uint64_t flags = irq_save ();
+
+  req->next = NULL;
+  if (port->pending_tail)
+    port->pending_tail->next = req;
+  else
+    port->pending_head = req;
+  port->pending_tail = req;
+  start_pending (port);
+
+  irq_restore (flags);
+  return 0;
+}
+
+// Run one non-queued command in slot 0 and poll for it. The caller
+// makes sure nothing else is in flight.
+static int
+exec_polled (struct ahci_port *port, uint8_t command, void *buffer,
+             uint32_t bytes)
+{
+  int ret = prepare_slot (port, 0, command, 0, 0, buffer, bytes, 0, 0);
+  if (ret < 0)
+    return ret;
+
+  port_write (port, PORT_IS, 0xFFFFFFFF);
+  port_write (port, PORT_CI, 1);
+
+  for (uint32_t i = 0; i < AHCI_POLL_LIMIT; i++)
+    {
+      if (port_read (port, PORT_IS) & IS_ERRORS)
+        {
+          port_stop (port);
+          port_start (port);
+          return DISK_ERR_DEVICE;
+        }
+      if (!(port_read (port, PORT_CI) & 1))
+        return 0;
+    }
+  return DISK_ERR_TIMEOUT;
+}
+
+/**
+ * @brief Writes back the drive's cache.
+ *
+ * FLUSH CACHE cannot be mixed with queued commands, so new requests are
+ * held back and the command waits for the port to go idle. Flushes
+ * share slot 0 and run one at a time. The port interrupt is masked
+ * while the command is polled, so the interrupt handler cannot clear
+ * an error before the poll sees it.
+ */
+static int
+ahci_flush (struct block_device *dev)
+{
+  struct ahci_port *port = dev->priv;
+  uint64_t flags = irq_save ();
+
+  while (port->flushing != FLUSH_IDLE)
+    schedule ();
+  port->flushing = FLUSH_DRAINING;
+  while (port->outstanding)
+    {
+      if (ahci_polled)
+        port_complete (port);
+      else
+        schedule ();
+    }
+
+  uint32_t ie = port_read (port, PORT_IE);
+  port_write (port, PORT_IE, 0);
+  port->flushing = FLUSH_RUNNING;
+  irq_restore (flags);
+
+  int ret = exec_polled (port, ATA_CMD_FLUSH_CACHE_EXT, NULL, 0);
+
+  flags = irq_save ();
+  port_write (port, PORT_IS, 0xFFFFFFFF);
+  port_write (port, PORT_IE, ie);
+  if (ret < 0)
+    port->stats.errors++;
+  port->flushing = FLUSH_IDLE;
+  start_pending (port);
+  irq_restore (flags);
+
+  return ret;
+}
+
+static int
+alloc_port_memory (struct ahci_port *port)
+{
+  // Command list (1 KiB) and received FIS area (256 bytes) share a page
+  uint8_t *page = alloc_page ();
+  if (!page)
+    return -1;
+  port->cmd_list = (struct ahci_cmd_header *)page;
+
+  uint64_t clb = phys_of (page);
+  uint64_t fb = clb + 1024;
+  port_write (port, PORT_CLB, clb & 0xFFFFFFFF);
+  port_write (port, PORT_CLBU, clb >> 32);
+  port_write (port, PORT_FB, fb & 0xFFFFFFFF);
+  port_write (port, PORT_FBU, fb >> 32);
+
+  struct ahci_cmd_table *tables = NULL;
+  for (int slot = 0; slot < AHCI_SLOTS; slot++)
+    {
+      if (!(port->slot_mask & (1U << slot)))
+        break;
+      if (slot % AHCI_TABLES_PER_PAGE == 0)
+        {
+          tables = alloc_page ();
+          if (!tables)
+            return -1;
+        }
+
+      port->tables[slot] = &tables[slot % AHCI_TABLES_PER_PAGE];
+      uint64_t ctba = phys_of (port->tables[slot]);
+      port->cmd_list[slot].ctba = ctba & 0xFFFFFFFF;
+      port->cmd_list[slot].ctbau = ctba >> 32;
+    }
+
+  return 0;
+}
+
+static void
+probe_port (uint32_t index, uint32_t hba_slots, int hba_ncq)
+{
+  struct ahci_port *port = &ports[port_count];
+  port->index = index;
+  port->regs = abar + PORT_BASE (index);
+
+  if ((port_read (port, PORT_SSTS) & SSTS_DET_MASK) != SSTS_DET_PRESENT
+      || port_read (port, PORT_SIG) != SIG_ATA)
+    return;
+
+  port_stop (port);
+  port->slot_mask = hba_slots == 32 ? 0xFFFFFFFF : (1U << hba_slots) - 1;
+  if (alloc_port_memory (port) < 0)
+    return;
+  port_start (port);
+
+  uint16_t *identify = alloc_page ();
+  if (!identify)
+    return;
+  int ret = exec_polled (port, ATA_CMD_IDENTIFY, identify, 512);
+  if (ret < 0 || !((identify[83] >> 10) & 1)) // Only LBA48 drives
+    {
+      free_page (identify);
+      port_stop (port);
+      return;
+    }
+
+  uint64_t sectors = (uint64_t)identify[100] | (uint64_t)identify[101] << 16
+                     | (uint64_t)identify[102] << 32
+                     | (uint64_t)identify[103] << 48;
+  uint32_t depth = 1;
+  if (hba_ncq && ((identify[76] >> 8) & 1))
+    {
+      port->ncq = 1;
+      depth = (identify[75] & 0x1F) + 1;
+      if (depth > hba_slots)
+        depth = hba_slots;
+    }
+  port->dev.rotational = identify[217] != 1; // 1 means solid state
+  free_page (identify);
+
+  port->slot_mask = depth == 32 ? 0xFFFFFFFF : (1U << depth) - 1;
+  port->stats.queue_depth = depth;
+
+  port->name[0] = 'a';
+  port->name[1] = 'h';
+  port->name[2] = 'c';
+  port->name[3] = 'i';
+  port->name[4] = '0' + port_count;
+  port->name[5] = '\0';
+  port->dev.name = port->name;
+  port->dev.sectors = sectors;
+  port->dev.max_sectors = AHCI_MAX_SECTORS;
+  port->dev.queue_depth = depth;
+  port->dev.rank = BLOCK_RANK_AHCI;
+  port->dev.priv = port;
+
+  port_write (port, PORT_IE, IS_DHRS | IS_PSS | IS_DSS | IS_SDBS
+                                 | IS_ERRORS);
+  port_count++;
+}
+
+// Prefer MSI; fall back to the legacy line, then to polling
+static void
+setup_interrupt (const pci_device_t *dev)
+{
+  int vector = apic_enabled () ? alloc_interrupt_vector () : -1;
+
+  if (vector >= 0 && pci_enable_msi (dev, vector, lapic_id ()) == 0)
+    register_interrupt_handler (vector, ahci_interrupt);
+  else if (dev->irq_line < IRQ_COUNT)
+    register_interrupt_handler (IRQ (dev->irq_line), ahci_interrupt);
+  else
+    ahci_polled = 1;
+}
+
+/**
+ * @brief Finds an AHCI controller and registers its SATA disks.
+ *
+ * Only the first controller is used. init_pci must run first.
+ */
+void
+init_ahci (void)
+{
+  const pci_device_t *dev = NULL;
+
+  while ((dev = pci_find (PCI_CLASS_STORAGE, PCI_SUBCLASS_SATA, dev)))
+    {
+      if (dev->prog_if == PCI_AHCI_PROG_IF)
+        break;
+    }
+  if (!dev)
+    return;
+
+  uint64_t bar = pci_bar (dev, AHCI_ABAR, NULL);
+  if (!bar)
+    return;
+
+  pci_enable (dev, PCI_COMMAND_MEMORY | PCI_COMMAND_BUS_MASTER);
+  abar = paging_map_mmio (bar, AHCI_ABAR_SIZE);
+  hba_write (HBA_GHC, hba_read (HBA_GHC) | GHC_AE);
+
+  uint32_t cap = hba_read (HBA_CAP);
+  uint32_t hba_slots = ((cap >> CAP_NCS_SHIFT) & CAP_NCS_MASK) + 1;
+  uint32_t implemented = hba_read (HBA_PI);
+
+  for (uint32_t i = 0; i < 32 && port_count < AHCI_MAX_PORTS; i++)
+    {
+      if (implemented & (1U << i))
+        probe_port (i, hba_slots, (cap & CAP_SNCQ) != 0);
+    }
+  if (!port_count)
+    return;
+
+  setup_interrupt (dev);
+  hba_write (HBA_IS, 0xFFFFFFFF);
+  if (!ahci_polled)
+    hba_write (HBA_GHC, hba_read (HBA_GHC) | GHC_IE);
+
+  for (uint32_t i = 0; i < port_count; i++)
+    {
+      ports[i].dev.ops = ahci_polled ? &ahci_polled_ops : &ahci_ops;
+      block_register (&ports[i].dev);
+      kprintf ("%s: %lu sectors, %s, queue depth %u\n", ports[i].name,
+               ports[i].dev.sectors, ports[i].ncq ? "NCQ" : "no NCQ",
+               ports[i].dev.queue_depth);
+    }
+}
+
+int
+ahci_get_stats (uint32_t index, ahci_stats_t *stats)
+{
+  if (index >= port_count)
+    return -1;
+
+  uint64_t flags = irq_save ();
+  *stats = ports[index].stats;
+  irq_restore (flags);
+  return 0;
+}
@@ -0,0 +1,27 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef AHCI_H
+#define AHCI_H
+
+#include "disk.h"
+
+#define AHCI_MAX_PORTS 4 // Disks registered, as ahci0 and up
+#define AHCI_SLOTS 32
+
+// Per-port statistics
+typedef struct
+{
+  uint64_t commands;
+  uint64_t errors;
+  uint32_t queue_depth;  // Tags the port uses
+  uint32_t max_inflight; // Most commands seen in flight at once
+} ahci_stats_t;
+
+void init_ahci (void);
+int ahci_get_stats (uint32_t index, ahci_stats_t *stats);
+
+#endif
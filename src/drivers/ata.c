@@ -0,0 +1,613 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "ata.h"
+#include "pci.h"
+#include "timer.h"
+#include "../cpu.h"
+#include "../idt.h"
+#include "../io.h"
+#include "../klog.h"
+#include "../memory.h"
+#include "../mutex.h"
+#include "../paging.h"
+#include "../process.h"
+
+// Primary ATA channel
+#define ATA_IO_BASE 0x1F0
+#define ATA_CONTROL 0x3F6
+
+#define ATA_REG_DATA 0
+#define ATA_REG_ERROR 1
+#define ATA_REG_COUNT 2
+#define ATA_REG_LBA0 3
+#define ATA_REG_LBA1 4
+#define ATA_REG_LBA2 5
+#define ATA_REG_DEVICE 6
+#define ATA_REG_STATUS 7
+#define ATA_REG_COMMAND 7
+
+#define ATA_SR_ERR 0x01
+#define ATA_SR_DRQ 0x08
+#define ATA_SR_DF 0x20
+#define ATA_SR_BSY 0x80
+
+#define ATA_CTL_NIEN 0x02 // Keep IRQ 14 quiet while a PIO command polls
+#define ATA_IRQ 14
+
+#define ATA_DEV_LBA 0x40
+#define ATA_DEV_MASTER 0xA0
+
+#define ATA_CMD_READ_SECTORS 0x20
+#define ATA_CMD_READ_SECTORS_EXT 0x24
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_READ_MULTIPLE_EXT 0x29
+#define ATA_CMD_WRITE_SECTORS 0x30
+#define ATA_CMD_WRITE_SECTORS_EXT 0x34
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_READ_MULTIPLE 0xC4
+#define ATA_CMD_WRITE_MULTIPLE 0xC5
+#define ATA_CMD_SET_MULTIPLE 0xC6
+#define ATA_CMD_READ_DMA 0xC8
+#define ATA_CMD_WRITE_DMA 0xCA
+#define ATA_CMD_FLUSH_CACHE 0xE7
+#define ATA_CMD_IDENTIFY 0xEC
+#define ATA_CMD_FLUSH_CACHE_EXT 0xEA
+
+#define ATA_LBA28_LIMIT (1ULL << 28)
+#define ATA_LBA28_MAX_SECTORS 256
+#define ATA_POLL_LIMIT 10000000
+
+// Bus-master IDE registers, primary channel, relative to BAR4
+#define BM_COMMAND 0
+#define BM_STATUS 2
+#define BM_PRDT 4
+
+#define BM_CMD_START 0x01
+#define BM_CMD_TO_MEMORY 0x08 // Direction for device reads
+#define BM_STATUS_ERROR 0x02
+#define BM_STATUS_IRQ 0x04
+
+#define PCI_IDE_BUS_MASTER 0x80 // prog_if: controller can bus master
+#define PCI_IDE_PRIMARY_NATIVE 0x01
+
+#define PRD_END 0x8000
+#define PRD_MAX_ENTRIES (PAGE_SIZE / sizeof (struct prd))
+#define DMA_BOUNDARY 0x10000 // No region may cross a 64 KiB line
+#define DMA_ADDR_LIMIT 0x100000000ULL
+// Worst case one region per page plus one for a misaligned start,
+// which keeps every chunk well inside a one-page table
+#define ATA_DMA_MAX_SECTORS 2048
+
+/**
+ * Physical region descriptor
+ * byte_count 0 means 64 KiB; PRD_END marks the last entry.
+ */
+struct prd
+{
+  uint32_t addr;
+  uint16_t byte_count;
+  uint16_t flags;
+} __attribute__ ((packed));
+
+/*
+ * State of the primary master. multiple is the number of sectors the
+ * drive moves per DRQ block once SET MULTIPLE MODE succeeded, so a READ
+ * or WRITE MULTIPLE command only stops for status once per block rather
+ * than once per sector.
+ */
+static struct
+{
+  uint8_t present;
+  uint8_t lba48;
+  uint16_t multiple; // Sectors per DRQ block; 0 if multiple mode is off
+  uint64_t sectors;
+  char model[41];
+  uint16_t bmide;     // Bus-master register base; 0 without DMA
+  struct prd *prdt;   // One page, below 4 GiB
+  uint8_t force_pio;  // Set by the benchmark
+} ata;
+
+// DMA completion, handed from the IRQ 14 handler to the waiting task
+static volatile uint8_t dma_active = 0;
+static volatile uint8_t dma_done = 0;
+static volatile uint8_t dma_failed = 0;
+static volatile int64_t dma_waiter = -1;
+
+static int ata_submit (struct block_device *dev, struct block_request *req);
+static int ata_flush (struct block_device *dev);
+
+static const struct block_ops ata_ops = {
+  .submit = ata_submit,
+  .flush = ata_flush,
+};
+
+static struct block_device ata_device = {
+  .name = "ata0",
+  .ops = &ata_ops,
+  .max_sectors = DISK_MAX_SECTORS,
+  .queue_depth = 1,
+  .rank = BLOCK_RANK_ATA,
+};
+
+static struct mutex ata_mutex = MUTEX_INIT; // Serialises commands
+
+// Four alternate-status reads give the drive the 400ns it needs to
+// update status after a command or a data block
+static inline void
+ata_delay (void)
+{
+  for (int i = 0; i < 4; i++)
+    inb (ATA_CONTROL);
+}
+
+static int
+ata_wait_idle (void)
+{
+  for (uint32_t i = 0; i < ATA_POLL_LIMIT; i++)
+    {
+      if (!(inb (ATA_IO_BASE + ATA_REG_STATUS) & ATA_SR_BSY))
+        return 0;
+    }
+  return DISK_ERR_TIMEOUT;
+}
+
+// Wait until the drive is ready for the next data block
+static int
+ata_wait_drq (void)
+{
+  for (uint32_t i = 0; i < ATA_POLL_LIMIT; i++)
+    {
+      uint8_t status = inb (ATA_IO_BASE + ATA_REG_STATUS);
+      if (status & ATA_SR_BSY)
+        continue;
+      if (status & (ATA_SR_ERR | ATA_SR_DF))
+        return DISK_ERR_DEVICE;
+      if (status & ATA_SR_DRQ)
+        return 0;
+    }
+  return DISK_ERR_TIMEOUT;
+}
+
+// Load the taskfile and issue the command. For LBA48 the high-order
+// bytes go in first; each register is a two-deep FIFO.
+static void
+ata_issue (uint8_t command, uint64_t lba, uint32_t count)
+{
+  if (ata.lba48)
+    {
+      outb (ATA_IO_BASE + ATA_REG_DEVICE, ATA_DEV_MASTER | ATA_DEV_LBA);
+      outb (ATA_IO_BASE + ATA_REG_COUNT, (count >> 8) & 0xFF);
+      outb (ATA_IO_BASE + ATA_REG_LBA0, (lba >> 24) & 0xFF);
+      outb (ATA_IO_BASE + ATA_REG_LBA1, (lba >> 32) & 0xFF);
+      outb (ATA_IO_BASE + ATA_REG_LBA2, (lba >> 40) & 0xFF);
+    }
+  else
+    {
+      outb (ATA_IO_BASE + ATA_REG_DEVICE,
+            ATA_DEV_MASTER | ATA_DEV_LBA | ((lba >> 24) & 0x0F));
+    }
+  outb (ATA_IO_BASE + ATA_REG_COUNT, count & 0xFF); // 0 means the maximum
+  outb (ATA_IO_BASE + ATA_REG_LBA0, lba & 0xFF);
+  outb (ATA_IO_BASE + ATA_REG_LBA1, (lba >> 8) & 0xFF);
+  outb (ATA_IO_BASE + ATA_REG_LBA2, (lba >> 16) & 0xFF);
+  outb (ATA_IO_BASE + ATA_REG_COMMAND, command);
+  ata_delay ();
+}
+
+static uint8_t
+ata_command (int write)
+{
+  if (ata.lba48)
+    {
+      if (ata.multiple)
+        return write ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE_EXT;
+      return write ? ATA_CMD_WRITE_SECTORS_EXT : ATA_CMD_READ_SECTORS_EXT;
+    }
+  if (ata.multiple)
+    return write ? ATA_CMD_WRITE_MULTIPLE : ATA_CMD_READ_MULTIPLE;
+  return write ? ATA_CMD_WRITE_SECTORS : ATA_CMD_READ_SECTORS;
+}
+
+// Run one command of at most the per-command limit, moving each DRQ
+// block with a single string instruction
+static int
+ata_transfer (uint64_t lba, uint32_t count, uint8_t *buffer, int write)
+{
+  uint32_t block = ata.multiple ? ata.multiple : 1;
+  int ret = ata_wait_idle ();
+  if (ret < 0)
+    return ret;
+
+  ata_issue (ata_command (write), lba, count);
+
+  while (count)
+    {
+      uint32_t sectors = count < block ? count : block;
+
+      ret = ata_wait_drq ();
+      if (ret < 0)
+        return ret;
+
+      if (write)
+        outsw (ATA_IO_BASE + ATA_REG_DATA, buffer, sectors * SECTOR_SIZE / 2);
+      else
+        insw (ATA_IO_BASE + ATA_REG_DATA, buffer, sectors * SECTOR_SIZE / 2);
+      ata_delay ();
+
+      buffer += sectors * SECTOR_SIZE;
+      count -= sectors;
+    }
+
+  ret = ata_wait_idle ();
+  if (ret < 0)
+    return ret;
+  if (inb (ATA_IO_BASE + ATA_REG_STATUS) & (ATA_SR_ERR | ATA_SR_DF))
+    return DISK_ERR_DEVICE;
+  return 0;
+}
+
+/**
+ * @brief Builds the PRD table for a kernel buffer.
+ *
+ * The buffer is walked a page at a time through the page tables, so it
+ * only has to be virtually contiguous. Physically adjacent pieces are
+ * merged into one region as long as it stays inside a 64 KiB line.
+ *
+ * @return 0 on success, or a negative value if the buffer cannot be
+ *         reached by the controller.
+ */
+static int
+ata_build_prdt (uint8_t *buffer, uint64_t bytes)
+{
+  uint64_t *pml4 = paging_current ();
+  uint32_t entries = 0;
+  struct prd *last = NULL;
+
+  while (bytes)
+    {
+      uintptr_t virt = (uintptr_t)buffer;
+      uint64_t len = PAGE_SIZE - (virt & (PAGE_SIZE - 1));
+      if (len > bytes)
+        len = bytes;
+
+      uint64_t phys = paging_virt_to_phys (pml4, virt);
+      if (phys + len > DMA_ADDR_LIMIT)
+        return DISK_ERR_RANGE;
+
+      uint32_t last_len = last && last->byte_count ? last->byte_count
+                                                   : DMA_BOUNDARY;
+      if (last && last->addr + last_len == phys && last->byte_count
+          && (last->addr & ~(DMA_BOUNDARY - 1))
+                 == ((phys + len - 1) & ~(DMA_BOUNDARY - 1)))
+        {
+          // A full 64 KiB region is stored as 0
+          last->byte_count = (last_len + len) & 0xFFFF;
+        }
+      else
+        {
+          if (entries == PRD_MAX_ENTRIES)
+            return DISK_ERR_RANGE;
+          last = &ata.prdt[entries++];
+          last->addr = phys;
+          last->byte_count = len;
+          last->flags = 0;
+        }
+
+      buffer += len;
+      bytes -= len;
+    }
+
+  last->flags = PRD_END;
+  return 0;
+}
+
+// IRQ 14: the drive raised INTRQ at the end of a DMA command
+static void
+ata_interrupt (void)
+{
+  uint8_t bm_status = inb (ata.bmide + BM_STATUS);
+  uint8_t status = inb (ATA_IO_BASE + ATA_REG_STATUS); // Clears INTRQ
+
+  if (!dma_active || !(bm_status & BM_STATUS_IRQ))
+    return;
+
+  outb (ata.bmide + BM_COMMAND, 0);
+  outb (ata.bmide + BM_STATUS, BM_STATUS_ERROR | BM_STATUS_IRQ);
+
+  dma_failed = (bm_status & BM_STATUS_ERROR)
+               || (status & (ATA_SR_ERR | ATA_SR_DF));
+  dma_active = 0;
+  dma_done = 1;
+
+  if (dma_waiter >= 0)
+    {
+      wake_process (dma_waiter);
+      dma_waiter = -1;
+    }
+}
+
+// Run one DMA command; the caller sleeps until IRQ 14 reports the end
+static int
+ata_dma_transfer (uint64_t lba, uint32_t count, uint8_t *buffer, int write)
+{
+  int ret = ata_build_prdt (buffer, (uint64_t)count * SECTOR_SIZE);
+  if (ret < 0)
+    return ret;
+
+  ret = ata_wait_idle ();
+  if (ret < 0)
+    return ret;
+
+  uint8_t direction = write ? 0 : BM_CMD_TO_MEMORY;
+  uint8_t command;
+  if (ata.lba48)
+    command = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+  else
+    command = write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA;
+  uint32_t prdt = paging_virt_to_phys (paging_current (),
+                                       (uintptr_t)ata.prdt);
+
+  outb (ata.bmide + BM_COMMAND, 0);
+  outl (ata.bmide + BM_PRDT, prdt);
+  outb (ata.bmide + BM_STATUS, BM_STATUS_ERROR | BM_STATUS_IRQ);
+  outb (ata.bmide + BM_COMMAND, direction);
+
+  // Interrupts stay off until the waiter is recorded, so the completion
+  // cannot slip in between starting the engine and going to sleep
+  uint64_t flags = irq_save ();
+  dma_done = 0;
+  dma_active = 1;
+  outb (ATA_CONTROL, 0);
+  ata_issue (command, lba, count);
+  outb (ata.bmide + BM_COMMAND, direction | BM_CMD_START);
+
+  while (!dma_done)
+    {
+      dma_waiter = current_process_id ();
+      block_current ();
+    }
+  outb (ATA_CONTROL, ATA_CTL_NIEN);
+  irq_restore (flags);
+
+  return dma_failed ? DISK_ERR_DEVICE : 0;
+}
+
+static inline int
+ata_use_dma (const void *buffer)
+{
+  // PRD addresses must be even
+  return ata.bmide && !ata.force_pio && !((uintptr_t)buffer & 1);
+}
+
+static int
+ata_rw (uint64_t lba, uint32_t count, uint8_t *buffer, int write)
+{
+  if (!ata.present)
+    return DISK_ERR_NO_DEVICE;
+  if (lba >= ata.sectors || count > ata.sectors - lba)
+    return DISK_ERR_RANGE;
+
+  int dma = ata_use_dma (buffer);
+  uint32_t limit = ata.lba48 ? DISK_MAX_SECTORS : ATA_LBA28_MAX_SECTORS;
+  if (dma && limit > ATA_DMA_MAX_SECTORS)
+    limit = ATA_DMA_MAX_SECTORS; // The PRD table; LBA28 caps lower
+  int ret = 0;
+
+  mutex_lock (&ata_mutex);
+  while (count && ret == 0)
+    {
+      uint32_t chunk = count < limit ? count : limit;
+      ret = dma ? ata_dma_transfer (lba, chunk, buffer, write)
+                : ata_transfer (lba, chunk, buffer, write);
+      lba += chunk;
+      buffer += (uint64_t)chunk * SECTOR_SIZE;
+      count -= chunk;
+    }
+  mutex_unlock (&ata_mutex);
+
+  return ret;
+}
+
+// Copy an IDENTIFY string, which stores two characters per word with
+// the first one in the high byte
+static void
+ata_copy_string (char *dst, const uint16_t *words, int len)
+{
+  for (int i = 0; i < len / 2; i++)
+    {
+      dst[2 * i] = words[i] >> 8;
+      dst[2 * i + 1] = words[i] & 0xFF;
+    }
+  dst[len] = '\0';
+  for (int i = len - 1; i >= 0 && dst[i] == ' '; i--)
+    dst[i] = '\0';
+}
+
+// Use the PCI IDE controller's bus-master engine when the drive can do
+// DMA and the primary channel sits at the legacy ports and IRQ 14
+static void
+ata_init_dma (const uint16_t *identify)
+{
+  const pci_device_t *ide = pci_find (PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE,
+                                      NULL);
+  bool is_io;
+
+  if (!ide || !(ide->prog_if & PCI_IDE_BUS_MASTER)
+      || (ide->prog_if & PCI_IDE_PRIMARY_NATIVE))
+    return;
+  if (!((identify[49] >> 8) & 1)) // Word 49 bit 8: DMA supported
+    return;
+
+  uint64_t bar = pci_bar (ide, 4, &is_io);
+  if (!bar || !is_io)
+    return;
+
+  ata.prdt = alloc_page ();
+  if (!ata.prdt)
+    return;
+
+  pci_enable (ide, PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+  ata.bmide = bar;
+  register_interrupt_handler (IRQ (ATA_IRQ), ata_interrupt);
+}
+
+/**
+ * @brief Identifies the primary master and registers it as "ata0".
+ *
+ * Multiple mode is enabled for PIO, and bus-master DMA is used instead
+ * when the PCI IDE controller supports it. init_pci must run first.
+ */
+void
+init_ata (void)
+{
+  uint16_t identify[256];
+
+  outb (ATA_CONTROL, ATA_CTL_NIEN);
+  outb (ATA_IO_BASE + ATA_REG_DEVICE, ATA_DEV_MASTER);
+  ata_delay ();
+
+  // A floating bus reads 0xFF, an absent drive 0
+  uint8_t status = inb (ATA_IO_BASE + ATA_REG_STATUS);
+  if (status == 0xFF || status == 0)
+    return;
+
+  outb (ATA_IO_BASE + ATA_REG_COUNT, 0);
+  outb (ATA_IO_BASE + ATA_REG_LBA0, 0);
+  outb (ATA_IO_BASE + ATA_REG_LBA1, 0);
+  outb (ATA_IO_BASE + ATA_REG_LBA2, 0);
+  outb (ATA_IO_BASE + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+  ata_delay ();
+
+  if (inb (ATA_IO_BASE + ATA_REG_STATUS) == 0 || ata_wait_idle () < 0)
+    return;
+  // ATAPI and SATA bridges in legacy mode set a signature instead
+  if (inb (ATA_IO_BASE + ATA_REG_LBA1) || inb (ATA_IO_BASE + ATA_REG_LBA2))
+    return;
+  if (ata_wait_drq () < 0)
+    return;
+  insw (ATA_IO_BASE + ATA_REG_DATA, identify, 256);
+
+  ata.present = 1;
+  ata.lba48 = (identify[83] >> 10) & 1;
+  if (ata.lba48)
+    ata.sectors = (uint64_t)identify[100] | (uint64_t)identify[101] << 16
+                  | (uint64_t)identify[102] << 32
+                  | (uint64_t)identify[103] << 48;
+  else
+    ata.sectors = (uint32_t)identify[60] | (uint32_t)identify[61] << 16;
+  ata_copy_string (ata.model, &identify[27], 40);
+
+  // Word 47 gives the largest DRQ block the drive supports
+  uint8_t max_multiple = identify[47] & 0xFF;
+  if (max_multiple)
+    {
+      outb (ATA_IO_BASE + ATA_REG_DEVICE, ATA_DEV_MASTER);
+      outb (ATA_IO_BASE + ATA_REG_COUNT, max_multiple);
+      outb (ATA_IO_BASE + ATA_REG_COMMAND, ATA_CMD_SET_MULTIPLE);
+      ata_delay ();
+      if (ata_wait_idle () == 0
+          && !(inb (ATA_IO_BASE + ATA_REG_STATUS) & ATA_SR_ERR))
+        ata.multiple = max_multiple;
+    }
+
+  ata_init_dma (identify);
+
+  ata_device.sectors = ata.sectors;
+  ata_device.rotational = identify[217] != 1; // 1 means solid state
+  block_register (&ata_device);
+  kprintf ("ata0: %s, %lu sectors, LBA%d, %u sectors per block, %s\n",
+           ata.model, ata.sectors, ata.lba48 ? 48 : 28,
+           ata.multiple ? ata.multiple : 1, ata.bmide ? "DMA" : "PIO");
+}
+
+/*
+ * The legacy channel runs one command at a time, so a request is carried
+ * out in full before submit returns. With bus mastering the data is moved
+ * by DMA while the caller sleeps. Otherwise READ/WRITE MULTIPLE (EXT)
+ * commands of up to DISK_MAX_SECTORS sectors (256 without LBA48) move
+ * each DRQ block with rep insw/outsw.
+ */
+static int
+ata_submit (struct block_device *dev, struct block_request *req)
+{
+  block_complete (req, ata_rw (req->lba, req->count, req->buffer,
+                               req->write));
+  return 0;
+}
+
+// Commit the drive's write cache to the medium
+static int
+ata_flush (struct block_device *dev)
+{
+  mutex_lock (&ata_mutex);
+  int ret = ata_wait_idle ();
+  if (ret == 0)
+    {
+      outb (ATA_IO_BASE + ATA_REG_DEVICE, ATA_DEV_MASTER);
+      outb (ATA_IO_BASE + ATA_REG_COMMAND, ata.lba48
+                                               ? ATA_CMD_FLUSH_CACHE_EXT
+                                               : ATA_CMD_FLUSH_CACHE);
+      ata_delay ();
+      ret = ata_wait_idle ();
+      if (ret == 0 && (inb (ATA_IO_BASE + ATA_REG_STATUS) & ATA_SR_ERR))
+        ret = DISK_ERR_DEVICE;
+    }
+  mutex_unlock (&ata_mutex);
+
+  return ret;
+}
+
+static uint64_t
+ata_bench_read (uint64_t sectors, uint8_t *buffer, uint32_t chunk)
+{
+  uint64_t start = read_tsc ();
+
+  for (uint64_t lba = 0; lba < sectors; lba += chunk)
+    {
+      uint32_t count = sectors - lba < chunk ? sectors - lba : chunk;
+      if (ata_rw (lba, count, buffer, 0) < 0)
+        return 0;
+    }
+
+  return read_tsc () - start;
+}
+
+/**
+ * @brief Times a sequential read from the start of the disk.
+ *
+ * The same range is read once with PIO and, when the controller can bus
+ * master, once with DMA, in ATA_BENCH_CHUNK sized requests.
+ *
+ * @param sectors Number of sectors to read in each pass.
+ * @param result Filled with total cycles for each pass; a pass that
+ *               could not run reports 0.
+ *
+ * @return 0 on success, or a negative value on error.
+ */
+int
+ata_benchmark (uint64_t sectors, struct ata_bench_result *result)
+{
+  if (!ata.present)
+    return DISK_ERR_NO_DEVICE;
+  if (sectors > ata.sectors)
+    sectors = ata.sectors;
+
+  uint8_t *buffer = allocate_memory (ATA_BENCH_CHUNK * SECTOR_SIZE);
+  if (!buffer)
+    return -1;
+
+  result->sectors = sectors;
+  ata.force_pio = 1;
+  result->pio_cycles = ata_bench_read (sectors, buffer, ATA_BENCH_CHUNK);
+  ata.force_pio = 0;
+  result->dma_cycles
+      = ata.bmide ? ata_bench_read (sectors, buffer, ATA_BENCH_CHUNK) : 0;
+
+  free_memory (buffer);
+  return 0;
+}
@@ -0,0 +1,28 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef ATA_H
+#define ATA_H
+
+#include "disk.h"
+
+#define ATA_BENCH_CHUNK 128 // Sectors per benchmark request
+
+/**
+ * Sequential read benchmark results
+ * Cycles are TSC ticks for the whole pass.
+ */
+struct ata_bench_result
+{
+  uint64_t sectors;
+  uint64_t pio_cycles;
+  uint64_t dma_cycles; // 0 without bus-master DMA
+};
+
+void init_ata (void);
+int ata_benchmark (uint64_t sectors, struct ata_bench_result *result);
+
+#endif
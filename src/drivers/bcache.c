@@ -0,0 +1,734 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "bcache.h"
+#include "../cpu.h"
+#include "../klog.h"
+#include "../memory.h"
+#include "../mutex.h"
+#include "../vtime.h"
+#include "../workqueue.h"
+#include <stddef.h>
+
+#define BCACHE_GHOSTS (BCACHE_BUFFERS / 2)   // 2Q's Kout
+#define BCACHE_A1IN_MAX (BCACHE_BUFFERS / 4) // 2Q's Kin
+#define BCACHE_HASH_SIZE (1U << BCACHE_HASH_BITS)
+
+/*
+ * Buffer cache in front of the block layer, caching 4 KiB blocks keyed
+ * by device and block number in a chained hash table.
+ *
+ * Replacement is 2Q: a block seen for the first time enters the A1in
+ * FIFO and is evicted from there without disturbing the Am LRU, so a
+ * large sequential scan cannot flush the working set. Blocks evicted
+ * from A1in leave a ghost entry, without data, in A1out; a miss that
+ * finds a ghost means the block was wanted again soon and it goes to Am.
+ *
+ * Writes only dirty the cached copy. Dirty blocks go to the device when
+ * they are evicted, on bcache_sync or bcache_flush, and from a worker
+ * once the oldest has waited BCACHE_WRITEBACK_NS.
+ *
+ * Reads also feed a small table of sequential streams. Each read that
+ * continues a stream doubles its read-ahead window, up to BCACHE_RA_MAX
+ * blocks; a read that skips within the window, or a read-ahead block
+ * evicted unread, halves it. Once half of the window has been consumed
+ * a worker reads the rest into A1in, so a scan stays ahead of its
+ * reader without pushing the working set out.
+ */
+struct bcache_entry
+{
+  struct block_device *dev;
+  uint64_t block;
+  uint8_t *data; // NULL for ghosts
+  uint8_t dirty;
+  uint8_t ra_stream; // 1 + the stream that read it ahead, until first use
+  struct bcache_queue *queue;
+  struct bcache_entry *hash_next;
+  struct bcache_entry *prev;
+  struct bcache_entry *next;
+};
+
+struct bcache_queue
+{
+  struct bcache_entry *head; // Most recently inserted or used
+  struct bcache_entry *tail;
+  uint32_t count;
+};
+
+struct bcache_stream
+{
+  struct block_device *dev;
+  uint64_t next;     // Block after the stream's last read
+  uint64_t ra_next;  // First block not read ahead yet
+  uint64_t ra_end;   // Read-ahead stops before this block
+  uint32_t window;   // Read-ahead size in blocks, 0 until confirmed
+  uint64_t last_use;
+  struct work work;
+};
+
+static struct bcache_entry entries[BCACHE_BUFFERS + BCACHE_GHOSTS];
+static struct bcache_stream streams[BCACHE_STREAMS];
+static uint64_t stream_clock = 0;
+static struct bcache_entry *hash_table[BCACHE_HASH_SIZE];
+static struct bcache_queue a1in, am, a1out, free_buffers, free_ghosts;
+
+static struct mutex bcache_mutex = MUTEX_INIT; // Held across device I/O
+static int bcache_ready = 0;
+static uint64_t dirty_since = 0; // When the dirty count last left zero
+static bcache_stats_t stats;
+
+static void writeback_work_fn (void *arg);
+static struct work writeback_work = WORK_INIT (writeback_work_fn, 0);
+
+static inline uint32_t
+hash_of (struct block_device *dev, uint64_t block)
+{
+  uint64_t key = block ^ ((uintptr_t)dev >> 4);
+  return (key * 0x9E3779B97F4A7C15ULL) >> (64 - BCACHE_HASH_BITS);
+}
+
+static struct bcache_entry *
+lookup (struct block_device *dev, uint64_t block)
+{
+  struct bcache_entry *e = hash_table[hash_of (dev, block)];
+  while (e && (e->dev != dev || e->block != block))
+    e = e->hash_next;
+  return e;
+}
+
+static void
+hash_insert (struct bcache_entry *e)
+{
+  uint32_t index = hash_of (e->dev, e->block);
+  e->hash_next = hash_table[index];
+  hash_table[index] = e;
+}
+
+static void
+hash_remove (struct bcache_entry *e)
+{
+  struct bcache_entry **link = &hash_table[hash_of (e->dev, e->block)];
+  while (*link != e)
+    link = &(*link)->hash_next;
+  *link = e->hash_next;
+}
+
+static void
+queue_push (struct bcache_queue *q, struct bcache_entry *e)
+{
+  e->queue = q;
+  e->prev = NULL;
+  e->next = q->head;
+  if (q->head)
+    q->head->prev = e;
+  else
+    q->tail = e;
+  q->head = e;
+  q->count++;
+}
+
+static void
+queue_remove (struct bcache_entry *e)
+{
+  struct bcache_queue *q = e->queue;
+
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    q->head = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    q->tail = e->prev;
+  q->count--;
+  e->queue = NULL;
+}
+
+static struct bcache_entry *
+queue_pop_tail (struct bcache_queue *q)
+{
+  struct bcache_entry *e = q->tail;
+  if (e)
+    queue_remove (e);
+  return e;
+}
+
+// Sectors of the block that exist; the device's last block may be short
+static inline uint32_t
+block_span (const struct bcache_entry *e)
+{
+  uint64_t left = e->dev->sectors - e->block * BCACHE_BLOCK_SECTORS;
+  return left < BCACHE_BLOCK_SECTORS ? left : BCACHE_BLOCK_SECTORS;
+}
+
+static inline void
+mark_dirty (struct bcache_entry *e)
+{
+  if (e->dirty)
+    return;
+  if (stats.dirty++ == 0)
+    dirty_since = vtime_now_ns ();
+  e->dirty = 1;
+}
+
+static inline void
+mark_clean (struct bcache_entry *e)
+{
+  e->dirty = 0;
+  stats.dirty--;
+}
+
+/**
+ * @brief Moves whole blocks between buffers and their devices.
+ *
+ * Up to BLOCK_BATCH blocks are submitted under a plug before waiting,
+ * so adjacent ones can merge and queueing hardware sees them at once.
+ *
+ * @return 0, or the first error; status holds each block's result.
+ */
+static int
+transfer (struct bcache_entry **batch, int n, int write, int *status)
+{
+  struct block_request reqs[BLOCK_BATCH];
+  int ret = 0;
+
+  for (int i = 0; i < n; i++)
+    {
+      if (i == 0 || batch[i - 1]->dev != batch[i]->dev)
+        block_plug (batch[i]->dev);
+
+      reqs[i].lba = batch[i]->block * BCACHE_BLOCK_SECTORS;
+      reqs[i].count = block_span (batch[i]);
+      reqs[i].write = write;
+      reqs[i].buffer = batch[i]->data;
+      block_start (batch[i]->dev, &reqs[i]);
+
+      if (i == n - 1 || batch[i + 1]->dev != batch[i]->dev)
+        block_unplug (batch[i]->dev);
+    }
+
+  for (int i = 0; i < n; i++)
+    {
+      status[i] = block_wait (batch[i]->dev, &reqs[i]);
+      if (status[i] < 0 && ret == 0)
+        ret = status[i];
+    }
+  return ret;
+}
+
+static int
+writeback (struct bcache_entry **batch, int n)
+{
+  int status[BLOCK_BATCH];
+  int ret = transfer (batch, n, 1, status);
+
+  for (int i = 0; i < n; i++)
+    {
+      if (status[i] == 0)
+        {
+          mark_clean (batch[i]);
+          stats.writebacks++;
+        }
+      else
+        stats.write_errors++;
+    }
+  return ret;
+}
+
+// Oldest block of q that is clean, or could be written back now
+static struct bcache_entry *
+pick_victim (struct bcache_queue *q)
+{
+  for (struct bcache_entry *e = q->tail; e; e = e->prev)
+    {
+      if (!e->dirty || writeback (&e, 1) == 0)
+        return e;
+    }
+  return NULL;
+}
+
+/**
+ * @brief Frees a data buffer, evicting a block if none is free.
+ *
+ * Takes A1in's oldest block while A1in is over its share, leaving a
+ * ghost behind, and otherwise Am's least recently used block. A dirty
+ * victim is written back first; one whose write fails stays cached and
+ * dirty, and the next oldest is tried instead.
+ *
+ * @return The buffer, or NULL if every cached block is stuck dirty.
+ */
+static struct bcache_entry *
+reclaim (void)
+{
+  struct bcache_entry *e = queue_pop_tail (&free_buffers);
+  if (e)
+    return e;
+
+  struct bcache_queue *first
+      = a1in.count > BCACHE_A1IN_MAX || !am.count ? &a1in : &am;
+  e = pick_victim (first);
+  if (!e)
+    e = pick_victim (first == &a1in ? &am : &a1in);
+  if (!e)
+    return NULL;
+
+  int from_a1in = e->queue == &a1in;
+  queue_remove (e);
+  if (e->ra_stream)
+    {
+      // Read too far ahead: the reader did not get here in time
+      struct bcache_stream *s = &streams[e->ra_stream - 1];
+      if (s->dev == e->dev)
+        s->window /= 2;
+      stats.ra_wasted++;
+    }
+  hash_remove (e);
+  stats.evictions++;
+
+  if (from_a1in)
+    {
+      struct bcache_entry *ghost = queue_pop_tail (&free_ghosts);
+      if (!ghost)
+        {
+          ghost = queue_pop_tail (&a1out);
+          hash_remove (ghost);
+        }
+      ghost->dev = e->dev;
+      ghost->block = e->block;
+      hash_insert (ghost);
+      queue_push (&a1out, ghost);
+    }
+  return e;
+}
+
+static void
+drop_ghost (struct bcache_entry *ghost)
+{
+  queue_remove (ghost);
+  hash_remove (ghost);
+  queue_push (&free_ghosts, ghost);
+}
+
+// Gives a block a buffer, taking the place of its ghost if there is one
+static struct bcache_entry *
+insert_block (struct block_device *dev, uint64_t block,
+              struct bcache_entry *ghost)
+{
+  struct bcache_queue *target = &a1in;
+
+  if (ghost)
+    {
+      drop_ghost (ghost);
+      target = &am;
+    }
+
+  struct bcache_entry *e = reclaim ();
+  if (!e)
+    return NULL;
+  e->dev = dev;
+  e->block = block;
+  e->ra_stream = 0;
+  hash_insert (e);
+  queue_push (target, e);
+  return e;
+}
+
+/**
+ * @brief Finds the buffer for a block, allocating one on a miss.
+ *
+ * @param fresh Set when the buffer does not hold the block's data yet.
+ * @return The buffer, or NULL if none could be freed.
+ */
+static struct bcache_entry *
+get_block (struct block_device *dev, uint64_t block, int *fresh)
+{
+  struct bcache_entry *e = lookup (dev, block);
+
+  if (e && e->data)
+    {
+      stats.hits++;
+      if (e->ra_stream)
+        {
+          e->ra_stream = 0;
+          stats.ra_hits++;
+        }
+      if (e->queue == &am)
+        {
+          queue_remove (e);
+          queue_push (&am, e);
+        }
+      *fresh = 0;
+      return e;
+    }
+
+  stats.misses++;
+  if (e)
+    stats.ghost_hits++;
+  *fresh = 1;
+  return insert_block (dev, block, e);
+}
+
+static void
+discard (struct bcache_entry *e)
+{
+  queue_remove (e);
+  hash_remove (e);
+  queue_push (&free_buffers, e);
+}
+
+static inline uint64_t
+device_blocks (struct block_device *dev)
+{
+  return (dev->sectors + BCACHE_BLOCK_SECTORS - 1) / BCACHE_BLOCK_SECTORS;
+}
+
+// Reads a stream's pending read-ahead range, a batch at a time
+static void
+readahead_work_fn (void *arg)
+{
+  struct bcache_stream *s = arg;
+  uint8_t tag = s - streams + 1;
+
+  mutex_lock (&bcache_mutex);
+  while (s->dev && s->ra_next < s->ra_end)
+    {
+      struct bcache_entry *fill[BLOCK_BATCH];
+      int status[BLOCK_BATCH];
+      int n = 0;
+
+      for (; n < BLOCK_BATCH && s->ra_next < s->ra_end; s->ra_next++)
+        {
+          struct bcache_entry *e = lookup (s->dev, s->ra_next);
+          if (e && e->data)
+            continue;
+
+          // A scan re-reading evicted blocks must not promote them to Am
+          if (e)
+            drop_ghost (e);
+          e = insert_block (s->dev, s->ra_next, NULL);
+          if (!e)
+            {
+              s->ra_end = s->ra_next;
+              break;
+            }
+          e->ra_stream = tag;
+          fill[n++] = e;
+        }
+
+      if (n)
+        transfer (fill, n, 0, status);
+      for (int i = 0; i < n; i++)
+        {
+          if (status[i] < 0)
+            discard (fill[i]);
+          else
+            stats.readahead++;
+        }
+
+      // Let readers at what has arrived before the next batch
+      mutex_unlock (&bcache_mutex);
+      mutex_lock (&bcache_mutex);
+    }
+  mutex_unlock (&bcache_mutex);
+}
+
+/**
+ * @brief Feeds a read of blocks [first, end) to the stream detector.
+ *
+ * A read starting at a stream's next block, or re-reading its last,
+ * partly read block, confirms it; other reads start a new stream in
+ * the least recently used slot.
+ */
+static void
+readahead_update (struct block_device *dev, uint64_t first, uint64_t end)
+{
+  struct bcache_stream *s = NULL;
+  struct bcache_stream *oldest = &streams[0];
+
+  for (int i = 0; i < BCACHE_STREAMS; i++)
+    {
+      struct bcache_stream *c = &streams[i];
+      if (c->dev == dev && first + c->window + 1 >= c->next
+          && first <= c->next + c->window)
+        {
+          s = c;
+          break;
+        }
+      if (c->last_use < oldest->last_use)
+        oldest = c;
+    }
+
+  if (!s)
+    {
+      s = oldest;
+      s->dev = dev;
+      s->window = 0;
+      s->ra_next = end;
+    }
+  else if (first == s->next || first + 1 == s->next)
+    {
+      if (s->window < BCACHE_RA_MIN)
+        s->window = BCACHE_RA_MIN;
+      else if (s->window < BCACHE_RA_MAX)
+        s->window *= 2;
+    }
+  else
+    s->window /= 2; // Skipped around inside the window
+
+  s->next = end;
+  s->last_use = ++stream_clock;
+  if (s->ra_next < end)
+    s->ra_next = end;
+  s->ra_end = end + s->window;
+  if (s->ra_end > device_blocks (dev))
+    s->ra_end = device_blocks (dev);
+
+  // Top the window up once half of what was read ahead is used
+  if (s->ra_next < s->ra_end && s->ra_next - end <= s->window / 2)
+    queue_work (&s->work);
+}
+
+static int
+bcache_rw (struct block_device *dev, uint64_t lba, uint32_t count,
+           uint8_t *buffer, int write)
+{
+  int ret = 0;
+
+  if (!dev)
+    return DISK_ERR_NO_DEVICE;
+  if (lba >= dev->sectors || count > dev->sectors - lba)
+    return DISK_ERR_RANGE;
+  if (!bcache_ready)
+    return write ? block_write (dev, lba, count, buffer)
+                 : block_read (dev, lba, count, buffer);
+
+  uint64_t first = lba / BCACHE_BLOCK_SECTORS;
+  uint64_t end = (lba + count + BCACHE_BLOCK_SECTORS - 1)
+                 / BCACHE_BLOCK_SECTORS;
+
+  mutex_lock (&bcache_mutex);
+  if (!write)
+    readahead_update (dev, first, end);
+  while (count && ret == 0)
+    {
+      struct bcache_entry *batch[BLOCK_BATCH];
+      struct bcache_entry *fill[BLOCK_BATCH];
+      uint32_t offset[BLOCK_BATCH];
+      uint32_t span[BLOCK_BATCH];
+      int fresh[BLOCK_BATCH];
+      int status[BLOCK_BATCH];
+      int n = 0;
+      int nfill = 0;
+      uint64_t next = lba;
+      uint32_t left = count;
+
+      for (; n < BLOCK_BATCH && left; n++)
+        {
+          offset[n] = next % BCACHE_BLOCK_SECTORS;
+          span[n] = BCACHE_BLOCK_SECTORS - offset[n];
+          if (span[n] > left)
+            span[n] = left;
+          batch[n] = get_block (dev, next / BCACHE_BLOCK_SECTORS, &fresh[n]);
+          if (!batch[n])
+            {
+              ret = DISK_ERR_BUSY; // Every buffer holds unwritable data
+              break;
+            }
+
+          // A write over the whole block needn't read it first
+          int whole = offset[n] == 0 && span[n] == block_span (batch[n]);
+          if (fresh[n] && !(write && whole))
+            fill[nfill++] = batch[n];
+
+          next += span[n];
+          left -= span[n];
+        }
+
+      if (nfill && ret == 0)
+        ret = transfer (fill, nfill, 0, status);
+      if (ret < 0)
+        {
+          for (int i = 0; i < n; i++)
+            {
+              if (fresh[i])
+                discard (batch[i]);
+            }
+          break;
+        }
+
+      for (int i = 0; i < n; i++)
+        {
+          uint8_t *data = batch[i]->data + offset[i] * SECTOR_SIZE;
+          if (write)
+            {
+              k_memcpy (data, buffer, span[i] * SECTOR_SIZE);
+              mark_dirty (batch[i]);
+            }
+          else
+            k_memcpy (buffer, data, span[i] * SECTOR_SIZE);
+
+          buffer += span[i] * SECTOR_SIZE;
+          lba += span[i];
+          count -= span[i];
+        }
+    }
+  mutex_unlock (&bcache_mutex);
+
+  return ret;
+}
+
+/**
+ * @brief Reads sectors through the cache.
+ *
+ * @return 0 on success, or a negative DISK_ERR_* value on error.
+ */
+int
+bcache_read (struct block_device *dev, uint64_t lba, uint32_t count,
+             void *buffer)
+{
+  return bcache_rw (dev, lba, count, buffer, 0);
+}
+
+/**
+ * @brief Writes sectors into the cache; see bcache_sync.
+ *
+ * @return 0 on success, or a negative DISK_ERR_* value on error.
+ */
+int
+bcache_write (struct block_device *dev, uint64_t lba, uint32_t count,
+              const void *buffer)
+{
+  return bcache_rw (dev, lba, count, (uint8_t *)buffer, 1);
+}
+
+// Write back the dirty blocks of dev, or of every device if dev is NULL
+static int
+sync_locked (struct block_device *dev)
+{
+  struct bcache_entry *batch[BLOCK_BATCH];
+  int n = 0;
+  int ret = 0;
+
+  for (uint32_t i = 0; i < BCACHE_BUFFERS; i++)
+    {
+      struct bcache_entry *e = &entries[i];
+      if (!e->dirty || (dev && e->dev != dev))
+        continue;
+
+      batch[n++] = e;
+      if (n == BLOCK_BATCH)
+        {
+          int err = writeback (batch, n);
+          if (err < 0 && ret == 0)
+            ret = err;
+          n = 0;
+        }
+    }
+  if (n)
+    {
+      int err = writeback (batch, n);
+      if (err < 0 && ret == 0)
+        ret = err;
+    }
+
+  if (stats.dirty)
+    dirty_since = vtime_now_ns ();
+  return ret;
+}
+
+/**
+ * @brief Writes back a device's dirty blocks; NULL means every device.
+ *
+ * The data may still sit in the drive's own cache; see bcache_flush.
+ */
+int
+bcache_sync (struct block_device *dev)
+{
+  mutex_lock (&bcache_mutex);
+  int ret = sync_locked (dev);
+  mutex_unlock (&bcache_mutex);
+  return ret;
+}
+
+/**
+ * @brief Writes back a device's dirty blocks and flushes its cache.
+ */
+int
+bcache_flush (struct block_device *dev)
+{
+  if (!dev)
+    return DISK_ERR_NO_DEVICE;
+
+  int ret = bcache_sync (dev);
+  int err = block_flush (dev);
+  return ret < 0 ? ret : err;
+}
+
+static void
+writeback_work_fn (void *arg)
+{
+  bcache_sync (NULL);
+}
+
+/**
+ * @brief Starts periodic write-back; called on every timer tick.
+ */
+void
+bcache_tick (void)
+{
+  if (stats.dirty && vtime_now_ns () - dirty_since >= BCACHE_WRITEBACK_NS)
+    queue_work (&writeback_work);
+}
+
+/**
+ * @brief Allocates the cache buffers; caching starts once this is done.
+ */
+void
+init_bcache (void)
+{
+  for (uint32_t i = 0; i < BCACHE_BUFFERS; i++)
+    {
+      entries[i].data = alloc_page ();
+      if (!entries[i].data)
+        break;
+      queue_push (&free_buffers, &entries[i]);
+    }
+  for (uint32_t i = BCACHE_BUFFERS; i < BCACHE_BUFFERS + BCACHE_GHOSTS; i++)
+    queue_push (&free_ghosts, &entries[i]);
+  for (int i = 0; i < BCACHE_STREAMS; i++)
+    {
+      streams[i].work.fn = readahead_work_fn;
+      streams[i].work.arg = &streams[i];
+    }
+
+  bcache_ready = free_buffers.count > 0;
+}
+
+void
+bcache_get_stats (bcache_stats_t *stats_out)
+{
+  uint64_t flags = irq_save ();
+  *stats_out = stats;
+  stats_out->resident = a1in.count + am.count;
+  irq_restore (flags);
+}
+
+void
+bcache_info (void)
+{
+  bcache_stats_t s;
+  bcache_get_stats (&s);
+
+  uint64_t lookups = s.hits + s.misses;
+  kprintf ("bcache: %u blocks cached, %u dirty, hit rate %lu%% "
+           "(%lu/%lu), %lu ghost hits\n",
+           s.resident, s.dirty, lookups ? s.hits * 100 / lookups : 0,
+           s.hits, lookups, s.ghost_hits);
+  kprintf ("bcache: %lu evictions, %lu write-backs, %lu write errors\n",
+           s.evictions, s.writebacks, s.write_errors);
+  kprintf ("bcache: %lu blocks read ahead, %lu used, %lu wasted\n",
+           s.readahead, s.ra_hits, s.ra_wasted);
+}
@@ -0,0 +1,47 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include "disk.h"
+
+#define BCACHE_BLOCK_SECTORS 8 // 4 KiB cache blocks
+#define BCACHE_BUFFERS 256     // 1 MiB of cached data
+#define BCACHE_HASH_BITS 9
+#define BCACHE_WRITEBACK_NS 5000000000ULL // Dirty data waits at most ~5 s
+#define BCACHE_STREAMS 8 // Sequential readers tracked for read-ahead
+#define BCACHE_RA_MIN 2  // Read-ahead window bounds, in blocks
+#define BCACHE_RA_MAX 32
+
+// Buffer cache statistics
+typedef struct
+{
+  uint64_t hits;       // Block lookups found in the cache
+  uint64_t misses;     // Block lookups that went to the device
+  uint64_t ghost_hits; // Misses on recently evicted blocks
+  uint64_t evictions;
+  uint64_t writebacks; // Dirty blocks written to the device
+  uint64_t write_errors;
+  uint64_t readahead;   // Blocks read ahead
+  uint64_t ra_hits;     // Read-ahead blocks later read
+  uint64_t ra_wasted;   // Read-ahead blocks evicted unread
+  uint32_t dirty; // Dirty blocks right now
+  uint32_t resident;
+} bcache_stats_t;
+
+void init_bcache (void);
+int bcache_read (struct block_device *dev, uint64_t lba, uint32_t count,
+                 void *buffer);
+int bcache_write (struct block_device *dev, uint64_t lba, uint32_t count,
+                  const void *buffer);
+int bcache_sync (struct block_device *dev);
+int bcache_flush (struct block_device *dev);
+void bcache_tick (void);
+void bcache_get_stats (bcache_stats_t *stats);
+void bcache_info (void);
+
+#endif
@@ -0,0 +1,209 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "blkbench.h"
+#include "ata.h"
+#include "timer.h"
+#include "../klog.h"
+#include "../memory.h"
+#include "../workqueue.h"
+#include <stddef.h>
+
+static const uint32_t bench_sizes[] = { 1, 8, 64, 256 }; // Sectors
+static const uint32_t bench_depths[] = { 1, 4, 16, 32 };
+
+static void bench_all_work (void *arg);
+static struct work bench_work = WORK_INIT (bench_all_work, 0);
+
+static inline uint64_t
+xorshift (uint64_t *state)
+{
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+}
+
+// Throughput of reading sectors in cycles, or 0 if it cannot be known
+static uint64_t
+kib_per_sec (uint64_t sectors, uint64_t cycles)
+{
+  return cycles ? sectors / 2 * tsc_frequency () / cycles : 0;
+}
+
+/**
+ * @brief Measures random reads of one size at one queue depth.
+ *
+ * Requests go through the block layer's queue but not the buffer
+ * cache. Every request reads into the same buffer, so none of them
+ * merge. Nothing is written, so any device can be measured.
+ *
+ * @return 0 on success, or a negative DISK_ERR_* value on error.
+ */
+int
+blkbench_run (struct block_device *dev, uint32_t sectors, uint32_t depth,
+              struct blkbench_point *point)
+{
+  struct block_request reqs[BLKBENCH_MAX_DEPTH];
+
+  if (!dev)
+    return DISK_ERR_NO_DEVICE;
+  if (!sectors || sectors > dev->sectors || sectors > dev->max_sectors
+      || !depth || depth > BLKBENCH_MAX_DEPTH)
+    return DISK_ERR_RANGE;
+
+  uint64_t ops = BLKBENCH_BYTES / ((uint64_t)sectors * SECTOR_SIZE);
+  if (ops < BLKBENCH_MIN_OPS)
+    ops = BLKBENCH_MIN_OPS;
+  if (ops > BLKBENCH_MAX_OPS)
+    ops = BLKBENCH_MAX_OPS;
+  if (depth > ops)
+    depth = ops;
+
+  uint8_t *buffer = allocate_memory (sectors * SECTOR_SIZE);
+  if (!buffer)
+    return -1;
+
+  uint64_t slots = (dev->sectors - sectors) / sectors + 1;
+  uint64_t seed = read_tsc () | 1;
+  uint64_t issued = 0;
+  int ret = 0;
+
+  uint64_t start = read_tsc ();
+  block_plug (dev);
+  for (uint32_t i = 0; i < depth; i++, issued++)
+    {
+      reqs[i].lba = (xorshift (&seed) % slots) * sectors;
+      reqs[i].count = sectors;
+      reqs[i].write = 0;
+      reqs[i].buffer = buffer;
+      block_start (dev, &reqs[i]);
+    }
+  block_unplug (dev);
+
+  // Refill each slot as it finishes, keeping depth requests in flight
+  for (uint64_t done = 0; done < ops;)
+    {
+      for (uint32_t i = 0; i < depth && done < ops; i++)
+        {
+          if (!reqs[i].buffer)
+            continue;
+
+          int err = block_wait (dev, &reqs[i]);
+          if (err < 0 && ret == 0)
+            ret = err;
+          done++;
+
+          if (issued < ops)
+            {
+              reqs[i].lba = (xorshift (&seed) % slots) * sectors;
+              block_start (dev, &reqs[i]);
+              issued++;
+            }
+          else
+            reqs[i].buffer = NULL;
+        }
+    }
+  uint64_t cycles = read_tsc () - start;
+
+  free_memory (buffer);
+
+  uint64_t hz = tsc_frequency ();
+  point->sectors = sectors;
+  point->depth = depth;
+  point->ops = ops;
+  point->cycles = cycles ? cycles : 1;
+  point->iops = ops * hz / point->cycles;
+  point->kib_per_sec = ops * sectors / 2 * hz / point->cycles;
+  return ret;
+}
+
+/**
+ * @brief Runs every size and depth combination, then a sequential
+ * read, and logs the results.
+ */
+void
+blkbench_suite (struct block_device *dev)
+{
+  kprintf ("blkbench: %s, random reads, %lu sectors\n", dev->name,
+           dev->sectors);
+
+  for (uint32_t s = 0; s < sizeof (bench_sizes) / sizeof (uint32_t); s++)
+    {
+      for (uint32_t d = 0; d < sizeof (bench_depths) / sizeof (uint32_t);
+           d++)
+        {
+          struct blkbench_point p;
+          int ret = blkbench_run (dev, bench_sizes[s], bench_depths[d], &p);
+          if (ret == DISK_ERR_RANGE)
+            continue;
+          if (ret < 0)
+            {
+              kprintf ("blkbench: %s failed with %d\n", dev->name, ret);
+              return;
+            }
+
+          kprintf ("blkbench: %6u B qd %2u: %8lu IOPS %8lu KiB/s\n",
+                   p.sectors * SECTOR_SIZE, p.depth, p.iops, p.kib_per_sec);
+        }
+    }
+
+  struct block_bench_result seq;
+  int ret = block_benchmark (dev, BLKBENCH_BYTES / SECTOR_SIZE,
+                             BLKBENCH_SEQ_CHUNK, &seq);
+  if (ret < 0)
+    kprintf ("blkbench: %s sequential read failed with %d\n", dev->name,
+             ret);
+  else
+    kprintf ("blkbench: %s sequential read: %lu KiB/s\n", dev->name,
+             kib_per_sec (seq.sectors, seq.cycles));
+}
+
+// The ATA disk once through PIO and once through DMA, if there is one
+static void
+ata_suite (void)
+{
+  struct ata_bench_result r;
+  int ret = ata_benchmark (BLKBENCH_BYTES / SECTOR_SIZE, &r);
+
+  if (ret == DISK_ERR_NO_DEVICE)
+    return;
+  if (ret < 0)
+    {
+      kprintf ("blkbench: ATA sequential read failed with %d\n", ret);
+      return;
+    }
+
+  if (r.dma_cycles)
+    kprintf ("blkbench: ATA sequential read: PIO %lu KiB/s, "
+             "DMA %lu KiB/s\n",
+             kib_per_sec (r.sectors, r.pio_cycles),
+             kib_per_sec (r.sectors, r.dma_cycles));
+  else
+    kprintf ("blkbench: ATA sequential read: PIO %lu KiB/s, no DMA\n",
+             kib_per_sec (r.sectors, r.pio_cycles));
+}
+
+static void
+bench_all_work (void *arg)
+{
+  for (uint32_t i = 0; i < block_count (); i++)
+    blkbench_suite (block_at (i));
+  ata_suite ();
+}
+
+/**
+ * @brief Benchmarks every registered device from a worker thread.
+ *
+ * Safe from interrupt context; results go to the kernel log.
+ */
+void
+blkbench_start (void)
+{
+  queue_work (&bench_work);
+}
@@ -0,0 +1,38 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef BLKBENCH_H
+#define BLKBENCH_H
+
+#include "disk.h"
+
+#define BLKBENCH_MAX_DEPTH 32
+#define BLKBENCH_MIN_OPS 16
+#define BLKBENCH_MAX_OPS 256
+#define BLKBENCH_BYTES (4 * 1024 * 1024) // Data moved per point, at most
+#define BLKBENCH_SEQ_CHUNK 128             // Sectors per sequential read
+
+/**
+ * One benchmark point
+ * Random aligned reads of one size with a fixed number in flight.
+ * Cycles are TSC ticks for the whole run.
+ */
+struct blkbench_point
+{
+  uint32_t sectors; // Per request
+  uint32_t depth;   // Requests in flight
+  uint64_t ops;
+  uint64_t cycles;
+  uint64_t iops;
+  uint64_t kib_per_sec;
+};
+
+int blkbench_run (struct block_device *dev, uint32_t sectors, uint32_t depth,
+                  struct blkbench_point *point);
+void blkbench_suite (struct block_device *dev);
+void blkbench_start (void);
+
+#endif
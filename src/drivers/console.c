@@ -0,0 +1,168 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "console.h"
+#include "../cpu.h"
+#include "../io.h"
+
+#define VGA_CRTC_INDEX 0x3D4
+#define VGA_CRTC_DATA 0x3D5
+#define VGA_CURSOR_HIGH 0x0E
+#define VGA_CURSOR_LOW 0x0F
+
+#define BLANK ((WHITE_ON_BLACK << 8) | ' ')
+#define BLANK_QWORD (0x0001000100010001ULL * BLANK)
+#define ROW_QWORDS (VGA_WIDTH * 2 / 8)
+#define ALL_ROWS ((1U << VGA_HEIGHT) - 1)
+#define CONSOLE_BATCH VGA_WIDTH // Characters rendered before a forced flush
+
+/*
+ * Text is rendered into a RAM shadow whose rows form a ring: scrolling
+ * advances top_row and blanks one row instead of moving the screen. Rows
+ * that changed are tracked by screen position and copied to VGA memory
+ * by console_flush, which is also the only place the cursor moves.
+ */
+static uint64_t shadow[VGA_HEIGHT][ROW_QWORDS];
+static int top_row = 0;   // Shadow row shown on the first screen line
+static int cursor_x = 0;  // Column on the screen
+static int cursor_y = 0;  // Line on the screen
+static uint32_t dirty = ALL_ROWS;
+static int flushed_cursor = -1;
+static uint32_t pending = 0; // Characters put since the last flush
+
+static inline uint16_t *
+screen_row (int y)
+{
+  return (uint16_t *)shadow[(top_row + y) % VGA_HEIGHT];
+}
+
+static void
+blank_row (int y)
+{
+  uint64_t *row = (uint64_t *)screen_row (y);
+  for (int i = 0; i < ROW_QWORDS; i++)
+    row[i] = BLANK_QWORD;
+}
+
+static void
+scroll (void)
+{
+  top_row = (top_row + 1) % VGA_HEIGHT;
+  blank_row (VGA_HEIGHT - 1);
+  dirty = ALL_ROWS; // Every line now shows a different row
+}
+
+static void
+put (char c)
+{
+  if (c == '\n')
+    {
+      cursor_x = 0;
+      cursor_y++;
+    }
+  else if (c == '\b')
+    {
+      if (cursor_x > 0)
+        cursor_x--;
+      screen_row (cursor_y)[cursor_x] = BLANK;
+      dirty |= 1U << cursor_y;
+    }
+  else
+    {
+      screen_row (cursor_y)[cursor_x] = (WHITE_ON_BLACK << 8) | (uint8_t)c;
+      dirty |= 1U << cursor_y;
+      cursor_x++;
+    }
+
+  if (cursor_x >= VGA_WIDTH)
+    {
+      cursor_x = 0;
+      cursor_y++;
+    }
+
+  if (cursor_y >= VGA_HEIGHT)
+    {
+      cursor_y = VGA_HEIGHT - 1;
+      scroll ();
+    }
+}
+
+static void
+flush_locked (void)
+{
+  volatile uint64_t *vga = (volatile uint64_t *)VGA_MEMORY;
+
+  for (int y = 0; dirty && y < VGA_HEIGHT; y++)
+    {
+      if (!(dirty & (1U << y)))
+        continue;
+
+      const uint64_t *row = (const uint64_t *)screen_row (y);
+      for (int i = 0; i < ROW_QWORDS; i++)
+        vga[y * ROW_QWORDS + i] = row[i];
+      dirty &= ~(1U << y);
+    }
+
+  int pos = cursor_y * VGA_WIDTH + cursor_x;
+  if (pos != flushed_cursor)
+    {
+      outb (VGA_CRTC_INDEX, VGA_CURSOR_LOW);
+      outb (VGA_CRTC_DATA, pos & 0xFF);
+      outb (VGA_CRTC_INDEX, VGA_CURSOR_HIGH);
+      outb (VGA_CRTC_DATA, (pos >> 8) & 0xFF);
+      flushed_cursor = pos;
+    }
+  pending = 0;
+}
+
+void
+console_clear (void)
+{
+  uint64_t flags = irq_save ();
+
+  for (int y = 0; y < VGA_HEIGHT; y++)
+    blank_row (y);
+  cursor_x = 0;
+  cursor_y = 0;
+  dirty = ALL_ROWS;
+  flush_locked ();
+
+  irq_restore (flags);
+}
+
+// Render one character into the shadow; flushed at the end of a line,
+// after CONSOLE_BATCH characters, or by console_flush
+void
+console_putc (char c)
+{
+  uint64_t flags = irq_save ();
+  put (c);
+  if (c == '\n' || ++pending >= CONSOLE_BATCH)
+    flush_locked ();
+  irq_restore (flags);
+}
+
+// Render a run of characters and flush once
+void
+console_write (const char *data, size_t len)
+{
+  uint64_t flags = irq_save ();
+
+  for (size_t i = 0; i < len; i++)
+    put (data[i]);
+  flush_locked ();
+
+  irq_restore (flags);
+}
+
+// Copy dirty lines to VGA memory and move the hardware cursor
+void
+console_flush (void)
+{
+  uint64_t flags = irq_save ();
+  flush_locked ();
+  irq_restore (flags);
+}
@@ -0,0 +1,23 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define VGA_MEMORY 0xB8000
+#define VGA_WIDTH 80
+#define VGA_HEIGHT 25
+#define WHITE_ON_BLACK 0x0F
+
+void console_clear (void);
+void console_putc (char c);
+void console_write (const char *data, size_t len);
+void console_flush (void);
+
+#endif
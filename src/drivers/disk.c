@@ -5,94 +5,431 @@
  */
 
 #include "disk.h"
-#include "../io.h"
+#include "ahci.h"
+#include "bcache.h"
+#include "elevator.h"
+#include "ata.h"
+#include "nvme.h"
+#include "ramdisk.h"
+#include "timer.h"
+#include "virtio_blk.h"
+#include "../cpu.h"
+#include "../klog.h"
+#include "../memory.h"
+#include "../process.h"
+#include <stddef.h>
 
+/*
+ * Block layer: drivers register a block_device and take requests through
+ * its submit operation, completing them whenever the hardware is done.
+ * The synchronous helpers split a transfer into requests the device can
+ * take, keep up to BLOCK_BATCH of them in flight so queueing hardware
+ * can work on them together, and sleep until they finish.
+ */
+static struct block_device *devices[BLOCK_MAX_DEVICES];
+static struct block_queue queues[BLOCK_MAX_DEVICES];
+static uint32_t device_count = 0;
+
+/**
+ * @brief Probes the storage drivers and sets up the buffer cache.
+ *
+ * Each driver registers the devices it finds; init_pci must run first.
+ */
 void
 init_disk ()
 {
-  // Initialization code for the disk
+  init_ata ();
+  init_ahci ();
+  init_virtio_blk ();
+  init_nvme (NVME_MODE_MSIX);
+  ramdisk_alloc ("ram0", RAMDISK_DEFAULT_SECTORS);
+  init_bcache ();
+}
+
+int
+block_register (struct block_device *dev)
+{
+  if (device_count >= BLOCK_MAX_DEVICES)
+    return -1;
+
+  struct block_queue *q = &queues[device_count];
+  elevator_init (q, dev,
+                 dev->rotational ? ELEVATOR_DEADLINE : ELEVATOR_NOOP);
+  dev->queue = q;
+  devices[device_count++] = dev;
+  return 0;
+}
+
+struct block_device *
+block_get (const char *name)
+{
+  for (uint32_t i = 0; i < device_count; i++)
+    {
+      const char *a = devices[i]->name;
+      const char *b = name;
+      while (*a && *a == *b)
+        {
+          a++;
+          b++;
+        }
+      if (*a == *b)
+        return devices[i];
+    }
+  return NULL;
+}
+
+uint32_t
+block_count (void)
+{
+  return device_count;
+}
+
+// Registered devices in registration order, NULL past the end
+struct block_device *
+block_at (uint32_t index)
+{
+  return index < device_count ? devices[index] : NULL;
+}
+
+// The highest ranked device, which backs the disk_* calls
+struct block_device *
+block_default (void)
+{
+  struct block_device *best = NULL;
+
+  for (uint32_t i = 0; i < device_count; i++)
+    {
+      if (!best || devices[i]->rank > best->rank)
+        best = devices[i];
+    }
+  return best;
 }
 
 /**
- * @brief Reads a sector from the disk using Programmed Input/Output (PIO).
+ * @brief Queues a request for its device.
+ *
+ * Unless the device is plugged the queue is run at once, which may
+ * sleep in the driver.
  *
- * This function reads a single sector of data from the disk at the specified
- * Logical Block Address (LBA). It uses the Intel 8230x Programmable
- * Input/Output (PIO) mode to communicate with the disk controller.
+ * @return 0 once the block layer owns the request, or a negative
+ *         DISK_ERR_* value if it was rejected and will not complete.
+ */
+int
+block_submit (struct block_device *dev, struct block_request *req)
+{
+  if (!dev)
+    return DISK_ERR_NO_DEVICE;
+  if (req->count == 0 || req->count > dev->max_sectors
+      || req->lba >= dev->sectors || req->count > dev->sectors - req->lba)
+    return DISK_ERR_RANGE;
+
+  req->status = 0;
+  req->complete = 0;
+  req->merged = NULL;
+  elevator_add (dev->queue, req);
+  elevator_run (dev->queue);
+  return 0;
+}
+
+/**
+ * @brief Tells the driver a run of submits is over.
+ *
+ * Drivers may hold back their doorbell until then, so every submitter
+ * must call this before waiting for its requests.
+ */
+void
+block_commit (struct block_device *dev)
+{
+  if (dev && dev->ops->commit)
+    dev->ops->commit (dev);
+}
+
+/**
+ * @brief Holds dispatch so a burst of submits can be sorted and merged.
+ *
+ * Plugs nest; the queue runs when the last block_unplug drops it.
+ */
+void
+block_plug (struct block_device *dev)
+{
+  uint64_t flags = irq_save ();
+  dev->queue->plugged++;
+  irq_restore (flags);
+}
+
+/**
+ * @brief Releases a plug, dispatching what collected and committing it.
+ */
+void
+block_unplug (struct block_device *dev)
+{
+  uint64_t flags = irq_save ();
+  dev->queue->plugged--;
+  irq_restore (flags);
+
+  elevator_run (dev->queue);
+  block_commit (dev);
+}
+
+/**
+ * @brief Finishes a request; called by drivers, also from interrupts.
+ */
+void
+block_complete (struct block_request *req, int status)
+{
+  req->status = status;
+  req->complete = 1;
+  if (req->done)
+    req->done (req);
+}
+
+static void
+block_wake (struct block_request *req)
+{
+  wake_process ((uint64_t)(uintptr_t)req->priv);
+}
+
+/**
+ * @brief Submits a request that the calling process will block_wait on.
+ *
+ * lba, count, write and buffer must be set. A rejected request is marked
+ * complete with the error, so it can be waited on like any other.
+ */
+void
+block_start (struct block_device *dev, struct block_request *req)
+{
+  req->done = block_wake;
+  req->priv = (void *)(uintptr_t)current_process_id ();
+
+  int err = block_submit (dev, req);
+  if (err < 0)
+    {
+      req->status = err;
+      req->complete = 1;
+    }
+}
+
+/**
+ * @brief Sleeps until a request from block_start finishes.
  *
- * @param lba The Logical Block Address (LBA) of the sector to read.
- * @param buffer A pointer to the buffer where the read data will be stored.
- *               Must be at least SECTOR_SIZE bytes in size.
+ * Completion and the check below are both made with interrupts off, so
+ * a wakeup cannot fall between them. Polled devices are driven from
+ * here with interrupts on, along with their request queue. The request
+ * must not be held back by a plug.
  *
- * @return 0 on success, or a negative value on error.
+ * @return The request's status.
  */
 int
-read_sector (uint64_t lba, void *buffer)
+block_wait (struct block_device *dev, struct block_request *req)
 {
-  // Assume using PIO to read a sector from disk
-  outb (0x1F6, 0xE0); // Set up master drive (0xE0 for the first drive)
-  outb (0x1F1, (uint8_t)((lba >> 24) & 0xFF)); // High byte of LBA
-  outb (0x1F2, (uint8_t)(SECTOR_SIZE / 512));  // Number of sectors to read (1)
-  outb (0x1F3, (uint8_t)(lba & 0xFF));         // Low byte of LBA
-  outb (0x1F4, (uint8_t)((lba >> 8) & 0xFF));  // Mid byte of LBA
-  outb (0x1F5, (uint8_t)((lba >> 16) & 0xFF)); // High byte of LBA
-  outb (0x1F7, 0x20); // Issue the command (READ SECTOR)
-
-  // Wait for the disk to be ready
-  while ((inb (0x1F7) & 0xC0) == 0)
+  while (1)
     {
+      uint64_t flags = irq_save ();
+      uint8_t done = req->complete;
+      if (!done && !dev->ops->poll)
+        block_current ();
+      irq_restore (flags);
+
+      if (done)
+        return req->status;
+      if (dev->ops->poll)
+        {
+          elevator_run (dev->queue);
+          dev->ops->poll (dev);
+        }
     }
+}
+
+static int
+block_rw (struct block_device *dev, uint64_t lba, uint32_t count,
+          uint8_t *buffer, int write)
+{
+  struct block_request reqs[BLOCK_BATCH];
+  int ret = 0;
+
+  if (!dev)
+    return DISK_ERR_NO_DEVICE;
+  if (lba >= dev->sectors || count > dev->sectors - lba)
+    return DISK_ERR_RANGE;
 
-  // Read the sector data
-  for (int i = 0; i < SECTOR_SIZE / 2; i++)
+  while (count && ret == 0)
     {
-      ((uint16_t *)buffer)[i] = inw (0x1F0);
+      int batch = 0;
+
+      block_plug (dev);
+      for (; batch < BLOCK_BATCH && count; batch++)
+        {
+          struct block_request *req = &reqs[batch];
+          uint32_t chunk = count < dev->max_sectors ? count : dev->max_sectors;
+
+          req->lba = lba;
+          req->count = chunk;
+          req->write = write;
+          req->buffer = buffer;
+          block_start (dev, req);
+
+          lba += chunk;
+          buffer += (uint64_t)chunk * SECTOR_SIZE;
+          count -= chunk;
+        }
+      block_unplug (dev);
+
+      for (int i = 0; i < batch; i++)
+        {
+          int err = block_wait (dev, &reqs[i]);
+          if (err < 0 && ret == 0)
+            ret = err;
+        }
     }
 
-  return 0; // Return 0 for success
+  return ret;
+}
+
+int
+block_read (struct block_device *dev, uint64_t lba, uint32_t count,
+            void *buffer)
+{
+  return block_rw (dev, lba, count, buffer, 0);
+}
+
+int
+block_write (struct block_device *dev, uint64_t lba, uint32_t count,
+             const void *buffer)
+{
+  return block_rw (dev, lba, count, (uint8_t *)buffer, 1);
+}
+
+int
+block_flush (struct block_device *dev)
+{
+  if (!dev)
+    return DISK_ERR_NO_DEVICE;
+  return dev->ops->flush ? dev->ops->flush (dev) : 0;
 }
 
 /**
- * @brief Writes a sector to the disk using Programmed Input/Output (PIO).
- *
- * This function writes a single sector of data to the disk at the specified
- * Logical Block Address (LBA). It uses the Intel 8230x Programmable
- * Input/Output (PIO) mode to communicate with the disk controller.
+ * @brief Times a sequential read from the start of a device.
  *
- * @param lba The Logical Block Address (LBA) of the sector to write.
- * @param buffer A pointer to the buffer containing the data to be written.
+ * The range is read in chunk sized block_read calls, so each call keeps
+ * up to BLOCK_BATCH requests of the device's maximum size in flight.
  *
- * @return 0 on success, or a negative value on error.
+ * @return 0 on success, or a negative DISK_ERR_* value on error.
  */
 int
-write_sector (uint64_t lba, const void *buffer)
+block_benchmark (struct block_device *dev, uint64_t sectors, uint32_t chunk,
+                 struct block_bench_result *result)
 {
-  // Assume using PIO to write a sector to disk
-  outb (0x1F6, 0xE0); // Set up master drive (0xE0 for the first drive)
-  outb (0x1F1, (uint8_t)((lba >> 24) & 0xFF)); // High byte of LBA
-  outb (0x1F2, (uint8_t)(SECTOR_SIZE / 512)); // Number of sectors to write (1)
-  outb (0x1F3, (uint8_t)(lba & 0xFF));        // Low byte of LBA
-  outb (0x1F4, (uint8_t)((lba >> 8) & 0xFF)); // Mid byte of LBA
-  outb (0x1F5, (uint8_t)((lba >> 16) & 0xFF)); // High byte of LBA
-  outb (0x1F7, 0x30); // Issue the command (WRITE SECTOR)
-
-  // Wait for the disk to be ready
-  while ((inb (0x1F7) & 0xC0) == 0)
-    {
-    }
+  if (!dev)
+    return DISK_ERR_NO_DEVICE;
+  if (sectors > dev->sectors)
+    sectors = dev->sectors;
 
-  // Write the sector data
-  for (int i = 0; i < SECTOR_SIZE / 2; i++)
+  uint8_t *buffer = allocate_memory (chunk * SECTOR_SIZE);
+  if (!buffer)
+    return -1;
+
+  int ret = 0;
+  uint64_t start = read_tsc ();
+  for (uint64_t lba = 0; lba < sectors && ret == 0; lba += chunk)
     {
-      outw (0x1F0, ((const uint16_t *)buffer)[i]);
+      uint32_t count = sectors - lba < chunk ? sectors - lba : chunk;
+      ret = block_read (dev, lba, count, buffer);
     }
 
-  return 0; // Return 0 for success
+  result->sectors = sectors;
+  result->chunk = chunk;
+  result->cycles = read_tsc () - start;
+
+  free_memory (buffer);
+  return ret;
+}
+
+/**
+ * @brief Reads sectors from the default disk through the buffer cache.
+ *
+ * @param lba The Logical Block Address (LBA) of the first sector.
+ * @param count The number of sectors to read.
+ * @param buffer Where the data will be stored; count * SECTOR_SIZE bytes.
+ *
+ * @return 0 on success, or a negative DISK_ERR_* value on error.
+ */
+int
+disk_read (uint64_t lba, uint32_t count, void *buffer)
+{
+  return bcache_read (block_default (), lba, count, buffer);
+}
+
+/**
+ * @brief Writes sectors to the default disk through the buffer cache.
+ *
+ * The data reaches the drive on write-back and may then sit in the
+ * drive's own cache; disk_flush pushes it all the way to the medium.
+ *
+ * @param lba The Logical Block Address (LBA) of the first sector.
+ * @param count The number of sectors to write.
+ * @param buffer The data to write; count * SECTOR_SIZE bytes.
+ *
+ * @return 0 on success, or a negative DISK_ERR_* value on error.
+ */
+int
+disk_write (uint64_t lba, uint32_t count, const void *buffer)
+{
+  return bcache_write (block_default (), lba, count, buffer);
+}
+
+/**
+ * @brief Writes back cached blocks of the default disk and commits the
+ * drive's write cache to the medium.
+ */
+int
+disk_flush (void)
+{
+  return bcache_flush (block_default ());
+}
+
+// Capacity of the default disk in sectors, 0 without a disk
+uint64_t
+disk_sectors (void)
+{
+  struct block_device *dev = block_default ();
+  return dev ? dev->sectors : 0;
+}
+
+/**
+ * @brief Reads a single sector; see disk_read.
+ */
+int
+read_sector (uint64_t lba, void *buffer)
+{
+  return disk_read (lba, 1, buffer);
+}
+
+/**
+ * @brief Writes a single sector; see disk_write.
+ */
+int
+write_sector (uint64_t lba, const void *buffer)
+{
+  return disk_write (lba, 1, buffer);
 }
 
 void
 disk_info ()
 {
-  // Optionally implement function to display disk info, not needed. fucking
-  // stupid thing.
+  struct block_device *def = block_default ();
+
+  if (!def)
+    {
+      kprintf ("disk: no block devices\n");
+      return;
+    }
+
+  for (uint32_t i = 0; i < device_count; i++)
+    {
+      kprintf ("disk: %s, %lu sectors, queue depth %u, %s%s\n",
+               devices[i]->name, devices[i]->sectors,
+               devices[i]->queue_depth, elevator_name (devices[i]->queue),
+               devices[i] == def ? ", default" : "");
+    }
+  bcache_info ();
 }
@@ -10,8 +10,116 @@
 #include <stdint.h>
 
 #define SECTOR_SIZE 512
+#define DISK_MAX_SECTORS 65536 // Largest single LBA48 command
+#define BLOCK_MAX_DEVICES 8
+#define BLOCK_BATCH 8 // Requests a synchronous transfer keeps in flight
+
+// Disk error codes
+#define DISK_ERR_NO_DEVICE -1
+#define DISK_ERR_RANGE -2 // Beyond the end of the disk or addressing
+#define DISK_ERR_DEVICE -3 // The drive reported ERR or DF
+#define DISK_ERR_TIMEOUT -4
+#define DISK_ERR_BUSY -5 // The driver cannot take the request now
+
+// Preference when several devices are present; the highest rank
+// backs disk_read and friends
+#define BLOCK_RANK_RAM 0
+#define BLOCK_RANK_ATA 1
+#define BLOCK_RANK_AHCI 2
+#define BLOCK_RANK_VIRTIO 3
+#define BLOCK_RANK_NVME 4
+
+struct block_device;
+struct block_queue;
+
+/**
+ * Sequential read benchmark results
+ * Cycles are TSC ticks for the whole pass.
+ */
+struct block_bench_result
+{
+  uint64_t sectors;
+  uint32_t chunk; // Sectors per request
+  uint64_t cycles;
+};
+
+/**
+ * Block I/O request
+ * Handed to the block layer with block_submit and finished with
+ * block_complete, possibly from interrupt context, where done also
+ * runs. The request must stay valid until then. On its way to the
+ * driver it may share a command with adjacent requests.
+ */
+struct block_request
+{
+  uint64_t lba;
+  uint32_t count;
+  uint8_t write;
+  void *buffer;
+  void (*done) (struct block_request *req);
+  void *priv;                 // For the submitter
+  int status;                 // 0 or a DISK_ERR_* value once complete
+  volatile uint8_t complete;
+  struct block_request *next; // For the driver's own queues
+  uint64_t deadline;          // The rest belong to the request queue
+  struct block_request *queue_next;
+  struct block_request *fifo_next;
+  struct block_request *merged;
+};
+
+/**
+ * Block driver operations
+ * submit may finish the request before returning. Drivers that batch
+ * doorbells provide commit, which block_commit calls after a run of
+ * submits. Drivers without a completion interrupt provide poll, which
+ * waiters call instead of sleeping.
+ */
+struct block_ops
+{
+  int (*submit) (struct block_device *dev, struct block_request *req);
+  void (*commit) (struct block_device *dev);
+  int (*flush) (struct block_device *dev);
+  void (*poll) (struct block_device *dev);
+};
+
+struct block_device
+{
+  const char *name;
+  const struct block_ops *ops;
+  uint64_t sectors;
+  uint32_t max_sectors; // Largest single request
+  uint32_t queue_depth; // Requests the device works on at once
+  int rank;
+  uint8_t rotational;         // Seeks are slow: use the deadline scheduler
+  struct block_queue *queue; // Set by block_register
+  void *priv;
+};
 
 void init_disk ();
+int block_register (struct block_device *dev);
+struct block_device *block_get (const char *name);
+struct block_device *block_default (void);
+uint32_t block_count (void);
+struct block_device *block_at (uint32_t index);
+int block_submit (struct block_device *dev, struct block_request *req);
+void block_commit (struct block_device *dev);
+void block_plug (struct block_device *dev);
+void block_unplug (struct block_device *dev);
+void block_complete (struct block_request *req, int status);
+void block_start (struct block_device *dev, struct block_request *req);
+int block_wait (struct block_device *dev, struct block_request *req);
+int block_read (struct block_device *dev, uint64_t lba, uint32_t count,
+                void *buffer);
+int block_write (struct block_device *dev, uint64_t lba, uint32_t count,
+                 const void *buffer);
+int block_flush (struct block_device *dev);
+int block_benchmark (struct block_device *dev, uint64_t sectors,
+                     uint32_t chunk, struct block_bench_result *result);
+
+int disk_read (uint64_t lba, uint32_t count, void *buffer);
+int disk_write (uint64_t lba, uint32_t count, const void *buffer);
+int disk_flush (void);
+uint64_t disk_sectors (void);
 int read_sector (uint64_t lba, void *buffer);
 int write_sector (uint64_t lba, const void *buffer);
 void disk_info ();
@@ -0,0 +1,272 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "elevator.h"
+#include "../cpu.h"
+#include "../vtime.h"
+#include <stddef.h>
+
+/*
+ * Request queue between block_submit and the driver. Requests collect
+ * here while the queue is plugged or the driver already has
+ * max_in_flight commands, then leave in policy order:
+ *
+ * - noop dispatches in arrival order.
+ * - deadline sweeps upwards through LBA order from where the last
+ *   command ended, wrapping at the top, unless the oldest read or write
+ *   has passed its expiry, in which case that goes first.
+ *
+ * Either way the chosen request absorbs queued requests that continue
+ * it on disk and in memory, up to the device's max_sectors, and the
+ * driver sees one command for all of them.
+ */
+
+static void
+elevator_work_fn (void *arg)
+{
+  elevator_run (arg);
+}
+
+void
+elevator_init (struct block_queue *q, struct block_device *dev, int policy)
+{
+  q->dev = dev;
+  q->policy = policy;
+  q->max_in_flight = dev->queue_depth ? dev->queue_depth : 1;
+  if (q->max_in_flight > ELEVATOR_MAX_INFLIGHT)
+    q->max_in_flight = ELEVATOR_MAX_INFLIGHT;
+  q->free_commands = (1ULL << ELEVATOR_MAX_INFLIGHT) - 1;
+  q->work.fn = elevator_work_fn;
+  q->work.arg = q;
+}
+
+const char *
+elevator_name (const struct block_queue *q)
+{
+  return q->policy == ELEVATOR_DEADLINE ? "deadline" : "noop";
+}
+
+static void
+list_remove (struct block_queue *q, struct block_request *req)
+{
+  struct block_request **link = &q->list;
+  while (*link != req)
+    link = &(*link)->queue_next;
+  *link = req->queue_next;
+}
+
+static void
+fifo_remove (struct block_queue *q, struct block_request *req)
+{
+  int dir = req->write ? 1 : 0;
+  struct block_request *prev = NULL;
+  struct block_request **link = &q->fifo_head[dir];
+
+  while (*link != req)
+    {
+      prev = *link;
+      link = &prev->fifo_next;
+    }
+  *link = req->fifo_next;
+  if (q->fifo_tail[dir] == req)
+    q->fifo_tail[dir] = prev;
+}
+
+/**
+ * @brief Queues a request; safe from interrupt context.
+ *
+ * Nothing is dispatched until elevator_run.
+ */
+void
+elevator_add (struct block_queue *q, struct block_request *req)
+{
+  int dir = req->write ? 1 : 0;
+  uint64_t flags = irq_save ();
+
+  req->deadline = vtime_now_ns ()
+                  + (req->write ? ELEVATOR_WRITE_EXPIRE_NS
+                                : ELEVATOR_READ_EXPIRE_NS);
+  req->fifo_next = NULL;
+  if (q->fifo_tail[dir])
+    q->fifo_tail[dir]->fifo_next = req;
+  else
+    q->fifo_head[dir] = req;
+  q->fifo_tail[dir] = req;
+
+  struct block_request **link = &q->list;
+  if (q->policy == ELEVATOR_DEADLINE)
+    {
+      while (*link && (*link)->lba <= req->lba)
+        link = &(*link)->queue_next;
+    }
+  else
+    {
+      while (*link)
+        link = &(*link)->queue_next;
+    }
+  req->queue_next = *link;
+  *link = req;
+  q->stats.queued++;
+
+  irq_restore (flags);
+}
+
+// Chooses the next request to dispatch; interrupts must be off
+static struct block_request *
+pick (struct block_queue *q)
+{
+  if (q->policy == ELEVATOR_NOOP)
+    return q->list;
+
+  // Reads are checked first; a writer waits longer anyway
+  uint64_t now = vtime_now_ns ();
+  for (int dir = 0; dir < 2; dir++)
+    {
+      if (q->fifo_head[dir] && q->fifo_head[dir]->deadline <= now)
+        {
+          q->stats.expired++;
+          return q->fifo_head[dir];
+        }
+    }
+
+  for (struct block_request *req = q->list; req; req = req->queue_next)
+    {
+      if (req->lba >= q->head_pos)
+        return req;
+    }
+  return q->list;
+}
+
+static void
+command_done (struct block_request *cmd)
+{
+  struct block_queue *q = cmd->priv;
+  struct block_request *req = cmd->merged;
+
+  while (req)
+    {
+      struct block_request *next = req->queue_next;
+      block_complete (req, cmd->status);
+      req = next;
+    }
+
+  uint64_t flags = irq_save ();
+  q->free_commands |= 1ULL << (cmd - q->commands);
+  q->in_flight--;
+  int more = q->list && !q->running && !q->plugged;
+  irq_restore (flags);
+
+  // The driver has room again; dispatch from a context that may sleep
+  if (more)
+    queue_work (&q->work);
+}
+
+// Requests adjacent to cmd on disk and in memory join it
+static void
+merge (struct block_queue *q, struct block_request *cmd)
+{
+  struct block_request *req = q->list;
+
+  while (req)
+    {
+      uint8_t *buffer = cmd->buffer;
+      uint32_t bytes = req->count * SECTOR_SIZE;
+      int back = req->lba == cmd->lba + cmd->count
+                 && req->buffer == buffer + cmd->count * SECTOR_SIZE;
+      int front = req->lba + req->count == cmd->lba
+                  && (uint8_t *)req->buffer + bytes == buffer;
+
+      if (req->write != cmd->write || (!back && !front)
+          || cmd->count + req->count > q->dev->max_sectors)
+        {
+          req = req->queue_next;
+          continue;
+        }
+
+      list_remove (q, req);
+      fifo_remove (q, req);
+      if (front)
+        {
+          cmd->lba = req->lba;
+          cmd->buffer = req->buffer;
+        }
+      cmd->count += req->count;
+      req->queue_next = cmd->merged;
+      cmd->merged = req;
+      q->stats.merged++;
+
+      // The command grew, so earlier requests may fit now
+      req = q->list;
+    }
+}
+
+// Turns the next request into a command; interrupts must be off
+static struct block_request *
+build_command (struct block_queue *q)
+{
+  struct block_request *req = pick (q);
+  int slot = __builtin_ctzll (q->free_commands);
+  struct block_request *cmd = &q->commands[slot];
+
+  q->free_commands &= ~(1ULL << slot);
+  list_remove (q, req);
+  fifo_remove (q, req);
+  req->queue_next = NULL;
+
+  cmd->lba = req->lba;
+  cmd->count = req->count;
+  cmd->write = req->write;
+  cmd->buffer = req->buffer;
+  cmd->done = command_done;
+  cmd->priv = q;
+  cmd->status = 0;
+  cmd->complete = 0;
+  cmd->merged = req;
+  merge (q, cmd);
+
+  q->head_pos = cmd->lba + cmd->count;
+  q->in_flight++;
+  q->stats.dispatched++;
+  return cmd;
+}
+
+/**
+ * @brief Hands queued requests to the driver while it has room.
+ *
+ * Does nothing while the queue is plugged. The driver's submit may
+ * sleep, so this must run in process context.
+ */
+void
+elevator_run (struct block_queue *q)
+{
+  int dispatched = 0;
+  uint64_t flags = irq_save ();
+
+  if (q->running)
+    {
+      irq_restore (flags);
+      return;
+    }
+
+  q->running = 1;
+  while (!q->plugged && q->list && q->in_flight < q->max_in_flight)
+    {
+      struct block_request *cmd = build_command (q);
+      irq_restore (flags);
+
+      int err = q->dev->ops->submit (q->dev, cmd);
+      if (err < 0)
+        block_complete (cmd, err);
+      dispatched = 1;
+
+      flags = irq_save ();
+    }
+  q->running = 0;
+  irq_restore (flags);
+
+  if (dispatched && q->dev->ops->commit)
+    q->dev->ops->commit (q->dev);
+}
@@ -0,0 +1,59 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef ELEVATOR_H
+#define ELEVATOR_H
+
+#include "disk.h"
+#include "../workqueue.h"
+
+// Scheduling policies
+#define ELEVATOR_NOOP 0     // FIFO with merging, for SSDs and virtual disks
+#define ELEVATOR_DEADLINE 1 // LBA order with expiry, for spinning disks
+
+#define ELEVATOR_READ_EXPIRE_NS 500000000ULL   // 500 ms
+#define ELEVATOR_WRITE_EXPIRE_NS 5000000000ULL // 5 s
+#define ELEVATOR_MAX_INFLIGHT 32 // Merged commands handed to a driver
+
+// Request queue statistics
+typedef struct
+{
+  uint64_t queued;     // Requests accepted
+  uint64_t dispatched; // Commands handed to the driver
+  uint64_t merged;     // Requests folded into another's command
+  uint64_t expired;    // Dispatches forced by a deadline
+} elevator_stats_t;
+
+/**
+ * Per-device request queue
+ * Requests wait here, sorted by the policy, until the driver has room.
+ * Adjacent requests with contiguous buffers leave as one command.
+ */
+struct block_queue
+{
+  struct block_device *dev;
+  int policy;
+  uint32_t plugged;  // Dispatch is held while non-zero
+  uint32_t in_flight;
+  uint32_t max_in_flight;
+  uint8_t running;   // A process is dispatching
+  uint64_t head_pos; // LBA after the last dispatch, for the sweep
+  struct block_request *list;        // Dispatch candidates
+  struct block_request *fifo_head[2]; // Arrival order, read and write
+  struct block_request *fifo_tail[2];
+  uint64_t free_commands;
+  struct block_request commands[ELEVATOR_MAX_INFLIGHT];
+  struct work work;
+  elevator_stats_t stats;
+};
+
+void elevator_init (struct block_queue *q, struct block_device *dev,
+                    int policy);
+void elevator_add (struct block_queue *q, struct block_request *req);
+void elevator_run (struct block_queue *q);
+const char *elevator_name (const struct block_queue *q);
+
+#endif
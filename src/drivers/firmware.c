@@ -47,14 +47,18 @@ firmware_print_info (void)
   print_string ("Firmware Vendor: ");
   print_string (firmware_info.vendor);
   print_string ("\nFirmware Version: ");
-  // Assuming you have these functions in io.c
+  print_hex (firmware_info.version);
   print_string ("\nMemory Map:\n");
 
   for (uint32_t i = 0; i < firmware_info.memory_map.entry_count; i++)
     {
       memory_map_entry_t *entry = &firmware_info.memory_map.entries[i];
       print_string ("Base: ");
-      // You'll need to implement these print functions
+      print_hex (entry->base);
+      print_string (" Length: ");
+      print_hex (entry->length);
+      print_string (" Type: ");
+      print_number (entry->type);
       print_string ("\n");
     }
 }
@@ -72,3 +76,9 @@ firmware_get_memory_size (void)
     }
   return total_size;
 }
+
+uint64_t
+firmware_get_rsdp_address (void)
+{
+  return firmware_info.rsdp_address;
+}
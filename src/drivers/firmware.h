@@ -52,5 +52,6 @@ void firmware_exit (void);
 bool firmware_get_memory_map (memory_map_t *map);
 void firmware_print_info (void);
 uint64_t firmware_get_memory_size (void);
+uint64_t firmware_get_rsdp_address (void);
 
 #endif // FIRMWARE_H
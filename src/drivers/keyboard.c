@@ -5,151 +5,242 @@
  */
 
 #include "keyboard.h"
+#include "console.h"
+#include "../cpu.h"
+#include "../debugkeys.h"
+#include "../idt.h"
 #include "../io.h"
+#include "../paging.h"
+#include "../process.h"
+#include "../softirq.h"
+#include "../syscall.h"
 
 #define KEYBOARD_DATA_PORT 0x60
 #define KEYBOARD_COMMAND_PORT 0x64
 
 #define MAX_KEYS 256
+#define SCANCODE_RING_SIZE 128 // Power of two
+#define INPUT_RING_SIZE 256    // Power of two
+#define STDIN_FD 0
 
 static char keymap[MAX_KEYS] = { 0 };
 static char shift_keymap[MAX_KEYS] = { 0 };
 static unsigned char shift_pressed = 0;
 
+/*
+ * Input moves through two single-producer single-consumer rings. The
+ * interrupt handler only queues raw scancodes; keyboard_softirq decodes
+ * them with interrupts enabled and queues the characters for readers.
+ * head is only written by the consumer and tail by the producer.
+ */
+static volatile unsigned char scancodes[SCANCODE_RING_SIZE];
+static volatile uint32_t scancode_head = 0;
+static volatile uint32_t scancode_tail = 0;
+
+static char input[INPUT_RING_SIZE];
+static volatile uint32_t input_head = 0;
+static volatile uint32_t input_tail = 0;
+
+static volatile int64_t input_waiter = -1;
+static keyboard_stats_t stats;
+
 void print_char (char c);
+void keyboard_callback ();
+static void keyboard_softirq (void *arg);
+static uint64_t sys_read (SYSCALL_PARAMS);
+
+static struct softirq keyboard_work = SOFTIRQ_INIT (keyboard_softirq, 0);
 
 // Initialize the keyboard
 void
 init_keyboard ()
 {
+  setup_keymap ();
   outb (KEYBOARD_COMMAND_PORT, 0xAE); // Enable keyboard interrupts
+  register_interrupt_handler (IRQ (1), keyboard_callback);
+  register_syscall (SYS_READ, sys_read);
 }
 
 // Keyboard interrupt callback
+// Only takes the scancode off the controller; decoding and echoing run
+// from keyboard_softirq with interrupts enabled.
 void
 keyboard_callback ()
 {
   unsigned char scancode = inb (KEYBOARD_DATA_PORT);
+  uint32_t tail = scancode_tail;
 
+  if (tail - __atomic_load_n (&scancode_head, __ATOMIC_ACQUIRE)
+      < SCANCODE_RING_SIZE)
+    {
+      scancodes[tail % SCANCODE_RING_SIZE] = scancode;
+      __atomic_store_n (&scancode_tail, tail + 1, __ATOMIC_RELEASE);
+    }
+  else
+    stats.scancodes_dropped++;
+
+  softirq_raise (&keyboard_work);
+}
+
+// Queue a decoded character for readers and echo it
+static void
+keyboard_queue (char c)
+{
+  uint32_t tail = input_tail;
+
+  if (tail - __atomic_load_n (&input_head, __ATOMIC_ACQUIRE)
+      >= INPUT_RING_SIZE)
+    {
+      stats.chars_dropped++;
+      return;
+    }
+
+  input[tail % INPUT_RING_SIZE] = c;
+  __atomic_store_n (&input_tail, tail + 1, __ATOMIC_RELEASE);
+  stats.chars++;
+  print_char (c);
+}
+
+// Decode one scancode
+static void
+keyboard_process (unsigned char scancode)
+{
   if (scancode & 0x80)
     {
       // Handle key release if necessary
-      if (scancode == 0x2A || scancode == 0x36)
+      if (scancode == 0xAA || scancode == 0xB6)
         {
           shift_pressed = 0;
         }
       return;
     }
 
-  int key = 0; // Change the type to int for comparison
-  if (scancode < MAX_KEYS)
+  if (debugkeys_handle (scancode))
+    return;
+
+  if (scancode == 0x2A || scancode == 0x36)
     {
-      if (shift_pressed)
-        {
-          key = shift_keymap[scancode];
-        }
-      else
-        {
-          key = keymap[scancode];
-        }
+      shift_pressed = 1;
+      return;
+    }
 
-      if (key)
-        {
-          print_char (key);
-        }
+  char key = shift_pressed ? shift_keymap[scancode] : keymap[scancode];
+  if (key)
+    {
+      keyboard_queue (key);
+    }
+}
 
-      if (scancode == 0x2A || scancode == 0x36)
+static void
+keyboard_softirq (void *arg)
+{
+  uint32_t head = scancode_head;
+
+  while (head != __atomic_load_n (&scancode_tail, __ATOMIC_ACQUIRE))
+    {
+      unsigned char scancode = scancodes[head % SCANCODE_RING_SIZE];
+      __atomic_store_n (&scancode_head, ++head, __ATOMIC_RELEASE);
+      keyboard_process (scancode);
+    }
+  console_flush (); // Show the echoed keys once per batch
+
+  uint64_t flags = irq_save ();
+  if (input_waiter >= 0 && input_head != input_tail)
+    {
+      wake_process (input_waiter);
+      input_waiter = -1;
+    }
+  irq_restore (flags);
+}
+
+/**
+ * @brief Copies up to len buffered characters without blocking.
+ *
+ * @return The number of characters copied
+ */
+size_t
+keyboard_read_nonblock (char *buf, size_t len)
+{
+  uint32_t head = input_head;
+  uint32_t tail = __atomic_load_n (&input_tail, __ATOMIC_ACQUIRE);
+  size_t copied = 0;
+
+  while (copied < len && head != tail)
+    {
+      buf[copied++] = input[head % INPUT_RING_SIZE];
+      head++;
+    }
+
+  __atomic_store_n (&input_head, head, __ATOMIC_RELEASE);
+  return copied;
+}
+
+/**
+ * @brief Reads keyboard input, blocking until at least one character.
+ *
+ * Only one process may wait for input at a time.
+ *
+ * @return The number of characters copied, at most len
+ */
+size_t
+keyboard_read (char *buf, size_t len)
+{
+  if (len == 0)
+    return 0;
+
+  while (1)
+    {
+      uint64_t flags = irq_save ();
+      size_t copied = keyboard_read_nonblock (buf, len);
+      if (copied)
         {
-          shift_pressed = 1;
+          irq_restore (flags);
+          return copied;
         }
+      input_waiter = current_process_id ();
+      block_current ();
+      irq_restore (flags);
     }
 }
 
-// Function to map scancodes to ASCII
 void
-setup_keymap ()
+keyboard_get_stats (keyboard_stats_t *out)
+{
+  *out = stats;
+}
+
+// SYS_READ: arg1 = fd, arg2 = buffer, arg3 = length. Only standard input
+// (the keyboard) is readable.
+static uint64_t
+sys_read (SYSCALL_PARAMS)
 {
-  // Basic key mapping (unshifted)
-  keymap[0x1E] = 'a';
-  keymap[0x30] = 'b';
-  keymap[0x2E] = 'c';
-  keymap[0x20] = ' ';
-  keymap[0x15] = 'd';
-  keymap[0x12] = 'e';
-  keymap[0x21] = 'f';
-  keymap[0x24] = 'g';
-  keymap[0x13] = 'h';
-  keymap[0x23] = 'i';
-  keymap[0x17] = 'j';
-  keymap[0x22] = 'k';
-  keymap[0x19] = 'l';
-  keymap[0x10] = 'm';
-  keymap[0x14] = 'n';
-  keymap[0x16] = 'o';
-  keymap[0x1C] = 'p';
-  keymap[0x1A] = 'q';
-  keymap[0x1D] = 'r';
-  keymap[0x18] = 's';
-  keymap[0x11] = 't';
-  keymap[0x14] = 'u';
-  keymap[0x1F] = 'v';
-  keymap[0x13] = 'w';
-  keymap[0x12] = 'x';
-  keymap[0x1B] = 'y';
-  keymap[0x2C] = 'z';
-  keymap[0x29] = '\n'; // Enter
-  keymap[0x0E] = '\b'; // Backspace
-
-  // Additional keys (unshifted)
-  keymap[0x39] = ' '; // Space
-  keymap[0x27] = ','; // Comma
-  keymap[0x28] = '.'; // Period
-  keymap[0x2D] = '-'; // Minus
-  keymap[0x2E] = '='; // Equals
-
-  // Shifted key mapping
-  shift_keymap[0x1E] = 'A';
-  shift_keymap[0x30] = 'B';
-  shift_keymap[0x2E] = 'C';
-  shift_keymap[0x20] = ' ';
-  shift_keymap[0x15] = 'D';
-  shift_keymap[0x12] = 'E';
-  shift_keymap[0x21] = 'F';
-  shift_keymap[0x24] = 'G';
-  shift_keymap[0x13] = 'H';
-  shift_keymap[0x23] = 'I';
-  shift_keymap[0x17] = 'J';
-  shift_keymap[0x22] = 'K';
-  shift_keymap[0x19] = 'L';
-  shift_keymap[0x10] = 'M';
-  shift_keymap[0x14] = 'N';
-  shift_keymap[0x16] = 'O';
-  shift_keymap[0x1C] = 'P';
-  shift_keymap[0x1A] = 'Q';
-  shift_keymap[0x1D] = 'R';
-  shift_keymap[0x18] = 'S';
-  shift_keymap[0x11] = 'T';
-  shift_keymap[0x14] = 'U';
-  shift_keymap[0x1F] = 'V';
-  shift_keymap[0x13] = 'W';
-  shift_keymap[0x12] = 'X';
-  shift_keymap[0x1B] = 'Y';
-  shift_keymap[0x2C] = 'Z';
-  shift_keymap[0x29] = '\n'; // Enter
-  shift_keymap[0x0E] = '\b'; // Backspace
-
-  // Additional keys (shifted)
-  shift_keymap[0x39] = ' '; // Space
-  shift_keymap[0x27] = '<'; // Comma
-  shift_keymap[0x28] = '>'; // Period
-  shift_keymap[0x2D] = '_'; // Minus
-  shift_keymap[0x2E] = '+'; // Equals
+  if (arg1 != STDIN_FD
+      || !paging_user_range (paging_current (), arg2, arg3, 1))
+    return SYSCALL_ERROR;
+
+  return keyboard_read ((char *)arg2, arg3);
+}
+
+// Fill consecutive scancodes starting at first from two strings
+static void
+map_keys (unsigned char first, const char *plain, const char *shifted)
+{
+  for (int i = 0; plain[i]; i++)
+    {
+      keymap[first + i] = plain[i];
+      shift_keymap[first + i] = shifted[i];
+    }
 }
 
-// Call this function to initialize everything
+// Function to map scancodes to ASCII (scancode set 1, US layout)
 void
-initialize_keyboard_driver ()
+setup_keymap ()
 {
-  setup_keymap ();
-  init_keyboard ();
+  map_keys (0x02, "1234567890-=", "!@#$%^&*()_+");
+  map_keys (0x10, "qwertyuiop[]", "QWERTYUIOP{}");
+  map_keys (0x1E, "asdfghjkl;'`", "ASDFGHJKL:\"~");
+  map_keys (0x2B, "\\zxcvbnm,./", "|ZXCVBNM<>?");
+  map_keys (0x0E, "\b\t", "\b\t"); // Backspace, Tab
+  map_keys (0x1C, "\n", "\n");     // Enter
+  map_keys (0x39, " ", " ");       // Space
 }
@@ -7,6 +7,21 @@
 #ifndef KEYBOARD_H
 #define KEYBOARD_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+// Keyboard driver statistics
+typedef struct
+{
+  uint64_t chars;             // Characters decoded for readers
+  uint64_t scancodes_dropped; // Lost to a full scancode ring
+  uint64_t chars_dropped;     // Lost to a full input ring
+} keyboard_stats_t;
+
 void init_keyboard ();
+void setup_keymap ();
+size_t keyboard_read (char *buf, size_t len);
+size_t keyboard_read_nonblock (char *buf, size_t len);
+void keyboard_get_stats (keyboard_stats_t *stats);
 
 #endif
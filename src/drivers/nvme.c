@@ -0,0 +1,673 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "nvme.h"
+#include "pci.h"
+#include "../apic.h"
+#include "../cpu.h"
+#include "../idt.h"
+#include "../klog.h"
+#include "../memory.h"
+#include "../paging.h"
+#include "timer.h"
+#include <stddef.h>
+
+#define PCI_NVME_PROG_IF 0x02
+
+// Controller registers
+#define NVME_CAP 0x00
+#define NVME_CC 0x14
+#define NVME_CSTS 0x1C
+#define NVME_AQA 0x24
+#define NVME_ASQ 0x28
+#define NVME_ACQ 0x30
+#define NVME_DOORBELLS 0x1000
+
+#define CAP_MQES_MASK 0xFFFF
+#define CAP_TO_SHIFT 24
+#define CAP_DSTRD_SHIFT 32
+
+#define CC_EN (1U << 0)
+#define CC_IOSQES (6U << 16) // 64-byte submission entries
+#define CC_IOCQES (4U << 20) // 16-byte completion entries
+#define CSTS_RDY (1U << 0)
+#define CSTS_CFS (1U << 1)
+
+// Admin commands
+#define ADMIN_CREATE_SQ 0x01
+#define ADMIN_CREATE_CQ 0x05
+#define ADMIN_IDENTIFY 0x06
+#define ADMIN_SET_FEATURES 0x09
+#define FEATURE_NUM_QUEUES 0x07
+#define IDENTIFY_NAMESPACE 0
+#define IDENTIFY_CONTROLLER 1
+
+// I/O commands
+#define IO_FLUSH 0x00
+#define IO_WRITE 0x01
+#define IO_READ 0x02
+
+#define QUEUE_PHYS_CONTIG 0x1
+#define CQ_IRQ_ENABLED 0x2
+
+#define NVME_SLOTS (NVME_QUEUE_SIZE - 1)
+#define NVME_MAX_SECTORS 256 // 128 KiB: PRP1 plus a 32-entry list
+#define NVME_PRP_LIST_BYTES 512
+#define NVME_PRP_LISTS_PER_PAGE (PAGE_SIZE / NVME_PRP_LIST_BYTES)
+#define NVME_MIN_TIMEOUT_MS 500 // CAP.TO of 0 still gets one unit
+#define NVME_MDTS_MAX_SHIFT 16  // Larger MDTS values never bind
+
+struct nvme_cmd
+{
+  uint8_t opcode;
+  uint8_t flags;
+  uint16_t cid;
+  uint32_t nsid;
+  uint64_t reserved;
+  uint64_t mptr;
+  uint64_t prp1;
+  uint64_t prp2;
+  uint32_t cdw10;
+  uint32_t cdw11;
+  uint32_t cdw12;
+  uint32_t cdw13;
+  uint32_t cdw14;
+  uint32_t cdw15;
+};
+
+struct nvme_cqe
+{
+  uint32_t result;
+  uint32_t reserved;
+  uint16_t sq_head;
+  uint16_t sq_id;
+  uint16_t cid;
+  volatile uint16_t status; // Bit 0 is the phase tag
+};
+
+/*
+ * A submission/completion queue pair. Each CPU submits only to its own
+ * pair and its completions interrupt only that CPU, so the submission
+ * path takes no lock: masking interrupts is enough. When the controller
+ * grants fewer pairs than there are CPUs they are shared round-robin,
+ * which is safe while only the boot CPU runs tasks. Command IDs are slot
+ * indexes; each slot owns a PRP list for transfers over two pages.
+ */
+struct nvme_queue
+{
+  uint16_t qid;
+  struct nvme_cmd *sq;
+  volatile struct nvme_cqe *cq;
+  volatile uint32_t *sq_doorbell;
+  volatile uint32_t *cq_doorbell;
+  uint16_t sq_tail;
+  uint16_t doorbell_tail; // sq_tail at the last doorbell write
+  uint16_t cq_head;
+  uint8_t phase;
+  uint64_t free_slots;
+  struct block_request *inflight[NVME_SLOTS];
+  uint64_t *prp_lists[NVME_SLOTS];
+  struct block_request *pending_head;
+  struct block_request *pending_tail;
+  uint64_t commands;
+  uint64_t doorbells;
+  uint64_t interrupts;
+};
+
+static struct
+{
+  volatile uint8_t *regs;
+  uint32_t doorbell_stride;
+  uint32_t timeout_ms;
+  struct nvme_queue admin;
+  struct nvme_queue queues[NVME_MAX_QUEUES];
+  uint32_t queue_count;
+  uint8_t polled;
+  struct block_device dev;
+} nvme;
+
+static int nvme_submit (struct block_device *dev, struct block_request *req);
+static void nvme_commit (struct block_device *dev);
+static int nvme_flush (struct block_device *dev);
+static void nvme_poll (struct block_device *dev);
+
+static struct block_ops nvme_ops = {
+  .submit = nvme_submit,
+  .commit = nvme_commit,
+  .flush = nvme_flush,
+};
+
+static inline uint32_t
+reg_read32 (uint32_t reg)
+{
+  return *(volatile uint32_t *)(nvme.regs + reg);
+}
+
+static inline void
+reg_write32 (uint32_t reg, uint32_t value)
+{
+  *(volatile uint32_t *)(nvme.regs + reg) = value;
+}
+
+static inline uint64_t
+reg_read64 (uint32_t reg)
+{
+  return reg_read32 (reg) | (uint64_t)reg_read32 (reg + 4) << 32;
+}
+
+static inline void
+reg_write64 (uint32_t reg, uint64_t value)
+{
+  reg_write32 (reg, value & 0xFFFFFFFF);
+  reg_write32 (reg + 4, value >> 32);
+}
+
+static inline uint64_t
+phys_of (const volatile void *virt)
+{
+  return paging_virt_to_phys (paging_current (), (uintptr_t)virt);
+}
+
+// TSC value at which a command started now has timed out
+static inline uint64_t
+deadline (void)
+{
+  return read_tsc () + tsc_frequency () / 1000 * nvme.timeout_ms;
+}
+
+static int
+wait_ready (uint32_t ready)
+{
+  uint64_t end = deadline ();
+
+  while (read_tsc () < end)
+    {
+      uint32_t csts = reg_read32 (NVME_CSTS);
+      if (csts & CSTS_CFS)
+        return DISK_ERR_DEVICE;
+      if ((csts & CSTS_RDY) == ready)
+        return 0;
+    }
+  return DISK_ERR_TIMEOUT;
+}
+
+static int
+queue_init (struct nvme_queue *q, uint16_t qid)
+{
+  q->qid = qid;
+  q->sq = alloc_page ();
+  q->cq = alloc_page ();
+  if (!q->sq || !q->cq)
+    return -1;
+
+  q->sq_doorbell = (volatile uint32_t *)(nvme.regs + NVME_DOORBELLS
+                                         + (2 * qid) * nvme.doorbell_stride);
+  q->cq_doorbell = (volatile uint32_t *)(nvme.regs + NVME_DOORBELLS
+                                         + (2 * qid + 1)
+                                               * nvme.doorbell_stride);
+  q->phase = 1;
+  q->free_slots = (1ULL << NVME_SLOTS) - 1;
+  return 0;
+}
+
+static void
+queue_push (struct nvme_queue *q, const struct nvme_cmd *cmd)
+{
+  q->sq[q->sq_tail] = *cmd;
+  q->sq_tail = (q->sq_tail + 1) % NVME_QUEUE_SIZE;
+  q->commands++;
+}
+
+static void
+queue_ring (struct nvme_queue *q)
+{
+  if (q->sq_tail == q->doorbell_tail)
+    return;
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  *q->sq_doorbell = q->sq_tail;
+  q->doorbell_tail = q->sq_tail;
+  q->doorbells++;
+}
+
+// Run an admin command and poll for it; used only during setup
+static int
+admin_exec (struct nvme_cmd *cmd, uint32_t *result)
+{
+  struct nvme_queue *q = &nvme.admin;
+
+  cmd->cid = q->sq_tail;
+  queue_push (q, cmd);
+  queue_ring (q);
+
+  uint64_t end = deadline ();
+  while (read_tsc () < end)
+    {
+      volatile struct nvme_cqe *cqe = &q->cq[q->cq_head];
+      if ((cqe->status & 1) != q->phase)
+        continue;
+
+      uint16_t status = cqe->status >> 1;
+      if (result)
+        *result = cqe->result;
+      q->cq_head = (q->cq_head + 1) % NVME_QUEUE_SIZE;
+      if (q->cq_head == 0)
+        q->phase ^= 1;
+      *q->cq_doorbell = q->cq_head;
+      return status ? DISK_ERR_DEVICE : 0;
+    }
+  return DISK_ERR_TIMEOUT;
+}
+
+/**
+ * @brief Fills PRP1/PRP2 for a buffer.
+ *
+ * PRP1 may start inside a page; every further entry names a whole page.
+ * Two pages fit in the command itself, more go through the slot's list.
+ */
+static int
+build_prps (struct nvme_cmd *cmd, uint64_t *list, uint8_t *buffer,
+            uint64_t bytes)
+{
+  uint64_t *pml4 = paging_current ();
+  uintptr_t virt = (uintptr_t)buffer;
+  uint64_t first = PAGE_SIZE - (virt & (PAGE_SIZE - 1));
+
+  if ((uintptr_t)buffer & 3)
+    return DISK_ERR_RANGE; // PRPs must be dword aligned
+
+  cmd->prp1 = paging_virt_to_phys (pml4, virt);
+  cmd->prp2 = 0;
+  if (bytes <= first)
+    return 0;
+
+  virt += first;
+  bytes -= first;
+  if (bytes <= PAGE_SIZE)
+    {
+      cmd->prp2 = paging_virt_to_phys (pml4, virt);
+      return 0;
+    }
+
+  uint32_t n = 0;
+  while (bytes)
+    {
+      if (n == NVME_PRP_LIST_BYTES / sizeof (uint64_t))
+        return DISK_ERR_RANGE;
+      list[n++] = paging_virt_to_phys (pml4, virt);
+      virt += PAGE_SIZE;
+      bytes -= bytes < PAGE_SIZE ? bytes : PAGE_SIZE;
+    }
+  cmd->prp2 = phys_of (list);
+  return 0;
+}
+
+static void
+queue_issue (struct nvme_queue *q, struct block_request *req, int slot)
+{
+  struct nvme_cmd cmd = { 0 };
+
+  cmd.opcode = req->write ? IO_WRITE : IO_READ;
+  cmd.cid = slot;
+  cmd.nsid = 1;
+  cmd.cdw10 = req->lba & 0xFFFFFFFF;
+  cmd.cdw11 = req->lba >> 32;
+  cmd.cdw12 = req->count - 1;
+
+  int ret = build_prps (&cmd, q->prp_lists[slot], req->buffer,
+                        (uint64_t)req->count * SECTOR_SIZE);
+  if (ret < 0)
+    {
+      block_complete (req, ret);
+      return;
+    }
+
+  q->inflight[slot] = req;
+  q->free_slots &= ~(1ULL << slot);
+  queue_push (q, &cmd);
+}
+
+// Move pending requests into free slots; interrupts must be off
+static void
+queue_start_pending (struct nvme_queue *q)
+{
+  while (q->pending_head && q->free_slots)
+    {
+      struct block_request *req = q->pending_head;
+      q->pending_head = req->next;
+      if (!q->pending_head)
+        q->pending_tail = NULL;
+
+      queue_issue (q, req, __builtin_ctzll (q->free_slots));
+    }
+}
+
+// Reap the completion queue; interrupts must be off
+static void
+queue_complete (struct nvme_queue *q)
+{
+  uint16_t start = q->cq_head;
+
+  while (((q->cq[q->cq_head].status & 1) == q->phase))
+    {
+      volatile struct nvme_cqe *cqe = &q->cq[q->cq_head];
+      uint16_t slot = cqe->cid;
+      uint16_t status = cqe->status >> 1;
+
+      q->cq_head = (q->cq_head + 1) % NVME_QUEUE_SIZE;
+      if (q->cq_head == 0)
+        q->phase ^= 1;
+
+      // A timed-out flush leaves its slot busy with no request behind it
+      if (slot < NVME_SLOTS && !(q->free_slots & (1ULL << slot)))
+        {
+          struct block_request *req = q->inflight[slot];
+          q->inflight[slot] = NULL;
+          q->free_slots |= 1ULL << slot;
+          if (req)
+            block_complete (req, status ? DISK_ERR_DEVICE : 0);
+        }
+    }
+
+  if (q->cq_head != start)
+    *q->cq_doorbell = q->cq_head;
+
+  queue_start_pending (q);
+  queue_ring (q);
+}
+
+static inline struct nvme_queue *
+local_queue (void)
+{
+  return &nvme.queues[this_cpu ()->index % nvme.queue_count];
+}
+
+static void
+nvme_interrupt (void)
+{
+  struct nvme_queue *q = local_queue ();
+  q->interrupts++;
+  queue_complete (q);
+}
+
+static int
+nvme_submit (struct block_device *dev, struct block_request *req)
+{
+  uint64_t flags = irq_save ();
+  struct nvme_queue *q = local_queue ();
+
+  req->next = NULL;
+  if (q->pending_tail)
+    q->pending_tail->next = req;
+  else
+    q->pending_head = req;
+  q->pending_tail = req;
+  queue_start_pending (q);
+
+  irq_restore (flags);
+  return 0;
+}
+
+// One doorbell write covers every command queued since the last one
+static void
+nvme_commit (struct block_device *dev)
+{
+  uint64_t flags = irq_save ();
+  queue_ring (local_queue ());
+  irq_restore (flags);
+}
+
+static void
+nvme_poll (struct block_device *dev)
+{
+  uint64_t flags = irq_save ();
+  queue_complete (local_queue ());
+  irq_restore (flags);
+}
+
+// Flushes are rare, so the caller polls its queue for the result
+static int
+nvme_flush (struct block_device *dev)
+{
+  struct block_request req = { 0 };
+  struct nvme_cmd cmd = { 0 };
+  uint64_t flags = irq_save ();
+  struct nvme_queue *q = local_queue ();
+  uint64_t end = deadline ();
+
+  while (!q->free_slots)
+    {
+      if (read_tsc () >= end)
+        {
+          irq_restore (flags);
+          return DISK_ERR_TIMEOUT;
+        }
+      queue_complete (q);
+    }
+
+  int slot = __builtin_ctzll (q->free_slots);
+  cmd.opcode = IO_FLUSH;
+  cmd.cid = slot;
+  cmd.nsid = 1;
+  q->inflight[slot] = &req;
+  q->free_slots &= ~(1ULL << slot);
+  queue_push (q, &cmd);
+  queue_ring (q);
+
+  end = deadline ();
+  while (!req.complete)
+    {
+      if (read_tsc () >= end)
+        {
+          // The slot stays busy until the controller answers, if ever
+          q->inflight[slot] = NULL;
+          irq_restore (flags);
+          return DISK_ERR_TIMEOUT;
+        }
+      queue_complete (q);
+    }
+  irq_restore (flags);
+
+  return req.status;
+}
+
+static int
+create_io_queue (uint16_t index, pci_msix_t *msix)
+{
+  struct nvme_queue *q = &nvme.queues[index];
+  uint16_t qid = index + 1;
+  struct nvme_cmd cmd = { 0 };
+  uint32_t cq_flags = QUEUE_PHYS_CONTIG;
+
+  if (queue_init (q, qid) < 0)
+    return -1;
+
+  uint64_t *lists = NULL;
+  for (int slot = 0; slot < NVME_SLOTS; slot++)
+    {
+      if (slot % NVME_PRP_LISTS_PER_PAGE == 0)
+        {
+          lists = alloc_page ();
+          if (!lists)
+            return -1;
+        }
+      q->prp_lists[slot]
+          = lists
+            + (slot % NVME_PRP_LISTS_PER_PAGE) * NVME_PRP_LIST_BYTES / 8;
+    }
+
+  if (msix)
+    {
+      // The queue's completions go to the CPU that submits on it
+      int vector = alloc_interrupt_vector ();
+      struct cpu_local *cpu = cpu_get (index);
+      if (vector < 0 || !cpu)
+        return -1;
+      pci_msix_set (msix, qid, vector, cpu->apic_id);
+      register_interrupt_handler (vector, nvme_interrupt);
+      cq_flags |= CQ_IRQ_ENABLED | (uint32_t)qid << 16;
+    }
+
+  cmd.opcode = ADMIN_CREATE_CQ;
+  cmd.prp1 = phys_of (q->cq);
+  cmd.cdw10 = (NVME_QUEUE_SIZE - 1) << 16 | qid;
+  cmd.cdw11 = cq_flags;
+  if (admin_exec (&cmd, NULL) < 0)
+    return -1;
+
+  cmd.opcode = ADMIN_CREATE_SQ;
+  cmd.prp1 = phys_of (q->sq);
+  cmd.cdw10 = (NVME_QUEUE_SIZE - 1) << 16 | qid;
+  cmd.cdw11 = (uint32_t)qid << 16 | QUEUE_PHYS_CONTIG;
+  return admin_exec (&cmd, NULL);
+}
+
+static int
+identify (void *page, uint32_t cns, uint32_t nsid)
+{
+  struct nvme_cmd cmd = { 0 };
+  cmd.opcode = ADMIN_IDENTIFY;
+  cmd.nsid = nsid;
+  cmd.prp1 = phys_of (page);
+  cmd.cdw10 = cns;
+  return admin_exec (&cmd, NULL);
+}
+
+/**
+ * @brief Finds an NVMe controller and registers namespace 1 as "nvme0n1".
+ *
+ * One I/O queue pair is created per CPU, as far as the controller
+ * grants. With NVME_MODE_MSIX each pair's completion queue interrupts its
+ * own CPU; without MSI-X, or with NVME_MODE_POLLED, waiters reap their
+ * queue themselves. Only namespaces formatted with 512-byte blocks are
+ * used. init_pci must run first.
+ */
+void
+init_nvme (int mode)
+{
+  const pci_device_t *dev = NULL;
+
+  while ((dev = pci_find (PCI_CLASS_STORAGE, PCI_SUBCLASS_NVM, dev)))
+    {
+      if (dev->prog_if == PCI_NVME_PROG_IF)
+        break;
+    }
+  if (!dev)
+    return;
+
+  uint64_t bar = pci_bar (dev, 0, NULL);
+  if (!bar)
+    return;
+  pci_enable (dev, PCI_COMMAND_MEMORY | PCI_COMMAND_BUS_MASTER);
+  nvme.regs = paging_map_mmio (bar, 2 * PAGE_SIZE);
+
+  uint64_t cap = reg_read64 (NVME_CAP);
+  nvme.timeout_ms = ((cap >> CAP_TO_SHIFT) & 0xFF) * 500;
+  if (nvme.timeout_ms < NVME_MIN_TIMEOUT_MS)
+    nvme.timeout_ms = NVME_MIN_TIMEOUT_MS;
+  nvme.doorbell_stride = 4U << ((cap >> CAP_DSTRD_SHIFT) & 0xF);
+  if ((cap & CAP_MQES_MASK) + 1 < NVME_QUEUE_SIZE)
+    return;
+
+  // Reset, then bring the controller up with the admin queue pair
+  reg_write32 (NVME_CC, 0);
+  if (wait_ready (0) < 0 || queue_init (&nvme.admin, 0) < 0)
+    return;
+  reg_write32 (NVME_AQA, (NVME_QUEUE_SIZE - 1) << 16 | (NVME_QUEUE_SIZE - 1));
+  reg_write64 (NVME_ASQ, phys_of (nvme.admin.sq));
+  reg_write64 (NVME_ACQ, phys_of (nvme.admin.cq));
+  reg_write32 (NVME_CC, CC_EN | CC_IOSQES | CC_IOCQES);
+  if (wait_ready (CSTS_RDY) < 0)
+    return;
+
+  uint8_t *page = alloc_page ();
+  if (!page)
+    return;
+
+  // Largest transfer: 2^MDTS minimum-size pages, 0 meaning no limit
+  uint32_t max_sectors = NVME_MAX_SECTORS;
+  if (identify (page, IDENTIFY_CONTROLLER, 0) < 0)
+    goto out;
+  uint8_t mdts = page[77];
+  if (mdts && mdts < NVME_MDTS_MAX_SHIFT
+      && ((uint64_t)PAGE_SIZE << mdts) / SECTOR_SIZE < max_sectors)
+    max_sectors = ((uint64_t)PAGE_SIZE << mdts) / SECTOR_SIZE;
+
+  if (identify (page, IDENTIFY_NAMESPACE, 1) < 0)
+    goto out;
+  uint64_t sectors = *(uint64_t *)page;
+  uint8_t format = page[26] & 0xF;
+  uint8_t lba_shift = page[128 + format * 4 + 2];
+  if (lba_shift != 9 || !sectors)
+    goto out;
+
+  // Ask for one queue pair per CPU; the controller may grant fewer
+  uint32_t wanted = cpu_count ();
+  if (wanted > NVME_MAX_QUEUES)
+    wanted = NVME_MAX_QUEUES;
+  struct nvme_cmd cmd = { 0 };
+  uint32_t granted;
+  cmd.opcode = ADMIN_SET_FEATURES;
+  cmd.cdw10 = FEATURE_NUM_QUEUES;
+  cmd.cdw11 = (wanted - 1) << 16 | (wanted - 1);
+  if (admin_exec (&cmd, &granted) < 0)
+    goto out;
+  uint32_t queues = (granted & 0xFFFF) + 1;
+  if ((granted >> 16) + 1 < queues)
+    queues = (granted >> 16) + 1;
+  if (queues > wanted)
+    queues = wanted;
+
+  pci_msix_t msix;
+  int use_msix = mode == NVME_MODE_MSIX && apic_enabled ()
+                 && pci_msix_map (dev, &msix) == 0 && msix.entries > queues;
+  for (uint32_t i = 0; i < queues; i++)
+    {
+      if (create_io_queue (i, use_msix ? &msix : NULL) < 0)
+        goto out;
+    }
+  nvme.queue_count = queues;
+  if (use_msix)
+    pci_msix_enable (dev, &msix);
+  else
+    {
+      nvme.polled = 1;
+      nvme_ops.poll = nvme_poll;
+    }
+
+  nvme.dev.name = "nvme0n1";
+  nvme.dev.ops = &nvme_ops;
+  nvme.dev.sectors = sectors;
+  nvme.dev.max_sectors = max_sectors;
+  nvme.dev.queue_depth = NVME_SLOTS;
+  nvme.dev.rank = BLOCK_RANK_NVME;
+  block_register (&nvme.dev);
+
+  kprintf ("nvme0n1: %lu sectors, %u queue pair(s), %s\n", sectors, queues,
+           nvme.polled ? "polled" : "MSI-X");
+
+out:
+  free_page (page);
+}
+
+void
+nvme_get_stats (nvme_stats_t *stats)
+{
+  uint64_t flags = irq_save ();
+
+  stats->commands = 0;
+  stats->doorbells = 0;
+  stats->interrupts = 0;
+  stats->queues = nvme.queue_count;
+  stats->polled = nvme.polled;
+  for (uint32_t i = 0; i < nvme.queue_count; i++)
+    {
+      stats->commands += nvme.queues[i].commands;
+      stats->doorbells += nvme.queues[i].doorbells;
+      stats->interrupts += nvme.queues[i].interrupts;
+    }
+
+  irq_restore (flags);
+}
@@ -0,0 +1,32 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef NVME_H
+#define NVME_H
+
+#include "disk.h"
+
+#define NVME_MAX_QUEUES 8   // I/O queue pairs, one per CPU
+#define NVME_QUEUE_SIZE 64  // Entries per queue; one slot stays empty
+
+// Completion modes
+#define NVME_MODE_MSIX 0   // Per-queue interrupts, polling without MSI-X
+#define NVME_MODE_POLLED 1 // Waiters reap their own queue
+
+// Driver statistics, summed over the queues
+typedef struct
+{
+  uint64_t commands;
+  uint64_t doorbells; // Submission doorbell writes
+  uint64_t interrupts;
+  uint32_t queues;
+  uint8_t polled;
+} nvme_stats_t;
+
+void init_nvme (int mode);
+void nvme_get_stats (nvme_stats_t *stats);
+
+#endif
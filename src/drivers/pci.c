@@ -0,0 +1,335 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "pci.h"
+#include "../cpu.h"
+#include "../io.h"
+#include "../paging.h"
+#include <stddef.h>
+
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA 0xCFC
+#define PCI_CONFIG_ENABLE 0x80000000
+
+#define PCI_MULTIFUNCTION 0x80
+
+#define MSI_CONTROL 2
+#define MSI_ADDRESS 4
+#define MSI_CONTROL_ENABLE 0x0001
+#define MSI_CONTROL_64BIT 0x0080
+#define MSI_CONTROL_MME_MASK 0x0070
+#define MSI_ADDRESS_BASE 0xFEE00000 // Local APIC, fixed delivery
+
+#define MSIX_CONTROL 2
+#define MSIX_TABLE 4
+#define MSIX_CONTROL_SIZE_MASK 0x07FF
+#define MSIX_CONTROL_MASK_ALL 0x4000
+#define MSIX_CONTROL_ENABLE 0x8000
+#define MSIX_BIR_MASK 0x7
+#define MSIX_ENTRY_DWORDS 4
+#define MSIX_VECTOR_MASKED 0x1
+
+static pci_device_t devices[PCI_MAX_DEVICES];
+static uint32_t device_count = 0;
+
+// Configuration mechanism #1: select a dword, then access it through
+// the data port. The address/data pair is shared, so keep interrupts
+// off between the two accesses.
+static uint32_t
+config_read (uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset)
+{
+  uint64_t flags = irq_save ();
+  outl (PCI_CONFIG_ADDRESS, PCI_CONFIG_ENABLE | (uint32_t)bus << 16
+                                | (uint32_t)slot << 11 | (uint32_t)func << 8
+                                | (offset & 0xFC));
+  uint32_t value = inl (PCI_CONFIG_DATA);
+  irq_restore (flags);
+  return value;
+}
+
+static void
+config_write (uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset,
+              uint32_t value)
+{
+  uint64_t flags = irq_save ();
+  outl (PCI_CONFIG_ADDRESS, PCI_CONFIG_ENABLE | (uint32_t)bus << 16
+                                | (uint32_t)slot << 11 | (uint32_t)func << 8
+                                | (offset & 0xFC));
+  outl (PCI_CONFIG_DATA, value);
+  irq_restore (flags);
+}
+
+uint32_t
+pci_read32 (const pci_device_t *dev, uint8_t offset)
+{
+  return config_read (dev->bus, dev->slot, dev->func, offset);
+}
+
+uint16_t
+pci_read16 (const pci_device_t *dev, uint8_t offset)
+{
+  return pci_read32 (dev, offset) >> ((offset & 2) * 8);
+}
+
+uint8_t
+pci_read8 (const pci_device_t *dev, uint8_t offset)
+{
+  return pci_read32 (dev, offset) >> ((offset & 3) * 8);
+}
+
+void
+pci_write32 (const pci_device_t *dev, uint8_t offset, uint32_t value)
+{
+  config_write (dev->bus, dev->slot, dev->func, offset, value);
+}
+
+// Read-modify-write of the containing dword. Used for the command
+// register, whose neighbouring status bits are write-one-to-clear, so
+// those are written back as zero.
+void
+pci_write16 (const pci_device_t *dev, uint8_t offset, uint16_t value)
+{
+  uint32_t shift = (offset & 2) * 8;
+  uint32_t dword = pci_read32 (dev, offset);
+
+  if ((offset & 0xFC) == PCI_COMMAND)
+    dword &= 0x0000FFFF;
+  dword = (dword & ~(0xFFFFU << shift)) | (uint32_t)value << shift;
+  pci_write32 (dev, offset, dword);
+}
+
+static void
+probe_function (uint8_t bus, uint8_t slot, uint8_t func)
+{
+  uint32_t id = config_read (bus, slot, func, PCI_VENDOR_ID);
+  if ((id & 0xFFFF) == 0xFFFF || device_count >= PCI_MAX_DEVICES)
+    return;
+
+  uint32_t class_rev = config_read (bus, slot, func, PCI_CLASS_REVISION);
+  pci_device_t *dev = &devices[device_count++];
+
+  dev->bus = bus;
+  dev->slot = slot;
+  dev->func = func;
+  dev->vendor_id = id & 0xFFFF;
+  dev->device_id = id >> 16;
+  dev->class_code = class_rev >> 24;
+  dev->subclass = (class_rev >> 16) & 0xFF;
+  dev->prog_if = (class_rev >> 8) & 0xFF;
+  dev->irq_line = config_read (bus, slot, func, PCI_INTERRUPT_LINE) & 0xFF;
+}
+
+/**
+ * @brief Enumerates every function on every bus into the device table.
+ *
+ * A brute-force scan rather than a bridge walk: 256 buses of 32 slots
+ * is cheap enough to do once at boot.
+ */
+void
+init_pci (void)
+{
+  device_count = 0;
+
+  for (uint32_t bus = 0; bus < 256; bus++)
+    {
+      for (uint8_t slot = 0; slot < 32; slot++)
+        {
+          uint32_t id = config_read (bus, slot, 0, PCI_VENDOR_ID);
+          if ((id & 0xFFFF) == 0xFFFF)
+            continue;
+
+          uint8_t header
+              = config_read (bus, slot, 0, PCI_HEADER_TYPE & 0xFC) >> 16;
+          uint8_t functions = (header & PCI_MULTIFUNCTION) ? 8 : 1;
+          for (uint8_t func = 0; func < functions; func++)
+            probe_function (bus, slot, func);
+        }
+    }
+}
+
+/**
+ * @brief Finds the next device of a class after the given one.
+ *
+ * @param class_code Class to match, or PCI_ANY.
+ * @param subclass Subclass to match, or PCI_ANY.
+ * @param after Previous match to continue from, or NULL to start over.
+ *
+ * @return The device, or NULL if there are no more.
+ */
+const pci_device_t *
+pci_find (uint16_t class_code, uint16_t subclass, const pci_device_t *after)
+{
+  uint32_t start = after ? (uint32_t)(after - devices) + 1 : 0;
+
+  for (uint32_t i = start; i < device_count; i++)
+    {
+      if ((class_code == PCI_ANY || devices[i].class_code == class_code)
+          && (subclass == PCI_ANY || devices[i].subclass == subclass))
+        return &devices[i];
+    }
+  return NULL;
+}
+
+/**
+ * @brief Finds the next device with a vendor and device ID.
+ */
+const pci_device_t *
+pci_find_id (uint16_t vendor_id, uint16_t device_id,
+             const pci_device_t *after)
+{
+  uint32_t start = after ? (uint32_t)(after - devices) + 1 : 0;
+
+  for (uint32_t i = start; i < device_count; i++)
+    {
+      if (devices[i].vendor_id == vendor_id
+          && (device_id == PCI_ANY || devices[i].device_id == device_id))
+        return &devices[i];
+    }
+  return NULL;
+}
+
+/**
+ * @brief Decodes a base address register.
+ *
+ * A 64-bit memory BAR takes the following register as its high half.
+ *
+ * @param is_io Set to whether the BAR is an I/O port range; may be NULL.
+ *
+ * @return The port or physical address, or 0 if the BAR is unused.
+ */
+uint64_t
+pci_bar (const pci_device_t *dev, int index, bool *is_io)
+{
+  uint8_t offset = PCI_BAR0 + index * 4;
+  uint32_t low = pci_read32 (dev, offset);
+
+  if (is_io)
+    *is_io = low & PCI_BAR_IO;
+  if (low & PCI_BAR_IO)
+    return low & ~0x3U;
+
+  uint64_t addr = low & ~0xFU;
+  if ((low & 0x6) == PCI_BAR_TYPE_64 && index < 5)
+    addr |= (uint64_t)pci_read32 (dev, offset + 4) << 32;
+  return addr;
+}
+
+// Turn on the given command bits (decoding, bus mastering)
+void
+pci_enable (const pci_device_t *dev, uint16_t command)
+{
+  uint16_t current = pci_read16 (dev, PCI_COMMAND);
+  pci_write16 (dev, PCI_COMMAND, current | command);
+}
+
+/**
+ * @brief Walks the capability list for a capability ID.
+ *
+ * @return Its offset in configuration space, or 0 if it is absent.
+ */
+uint8_t
+pci_find_capability (const pci_device_t *dev, uint8_t id)
+{
+  if (!(pci_read16 (dev, PCI_STATUS) & PCI_STATUS_CAPABILITIES))
+    return 0;
+
+  uint8_t offset = pci_read8 (dev, PCI_CAPABILITIES) & 0xFC;
+  for (int guard = 0; offset && guard < 48; guard++)
+    {
+      if (pci_read8 (dev, offset) == id)
+        return offset;
+      offset = pci_read8 (dev, offset + 1) & 0xFC;
+    }
+  return 0;
+}
+
+/**
+ * @brief Points the device's MSI capability at one vector on one CPU.
+ *
+ * A single message is enabled and legacy INTx is turned off.
+ *
+ * @return 0 on success, or a negative value without MSI support.
+ */
+int
+pci_enable_msi (const pci_device_t *dev, uint8_t vector, uint32_t apic_id)
+{
+  uint8_t cap = pci_find_capability (dev, PCI_CAP_MSI);
+  if (!cap)
+    return -1;
+
+  uint16_t control = pci_read16 (dev, cap + MSI_CONTROL);
+  uint8_t data_offset = (control & MSI_CONTROL_64BIT) ? 12 : 8;
+
+  pci_write32 (dev, cap + MSI_ADDRESS, MSI_ADDRESS_BASE | apic_id << 12);
+  if (control & MSI_CONTROL_64BIT)
+    pci_write32 (dev, cap + MSI_ADDRESS + 4, 0);
+  pci_write16 (dev, cap + data_offset, vector);
+
+  control &= ~MSI_CONTROL_MME_MASK;
+  pci_write16 (dev, cap + MSI_CONTROL, control | MSI_CONTROL_ENABLE);
+  pci_enable (dev, PCI_COMMAND_INTX_DISABLE);
+  return 0;
+}
+
+/**
+ * @brief Maps the device's MSI-X table.
+ *
+ * Entries start masked; program them with pci_msix_set and then turn
+ * the capability on with pci_msix_enable.
+ *
+ * @return 0 on success, or a negative value without MSI-X support.
+ */
+int
+pci_msix_map (const pci_device_t *dev, pci_msix_t *msix)
+{
+  uint8_t cap = pci_find_capability (dev, PCI_CAP_MSIX);
+  if (!cap)
+    return -1;
+
+  uint16_t control = pci_read16 (dev, cap + MSIX_CONTROL);
+  uint32_t table = pci_read32 (dev, cap + MSIX_TABLE);
+  bool is_io;
+  uint64_t bar = pci_bar (dev, table & MSIX_BIR_MASK, &is_io);
+  if (!bar || is_io)
+    return -1;
+
+  msix->cap = cap;
+  msix->entries = (control & MSIX_CONTROL_SIZE_MASK) + 1;
+  msix->table = paging_map_mmio (bar + (table & ~MSIX_BIR_MASK),
+                                 msix->entries * MSIX_ENTRY_DWORDS * 4);
+
+  for (uint16_t i = 0; i < msix->entries; i++)
+    msix->table[i * MSIX_ENTRY_DWORDS + 3] = MSIX_VECTOR_MASKED;
+  return 0;
+}
+
+// Route one table entry to a vector on a CPU and unmask it
+void
+pci_msix_set (pci_msix_t *msix, uint16_t entry, uint8_t vector,
+              uint32_t apic_id)
+{
+  volatile uint32_t *e = &msix->table[entry * MSIX_ENTRY_DWORDS];
+
+  e[0] = MSI_ADDRESS_BASE | apic_id << 12;
+  e[1] = 0;
+  e[2] = vector;
+  e[3] = 0;
+}
+
+void
+pci_msix_enable (const pci_device_t *dev, const pci_msix_t *msix)
+{
+  uint16_t control = pci_read16 (dev, msix->cap + MSIX_CONTROL);
+  control = (control & ~MSIX_CONTROL_MASK_ALL) | MSIX_CONTROL_ENABLE;
+  pci_write16 (dev, msix->cap + MSIX_CONTROL, control);
+  pci_enable (dev, PCI_COMMAND_INTX_DISABLE);
+}
+
+uint32_t
+pci_device_count (void)
+{
+  return device_count;
+}
@@ -0,0 +1,91 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef PCI_H
+#define PCI_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PCI_MAX_DEVICES 64
+
+// Configuration space registers
+#define PCI_VENDOR_ID 0x00
+#define PCI_DEVICE_ID 0x02
+#define PCI_COMMAND 0x04
+#define PCI_STATUS 0x06
+#define PCI_CLASS_REVISION 0x08
+#define PCI_HEADER_TYPE 0x0E
+#define PCI_BAR0 0x10
+#define PCI_CAPABILITIES 0x34
+#define PCI_INTERRUPT_LINE 0x3C
+
+#define PCI_COMMAND_IO 0x0001
+#define PCI_COMMAND_MEMORY 0x0002
+#define PCI_COMMAND_BUS_MASTER 0x0004
+#define PCI_COMMAND_INTX_DISABLE 0x0400
+
+#define PCI_STATUS_CAPABILITIES 0x0010
+
+#define PCI_CAP_MSI 0x05
+#define PCI_CAP_VENDOR 0x09
+#define PCI_CAP_MSIX 0x11
+
+#define PCI_BAR_IO 0x01
+#define PCI_BAR_TYPE_64 0x04
+
+// Classes used by the storage drivers
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE 0x01
+#define PCI_SUBCLASS_SATA 0x06
+#define PCI_SUBCLASS_NVM 0x08
+
+#define PCI_ANY 0xFFFF // Wildcard for pci_find
+
+// A function found during enumeration
+typedef struct
+{
+  uint8_t bus;
+  uint8_t slot;
+  uint8_t func;
+  uint16_t vendor_id;
+  uint16_t device_id;
+  uint8_t class_code;
+  uint8_t subclass;
+  uint8_t prog_if;
+  uint8_t irq_line;
+} pci_device_t;
+
+// A mapped MSI-X table
+typedef struct
+{
+  volatile uint32_t *table;
+  uint16_t entries;
+  uint8_t cap;
+} pci_msix_t;
+
+void init_pci (void);
+uint32_t pci_read32 (const pci_device_t *dev, uint8_t offset);
+uint16_t pci_read16 (const pci_device_t *dev, uint8_t offset);
+uint8_t pci_read8 (const pci_device_t *dev, uint8_t offset);
+void pci_write32 (const pci_device_t *dev, uint8_t offset, uint32_t value);
+void pci_write16 (const pci_device_t *dev, uint8_t offset, uint16_t value);
+const pci_device_t *pci_find (uint16_t class_code, uint16_t subclass,
+                              const pci_device_t *after);
+const pci_device_t *pci_find_id (uint16_t vendor_id, uint16_t device_id,
+                                 const pci_device_t *after);
+uint64_t pci_bar (const pci_device_t *dev, int index, bool *is_io);
+void pci_enable (const pci_device_t *dev, uint16_t command);
+uint8_t pci_find_capability (const pci_device_t *dev, uint8_t id);
+int pci_enable_msi (const pci_device_t *dev, uint8_t vector,
+                    uint32_t apic_id);
+int pci_msix_map (const pci_device_t *dev, pci_msix_t *msix);
+void pci_msix_set (pci_msix_t *msix, uint16_t entry, uint8_t vector,
+                   uint32_t apic_id);
+void pci_msix_enable (const pci_device_t *dev, const pci_msix_t *msix);
+uint32_t pci_device_count (void);
+
+#endif
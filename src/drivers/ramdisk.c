@@ -0,0 +1,141 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "ramdisk.h"
+#include "../memory.h"
+#include <stddef.h>
+
+#define SECTORS_PER_PAGE (PAGE_SIZE / SECTOR_SIZE)
+
+/*
+ * Block devices kept in memory, so the block layer can be measured
+ * without a slow emulated drive behind it. A disk is built from pool
+ * pages, which need not be contiguous and are reached through a page
+ * table. Requests complete inside submit.
+ */
+struct ramdisk
+{
+  char name[8];
+  uint8_t **pages;
+  struct block_device dev;
+};
+
+static struct ramdisk disks[RAMDISK_MAX];
+static uint32_t disk_count = 0;
+
+static int ramdisk_submit (struct block_device *dev,
+                           struct block_request *req);
+
+static const struct block_ops ramdisk_ops = {
+  .submit = ramdisk_submit,
+};
+
+// Where a sector lives; the run of sectors after it in the same page
+static uint8_t *
+locate (struct ramdisk *rd, uint64_t lba, uint32_t *run)
+{
+  uint32_t offset = lba % SECTORS_PER_PAGE;
+  *run = SECTORS_PER_PAGE - offset;
+  return rd->pages[lba / SECTORS_PER_PAGE] + offset * SECTOR_SIZE;
+}
+
+static int
+ramdisk_submit (struct block_device *dev, struct block_request *req)
+{
+  struct ramdisk *rd = dev->priv;
+  uint8_t *buffer = req->buffer;
+  uint64_t lba = req->lba;
+  uint32_t count = req->count;
+
+  while (count)
+    {
+      uint32_t run;
+      uint8_t *data = locate (rd, lba, &run);
+      if (run > count)
+        run = count;
+
+      if (req->write)
+        k_memcpy (data, buffer, (uint64_t)run * SECTOR_SIZE);
+      else
+        k_memcpy (buffer, data, (uint64_t)run * SECTOR_SIZE);
+
+      buffer += (uint64_t)run * SECTOR_SIZE;
+      lba += run;
+      count -= run;
+    }
+
+  block_complete (req, 0);
+  return 0;
+}
+
+static struct ramdisk *
+ramdisk_new (const char *name, uint64_t sectors)
+{
+  if (disk_count >= RAMDISK_MAX || !sectors)
+    return NULL;
+
+  struct ramdisk *rd = &disks[disk_count];
+  uint32_t i = 0;
+  for (; i < sizeof (rd->name) - 1 && name[i]; i++)
+    rd->name[i] = name[i];
+  rd->name[i] = '\0';
+
+  rd->dev.name = rd->name;
+  rd->dev.ops = &ramdisk_ops;
+  rd->dev.sectors = sectors;
+  rd->dev.max_sectors = DISK_MAX_SECTORS;
+  rd->dev.queue_depth = 32;
+  rd->dev.rank = BLOCK_RANK_RAM;
+  rd->dev.priv = rd;
+  return rd;
+}
+
+// Gives back the first count pages of a disk and its page table
+static void
+release_pages (struct ramdisk *rd, uint64_t count)
+{
+  while (count--)
+    free_page (rd->pages[count]);
+  free_memory (rd->pages);
+  rd->pages = NULL;
+}
+
+/**
+ * @brief Registers a zero-filled disk built from pool pages.
+ *
+ * @param sectors The size, rounded up to whole pages.
+ * @return 0 on success, -1 if memory or disk slots ran out.
+ */
+int
+ramdisk_alloc (const char *name, uint64_t sectors)
+{
+  uint64_t count = (sectors + SECTORS_PER_PAGE - 1) / SECTORS_PER_PAGE;
+  struct ramdisk *rd = ramdisk_new (name, count * SECTORS_PER_PAGE);
+  if (!rd)
+    return -1;
+
+  rd->pages = allocate_memory (count * sizeof (uint8_t *));
+  if (!rd->pages)
+    return -1;
+
+  for (uint64_t i = 0; i < count; i++)
+    {
+      rd->pages[i] = alloc_page ();
+      if (!rd->pages[i])
+        {
+          release_pages (rd, i);
+          return -1;
+        }
+    }
+
+  if (block_register (&rd->dev) < 0)
+    {
+      release_pages (rd, count);
+      return -1;
+    }
+  disk_count++;
+  return 0;
+}
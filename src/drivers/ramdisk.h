@@ -0,0 +1,17 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+#include "disk.h"
+
+#define RAMDISK_MAX 2
+#define RAMDISK_DEFAULT_SECTORS 1024 // 512 KiB scratch disk, "ram0"
+
+int ramdisk_alloc (const char *name, uint64_t sectors);
+
+#endif
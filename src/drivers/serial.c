@@ -0,0 +1,302 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "serial.h"
+#include "../cpu.h"
+#include "../idt.h"
+#include "../io.h"
+#include "../process.h"
+
+// 16550 registers, relative to SERIAL_PORT
+#define UART_DATA 0
+#define UART_IER 1
+#define UART_IIR 2
+#define UART_FCR 2
+#define UART_LCR 3
+#define UART_MCR 4
+#define UART_LSR 5
+#define UART_MSR 6
+
+#define IER_RX_AVAILABLE 0x01
+#define IER_TX_EMPTY 0x02
+#define IER_LINE_STATUS 0x04
+
+#define IIR_NONE 0x01
+#define IIR_ID_MASK 0x0E
+#define IIR_MODEM_STATUS 0x00
+#define IIR_TX_EMPTY 0x02
+#define IIR_RX_AVAILABLE 0x04
+#define IIR_LINE_STATUS 0x06
+#define IIR_RX_TIMEOUT 0x0C
+
+#define LSR_DATA_READY 0x01
+#define LSR_TX_EMPTY 0x20
+
+#define LCR_DLAB 0x80
+#define LCR_8N1 0x03
+#define FCR_ENABLE_CLEAR_14 0xC7 // Enable FIFOs, clear them, 14-byte RX level
+#define MCR_DTR_RTS_OUT2 0x0B    // OUT2 gates the IRQ line on PCs
+
+#define SERIAL_IRQ 4
+#define UART_FIFO_SIZE 16
+#define SERIAL_RING_SIZE 1024 // Power of two
+
+/**
+ * Single-producer single-consumer byte ring
+ * head is only written by the consumer and tail by the producer, so the
+ * ISR and the task side never need a lock between them.
+ */
+typedef struct
+{
+  volatile uint32_t head;
+  volatile uint32_t tail;
+  uint8_t data[SERIAL_RING_SIZE];
+} serial_ring_t;
+
+static serial_ring_t tx_ring;
+static serial_ring_t rx_ring;
+static volatile uint8_t tx_idle = 1; // No THRE interrupt is on its way
+static volatile int64_t rx_waiter = -1;
+static serial_stats_t stats;
+
+static inline uint32_t
+ring_count (serial_ring_t *ring)
+{
+  return __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE)
+         - __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+}
+
+// Move up to one FIFO's worth of queued bytes into the UART. Runs with
+// interrupts disabled, either from the ISR or to restart an idle
+// transmitter.
+static void
+serial_tx_refill (void)
+{
+  uint32_t head = tx_ring.head;
+  uint32_t tail = __atomic_load_n (&tx_ring.tail, __ATOMIC_ACQUIRE);
+  int burst = 0;
+
+  while (head != tail && burst < UART_FIFO_SIZE)
+    {
+      outb (SERIAL_PORT + UART_DATA, tx_ring.data[head % SERIAL_RING_SIZE]);
+      head++;
+      burst++;
+    }
+
+  __atomic_store_n (&tx_ring.head, head, __ATOMIC_RELEASE);
+  stats.tx_bytes += burst;
+  tx_idle = burst == 0;
+}
+
+static void
+serial_rx_drain (void)
+{
+  uint32_t tail = rx_ring.tail;
+
+  while (inb (SERIAL_PORT + UART_LSR) & LSR_DATA_READY)
+    {
+      uint8_t byte = inb (SERIAL_PORT + UART_DATA);
+      if (tail - __atomic_load_n (&rx_ring.head, __ATOMIC_ACQUIRE)
+          >= SERIAL_RING_SIZE)
+        {
+          stats.rx_dropped++;
+          continue;
+        }
+      rx_ring.data[tail % SERIAL_RING_SIZE] = byte;
+      tail++;
+      stats.rx_bytes++;
+    }
+
+  __atomic_store_n (&rx_ring.tail, tail, __ATOMIC_RELEASE);
+
+  if (rx_waiter >= 0 && ring_count (&rx_ring))
+    {
+      wake_process (rx_waiter);
+      rx_waiter = -1;
+    }
+}
+
+// IRQ 4 handler
+static void
+serial_interrupt (void)
+{
+  uint8_t iir;
+
+  stats.interrupts++;
+  while (!((iir = inb (SERIAL_PORT + UART_IIR)) & IIR_NONE))
+    {
+      switch (iir & IIR_ID_MASK)
+        {
+        case IIR_LINE_STATUS:
+          inb (SERIAL_PORT + UART_LSR);
+          break;
+        case IIR_RX_AVAILABLE:
+        case IIR_RX_TIMEOUT:
+          serial_rx_drain ();
+          break;
+        case IIR_TX_EMPTY:
+          serial_tx_refill ();
+          break;
+        case IIR_MODEM_STATUS:
+          inb (SERIAL_PORT + UART_MSR);
+          break;
+        }
+    }
+}
+
+/**
+ * @brief Sets the line speed.
+ *
+ * @param baud Any rate that divides 115200 evenly.
+ *
+ * @return 0 on success, or a negative value for an unsupported rate.
+ */
+int
+serial_set_baud (uint32_t baud)
+{
+  if (baud == 0 || baud > SERIAL_MAX_BAUD || SERIAL_MAX_BAUD % baud)
+    return -1;
+
+  uint16_t divisor = SERIAL_MAX_BAUD / baud;
+  uint64_t flags = irq_save ();
+
+  outb (SERIAL_PORT + UART_LCR, LCR_DLAB);
+  outb (SERIAL_PORT + UART_DATA, divisor & 0xFF);
+  outb (SERIAL_PORT + UART_IER, (divisor >> 8) & 0xFF);
+  outb (SERIAL_PORT + UART_LCR, LCR_8N1);
+
+  irq_restore (flags);
+  return 0;
+}
+
+/**
+ * @brief Programs COM1 for interrupt-driven operation.
+ */
+void
+init_serial (uint32_t baud)
+{
+  outb (SERIAL_PORT + UART_IER, 0x00); // Disable all interrupts
+  if (serial_set_baud (baud) < 0)
+    serial_set_baud (SERIAL_DEFAULT_BAUD);
+  outb (SERIAL_PORT + UART_FCR, FCR_ENABLE_CLEAR_14);
+  outb (SERIAL_PORT + UART_MCR, MCR_DTR_RTS_OUT2);
+
+  register_interrupt_handler (IRQ (SERIAL_IRQ), serial_interrupt);
+  outb (SERIAL_PORT + UART_IER,
+        IER_RX_AVAILABLE | IER_TX_EMPTY | IER_LINE_STATUS);
+}
+
+/**
+ * @brief Queues bytes for transmission and returns without waiting.
+ *
+ * Producers are serialized by disabling interrupts around the enqueue,
+ * which also covers restarting an idle transmitter. Bytes that do not fit
+ * in the ring are dropped and counted.
+ *
+ * @return Number of bytes queued.
+ */
+size_t
+serial_write (const void *data, size_t len)
+{
+  const uint8_t *bytes = data;
+  uint64_t flags = irq_save ();
+  uint32_t tail = tx_ring.tail;
+  size_t queued = 0;
+
+  while (queued < len
+         && tail - __atomic_load_n (&tx_ring.head, __ATOMIC_ACQUIRE)
+                < SERIAL_RING_SIZE)
+    {
+      tx_ring.data[tail % SERIAL_RING_SIZE] = bytes[queued++];
+      tail++;
+    }
+  __atomic_store_n (&tx_ring.tail, tail, __ATOMIC_RELEASE);
+  stats.tx_dropped += len - queued;
+
+  if (tx_idle)
+    serial_tx_refill ();
+
+  irq_restore (flags);
+  return queued;
+}
+
+/**
+ * @brief Takes received bytes without waiting.
+ *
+ * @return Number of bytes copied, possibly 0.
+ */
+size_t
+serial_read (void *data, size_t len)
+{
+  uint8_t *bytes = data;
+  uint32_t head = rx_ring.head;
+  uint32_t tail = __atomic_load_n (&rx_ring.tail, __ATOMIC_ACQUIRE);
+  size_t copied = 0;
+
+  while (copied < len && head != tail)
+    {
+      bytes[copied++] = rx_ring.data[head % SERIAL_RING_SIZE];
+      head++;
+    }
+
+  __atomic_store_n (&rx_ring.head, head, __ATOMIC_RELEASE);
+  return copied;
+}
+
+/**
+ * @brief Pushes everything queued out by polling.
+ *
+ * For paths that cannot rely on interrupts, such as dumping state after
+ * a hang.
+ */
+void
+serial_flush (void)
+{
+  uint64_t flags = irq_save ();
+
+  while (ring_count (&tx_ring))
+    {
+      while ((inb (SERIAL_PORT + UART_LSR) & LSR_TX_EMPTY) == 0)
+        {
+        }
+      serial_tx_refill ();
+    }
+
+  irq_restore (flags);
+}
+
+void
+serial_get_stats (serial_stats_t *out)
+{
+  if (out)
+    *out = stats;
+}
+
+// Blocking single-byte read
+unsigned char
+read_serial ()
+{
+  unsigned char c;
+
+  while (1)
+    {
+      uint64_t flags = irq_save ();
+      if (serial_read (&c, 1) == 1)
+        {
+          irq_restore (flags);
+          return c;
+        }
+      rx_waiter = current_process_id ();
+      block_current ();
+      irq_restore (flags);
+    }
+}
+
+void
+write_serial (unsigned char data)
+{
+  serial_write (&data, 1);
+}
@@ -0,0 +1,36 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SERIAL_PORT 0x3F8
+#define SERIAL_MAX_BAUD 115200
+#define SERIAL_DEFAULT_BAUD 115200
+
+// Serial driver statistics
+typedef struct
+{
+  uint64_t tx_bytes;
+  uint64_t rx_bytes;
+  uint64_t tx_dropped; // Bytes lost to a full TX ring
+  uint64_t rx_dropped; // Bytes lost to a full RX ring
+  uint64_t interrupts;
+} serial_stats_t;
+
+void init_serial (uint32_t baud);
+int serial_set_baud (uint32_t baud);
+size_t serial_write (const void *data, size_t len);
+size_t serial_read (void *data, size_t len);
+void serial_flush (void);
+void serial_get_stats (serial_stats_t *stats);
+unsigned char read_serial ();
+void write_serial (unsigned char data);
+
+#endif
@@ -9,7 +9,12 @@
 
 #define TIMER_COMMAND 0x43
 #define TIMER_CHANNEL 0x40
+#define TIMER_CHANNEL2 0x42
+#define TIMER_GATE 0x61
 #define PIT_FREQUENCY 1193180
+#define CALIBRATE_HZ 100 // Calibrate over a 10 ms window
+
+static uint64_t tsc_hz = 0;
 
 void
 init_timer (int frequency)
@@ -19,3 +24,39 @@ init_timer (int frequency)
   outb (TIMER_CHANNEL, divisor & 0xFF);
   outb (TIMER_CHANNEL, (divisor >> 8) & 0xFF);
 }
+
+/**
+ * @brief Measures the TSC frequency against PIT channel 2.
+ *
+ * Channel 2 is programmed as a one-shot (mode 0) counter gated through
+ * port 0x61, and the TSC is sampled until its output goes high.
+ *
+ * @return The TSC frequency in Hz.
+ */
+uint64_t
+calibrate_tsc (void)
+{
+  uint16_t count = PIT_FREQUENCY / CALIBRATE_HZ;
+
+  // Enable the channel 2 gate, disable the speaker
+  outb (TIMER_GATE, (inb (TIMER_GATE) & ~0x02) | 0x01);
+
+  outb (TIMER_COMMAND, 0xB0); // Channel 2, lobyte/hibyte, mode 0
+  outb (TIMER_CHANNEL2, count & 0xFF);
+  outb (TIMER_CHANNEL2, (count >> 8) & 0xFF);
+
+  uint64_t start = read_tsc ();
+  while ((inb (TIMER_GATE) & 0x20) == 0)
+    {
+    }
+  uint64_t end = read_tsc ();
+
+  tsc_hz = (end - start) * CALIBRATE_HZ;
+  return tsc_hz;
+}
+
+uint64_t
+tsc_frequency (void)
+{
+  return tsc_hz;
+}
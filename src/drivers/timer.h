@@ -7,6 +7,18 @@
 #ifndef TIMER_H
 #define TIMER_H
 
+#include <stdint.h>
+
 void init_timer (int frequency);
+uint64_t calibrate_tsc (void);
+uint64_t tsc_frequency (void);
+
+static inline uint64_t
+read_tsc (void)
+{
+  uint32_t lo, hi;
+  asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
 
 #endif
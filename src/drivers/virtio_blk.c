@@ -0,0 +1,705 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "virtio_blk.h"
+#include "pci.h"
+#include "../apic.h"
+#include "../cpu.h"
+#include "../idt.h"
+#include "../klog.h"
+#include "../memory.h"
+#include "../paging.h"
+#include <stddef.h>
+
+#define VIRTIO_VENDOR 0x1AF4
+#define VIRTIO_BLK_LEGACY_ID 0x1001 // Transitional device
+#define VIRTIO_BLK_MODERN_ID 0x1042
+
+// Vendor capability types
+#define VIRTIO_PCI_CAP_COMMON 1
+#define VIRTIO_PCI_CAP_NOTIFY 2
+#define VIRTIO_PCI_CAP_ISR 3
+#define VIRTIO_PCI_CAP_DEVICE 4
+
+#define CAP_CFG_TYPE 3
+#define CAP_BAR 4
+#define CAP_OFFSET 8
+#define CAP_LENGTH 12
+#define CAP_NOTIFY_MULTIPLIER 16
+
+// Common configuration layout
+struct virtio_common_cfg
+{
+  uint32_t device_feature_select;
+  uint32_t device_feature;
+  uint32_t driver_feature_select;
+  uint32_t driver_feature;
+  uint16_t msix_config;
+  uint16_t num_queues;
+  uint8_t device_status;
+  uint8_t config_generation;
+  uint16_t queue_select;
+  uint16_t queue_size;
+  uint16_t queue_msix_vector;
+  uint16_t queue_enable;
+  uint16_t queue_notify_off;
+  uint64_t queue_desc;
+  uint64_t queue_driver;
+  uint64_t queue_device;
+} __attribute__ ((packed));
+
+#define STATUS_ACKNOWLEDGE 1
+#define STATUS_DRIVER 2
+#define STATUS_DRIVER_OK 4
+#define STATUS_FEATURES_OK 8
+#define STATUS_FAILED 128
+
+#define VIRTIO_NO_VECTOR 0xFFFF
+
+#define F_BLK_SEG_MAX (1ULL << 2)
+#define F_BLK_FLUSH (1ULL << 9)
+#define F_BLK_MQ (1ULL << 12)
+#define F_RING_INDIRECT_DESC (1ULL << 28)
+#define F_RING_EVENT_IDX (1ULL << 29)
+#define F_VERSION_1 (1ULL << 32)
+
+// Device configuration fields
+#define BLK_CFG_CAPACITY 0
+#define BLK_CFG_SEG_MAX 12
+#define BLK_CFG_NUM_QUEUES 34
+
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+#define VIRTIO_BLK_S_OK 0
+
+#define VIRTQ_DESC_F_NEXT 1
+#define VIRTQ_DESC_F_WRITE 2
+#define VIRTQ_DESC_F_INDIRECT 4
+
+// Largest request and the indirect table it needs: header, one
+// descriptor per page of data, status
+#define VIRTIO_MAX_SECTORS 128
+#define VIRTIO_DATA_SEGS (VIRTIO_MAX_SECTORS * SECTOR_SIZE / PAGE_SIZE + 1)
+#define VIRTIO_REQ_SLOT 512
+#define VIRTIO_SLOTS_PER_PAGE (PAGE_SIZE / VIRTIO_REQ_SLOT)
+
+struct virtq_desc
+{
+  uint64_t addr;
+  uint32_t len;
+  uint16_t flags;
+  uint16_t next;
+};
+
+struct virtq_avail
+{
+  uint16_t flags;
+  volatile uint16_t idx;
+  uint16_t ring[VIRTQ_SIZE];
+  volatile uint16_t used_event;
+};
+
+struct virtq_used_elem
+{
+  uint32_t id;
+  uint32_t len;
+};
+
+struct virtq_used
+{
+  uint16_t flags;
+  volatile uint16_t idx;
+  struct virtq_used_elem ring[VIRTQ_SIZE];
+  volatile uint16_t avail_event;
+};
+
+/**
+ * Per-request memory
+ * The request header, the indirect descriptor table and the status byte
+ * the device writes back.
+ */
+struct virtio_req
+{
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t sector;
+  struct virtq_desc table[VIRTIO_DATA_SEGS + 2];
+  volatile uint8_t status;
+};
+
+_Static_assert (sizeof (struct virtio_req) <= VIRTIO_REQ_SLOT,
+                "virtio request slot too small");
+
+/*
+ * One virtqueue per CPU. Every request takes a single ring descriptor
+ * pointing at its own indirect table, so descriptor, request slot and
+ * ring position all share one index. A queue is only touched by the CPU
+ * it belongs to, from submission and from its own MSI-X vector, so
+ * masking interrupts is the only locking it needs. If the device offers
+ * fewer queues than there are CPUs, CPUs share queues round-robin; that
+ * needs a lock once application processors run the scheduler.
+ */
+struct virtqueue
+{
+  uint16_t index;
+  struct virtq_desc *desc;
+  struct virtq_avail *avail;
+  struct virtq_used *used;
+  volatile uint16_t *notify;
+  struct virtio_req *reqs[VIRTQ_SIZE];
+  struct block_request *inflight[VIRTQ_SIZE];
+  uint64_t free_slots;
+  uint16_t avail_idx;     // Next avail ring entry we fill
+  uint16_t kicked_idx;    // avail_idx at the last doorbell
+  uint16_t last_used;
+  struct block_request *pending_head;
+  struct block_request *pending_tail;
+  uint64_t requests;
+  uint64_t notifications;
+  uint64_t interrupts;
+};
+
+static struct
+{
+  const pci_device_t *pci;
+  volatile struct virtio_common_cfg *common;
+  volatile uint8_t *notify_base;
+  uint32_t notify_multiplier;
+  volatile uint8_t *isr;
+  volatile uint8_t *device_cfg;
+  uint64_t features;
+  uint32_t data_segs;
+  struct virtqueue queues[VIRTIO_BLK_MAX_QUEUES];
+  uint32_t queue_count;
+  uint8_t polled;
+  struct block_device dev;
+} vblk;
+
+static int virtio_submit (struct block_device *dev,
+                          struct block_request *req);
+static void virtio_commit (struct block_device *dev);
+static int virtio_flush (struct block_device *dev);
+static void virtio_poll (struct block_device *dev);
+
+static struct block_ops virtio_ops = {
+  .submit = virtio_submit,
+  .commit = virtio_commit,
+  .flush = virtio_flush,
+};
+
+static inline uint64_t
+phys_of (const volatile void *virt)
+{
+  return paging_virt_to_phys (paging_current (), (uintptr_t)virt);
+}
+
+static void *
+map_cap (uint8_t cap)
+{
+  bool is_io;
+  uint8_t bar = pci_read8 (vblk.pci, cap + CAP_BAR);
+  uint32_t offset = pci_read32 (vblk.pci, cap + CAP_OFFSET);
+  uint32_t length = pci_read32 (vblk.pci, cap + CAP_LENGTH);
+  uint64_t base = pci_bar (vblk.pci, bar, &is_io);
+
+  if (!base || is_io)
+    return NULL;
+  return paging_map_mmio (base + offset, length);
+}
+
+// Walk the vendor capabilities for the virtio 1.x register windows
+static int
+find_caps (void)
+{
+  uint8_t cap = pci_find_capability (vblk.pci, PCI_CAP_VENDOR);
+
+  for (int guard = 0; cap && guard < 48; guard++)
+    {
+      if (pci_read8 (vblk.pci, cap) == PCI_CAP_VENDOR)
+        {
+          switch (pci_read8 (vblk.pci, cap + CAP_CFG_TYPE))
+            {
+            case VIRTIO_PCI_CAP_COMMON:
+              if (!vblk.common)
+                vblk.common = map_cap (cap);
+              break;
+            case VIRTIO_PCI_CAP_NOTIFY:
+              if (!vblk.notify_base)
+                {
+                  vblk.notify_base = map_cap (cap);
+                  vblk.notify_multiplier
+                      = pci_read32 (vblk.pci, cap + CAP_NOTIFY_MULTIPLIER);
+                }
+              break;
+            case VIRTIO_PCI_CAP_ISR:
+              if (!vblk.isr)
+                vblk.isr = map_cap (cap);
+              break;
+            case VIRTIO_PCI_CAP_DEVICE:
+              if (!vblk.device_cfg)
+                vblk.device_cfg = map_cap (cap);
+              break;
+            }
+        }
+      cap = pci_read8 (vblk.pci, cap + 1) & 0xFC;
+    }
+
+  return vblk.common && vblk.notify_base && vblk.isr && vblk.device_cfg
+             ? 0
+             : -1;
+}
+
+static inline uint32_t
+cfg_read32 (uint32_t offset)
+{
+  return *(volatile uint32_t *)(vblk.device_cfg + offset);
+}
+
+// Doorbell only when the device asked to hear about entries past the
+// ones it has seen (VIRTIO_F_EVENT_IDX); otherwise it is still working
+// through the ring and will pick the new entries up by itself
+static inline int
+need_event (uint16_t event, uint16_t new_idx, uint16_t old_idx)
+{
+  return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+static void
+queue_kick (struct virtqueue *vq)
+{
+  if (vq->avail_idx == vq->kicked_idx)
+    return;
+
+  // The index store must be visible before reading the device's event
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+  int kick = (vblk.features & F_RING_EVENT_IDX)
+                 ? need_event (vq->used->avail_event, vq->avail_idx,
+                               vq->kicked_idx)
+                 : 1;
+  vq->kicked_idx = vq->avail_idx;
+  if (kick)
+    {
+      *vq->notify = vq->index;
+      vq->notifications++;
+    }
+}
+
+static void
+queue_issue (struct virtqueue *vq, struct block_request *req, int slot)
+{
+  struct virtio_req *vr = vq->reqs[slot];
+  uint8_t *buffer = req->buffer;
+  uint64_t bytes = (uint64_t)req->count * SECTOR_SIZE;
+  uint64_t *pml4 = paging_current ();
+  uint16_t n = 0;
+
+  vr->type = req->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+  vr->reserved = 0;
+  vr->sector = req->lba;
+  vr->status = 0xFF;
+
+  vr->table[n].addr = phys_of (vr);
+  vr->table[n].len = 16;
+  vr->table[n].flags = VIRTQ_DESC_F_NEXT;
+  n++;
+
+  // Data, one descriptor per physically contiguous run
+  while (bytes)
+    {
+      uintptr_t virt = (uintptr_t)buffer;
+      uint64_t len = PAGE_SIZE - (virt & (PAGE_SIZE - 1));
+      if (len > bytes)
+        len = bytes;
+      uint64_t phys = paging_virt_to_phys (pml4, virt);
+      struct virtq_desc *prev = &vr->table[n - 1];
+
+      if (n > 1 && prev->addr + prev->len == phys)
+        prev->len += len;
+      else
+        {
+          vr->table[n].addr = phys;
+          vr->table[n].len = len;
+          vr->table[n].flags = VIRTQ_DESC_F_NEXT
+                               | (req->write ? 0 : VIRTQ_DESC_F_WRITE);
+          n++;
+        }
+      buffer += len;
+      bytes -= len;
+    }
+
+  vr->table[n].addr = phys_of (&vr->status);
+  vr->table[n].len = 1;
+  vr->table[n].flags = VIRTQ_DESC_F_WRITE;
+  n++;
+  for (uint16_t i = 0; i + 1 < n; i++)
+    vr->table[i].next = i + 1;
+
+  vq->desc[slot].addr = phys_of (vr->table);
+  vq->desc[slot].len = n * sizeof (struct virtq_desc);
+  vq->desc[slot].flags = VIRTQ_DESC_F_INDIRECT;
+  vq->desc[slot].next = 0;
+
+  vq->inflight[slot] = req;
+  vq->free_slots &= ~(1ULL << slot);
+  vq->avail->ring[vq->avail_idx % VIRTQ_SIZE] = slot;
+  __atomic_store_n (&vq->avail->idx, ++vq->avail_idx, __ATOMIC_RELEASE);
+  vq->requests++;
+}
+
+// Move pending requests into free slots; interrupts must be off
+static void
+queue_start_pending (struct virtqueue *vq)
+{
+  while (vq->pending_head && vq->free_slots)
+    {
+      struct block_request *req = vq->pending_head;
+      vq->pending_head = req->next;
+      if (!vq->pending_head)
+        vq->pending_tail = NULL;
+
+      queue_issue (vq, req, __builtin_ctzll (vq->free_slots));
+    }
+}
+
+// Retire used entries; interrupts must be off
+static void
+queue_complete (struct virtqueue *vq)
+{
+  uint16_t used_idx = __atomic_load_n (&vq->used->idx, __ATOMIC_ACQUIRE);
+
+  while (vq->last_used != used_idx)
+    {
+      uint32_t slot = vq->used->ring[vq->last_used % VIRTQ_SIZE].id;
+      struct block_request *req = vq->inflight[slot];
+
+      vq->last_used++;
+      vq->inflight[slot] = NULL;
+      vq->free_slots |= 1ULL << slot;
+      if (req)
+        block_complete (req, vq->reqs[slot]->status == VIRTIO_BLK_S_OK
+                                 ? 0
+                                 : DISK_ERR_DEVICE);
+    }
+
+  // Interrupt again for the next entry
+  vq->avail->used_event = vq->last_used;
+
+  uint16_t before = vq->avail_idx;
+  queue_start_pending (vq);
+  if (vq->avail_idx != before)
+    queue_kick (vq);
+}
+
+static inline struct virtqueue *
+local_queue (void)
+{
+  return &vblk.queues[this_cpu ()->index % vblk.queue_count];
+}
+
+static void
+virtio_queue_interrupt (void)
+{
+  struct virtqueue *vq = local_queue ();
+  vq->interrupts++;
+  queue_complete (vq);
+}
+
+// Legacy line: reading the ISR status acknowledges it
+static void
+virtio_intx_interrupt (void)
+{
+  if (!(*vblk.isr & 1))
+    return;
+  for (uint32_t i = 0; i < vblk.queue_count; i++)
+    {
+      vblk.queues[i].interrupts++;
+      queue_complete (&vblk.queues[i]);
+    }
+}
+
+static int
+virtio_submit (struct block_device *dev, struct block_request *req)
+{
+  uint64_t flags = irq_save ();
+  struct virtqueue *vq = local_queue ();
+
+  req->next = NULL;
+  if (vq->pending_tail)
+    vq->pending_tail->next = req;
+  else
+    vq->pending_head = req;
+  vq->pending_tail = req;
+  queue_start_pending (vq);
+
+  irq_restore (flags);
+  return 0;
+}
+
+// Ring the doorbell once for everything submitted since the last one
+static void
+virtio_commit (struct block_device *dev)
+{
+  uint64_t flags = irq_save ();
+  queue_kick (local_queue ());
+  irq_restore (flags);
+}
+
+static void
+virtio_poll (struct block_device *dev)
+{
+  uint64_t flags = irq_save ();
+  queue_complete (local_queue ());
+  irq_restore (flags);
+}
+
+/**
+ * @brief Sends a FLUSH request through the local queue.
+ *
+ * Waits by polling the request; flushes are rare.
+ */
+static int
+virtio_flush (struct block_device *dev)
+{
+  if (!(vblk.features & F_BLK_FLUSH))
+    return 0;
+
+  struct block_request req = { 0 };
+  uint64_t flags = irq_save ();
+  struct virtqueue *vq = local_queue ();
+
+  while (!vq->free_slots)
+    queue_complete (vq);
+
+  int slot = __builtin_ctzll (vq->free_slots);
+  struct virtio_req *vr = vq->reqs[slot];
+  vr->type = VIRTIO_BLK_T_FLUSH;
+  vr->reserved = 0;
+  vr->sector = 0;
+  vr->status = 0xFF;
+  vr->table[0].addr = phys_of (vr);
+  vr->table[0].len = 16;
+  vr->table[0].flags = VIRTQ_DESC_F_NEXT;
+  vr->table[0].next = 1;
+  vr->table[1].addr = phys_of (&vr->status);
+  vr->table[1].len = 1;
+  vr->table[1].flags = VIRTQ_DESC_F_WRITE;
+
+  vq->desc[slot].addr = phys_of (vr->table);
+  vq->desc[slot].len = 2 * sizeof (struct virtq_desc);
+  vq->desc[slot].flags = VIRTQ_DESC_F_INDIRECT;
+  vq->inflight[slot] = &req;
+  vq->free_slots &= ~(1ULL << slot);
+  vq->avail->ring[vq->avail_idx % VIRTQ_SIZE] = slot;
+  __atomic_store_n (&vq->avail->idx, ++vq->avail_idx, __ATOMIC_RELEASE);
+  queue_kick (vq);
+
+  while (!req.complete)
+    queue_complete (vq);
+  irq_restore (flags);
+
+  return req.status;
+}
+
+static int
+setup_queue (uint16_t index, pci_msix_t *msix)
+{
+  volatile struct virtio_common_cfg *common = vblk.common;
+  struct virtqueue *vq = &vblk.queues[index];
+
+  common->queue_select = index;
+  if (common->queue_size < VIRTQ_SIZE)
+    return -1;
+  common->queue_size = VIRTQ_SIZE;
+
+  // Descriptors, then the available and used rings, in one page
+  uint8_t *ring = alloc_page ();
+  if (!ring)
+    return -1;
+  vq->index = index;
+  vq->desc = (struct virtq_desc *)ring;
+  vq->avail = (struct virtq_avail *)(ring + VIRTQ_SIZE * 16);
+  vq->used = (struct virtq_used *)(((uintptr_t)(vq->avail + 1) + 3) & ~3);
+
+  for (int slot = 0; slot < VIRTQ_SIZE; slot++)
+    {
+      if (slot % VIRTIO_SLOTS_PER_PAGE == 0)
+        {
+          ring = alloc_page ();
+          if (!ring)
+            return -1;
+        }
+      uint32_t offset = (slot % VIRTIO_SLOTS_PER_PAGE) * VIRTIO_REQ_SLOT;
+      vq->reqs[slot] = (struct virtio_req *)(ring + offset);
+    }
+  vq->free_slots = VIRTQ_SIZE == 64 ? ~0ULL : (1ULL << VIRTQ_SIZE) - 1;
+
+  common->queue_desc = phys_of (vq->desc);
+  common->queue_driver = phys_of (vq->avail);
+  common->queue_device = phys_of (vq->used);
+  vq->notify = (volatile uint16_t *)(vblk.notify_base
+                                     + common->queue_notify_off
+                                           * vblk.notify_multiplier);
+
+  if (msix)
+    {
+      // Each queue interrupts the CPU that submits on it
+      int vector = alloc_interrupt_vector ();
+      struct cpu_local *cpu = cpu_get (index);
+      if (vector < 0 || !cpu)
+        return -1;
+      pci_msix_set (msix, index, vector, cpu->apic_id);
+      register_interrupt_handler (vector, virtio_queue_interrupt);
+      common->queue_msix_vector = index;
+      if (common->queue_msix_vector != index)
+        return -1;
+    }
+
+  common->queue_enable = 1;
+  return 0;
+}
+
+static int
+negotiate (void)
+{
+  volatile struct virtio_common_cfg *common = vblk.common;
+  uint64_t offered;
+
+  common->device_status = 0;
+  while (common->device_status)
+    {
+    }
+  common->device_status = STATUS_ACKNOWLEDGE;
+  common->device_status |= STATUS_DRIVER;
+
+  common->device_feature_select = 0;
+  offered = common->device_feature;
+  common->device_feature_select = 1;
+  offered |= (uint64_t)common->device_feature << 32;
+
+  if (!(offered & F_VERSION_1) || !(offered & F_RING_INDIRECT_DESC))
+    return -1;
+  vblk.features = offered
+                  & (F_VERSION_1 | F_RING_INDIRECT_DESC | F_RING_EVENT_IDX
+                     | F_BLK_MQ | F_BLK_FLUSH | F_BLK_SEG_MAX);
+
+  common->driver_feature_select = 0;
+  common->driver_feature = vblk.features & 0xFFFFFFFF;
+  common->driver_feature_select = 1;
+  common->driver_feature = vblk.features >> 32;
+
+  common->device_status |= STATUS_FEATURES_OK;
+  if (!(common->device_status & STATUS_FEATURES_OK))
+    return -1;
+  return 0;
+}
+
+/**
+ * @brief Finds a virtio-blk device and registers it as "vda".
+ *
+ * Negotiates a modern (1.x) device with indirect descriptors, sets up one
+ * queue per online CPU as far as the device allows, and routes each
+ * queue's completions to its CPU through MSI-X. init_pci must run first.
+ */
+void
+init_virtio_blk (void)
+{
+  vblk.pci = pci_find_id (VIRTIO_VENDOR, VIRTIO_BLK_MODERN_ID, NULL);
+  if (!vblk.pci)
+    vblk.pci = pci_find_id (VIRTIO_VENDOR, VIRTIO_BLK_LEGACY_ID, NULL);
+  if (!vblk.pci)
+    return;
+
+  pci_enable (vblk.pci, PCI_COMMAND_MEMORY | PCI_COMMAND_BUS_MASTER);
+  if (find_caps () < 0 || negotiate () < 0)
+    goto fail;
+
+  uint32_t queues = cpu_count ();
+  uint32_t device_queues = (vblk.features & F_BLK_MQ)
+                               ? *(volatile uint16_t *)(vblk.device_cfg
+                                                        + BLK_CFG_NUM_QUEUES)
+                               : 1;
+  if (queues > device_queues)
+    queues = device_queues;
+  if (queues > VIRTIO_BLK_MAX_QUEUES)
+    queues = VIRTIO_BLK_MAX_QUEUES;
+
+  pci_msix_t msix;
+  int use_msix = apic_enabled () && pci_msix_map (vblk.pci, &msix) == 0
+                 && msix.entries >= queues;
+  if (use_msix)
+    vblk.common->msix_config = VIRTIO_NO_VECTOR;
+
+  for (uint32_t i = 0; i < queues; i++)
+    {
+      if (setup_queue (i, use_msix ? &msix : NULL) < 0)
+        goto fail;
+    }
+  vblk.queue_count = queues;
+
+  if (use_msix)
+    pci_msix_enable (vblk.pci, &msix);
+  else if (vblk.pci->irq_line < IRQ_COUNT)
+    register_interrupt_handler (IRQ (vblk.pci->irq_line),
+                                virtio_intx_interrupt);
+  else
+    {
+      vblk.polled = 1;
+      virtio_ops.poll = virtio_poll;
+    }
+
+  // Requests never need more data descriptors than the device accepts
+  uint32_t max_sectors = VIRTIO_MAX_SECTORS;
+  if (vblk.features & F_BLK_SEG_MAX)
+    {
+      uint32_t seg_max = cfg_read32 (BLK_CFG_SEG_MAX);
+      if (seg_max && seg_max < VIRTIO_DATA_SEGS)
+        max_sectors = (seg_max - 1) * (PAGE_SIZE / SECTOR_SIZE);
+      if (max_sectors == 0)
+        max_sectors = 1;
+    }
+
+  vblk.common->device_status |= STATUS_DRIVER_OK;
+
+  vblk.dev.name = "vda";
+  vblk.dev.ops = &virtio_ops;
+  vblk.dev.sectors = (uint64_t)cfg_read32 (BLK_CFG_CAPACITY)
+                     | (uint64_t)cfg_read32 (BLK_CFG_CAPACITY + 4) << 32;
+  vblk.dev.max_sectors = max_sectors;
+  vblk.dev.queue_depth = VIRTQ_SIZE;
+  vblk.dev.rank = BLOCK_RANK_VIRTIO;
+  block_register (&vblk.dev);
+
+  kprintf ("vda: %lu sectors, %u queue(s), %s%s\n", vblk.dev.sectors, queues,
+           use_msix ? "MSI-X" : vblk.polled ? "polled" : "INTx",
+           (vblk.features & F_RING_EVENT_IDX) ? ", event index" : "");
+  return;
+
+fail:
+  if (vblk.common)
+    vblk.common->device_status |= STATUS_FAILED;
+  vblk.pci = NULL;
+}
+
+void
+virtio_blk_get_stats (virtio_blk_stats_t *stats)
+{
+  uint64_t flags = irq_save ();
+
+  stats->requests = 0;
+  stats->notifications = 0;
+  stats->interrupts = 0;
+  stats->queues = vblk.queue_count;
+  for (uint32_t i = 0; i < vblk.queue_count; i++)
+    {
+      stats->requests += vblk.queues[i].requests;
+      stats->notifications += vblk.queues[i].notifications;
+      stats->interrupts += vblk.queues[i].interrupts;
+    }
+
+  irq_restore (flags);
+}
@@ -0,0 +1,27 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include "disk.h"
+
+#define VIRTIO_BLK_MAX_QUEUES 4
+#define VIRTQ_SIZE 64 // Ring entries per queue; a power of two
+
+// Driver statistics, summed over the queues
+typedef struct
+{
+  uint64_t requests;
+  uint64_t notifications; // Doorbell writes
+  uint64_t interrupts;
+  uint32_t queues;
+} virtio_blk_stats_t;
+
+void init_virtio_blk (void);
+void virtio_blk_get_stats (virtio_blk_stats_t *stats);
+
+#endif
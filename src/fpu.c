@@ -0,0 +1,370 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "fpu.h"
+#include "cpu.h"
+#include "drivers/timer.h"
+#include "idt.h"
+#include "klog.h"
+#include "memory.h"
+#include "workqueue.h"
+#include <stddef.h>
+
+#define CR0_MP (1 << 1)
+#define CR0_EM (1 << 2)
+#define CR0_TS (1 << 3)
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+#define CR4_OSXSAVE (1 << 18)
+
+#define CPUID1_ECX_XSAVE (1 << 26)
+#define CPUID1_ECX_AVX (1 << 28)
+#define CPUIDD1_EAX_XSAVEOPT (1 << 0)
+
+// XCR0 components managed by the kernel
+#define XSTATE_X87 (1 << 0)
+#define XSTATE_SSE (1 << 1)
+#define XSTATE_AVX (1 << 2)
+
+#define NM_VECTOR 7
+#define FPU_DEFAULT_FCW 0x037F
+#define FPU_DEFAULT_MXCSR 0x1F80
+
+static int fpu_policy = FPU_POLICY_LAZY;
+static uint64_t xstate_mask = 0;
+static uint8_t has_xsave = 0;
+static uint8_t has_xsaveopt = 0;
+
+static struct fpu_state *fpu_current = NULL; // Task that is running
+static struct fpu_state *fpu_owner = NULL;   // Task whose state is loaded
+static struct fpu_stats stats;
+
+static void bench_work_fn (void *arg);
+static struct work bench_work = WORK_INIT (bench_work_fn, 0);
+
+static inline uint64_t
+read_cr0 (void)
+{
+  uint64_t value;
+  asm volatile ("mov %%cr0, %0" : "=r"(value));
+  return value;
+}
+
+static inline void
+write_cr0 (uint64_t value)
+{
+  asm volatile ("mov %0, %%cr0" : : "r"(value));
+}
+
+static inline uint64_t
+read_cr4 (void)
+{
+  uint64_t value;
+  asm volatile ("mov %%cr4, %0" : "=r"(value));
+  return value;
+}
+
+static inline void
+write_cr4 (uint64_t value)
+{
+  asm volatile ("mov %0, %%cr4" : : "r"(value));
+}
+
+static inline void
+set_ts (void)
+{
+  write_cr0 (read_cr0 () | CR0_TS);
+}
+
+static inline void
+clts (void)
+{
+  asm volatile ("clts");
+}
+
+// Write back the registers into state; XSAVEOPT skips components that
+// are unmodified since the last XRSTOR or still in their init state.
+static void
+fpu_save (struct fpu_state *state)
+{
+  uint32_t lo = xstate_mask, hi = xstate_mask >> 32;
+
+  if (has_xsaveopt)
+    asm volatile ("xsaveopt64 (%0)"
+                  :
+                  : "r"(state->area), "a"(lo), "d"(hi)
+                  : "memory");
+  else if (has_xsave)
+    asm volatile ("xsave64 (%0)"
+                  :
+                  : "r"(state->area), "a"(lo), "d"(hi)
+                  : "memory");
+  else
+    asm volatile ("fxsave64 (%0)" : : "r"(state->area) : "memory");
+
+  stats.saves++;
+}
+
+static void
+fpu_restore (struct fpu_state *state)
+{
+  uint32_t lo = xstate_mask, hi = xstate_mask >> 32;
+
+  if (has_xsave)
+    asm volatile ("xrstor64 (%0)"
+                  :
+                  : "r"(state->area), "a"(lo), "d"(hi)
+                  : "memory");
+  else
+    asm volatile ("fxrstor64 (%0)" : : "r"(state->area) : "memory");
+
+  stats.restores++;
+}
+
+/**
+ * @brief Enables x87/SSE/AVX state and installs the #NM handler.
+ *
+ * The kernel is built with -mgeneral-regs-only, so extended state only
+ * ever belongs to tasks and is switched here rather than on every entry.
+ *
+ * @param policy FPU_POLICY_LAZY or FPU_POLICY_EAGER.
+ */
+void
+init_fpu (int policy)
+{
+  uint32_t a, b, c, d;
+
+  fpu_policy = policy;
+
+  write_cr0 ((read_cr0 () & ~CR0_EM) | CR0_MP);
+  write_cr4 (read_cr4 () | CR4_OSFXSR | CR4_OSXMMEXCPT);
+
+  cpuid (1, 0, &a, &b, &c, &d);
+  if (c & CPUID1_ECX_XSAVE)
+    {
+      write_cr4 (read_cr4 () | CR4_OSXSAVE);
+
+      xstate_mask = XSTATE_X87 | XSTATE_SSE;
+      if (c & CPUID1_ECX_AVX)
+        xstate_mask |= XSTATE_AVX;
+
+      asm volatile ("xsetbv"
+                    :
+                    : "c"(0), "a"((uint32_t)xstate_mask),
+                      "d"((uint32_t)(xstate_mask >> 32)));
+
+      // EBX reports the area size for the components enabled in XCR0
+      cpuid (0xD, 0, &a, &b, &c, &d);
+      if (b <= PAGE_SIZE)
+        {
+          has_xsave = 1;
+          cpuid (0xD, 1, &a, &b, &c, &d);
+          has_xsaveopt = a & CPUIDD1_EAX_XSAVEOPT;
+        }
+    }
+
+  register_interrupt_handler (NM_VECTOR, fpu_nm_trap);
+
+  if (fpu_policy == FPU_POLICY_LAZY)
+    set_ts ();
+}
+
+/**
+ * @brief Allocates and initializes a task's save area.
+ *
+ * XSTATE_BV is left zero, so the first XRSTOR puts every component in
+ * its init state. FCW and MXCSR are still set for the FXRSTOR path.
+ *
+ * @return 0 on success, or a negative value on error.
+ */
+int
+fpu_alloc_state (struct fpu_state *state)
+{
+  state->area = alloc_page ();
+  if (!state->area)
+    return -1;
+
+  *(uint16_t *)(state->area + 0) = FPU_DEFAULT_FCW;
+  *(uint32_t *)(state->area + 24) = FPU_DEFAULT_MXCSR;
+  return 0;
+}
+
+void
+fpu_free_state (struct fpu_state *state)
+{
+  if (fpu_owner == state)
+    fpu_owner = NULL;
+  if (fpu_current == state)
+    fpu_current = NULL;
+
+  free_page (state->area);
+  state->area = NULL;
+}
+
+/**
+ * @brief Switches extended state from prev to next.
+ *
+ * Lazy: only CR0.TS changes here, unless next still owns the registers.
+ * Eager: prev is saved and next restored immediately.
+ */
+void
+fpu_switch (struct fpu_state *prev, struct fpu_state *next)
+{
+  fpu_current = next;
+
+  if (fpu_policy == FPU_POLICY_EAGER)
+    {
+      if (prev && prev == fpu_owner)
+        fpu_save (prev);
+      if (next)
+        fpu_restore (next);
+      fpu_owner = next;
+      return;
+    }
+
+  if (next && next == fpu_owner)
+    clts ();
+  else
+    set_ts ();
+}
+
+/**
+ * @brief Device-not-available trap: first FPU use since the last switch.
+ */
+void
+fpu_nm_trap (void)
+{
+  clts ();
+  stats.traps++;
+
+  if (fpu_owner == fpu_current)
+    return;
+
+  if (fpu_owner)
+    fpu_save (fpu_owner);
+  if (fpu_current)
+    fpu_restore (fpu_current);
+  fpu_owner = fpu_current;
+}
+
+void
+fpu_get_stats (struct fpu_stats *out)
+{
+  if (out)
+    *out = stats;
+}
+
+// Dirty the SSE state the way a task's vector code would. The kernel does
+// not allocate vector registers itself, so no clobber is needed.
+static inline void
+fpu_touch (void)
+{
+  asm volatile ("pxor %%xmm0, %%xmm0\n\taddps %%xmm0, %%xmm1" : : : "memory");
+}
+
+static uint64_t
+fpu_bench_run (int policy, uint64_t iterations, int touch,
+               struct fpu_state *a, struct fpu_state *b)
+{
+  clts ();
+  fpu_policy = policy;
+  fpu_owner = NULL;
+  fpu_current = NULL;
+  fpu_switch (NULL, a);
+  if (touch)
+    fpu_touch ();
+
+  uint64_t start = read_tsc ();
+  for (uint64_t i = 0; i < iterations; i++)
+    {
+      fpu_switch (a, b);
+      if (touch)
+        fpu_touch ();
+      fpu_switch (b, a);
+      if (touch)
+        fpu_touch ();
+    }
+  return read_tsc () - start;
+}
+
+/**
+ * @brief Measures the FPU part of a context switch under both policies.
+ *
+ * Two scratch tasks are switched back and forth, once with both using
+ * SSE after every switch and once with neither using it. The running
+ * task's state is written back first and reloaded afterwards, and
+ * interrupts stay off so the scheduler cannot switch in between.
+ *
+ * @return 0 on success, or a negative value on error.
+ */
+int
+fpu_benchmark (uint64_t iterations, struct fpu_bench_result *result)
+{
+  struct fpu_state a, b;
+  int saved_policy = fpu_policy;
+  struct fpu_state *saved_current = fpu_current;
+
+  if (fpu_alloc_state (&a) < 0)
+    return -1;
+  if (fpu_alloc_state (&b) < 0)
+    {
+      fpu_free_state (&a);
+      return -1;
+    }
+
+  uint64_t flags = irq_save ();
+  clts ();
+  if (fpu_owner)
+    fpu_save (fpu_owner);
+
+  result->iterations = iterations;
+  result->lazy_cycles = fpu_bench_run (FPU_POLICY_LAZY, iterations, 1, &a, &b);
+  result->eager_cycles
+      = fpu_bench_run (FPU_POLICY_EAGER, iterations, 1, &a, &b);
+  result->lazy_idle_cycles
+      = fpu_bench_run (FPU_POLICY_LAZY, iterations, 0, &a, &b);
+  result->eager_idle_cycles
+      = fpu_bench_run (FPU_POLICY_EAGER, iterations, 0, &a, &b);
+
+  fpu_policy = saved_policy;
+  fpu_owner = NULL;
+  fpu_current = NULL;
+  fpu_switch (NULL, saved_current);
+  irq_restore (flags);
+
+  fpu_free_state (&a);
+  fpu_free_state (&b);
+  return 0;
+}
+
+static void
+bench_work_fn (void *arg)
+{
+  struct fpu_bench_result r;
+  uint64_t n = FPU_BENCH_ITERATIONS * 2; // Two switches per iteration
+
+  if (fpu_benchmark (FPU_BENCH_ITERATIONS, &r) < 0)
+    {
+      kprintf ("fpubench: no pages for the scratch tasks\n");
+      return;
+    }
+
+  kprintf ("fpubench: cycles per switch, lazy %lu eager %lu with SSE, "
+           "lazy %lu eager %lu without\n",
+           r.lazy_cycles / n, r.eager_cycles / n, r.lazy_idle_cycles / n,
+           r.eager_idle_cycles / n);
+}
+
+/**
+ * @brief Runs the switch cost benchmark from a worker thread.
+ *
+ * Safe from interrupt context; results go to the kernel log.
+ */
+void
+fpu_bench_start (void)
+{
+  queue_work (&bench_work);
+}
@@ -0,0 +1,59 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef FPU_H
+#define FPU_H
+
+#include <stdint.h>
+
+// Context switch policies
+#define FPU_POLICY_LAZY 0  // Set CR0.TS, load state on the first #NM
+#define FPU_POLICY_EAGER 1 // XSAVEOPT/XRSTOR on every switch
+
+#define FPU_BENCH_ITERATIONS 10000 // Round trips per case for the bench key
+
+/**
+ * Per-task extended state
+ * area is one page; the XSAVE image lives at its start.
+ */
+struct fpu_state
+{
+  uint8_t *area;
+};
+
+/**
+ * FPU switch statistics
+ */
+struct fpu_stats
+{
+  uint64_t saves;    // XSAVEOPT/XSAVE/FXSAVE executed
+  uint64_t restores; // XRSTOR/FXRSTOR executed
+  uint64_t traps;    // #NM traps taken
+};
+
+/**
+ * Switch cost measurements, in total cycles over all iterations
+ * Each iteration is a switch to the other task and back.
+ */
+struct fpu_bench_result
+{
+  uint64_t iterations;
+  uint64_t lazy_cycles;       // Both tasks touch the FPU
+  uint64_t eager_cycles;      // Both tasks touch the FPU
+  uint64_t lazy_idle_cycles;  // Neither task touches the FPU
+  uint64_t eager_idle_cycles; // Neither task touches the FPU
+};
+
+void init_fpu (int policy);
+int fpu_alloc_state (struct fpu_state *state);
+void fpu_free_state (struct fpu_state *state);
+void fpu_switch (struct fpu_state *prev, struct fpu_state *next);
+void fpu_nm_trap (void);
+void fpu_get_stats (struct fpu_stats *stats);
+int fpu_benchmark (uint64_t iterations, struct fpu_bench_result *result);
+void fpu_bench_start (void);
+
+#endif
@@ -0,0 +1,953 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "fs.h"
+#include "cpu.h"
+#include "klog.h"
+#include "memory.h"
+#include "mutex.h"
+#include "drivers/bcache.h"
+#include <stddef.h>
+
+#define INODES_PER_BLOCK (FS_BLOCK_SIZE / FS_INODE_SIZE)
+#define BITS_PER_BLOCK (FS_BLOCK_SIZE * 8)
+#define DCACHE_BUCKETS (1U << FS_DCACHE_BITS)
+
+_Static_assert (sizeof (struct fs_disk_inode) == FS_INODE_SIZE,
+                "on-disk inode size");
+_Static_assert (sizeof (struct fs_dirent) == 64, "directory entry size");
+_Static_assert (FS_BLOCK_SIZE == PAGE_SIZE, "a block fills a cached page");
+
+/*
+ * KFS, a small extent-based filesystem.
+ *
+ * Every inode maps its file blocks through up to FS_EXTENTS runs of
+ * contiguous disk blocks, and block allocation first tries the block
+ * after a file's last extent, so files written front to back stay in
+ * few extents. File and directory contents live in the page cache,
+ * keyed by inode and page index, and go straight between cached pages
+ * and the device. Metadata (superblock, bitmap, inodes) goes through
+ * the buffer cache. The block bitmap is also kept whole in memory.
+ *
+ * Path resolution consults a hashed cache of (directory, name) ->
+ * inode, which also remembers names that do not exist.
+ *
+ * One lock covers the filesystem; the page cache's backing store
+ * callbacks rely on it being held.
+ */
+struct dentry
+{
+  uint32_t parent;
+  uint32_t ino; // 0 for a name known not to exist
+  uint64_t last_use;
+  uint8_t used;
+  uint8_t len;
+  char name[FS_NAME_MAX];
+  struct dentry *hash_next;
+};
+
+static struct
+{
+  struct block_device *dev;
+  struct fs_super sb;
+  uint8_t *bitmap;
+  uint64_t free_blocks;
+  uint64_t alloc_hint;
+  int mounted;
+} fs;
+
+static struct fs_inode inodes[FS_INODE_CACHE];
+static struct dentry dentries[FS_DCACHE_SIZE];
+static struct dentry *dcache[DCACHE_BUCKETS];
+static uint64_t dcache_clock = 0;
+static uint8_t sector_buf[SECTOR_SIZE];
+static fs_stats_t stats;
+static struct mutex fs_mutex = MUTEX_INIT;
+
+static int fs_readpage (struct page_mapping *mapping, uint64_t index,
+                        void *page);
+static int fs_writepage (struct page_mapping *mapping, uint64_t index,
+                         const void *page);
+
+static const struct page_mapping_ops fs_page_ops = {
+  .readpage = fs_readpage,
+  .writepage = fs_writepage,
+};
+
+// Reads or writes metadata that lies within one sector
+static int
+meta_rw (uint64_t byte_offset, void *buffer, uint32_t len, int write)
+{
+  uint64_t lba = byte_offset / SECTOR_SIZE;
+  uint32_t offset = byte_offset % SECTOR_SIZE;
+
+  if (bcache_read (fs.dev, lba, 1, sector_buf) < 0)
+    return FS_ERR_IO;
+  if (!write)
+    {
+      k_memcpy (buffer, sector_buf + offset, len);
+      return 0;
+    }
+
+  k_memcpy (sector_buf + offset, buffer, len);
+  return bcache_write (fs.dev, lba, 1, sector_buf) < 0 ? FS_ERR_IO : 0;
+}
+
+static inline uint64_t
+inode_offset (uint32_t ino)
+{
+  return (uint64_t)fs.sb.inode_start * FS_BLOCK_SIZE
+         + (uint64_t)ino * FS_INODE_SIZE;
+}
+
+static int
+inode_store (struct fs_inode *inode)
+{
+  return meta_rw (inode_offset (inode->ino), &inode->disk, FS_INODE_SIZE, 1);
+}
+
+// Marks a block used or free, writing the bitmap sector through
+static int
+bitmap_set (uint64_t block, int used)
+{
+  if (used)
+    fs.bitmap[block / 8] |= 1 << (block % 8);
+  else
+    fs.bitmap[block / 8] &= ~(1 << (block % 8));
+
+  uint64_t byte = (block / 8) & ~(uint64_t)(SECTOR_SIZE - 1);
+  uint64_t lba = (uint64_t)fs.sb.bitmap_start * FS_BLOCK_SECTORS
+                 + byte / SECTOR_SIZE;
+  return bcache_write (fs.dev, lba, 1, fs.bitmap + byte) < 0 ? FS_ERR_IO : 0;
+}
+
+// Allocates a data block, at prefer if it is free
+static int64_t
+block_alloc (uint64_t prefer)
+{
+  uint64_t first = fs.sb.data_start;
+  uint64_t range = fs.sb.blocks - first;
+
+  if (!fs.free_blocks)
+    return FS_ERR_NOSPC;
+  if (prefer < first || prefer >= fs.sb.blocks)
+    prefer = fs.alloc_hint;
+
+  for (uint64_t n = 0; n < range; n++)
+    {
+      uint64_t block = first + (prefer - first + n) % range;
+      if (fs.bitmap[block / 8] & (1 << (block % 8)))
+        continue;
+
+      if (bitmap_set (block, 1) < 0)
+        return FS_ERR_IO;
+      fs.free_blocks--;
+      fs.alloc_hint = block + 1 < fs.sb.blocks ? block + 1 : first;
+      return block;
+    }
+  return FS_ERR_NOSPC;
+}
+
+/**
+ * @brief Maps a file block to its disk block.
+ *
+ * Files only grow at the end, so with alloc every missing block up to
+ * and including fblock is allocated, extending the last extent when
+ * the allocator allows.
+ *
+ * @return The disk block, 0 for a block past the mapped range without
+ *         alloc, or a negative FS_ERR_* value.
+ */
+static int64_t
+bmap (struct fs_inode *inode, uint64_t fblock, int alloc)
+{
+  struct fs_disk_inode *d = &inode->disk;
+  uint64_t base = 0;
+
+  for (uint32_t i = 0; i < d->extent_count; i++)
+    {
+      if (fblock < base + d->extents[i].length)
+        return d->extents[i].start + (fblock - base);
+      base += d->extents[i].length;
+    }
+  if (!alloc)
+    return 0;
+
+  int64_t block = 0;
+  for (; base <= fblock; base++)
+    {
+      struct fs_extent *last
+          = d->extent_count ? &d->extents[d->extent_count - 1] : NULL;
+      block = block_alloc (last ? last->start + last->length : 0);
+      if (block < 0)
+        break;
+
+      if (last && block == last->start + last->length)
+        last->length++;
+      else if (d->extent_count < FS_EXTENTS)
+        {
+          d->extents[d->extent_count].start = block;
+          d->extents[d->extent_count].length = 1;
+          d->extent_count++;
+        }
+      else
+        {
+          bitmap_set (block, 0);
+          fs.free_blocks++;
+          block = FS_ERR_NOSPC;
+          break;
+        }
+    }
+
+  int err = inode_store (inode);
+  return block < 0 ? block : err < 0 ? err : block;
+}
+
+static int
+fs_readpage (struct page_mapping *mapping, uint64_t index, void *page)
+{
+  struct fs_inode *inode = mapping->priv;
+  int64_t block = bmap (inode, index, 0);
+
+  if (block == 0)
+    {
+      k_memset (page, 0, PAGE_SIZE);
+      return 0;
+    }
+  if (block_read (fs.dev, block * FS_BLOCK_SECTORS, FS_BLOCK_SECTORS, page)
+      < 0)
+    return FS_ERR_IO;
+  return 0;
+}
+
+static int
+fs_writepage (struct page_mapping *mapping, uint64_t index, const void *page)
+{
+  struct fs_inode *inode = mapping->priv;
+  int64_t block = bmap (inode, index, 1);
+
+  if (block < 0)
+    return block;
+  if (block_write (fs.dev, block * FS_BLOCK_SECTORS, FS_BLOCK_SECTORS, page)
+      < 0)
+    return FS_ERR_IO;
+  return 0;
+}
+
+// Finds an inode in memory or loads it, taking a reference
+static struct fs_inode *
+iget (uint32_t ino)
+{
+  struct fs_inode *victim = NULL;
+
+  for (uint32_t i = 0; i < FS_INODE_CACHE; i++)
+    {
+      struct fs_inode *inode = &inodes[i];
+      if (inode->ino == ino)
+        {
+          inode->refs++;
+          return inode;
+        }
+
+      // Prefer empty slots, then unused inodes without cached pages
+      if (inode->refs)
+        continue;
+      if (!victim || !inode->ino
+          || (victim->ino && inode->mapping.pages < victim->mapping.pages))
+        victim = inode;
+    }
+
+  if (!victim || pagecache_invalidate (&victim->mapping) < 0)
+    return NULL;
+  victim->ino = 0;
+  if (meta_rw (inode_offset (ino), &victim->disk, FS_INODE_SIZE, 0) < 0)
+    return NULL;
+
+  victim->ino = ino;
+  victim->refs = 1;
+  victim->mapping.ops = &fs_page_ops;
+  victim->mapping.priv = victim;
+  return victim;
+}
+
+static inline void
+iput (struct fs_inode *inode)
+{
+  inode->refs--;
+}
+
+// Allocates an on-disk inode of the given type
+static int64_t
+ialloc (uint16_t type)
+{
+  struct fs_disk_inode disk;
+
+  for (uint32_t ino = FS_ROOT_INODE + 1; ino < fs.sb.inodes; ino++)
+    {
+      if (meta_rw (inode_offset (ino), &disk, FS_INODE_SIZE, 0) < 0)
+        return FS_ERR_IO;
+      if (disk.type != FS_TYPE_FREE)
+        continue;
+
+      k_memset (&disk, 0, sizeof (disk));
+      disk.type = type;
+      disk.links = 1;
+      if (meta_rw (inode_offset (ino), &disk, FS_INODE_SIZE, 1) < 0)
+        return FS_ERR_IO;
+      return ino;
+    }
+  return FS_ERR_NOSPC;
+}
+
+static int64_t
+read_locked (struct fs_inode *inode, uint64_t offset, uint8_t *buffer,
+             uint64_t len)
+{
+  uint64_t done = 0;
+
+  if (offset >= inode->disk.size)
+    return 0;
+  if (len > inode->disk.size - offset)
+    len = inode->disk.size - offset;
+
+  while (done < len)
+    {
+      uint64_t pos = offset + done;
+      uint32_t in_page = pos % PAGE_SIZE;
+      uint64_t chunk = PAGE_SIZE - in_page;
+      if (chunk > len - done)
+        chunk = len - done;
+
+      struct cached_page *page;
+      int ret = pagecache_get (&inode->mapping, pos / PAGE_SIZE, 0, &page);
+      if (ret < 0)
+        return done ? (int64_t)done : FS_ERR_IO;
+
+      k_memcpy (buffer + done, page->data + in_page, chunk);
+      pagecache_put (page);
+      done += chunk;
+    }
+  return done;
+}
+
+// Writes len bytes at offset, zeros when buffer is NULL
+static int64_t
+write_locked (struct fs_inode *inode, uint64_t offset, const uint8_t *buffer,
+              uint64_t len)
+{
+  uint64_t done = 0;
+  int64_t ret = 0;
+
+  while (done < len)
+    {
+      uint64_t pos = offset + done;
+      uint64_t index = pos / PAGE_SIZE;
+      uint32_t in_page = pos % PAGE_SIZE;
+      uint64_t chunk = PAGE_SIZE - in_page;
+      if (chunk > len - done)
+        chunk = len - done;
+
+      ret = bmap (inode, index, 1);
+      if (ret < 0)
+        break;
+
+      // Nothing worth reading: all of it is overwritten or past the end
+      int flags = 0;
+      if (chunk == PAGE_SIZE || index * PAGE_SIZE >= inode->disk.size)
+        flags = PAGECACHE_NOREAD;
+
+      struct cached_page *page;
+      ret = pagecache_get (&inode->mapping, index, flags, &page);
+      if (ret < 0)
+        {
+          ret = FS_ERR_IO;
+          break;
+        }
+
+      if (buffer)
+        k_memcpy (page->data + in_page, buffer + done, chunk);
+      else
+        k_memset (page->data + in_page, 0, chunk);
+      pagecache_mark_dirty (page);
+      pagecache_put (page);
+
+      done += chunk;
+      if (offset + done > inode->disk.size)
+        inode->disk.size = offset + done;
+    }
+
+  if (done)
+    inode_store (inode);
+  return done ? (int64_t)done : ret;
+}
+
+static uint32_t
+dcache_hash (uint32_t parent, const char *name, uint32_t len)
+{
+  uint32_t hash = 2166136261U ^ parent;
+  for (uint32_t i = 0; i < len; i++)
+    hash = (hash ^ (uint8_t)name[i]) * 16777619U;
+  return hash % DCACHE_BUCKETS;
+}
+
+static int
+name_equal (const char *a, const char *b, uint32_t len)
+{
+  for (uint32_t i = 0; i < len; i++)
+    {
+      if (a[i] != b[i])
+        return 0;
+    }
+  return 1;
+}
+
+static struct dentry *
+dcache_find (uint32_t parent, const char *name, uint32_t len)
+{
+  struct dentry *d = dcache[dcache_hash (parent, name, len)];
+  while (d && !(d->parent == parent && d->len == len
+                && name_equal (d->name, name, len)))
+    d = d->hash_next;
+  return d;
+}
+
+// Records what a name resolves to, replacing the least recent entry
+static void
+dcache_add (uint32_t parent, const char *name, uint32_t len, uint32_t ino)
+{
+  struct dentry *d = dcache_find (parent, name, len);
+
+  if (!d)
+    {
+      d = &dentries[0];
+      for (uint32_t i = 0; i < FS_DCACHE_SIZE && d->used; i++)
+        {
+          if (!dentries[i].used || dentries[i].last_use < d->last_use)
+            d = &dentries[i];
+        }
+
+      if (d->used)
+        {
+          struct dentry **link = &dcache[dcache_hash (d->parent, d->name,
+                                                      d->len)];
+          while (*link != d)
+            link = &(*link)->hash_next;
+          *link = d->hash_next;
+        }
+
+      uint32_t bucket = dcache_hash (parent, name, len);
+      d->used = 1;
+      d->parent = parent;
+      d->len = len;
+      k_memcpy (d->name, name, len);
+      d->hash_next = dcache[bucket];
+      dcache[bucket] = d;
+    }
+
+  d->ino = ino;
+  d->last_use = ++dcache_clock;
+}
+
+// Scans a directory for a name; 0 if it is not there
+static int64_t
+dir_find (struct fs_inode *dir, const char *name, uint32_t len)
+{
+  struct fs_dirent de;
+
+  for (uint64_t off = 0; off < dir->disk.size; off += sizeof (de))
+    {
+      if (read_locked (dir, off, (uint8_t *)&de, sizeof (de)) < 0)
+        return FS_ERR_IO;
+      if (de.inode && de.name_len == len && name_equal (de.name, name, len))
+        return de.inode;
+    }
+  return 0;
+}
+
+static int
+dir_add (struct fs_inode *dir, const char *name, uint32_t len, uint32_t ino,
+         uint8_t type)
+{
+  struct fs_dirent de;
+  uint64_t off = 0;
+
+  // Reuse the first empty entry, else append
+  for (; off < dir->disk.size; off += sizeof (de))
+    {
+      if (read_locked (dir, off, (uint8_t *)&de, sizeof (de)) < 0)
+        return FS_ERR_IO;
+      if (!de.inode)
+        break;
+    }
+
+  k_memset (&de, 0, sizeof (de));
+  de.inode = ino;
+  de.type = type;
+  de.name_len = len;
+  k_memcpy (de.name, name, len);
+
+  int64_t ret = write_locked (dir, off, (uint8_t *)&de, sizeof (de));
+  return ret < 0 ? ret : 0;
+}
+
+// Looks a name up in a directory, through the dentry cache
+static int64_t
+lookup_child (uint32_t dir_ino, const char *name, uint32_t len)
+{
+  struct dentry *d = dcache_find (dir_ino, name, len);
+
+  if (d)
+    {
+      stats.dcache_hits++;
+      d->last_use = ++dcache_clock;
+      return d->ino ? d->ino : FS_ERR_NOENT;
+    }
+
+  stats.dcache_misses++;
+  struct fs_inode *dir = iget (dir_ino);
+  if (!dir)
+    return FS_ERR_NOSPC;
+
+  int64_t ino = dir->disk.type == FS_TYPE_DIR ? dir_find (dir, name, len)
+                                              : FS_ERR_NOTDIR;
+  iput (dir);
+  if (ino < 0)
+    return ino;
+
+  dcache_add (dir_ino, name, len, ino);
+  return ino ? ino : FS_ERR_NOENT;
+}
+
+/**
+ * @brief Resolves every component of a path but the last.
+ *
+ * @param name Set to the last component, or NULL for the root.
+ * @return The inode of the directory holding it, or a negative FS_ERR_*.
+ */
+static int64_t
+walk (const char *path, const char **name, uint32_t *len)
+{
+  uint32_t dir = FS_ROOT_INODE;
+
+  *name = NULL;
+  *len = 0;
+  while (1)
+    {
+      while (*path == '/')
+        path++;
+      if (!*path)
+        return dir;
+
+      const char *start = path;
+      while (*path && *path != '/')
+        path++;
+      uint32_t n = path - start;
+      if (n > FS_NAME_MAX || (n == 2 && start[0] == '.' && start[1] == '.'))
+        return FS_ERR_INVAL;
+      if (n == 1 && start[0] == '.')
+        continue;
+
+      const char *rest = path;
+      while (*rest == '/')
+        rest++;
+      if (!*rest)
+        {
+          *name = start;
+          *len = n;
+          return dir;
+        }
+
+      int64_t ino = lookup_child (dir, start, n);
+      if (ino < 0)
+        return ino;
+      dir = ino;
+    }
+}
+
+static int64_t
+create_child (uint32_t dir_ino, const char *name, uint32_t len,
+              uint16_t type)
+{
+  struct fs_inode *dir = iget (dir_ino);
+  if (!dir)
+    return FS_ERR_NOSPC;
+  if (dir->disk.type != FS_TYPE_DIR)
+    {
+      iput (dir);
+      return FS_ERR_NOTDIR;
+    }
+
+  int64_t ino = ialloc (type);
+  if (ino >= 0)
+    {
+      int err = dir_add (dir, name, len, ino, type);
+      if (err < 0)
+        ino = err;
+      else
+        dcache_add (dir_ino, name, len, ino);
+    }
+  iput (dir);
+  return ino;
+}
+
+/**
+ * @brief Opens a file or directory by absolute path.
+ *
+ * With FS_CREATE a missing file is created. The inode stays referenced
+ * until fs_close.
+ *
+ * @return 0 on success, or a negative FS_ERR_* value.
+ */
+int
+fs_open (const char *path, int flags, struct fs_inode **out)
+{
+  const char *name;
+  uint32_t len;
+  int64_t ino = FS_ERR_NOFS;
+
+  mutex_lock (&fs_mutex);
+  if (fs.mounted)
+    ino = walk (path, &name, &len);
+  if (ino >= 0 && name)
+    {
+      uint32_t dir = ino;
+      ino = lookup_child (dir, name, len);
+      if (ino == FS_ERR_NOENT && (flags & FS_CREATE))
+        ino = create_child (dir, name, len, FS_TYPE_FILE);
+    }
+  if (ino >= 0)
+    {
+      *out = iget (ino);
+      if (!*out)
+        ino = FS_ERR_NOSPC;
+    }
+  mutex_unlock (&fs_mutex);
+
+  return ino < 0 ? ino : 0;
+}
+
+/**
+ * @brief Creates a directory.
+ *
+ * @return 0 on success, or a negative FS_ERR_* value.
+ */
+int
+fs_mkdir (const char *path)
+{
+  const char *name;
+  uint32_t len;
+  int64_t ret = FS_ERR_NOFS;
+
+  mutex_lock (&fs_mutex);
+  if (fs.mounted)
+    ret = walk (path, &name, &len);
+  if (ret >= 0 && !name)
+    ret = FS_ERR_EXIST;
+  if (ret >= 0)
+    {
+      uint32_t dir = ret;
+      ret = lookup_child (dir, name, len);
+      if (ret >= 0)
+        ret = FS_ERR_EXIST;
+      else if (ret == FS_ERR_NOENT)
+        ret = create_child (dir, name, len, FS_TYPE_DIR);
+    }
+  mutex_unlock (&fs_mutex);
+
+  return ret < 0 ? ret : 0;
+}
+
+void
+fs_close (struct fs_inode *inode)
+{
+  mutex_lock (&fs_mutex);
+  iput (inode);
+  mutex_unlock (&fs_mutex);
+}
+
+/**
+ * @brief Reads from a file through the page cache.
+ *
+ * @return Bytes read, 0 at the end, or a negative FS_ERR_* value.
+ */
+int64_t
+fs_read (struct fs_inode *inode, uint64_t offset, void *buffer, uint64_t len)
+{
+  mutex_lock (&fs_mutex);
+  int64_t ret = inode->disk.type == FS_TYPE_FILE
+                    ? read_locked (inode, offset, buffer, len)
+                    : FS_ERR_ISDIR;
+  mutex_unlock (&fs_mutex);
+  return ret;
+}
+
+/**
+ * @brief Writes to a file through the page cache.
+ *
+ * Blocks are allocated now and written back with the page cache.
+ * Writing past the end zero-fills the gap.
+ *
+ * @return Bytes written, or a negative FS_ERR_* value.
+ */
+int64_t
+fs_write (struct fs_inode *inode, uint64_t offset, const void *buffer,
+          uint64_t len)
+{
+  int64_t ret = FS_ERR_ISDIR;
+
+  mutex_lock (&fs_mutex);
+  if (inode->disk.type == FS_TYPE_FILE)
+    {
+      ret = 0;
+      if (offset > inode->disk.size)
+        {
+          uint64_t gap = offset - inode->disk.size;
+          ret = write_locked (inode, inode->disk.size, NULL, gap);
+          if (ret >= 0 && (uint64_t)ret < gap)
+            ret = FS_ERR_NOSPC;
+        }
+      if (ret >= 0)
+        ret = write_locked (inode, offset, buffer, len);
+    }
+  mutex_unlock (&fs_mutex);
+  return ret;
+}
+
+/**
+ * @brief Returns the index'th entry of a directory.
+ *
+ * @return 1 with the entry, 0 past the last one, or a negative FS_ERR_*.
+ */
+int
+fs_readdir (struct fs_inode *dir, uint32_t index, struct fs_dirent *out)
+{
+  int ret = 0;
+
+  mutex_lock (&fs_mutex);
+  if (dir->disk.type != FS_TYPE_DIR)
+    ret = FS_ERR_NOTDIR;
+  for (uint64_t off = 0; ret == 0 && off < dir->disk.size;
+       off += sizeof (*out))
+    {
+      if (read_locked (dir, off, (uint8_t *)out, sizeof (*out)) < 0)
+        ret = FS_ERR_IO;
+      else if (out->inode && index-- == 0)
+        ret = 1;
+    }
+  mutex_unlock (&fs_mutex);
+
+  return ret;
+}
+
+/**
+ * @brief Gets a cached page of a regular file for mapping it.
+ *
+ * The page comes back referenced; drop it with pagecache_put.
+ *
+ * @return 0 on success, or a negative FS_ERR_* value.
+ */
+int
+fs_get_page (struct fs_inode *inode, uint64_t index, struct cached_page **out)
+{
+  int ret = FS_ERR_ISDIR;
+
+  mutex_lock (&fs_mutex);
+  if (inode->disk.type == FS_TYPE_FILE)
+    ret = pagecache_get (&inode->mapping, index, 0, out) < 0 ? FS_ERR_IO : 0;
+  mutex_unlock (&fs_mutex);
+  return ret;
+}
+
+uint64_t
+fs_size (struct fs_inode *inode)
+{
+  return inode->disk.size;
+}
+
+/**
+ * @brief Writes a file's dirty pages and metadata to the medium.
+ */
+int
+fs_fsync (struct fs_inode *inode)
+{
+  mutex_lock (&fs_mutex);
+  int ret = pagecache_sync (&inode->mapping) < 0 ? FS_ERR_IO : 0;
+  if (bcache_flush (fs.dev) < 0)
+    ret = FS_ERR_IO;
+  mutex_unlock (&fs_mutex);
+  return ret;
+}
+
+/**
+ * @brief Writes every dirty page and metadata block to the medium.
+ */
+int
+fs_sync (void)
+{
+  int ret = FS_ERR_NOFS;
+
+  mutex_lock (&fs_mutex);
+  if (fs.mounted)
+    {
+      ret = pagecache_sync (NULL) < 0 ? FS_ERR_IO : 0;
+      if (bcache_flush (fs.dev) < 0)
+        ret = FS_ERR_IO;
+    }
+  mutex_unlock (&fs_mutex);
+  return ret;
+}
+
+/**
+ * @brief Writes an empty filesystem covering the whole device.
+ *
+ * @return 0 on success, or a negative FS_ERR_* value.
+ */
+int
+fs_format (struct block_device *dev)
+{
+  struct fs_super sb = { 0 };
+
+  if (!dev || (fs.mounted && fs.dev == dev))
+    return FS_ERR_INVAL;
+
+  sb.magic = FS_MAGIC;
+  sb.block_size = FS_BLOCK_SIZE;
+  sb.blocks = dev->sectors / FS_BLOCK_SECTORS;
+  sb.inodes = (sb.blocks / 4 + INODES_PER_BLOCK - 1) & ~(INODES_PER_BLOCK - 1);
+  if (sb.inodes < INODES_PER_BLOCK)
+    sb.inodes = INODES_PER_BLOCK;
+  sb.bitmap_start = 1;
+  sb.bitmap_blocks = (sb.blocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+  sb.inode_start = sb.bitmap_start + sb.bitmap_blocks;
+  sb.inode_blocks = sb.inodes / INODES_PER_BLOCK;
+  sb.data_start = sb.inode_start + sb.inode_blocks;
+  if (sb.data_start + 1 >= sb.blocks)
+    return FS_ERR_NOSPC;
+
+  uint8_t *page = alloc_page ();
+  if (!page)
+    return FS_ERR_NOSPC;
+
+  int ret = 0;
+  for (uint64_t block = 0; block < sb.data_start && ret == 0; block++)
+    {
+      k_memset (page, 0, PAGE_SIZE);
+      if (block == 0)
+        k_memcpy (page, &sb, sizeof (sb));
+
+      // Metadata blocks are allocated
+      if (block >= sb.bitmap_start && block < sb.inode_start)
+        {
+          uint64_t first = (block - sb.bitmap_start) * BITS_PER_BLOCK;
+          for (uint64_t b = first;
+               b < sb.data_start && b < first + BITS_PER_BLOCK; b++)
+            page[(b - first) / 8] |= 1 << ((b - first) % 8);
+        }
+
+      // The root directory
+      if (block == sb.inode_start)
+        {
+          struct fs_disk_inode *root
+              = (struct fs_disk_inode *)(page
+                                         + FS_ROOT_INODE * FS_INODE_SIZE);
+          root->type = FS_TYPE_DIR;
+          root->links = 2;
+        }
+
+      ret = bcache_write (dev, block * FS_BLOCK_SECTORS, FS_BLOCK_SECTORS,
+                          page);
+    }
+  free_page (page);
+
+  if (ret == 0)
+    ret = bcache_flush (dev);
+  return ret < 0 ? FS_ERR_IO : 0;
+}
+
+/**
+ * @brief Mounts the filesystem on a device; one mount at a time.
+ *
+ * @return 0 on success, or a negative FS_ERR_* value.
+ */
+int
+fs_mount (struct block_device *dev)
+{
+  struct fs_super sb;
+
+  if (!dev || fs.mounted)
+    return FS_ERR_INVAL;
+  if (bcache_read (dev, 0, 1, sector_buf) < 0)
+    return FS_ERR_IO;
+  k_memcpy (&sb, sector_buf, sizeof (sb));
+  if (sb.magic != FS_MAGIC || sb.block_size != FS_BLOCK_SIZE
+      || sb.blocks > dev->sectors / FS_BLOCK_SECTORS
+      || sb.data_start >= sb.blocks)
+    return FS_ERR_NOFS;
+
+  // The bitmap is read and written in whole sectors
+  uint64_t bytes = ((sb.blocks + 7) / 8 + SECTOR_SIZE - 1)
+                   & ~(uint64_t)(SECTOR_SIZE - 1);
+  uint8_t *bitmap = allocate_memory (bytes);
+  if (!bitmap)
+    return FS_ERR_NOSPC;
+  if (bcache_read (dev, (uint64_t)sb.bitmap_start * FS_BLOCK_SECTORS,
+                   bytes / SECTOR_SIZE, bitmap)
+      < 0)
+    {
+      free_memory (bitmap);
+      return FS_ERR_IO;
+    }
+
+  fs.free_blocks = 0;
+  for (uint64_t b = sb.data_start; b < sb.blocks; b++)
+    {
+      if (!(bitmap[b / 8] & (1 << (b % 8))))
+        fs.free_blocks++;
+    }
+
+  fs.dev = dev;
+  fs.sb = sb;
+  fs.bitmap = bitmap;
+  fs.alloc_hint = sb.data_start;
+  fs.mounted = 1;
+  return 0;
+}
+
+void
+fs_get_stats (fs_stats_t *stats_out)
+{
+  mutex_lock (&fs_mutex);
+  *stats_out = stats;
+  stats_out->free_blocks = fs.free_blocks;
+  stats_out->blocks = fs.mounted ? fs.sb.blocks : 0;
+  mutex_unlock (&fs_mutex);
+}
+
+/**
+ * @brief Sets up the page cache and mounts the root filesystem.
+ *
+ * The default disk is used if it holds KFS; otherwise ram0 is
+ * formatted as a scratch root.
+ */
+void
+init_fs (void)
+{
+  init_pagecache ();
+
+  struct block_device *dev = block_default ();
+  if (fs_mount (dev) < 0)
+    {
+      dev = block_get ("ram0");
+      if (fs_format (dev) < 0 || fs_mount (dev) < 0)
+        {
+          kprintf ("fs: nothing to mount\n");
+          return;
+        }
+    }
+
+  kprintf ("fs: mounted %s, %lu of %lu blocks free\n", dev->name,
+           fs.free_blocks, fs.sb.blocks);
+}
@@ -0,0 +1,126 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef FS_H
+#define FS_H
+
+#include "pagecache.h"
+#include "drivers/disk.h"
+#include <stdint.h>
+
+#define FS_MAGIC 0x3153464B // "KFS1"
+#define FS_BLOCK_SIZE 4096
+#define FS_BLOCK_SECTORS (FS_BLOCK_SIZE / SECTOR_SIZE)
+#define FS_INODE_SIZE 128
+#define FS_EXTENTS 13
+#define FS_NAME_MAX 58
+#define FS_PATH_MAX 256 // Longest path a system call accepts
+#define FS_ROOT_INODE 1
+#define FS_INODE_CACHE 32
+#define FS_DCACHE_SIZE 64
+#define FS_DCACHE_BITS 5
+
+// Inode types
+#define FS_TYPE_FREE 0
+#define FS_TYPE_FILE 1
+#define FS_TYPE_DIR 2
+
+// fs_open flags
+#define FS_CREATE 0x1
+
+// Error codes
+#define FS_ERR_NOENT -1
+#define FS_ERR_EXIST -2
+#define FS_ERR_NOSPC -3 // No free block or inode, or the extents ran out
+#define FS_ERR_NOTDIR -4
+#define FS_ERR_ISDIR -5
+#define FS_ERR_INVAL -6
+#define FS_ERR_IO -7
+#define FS_ERR_NOFS -8 // Nothing mounted, or no filesystem on the device
+
+/**
+ * Superblock, stored in block 0
+ * Followed by the block bitmap, the inode table and the data blocks.
+ */
+struct fs_super
+{
+  uint32_t magic;
+  uint32_t block_size;
+  uint64_t blocks;
+  uint32_t inodes;
+  uint32_t bitmap_start;
+  uint32_t bitmap_blocks;
+  uint32_t inode_start;
+  uint32_t inode_blocks;
+  uint32_t data_start;
+};
+
+// A run of contiguous data blocks
+struct fs_extent
+{
+  uint32_t start;
+  uint32_t length;
+};
+
+struct fs_disk_inode
+{
+  uint16_t type;
+  uint16_t links;
+  uint32_t extent_count;
+  uint64_t size;
+  struct fs_extent extents[FS_EXTENTS]; // File blocks in order
+  uint8_t reserved[8];
+};
+
+// Directory entry; directories are files of these
+struct fs_dirent
+{
+  uint32_t inode; // 0 for an unused entry
+  uint8_t type;
+  uint8_t name_len;
+  char name[FS_NAME_MAX];
+};
+
+/**
+ * In-memory inode
+ * Its page mapping keys the inode's pages in the page cache.
+ */
+struct fs_inode
+{
+  uint32_t ino;
+  uint32_t refs;
+  struct fs_disk_inode disk;
+  struct page_mapping mapping;
+};
+
+// Filesystem statistics
+typedef struct
+{
+  uint64_t dcache_hits;
+  uint64_t dcache_misses;
+  uint64_t free_blocks;
+  uint64_t blocks;
+} fs_stats_t;
+
+void init_fs (void);
+int fs_format (struct block_device *dev);
+int fs_mount (struct block_device *dev);
+int fs_open (const char *path, int flags, struct fs_inode **out);
+int fs_mkdir (const char *path);
+void fs_close (struct fs_inode *inode);
+int64_t fs_read (struct fs_inode *inode, uint64_t offset, void *buffer,
+                 uint64_t len);
+int64_t fs_write (struct fs_inode *inode, uint64_t offset,
+                  const void *buffer, uint64_t len);
+int fs_readdir (struct fs_inode *dir, uint32_t index, struct fs_dirent *out);
+int fs_get_page (struct fs_inode *inode, uint64_t index,
+                 struct cached_page **out);
+uint64_t fs_size (struct fs_inode *inode);
+int fs_fsync (struct fs_inode *inode);
+int fs_sync (void);
+void fs_get_stats (fs_stats_t *stats);
+
+#endif
@@ -0,0 +1,162 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "futex.h"
+#include "cpu.h"
+#include "paging.h"
+#include "process.h"
+#include <stddef.h>
+
+#define FUTEX_BUCKETS (1 << FUTEX_HASH_BITS)
+
+/*
+ * Sleeping processes are kept in a table of wait queues hashed on the
+ * address space and address they wait on, so a wake only walks the
+ * waiters that could match. Cloned address spaces use the same
+ * addresses for different memory, so the address alone is not a key.
+ * A process waits on one address at a time, so the queue nodes are
+ * preallocated, one per process. The value check and the enqueue
+ * happen with interrupts disabled, as does the wake, so a wake cannot
+ * fall between them.
+ */
+struct futex_waiter
+{
+  uint64_t *space; // Page tables addr belongs to
+  uintptr_t addr;
+  uint64_t pid;
+  volatile uint8_t woken;
+  struct futex_waiter *next;
+};
+
+static struct futex_waiter *buckets[FUTEX_BUCKETS];
+static struct futex_waiter waiters[FUTEX_WAITERS];
+
+static inline struct futex_waiter **
+bucket_of (uint64_t *space, uintptr_t addr)
+{
+  uint64_t key = (addr >> 2) ^ ((uintptr_t)space >> 12);
+  return &buckets[(key * 0x9E3779B97F4A7C15ULL) >> (64 - FUTEX_HASH_BITS)];
+}
+
+// The word must be aligned and mapped for user access
+static int
+valid_address (volatile uint32_t *addr)
+{
+  uintptr_t va = (uintptr_t)addr;
+  return va && !(va & 3)
+         && paging_user_range (paging_current (), va, sizeof (*addr), 0);
+}
+
+static void
+dequeue (struct futex_waiter **bucket, struct futex_waiter *waiter)
+{
+  for (struct futex_waiter **link = bucket; *link; link = &(*link)->next)
+    {
+      if (*link == waiter)
+        {
+          *link = waiter->next;
+          return;
+        }
+    }
+}
+
+/**
+ * @brief Sleeps until woken on addr, if *addr still equals val.
+ *
+ * @return 0 once woken, FUTEX_ERR_AGAIN if the value had changed, or
+ *         FUTEX_ERR_INVAL for an unaligned address or one not mapped
+ *         for user access.
+ */
+int
+futex_wait (volatile uint32_t *addr, uint32_t val)
+{
+  uint64_t pid = current_process_id ();
+  if (!valid_address (addr) || pid >= FUTEX_WAITERS)
+    return FUTEX_ERR_INVAL;
+
+  uint64_t *space = paging_current ();
+  struct futex_waiter **bucket = bucket_of (space, (uintptr_t)addr);
+  struct futex_waiter *self = &waiters[pid];
+
+  uint64_t flags = irq_save ();
+  if (__atomic_load_n (addr, __ATOMIC_ACQUIRE) != val)
+    {
+      irq_restore (flags);
+      return FUTEX_ERR_AGAIN;
+    }
+
+  self->space = space;
+  self->addr = (uintptr_t)addr;
+  self->pid = pid;
+  self->woken = 0;
+  self->next = *bucket;
+  *bucket = self;
+
+  while (!self->woken)
+    block_current ();
+  irq_restore (flags);
+  return 0;
+}
+
+/**
+ * @brief Wakes up to count waiters on addr in the caller's address space.
+ *
+ * @return The number woken, or FUTEX_ERR_INVAL.
+ */
+int
+futex_wake (volatile uint32_t *addr, uint32_t count)
+{
+  if (!valid_address (addr))
+    return FUTEX_ERR_INVAL;
+
+  uint64_t *space = paging_current ();
+  struct futex_waiter **bucket = bucket_of (space, (uintptr_t)addr);
+  int woken = 0;
+
+  uint64_t flags = irq_save ();
+  struct futex_waiter *waiter = *bucket;
+  while (waiter && (uint32_t)woken < count)
+    {
+      struct futex_waiter *next = waiter->next;
+      if (waiter->space == space && waiter->addr == (uintptr_t)addr)
+        {
+          dequeue (bucket, waiter);
+          waiter->woken = 1;
+          wake_process (waiter->pid);
+          woken++;
+        }
+      waiter = next;
+    }
+  irq_restore (flags);
+  return woken;
+}
+
+// arg1 is the address, arg2 the FUTEX_* operation and arg3 its value;
+// errors are returned as the negative FUTEX_ERR_* value
+static uint64_t
+sys_futex (SYSCALL_PARAMS)
+{
+  volatile uint32_t *addr = (volatile uint32_t *)arg1;
+
+  switch (arg2)
+    {
+    case FUTEX_WAIT:
+      return (uint64_t)(int64_t)futex_wait (addr, arg3);
+    case FUTEX_WAKE:
+      return (uint64_t)(int64_t)futex_wake (addr, arg3);
+    default:
+      return SYSCALL_ERROR;
+    }
+}
+
+/**
+ * @brief Registers SYS_FUTEX.
+ */
+void
+init_futex (void)
+{
+  register_syscall (SYS_FUTEX, sys_futex);
+}
@@ -0,0 +1,70 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef FUTEX_H
+#define FUTEX_H
+
+#include "syscall.h"
+#include <stdint.h>
+
+#define FUTEX_HASH_BITS 6
+#define FUTEX_WAITERS 32 // One per process
+
+// Operations for SYS_FUTEX
+#define FUTEX_WAIT 0 // Sleep if *addr still equals val
+#define FUTEX_WAKE 1 // Wake up to val waiters on addr
+
+// Error codes
+#define FUTEX_ERR_INVAL -1
+#define FUTEX_ERR_AGAIN -2 // *addr no longer held the expected value
+
+void init_futex (void);
+int futex_wait (volatile uint32_t *addr, uint32_t val);
+int futex_wake (volatile uint32_t *addr, uint32_t count);
+
+/*
+ * Mutex for user mode built on SYS_FUTEX. The word is 0 when unlocked,
+ * 1 when locked and 2 when locked with waiters, so neither lock nor
+ * unlock enters the kernel unless another process is involved.
+ */
+static inline int64_t
+futex_call (volatile uint32_t *addr, uint64_t op, uint64_t val)
+{
+  // The kernel clears the argument registers on the way out
+  int64_t ret = SYS_FUTEX;
+  asm volatile ("syscall"
+                : "+a"(ret), "+D"(addr), "+S"(op), "+d"(val)
+                :
+                : "rcx", "r11", "r8", "r9", "r10", "memory");
+  return ret;
+}
+
+static inline void
+umutex_lock (volatile uint32_t *lock)
+{
+  uint32_t c = 0;
+  if (__atomic_compare_exchange_n (lock, &c, 1, 0, __ATOMIC_ACQUIRE,
+                                   __ATOMIC_RELAXED))
+    return;
+
+  // Mark the lock contended before sleeping, so unlock wakes us
+  if (c != 2)
+    c = __atomic_exchange_n (lock, 2, __ATOMIC_ACQUIRE);
+  while (c != 0)
+    {
+      futex_call (lock, FUTEX_WAIT, 2);
+      c = __atomic_exchange_n (lock, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+static inline void
+umutex_unlock (volatile uint32_t *lock)
+{
+  if (__atomic_exchange_n (lock, 0, __ATOMIC_RELEASE) == 2)
+    futex_call (lock, FUTEX_WAKE, 1);
+}
+
+#endif
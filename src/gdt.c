@@ -9,6 +9,9 @@
 #define SYSTEM_TSS_AVAILABLE 0x9
 #define SYSTEM_TSS_BUSY 0xB
 
+#define GDT_ENTRIES 7 // The TSS descriptor takes two slots
+#define TSS_STACK_SIZE 4096
+
 struct gdt_entry
 {
   unsigned short limit_low;
@@ -17,6 +20,12 @@ struct gdt_entry
   unsigned char access;
   unsigned char granularity;
   unsigned char base_high;
+} __attribute__ ((packed));
+
+// 16-byte system descriptor, spans two GDT slots
+struct gdt_system_entry
+{
+  struct gdt_entry low;
   unsigned int base_upper; // Upper 32 bits for 64-bit base address
   unsigned int reserved;   // Must be zero
 } __attribute__ ((packed));
@@ -38,12 +47,16 @@ struct gdt_ptr
   unsigned long long base;
 } __attribute__ ((packed));
 
-// We'll need more entries for 64-bit mode
-// Null + Code + Data + User Code + User Data + TSS
-struct gdt_entry gdt[6];
+// Null + Code + Data + User Data + User Code + TSS
+// User data sits below user code because SYSRET loads SS from STAR + 8
+// and CS from STAR + 16.
+struct gdt_entry gdt[GDT_ENTRIES];
 struct gdt_ptr gdt_p;
 struct tss_entry tss;
 
+// Ring 0 stack until the first process switch or run_user sets RSP0
+static unsigned char tss_stack[TSS_STACK_SIZE] __attribute__ ((aligned (16)));
+
 /**
  * @brief Sets up a Global Descriptor Table (GDT) entry for 64-bit mode.
  *
@@ -64,12 +77,10 @@ gdt_set_entry (int num, unsigned long long base, unsigned long limit,
   gdt[num].base_low = (base & 0xFFFF);
   gdt[num].base_middle = (base >> 16) & 0xFF;
   gdt[num].base_high = (base >> 24) & 0xFF;
-  gdt[num].base_upper = (base >> 32) & 0xFFFFFFFF;
   gdt[num].limit_low = (limit & 0xFFFF);
   gdt[num].granularity = (limit >> 16) & 0x0F;
   gdt[num].granularity |= granularity & 0xF0;
   gdt[num].access = access;
-  gdt[num].reserved = 0;
 }
 
 /**
@@ -86,23 +97,25 @@ gdt_set_entry (int num, unsigned long long base, unsigned long limit,
 static void
 gdt_set_tss (int num, unsigned long long base, unsigned long limit)
 {
+  struct gdt_system_entry *entry = (struct gdt_system_entry *)&gdt[num];
+
   // Base address
-  gdt[num].base_low = base & 0xFFFF;
-  gdt[num].base_middle = (base >> 16) & 0xFF;
-  gdt[num].base_high = (base >> 24) & 0xFF;
-  gdt[num].base_upper = (base >> 32) & 0xFFFFFFFF;
+  entry->low.base_low = base & 0xFFFF;
+  entry->low.base_middle = (base >> 16) & 0xFF;
+  entry->low.base_high = (base >> 24) & 0xFF;
+  entry->base_upper = (base >> 32) & 0xFFFFFFFF;
 
   // Limit (size of TSS)
-  gdt[num].limit_low = limit & 0xFFFF;
-  gdt[num].granularity = (limit >> 16) & 0x0F;
+  entry->low.limit_low = limit & 0xFFFF;
+  entry->low.granularity = (limit >> 16) & 0x0F;
 
   // Access byte - Present, Ring 0, System Segment, Type (9 for available TSS)
-  gdt[num].access = 0x80 | (0 << 5) | SYSTEM_TSS_AVAILABLE;
+  entry->low.access = 0x80 | (0 << 5) | SYSTEM_TSS_AVAILABLE;
 
   // Granularity byte - 4KB blocks, 64-bit TSS
-  gdt[num].granularity |= 0x00; // No 4KB granularity for TSS
+  entry->low.granularity |= 0x00; // No 4KB granularity for TSS
 
-  gdt[num].reserved = 0;
+  entry->reserved = 0;
 }
 
 /**
@@ -121,7 +134,7 @@ init_tss (void)
     }
 
   // Set up privilege level 0 stack (kernel stack)
-  tss.rsp[0] = 0x200000; // Example stack address, adjust as needed
+  tss.rsp[0] = (unsigned long long)(tss_stack + TSS_STACK_SIZE);
 
   // Set up Interrupt Stack Table (if needed)
   // tss.ist[0] = 0x100000;  // Example IST address
@@ -137,14 +150,14 @@ init_tss (void)
  * - Null descriptor
  * - Kernel code segment
  * - Kernel data segment
- * - User code segment
  * - User data segment
+ * - User code segment
  * - Task State Segment
  */
 void
 init_gdt (void)
 {
-  gdt_p.limit = (sizeof (struct gdt_entry) * 6) - 1;
+  gdt_p.limit = (sizeof (struct gdt_entry) * GDT_ENTRIES) - 1;
   gdt_p.base = (unsigned long long)&gdt;
 
   // Null segment
@@ -158,13 +171,13 @@ init_gdt (void)
   // Access: Present, Ring 0, Data Segment, Read/Write
   gdt_set_entry (2, 0, 0x000FFFFF, 0x92, 0xA0);
 
-  // User code segment - 64-bit
-  // Access: Present, Ring 3, Code Segment, Executable, Read
-  gdt_set_entry (3, 0, 0x000FFFFF, 0xFA | 0x20, 0xA0);
-
   // User data segment
   // Access: Present, Ring 3, Data Segment, Read/Write
-  gdt_set_entry (4, 0, 0x000FFFFF, 0xF2, 0xA0);
+  gdt_set_entry (3, 0, 0x000FFFFF, 0xF2, 0xA0);
+
+  // User code segment - 64-bit
+  // Access: Present, Ring 3, Code Segment, Executable, Read
+  gdt_set_entry (4, 0, 0x000FFFFF, 0xFA | 0x20, 0xA0);
 
   // Initialize TSS
   init_tss ();
@@ -176,5 +189,17 @@ init_gdt (void)
   asm volatile ("lgdt (%0)" : : "r"(&gdt_p));
 
   // Load TSS
-  asm volatile ("ltr %%ax" : : "a"(0x28)); // 0x28 = TSS segment selector
+  asm volatile ("ltr %%ax" : : "a"(TSS_SELECTOR));
+}
+
+/**
+ * @brief Sets the stack loaded on an interrupt or exception from ring 3.
+ *
+ * Called on every process switch, and by run_user, so that RSP0 always
+ * points below anything the current process keeps on its kernel stack.
+ */
+void
+tss_set_kernel_stack (unsigned long long rsp)
+{
+  tss.rsp[0] = rsp;
 }
@@ -7,6 +7,13 @@
 #ifndef GDT_H
 #define GDT_H
 
+#define KERNEL_CODE_SELECTOR 0x08
+#define KERNEL_DATA_SELECTOR 0x10
+#define USER_DATA_SELECTOR 0x18
+#define USER_CODE_SELECTOR 0x20
+#define TSS_SELECTOR 0x28
+
 void init_gdt ();
+void tss_set_kernel_stack (unsigned long long rsp);
 
 #endif
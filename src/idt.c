@@ -5,8 +5,15 @@
  */
 
 #include "idt.h"
+#include "cpu.h"
+#include "gdt.h"
 #include "io.h"
-#include <stdint.h>
+#include "klog.h"
+#include "pic.h"
+#include "process.h"
+#include "softirq.h"
+#include "syscall.h"
+#include <stddef.h>
 
 struct idt_entry
 {
@@ -25,11 +32,19 @@ struct idt_ptr
   uintptr_t base; // Use uintptr_t for pointer conversion
 } __attribute__ ((packed));
 
-struct idt_entry idt[256];
+struct idt_entry idt[IDT_ENTRIES];
 struct idt_ptr idt_p;
 
-extern void timer_handler ();
-extern void keyboard_handler ();
+// Entry stubs generated in interrupts.asm
+extern uint64_t isr_stub_table[IDT_ENTRIES];
+
+// Handler per vector; the stub checks interrupt_frame_needed to decide
+// whether to build the full trap frame before dispatching.
+static void *interrupt_handlers[IDT_ENTRIES];
+static uint8_t vector_allocated[IDT_ENTRIES];
+uint8_t interrupt_frame_needed[IDT_ENTRIES];
+
+static const struct irq_chip *irq_chip = &pic_chip;
 
 void
 idt_set_entry (unsigned char num, unsigned long long base, unsigned short sel,
@@ -47,19 +62,173 @@ idt_set_entry (unsigned char num, unsigned long long base, unsigned short sel,
 void
 init_idt ()
 {
-  idt_p.limit = (sizeof (struct idt_entry) * 256) - 1;
+  idt_p.limit = (sizeof (struct idt_entry) * IDT_ENTRIES) - 1;
   idt_p.base = (uintptr_t)&idt;
 
-  for (int i = 0; i < 256; i++)
+  for (int i = 0; i < IDT_ENTRIES; i++)
     {
-      idt_set_entry (i, 0, 0, 0);
+      idt_set_entry (i, isr_stub_table[i], KERNEL_CODE_SELECTOR, 0x8E);
     }
 
-  // Set up timer interrupt handler (IRQ 0)
-  idt_set_entry (32, (unsigned long long)timer_handler, 0x08, 0x8E);
-
-  // Set up keyboard interrupt handler (IRQ 1)
-  idt_set_entry (33, (unsigned long long)keyboard_handler, 0x08, 0x8E);
+  // IRQ 0-15 at vectors 32-47
+  pic_remap (IRQ_BASE, IRQ_BASE + 8);
 
   asm volatile ("lidt (%0)" : : "r"(&idt_p));
 }
+
+static void
+install_handler (uint64_t n, void *handler, uint8_t full_frame)
+{
+  if (n >= IDT_ENTRIES)
+    return;
+
+  interrupt_handlers[n] = handler;
+  interrupt_frame_needed[n] = full_frame;
+
+  if (n >= IRQ_BASE && n < IRQ_BASE + IRQ_COUNT)
+    irq_chip->unmask (n - IRQ_BASE);
+}
+
+/**
+ * @brief Registers a short handler on the fast path.
+ *
+ * The entry stub saves only the caller-saved registers before calling
+ * handler, which is enough for any C function that does not need to
+ * inspect or change the interrupted context.
+ */
+void
+register_interrupt_handler (uint64_t n, void (*handler) (void))
+{
+  install_handler (n, handler, 0);
+}
+
+/**
+ * @brief Registers a handler that receives the full trap frame.
+ */
+void
+register_trap_handler (uint64_t n, trap_handler_t handler)
+{
+  install_handler (n, handler, 1);
+}
+
+void
+unregister_interrupt_handler (uint64_t n)
+{
+  if (n >= IDT_ENTRIES)
+    return;
+
+  if (n >= IRQ_BASE && n < IRQ_BASE + IRQ_COUNT)
+    irq_chip->mask (n - IRQ_BASE);
+
+  interrupt_handlers[n] = NULL;
+  interrupt_frame_needed[n] = 0;
+}
+
+/**
+ * @brief Switches interrupt controllers.
+ *
+ * Lines that already have handlers are unmasked on the new controller;
+ * the caller is responsible for silencing the old one.
+ */
+void
+set_irq_chip (const struct irq_chip *chip)
+{
+  irq_chip = chip;
+
+  for (int irq = 0; irq < IRQ_COUNT; irq++)
+    {
+      if (interrupt_handlers[IRQ_BASE + irq])
+        irq_chip->unmask (irq);
+    }
+}
+
+/**
+ * @brief Reserves an unused vector for a message-signalled interrupt.
+ *
+ * @return The vector, or -1 if none is left.
+ */
+int
+alloc_interrupt_vector (void)
+{
+  int vector = -1;
+  uint64_t flags = irq_save ();
+
+  for (int v = DYNAMIC_VECTOR_BASE; v < DYNAMIC_VECTOR_END; v++)
+    {
+      if (v != SYSCALL_VECTOR && !vector_allocated[v]
+          && !interrupt_handlers[v])
+        {
+          vector_allocated[v] = 1;
+          vector = v;
+          break;
+        }
+    }
+
+  irq_restore (flags);
+  return vector;
+}
+
+// Acknowledge hardware interrupts before running the handler, so a
+// handler that switches tasks does not hold off further interrupts.
+static inline void
+interrupt_ack (uint64_t vector)
+{
+  if (vector >= IRQ_BASE)
+    irq_chip->eoi (vector);
+}
+
+static void
+unhandled_exception (void)
+{
+  print_string ("Unhandled CPU exception\n");
+  klog_dump ();
+  while (1)
+    {
+      asm volatile ("cli; hlt");
+    }
+}
+
+// Work left for after a hardware interrupt's handler: deferred work,
+// then a process switch if one is due and no drain is in progress
+static inline void
+interrupt_exit (uint64_t vector)
+{
+  if (vector < IRQ_BASE)
+    return;
+
+  softirq_run ();
+  if (!softirq_active ())
+    schedule_pending ();
+}
+
+// Called from isr_common for fast-path vectors
+void
+interrupt_dispatch (uint64_t vector)
+{
+  void (*handler) (void) = interrupt_handlers[vector];
+
+  interrupt_ack (vector);
+
+  if (handler)
+    handler ();
+  else if (vector < IRQ_BASE)
+    unhandled_exception ();
+
+  interrupt_exit (vector);
+}
+
+// Called from isr_common for vectors registered with a trap handler
+void
+trap_dispatch (struct trap_frame *frame)
+{
+  trap_handler_t handler = interrupt_handlers[frame->vector];
+
+  interrupt_ack (frame->vector);
+
+  if (handler)
+    handler (frame);
+  else if (frame->vector < IRQ_BASE)
+    unhandled_exception ();
+
+  interrupt_exit (frame->vector);
+}
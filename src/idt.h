@@ -7,8 +7,50 @@
 #ifndef IDT_H
 #define IDT_H
 
+#include <stdint.h>
+
+#define IDT_ENTRIES 256
+#define IRQ_BASE 32
+#define IRQ_COUNT 16
+#define DYNAMIC_VECTOR_BASE (IRQ_BASE + IRQ_COUNT) // For MSI and the like
+#define DYNAMIC_VECTOR_END 0xF0
+#define IRQ(n) (IRQ_BASE + (n))
+
+/**
+ * Trap frame built by the common entry stub in interrupts.asm
+ * Only handlers registered with register_trap_handler get the
+ * callee-saved part; fast handlers run with just the scratch registers
+ * saved.
+ */
+struct trap_frame
+{
+  uint64_t r15, r14, r13, r12, rbp, rbx;              // Full frame only
+  uint64_t r11, r10, r9, r8, rdi, rsi, rdx, rcx, rax; // Always saved
+  uint64_t vector;
+  uint64_t error_code;
+  uint64_t rip, cs, rflags, rsp, ss; // Pushed by the CPU
+};
+
+typedef void (*trap_handler_t) (struct trap_frame *frame);
+
+/**
+ * Interrupt controller operations
+ * The PIC is used until a better controller installs itself.
+ */
+struct irq_chip
+{
+  void (*eoi) (uint64_t vector);
+  void (*mask) (uint8_t irq);
+  void (*unmask) (uint8_t irq);
+};
+
 void idt_set_entry (unsigned char num, unsigned long long base,
                     unsigned short sel, unsigned char flags);
 void init_idt ();
+void register_interrupt_handler (uint64_t n, void (*handler) (void));
+void register_trap_handler (uint64_t n, trap_handler_t handler);
+void unregister_interrupt_handler (uint64_t n);
+void set_irq_chip (const struct irq_chip *chip);
+int alloc_interrupt_vector (void);
 
 #endif
@@ -1,156 +1,95 @@
 [BITS 64]
 
-extern outb
-extern inb_asm ; Because assembly already has inb, thats why its inb_asm, no shit...
-extern memcpy
-global timer_handler
-global keyboard_handler
-global disk_handler
-
-section .bss
-buffer: resb 512
+extern interrupt_dispatch
+extern trap_dispatch
+extern interrupt_frame_needed
+global isr_stub_table
 
 section .text
 
-timer_handler:
+; One stub per vector. Each pushes a dummy error code when the CPU does
+; not push one, then the vector number, so isr_common always sees the
+; same layout.
+%assign i 0
+%rep 256
+isr_stub_%+i:
+%if !(i == 8 || (i >= 10 && i <= 14) || i == 17 || i == 21 || i == 29 || i == 30)
+    push 0
+%endif
+    push i
+    jmp isr_common
+%assign i i+1
+%endrep
+
+; Stack on entry: vector, error code, RIP, CS, RFLAGS, RSP, SS.
+; The caller-saved registers are always saved; they are all a C handler
+; may clobber. Vectors flagged in interrupt_frame_needed also get the
+; callee-saved registers, completing a struct trap_frame (idt.h).
+isr_common:
+    test qword [rsp + 24], 3 ; Saved CS, swap GS only when coming from ring 3
+    jz .kernel_entry
+    swapgs
+.kernel_entry:
+    cld
+
     push rax
-    push rbx
     push rcx
     push rdx
     push rsi
     push rdi
-    push rbp
     push r8
     push r9
     push r10
     push r11
-    push r12
-    push r13
-    push r14
-    push r15
-    
-    mov rdi, 0x20        ; First argument: port number
-    mov rsi, 0x20        ; Second argument: data
-    call outb            ; Call the outb function
 
-    pop r15
-    pop r14
-    pop r13
-    pop r12
-    pop r11
-    pop r10
-    pop r9
-    pop r8
-    pop rbp
-    pop rdi
-    pop rsi
-    pop rdx
-    pop rcx
-    pop rbx
-    pop rax
+    mov rdi, [rsp + 72]      ; Vector
+    cmp byte [interrupt_frame_needed + rdi], 0
+    jne .full_frame
 
-    iretq
+    call interrupt_dispatch
+    jmp .restore
 
-keyboard_handler:
-    push rax
+.full_frame:
     push rbx
-    push rcx
-    push rdx
-    push rsi
-    push rdi
     push rbp
-    push r8
-    push r9
-    push r10
-    push r11
     push r12
     push r13
     push r14
     push r15
 
-    mov rdi, 0x20        ; First argument: port number
-    mov rsi, 0x20        ; Second argument: data
-    call outb            ; Call the outb function
+    mov rdi, rsp
+    call trap_dispatch
 
     pop r15
     pop r14
     pop r13
     pop r12
-    pop r11
-    pop r10
-    pop r9
-    pop r8
     pop rbp
-    pop rdi
-    pop rsi
-    pop rdx
-    pop rcx
     pop rbx
-    pop rax
-
-    iretq
-
-disk_handler:
-    push rax
-    push rbx
-    push rcx
-    push rdx
-    push rsi
-    push rdi
-    push rbp
-    push r8
-    push r9
-    push r10
-    push r11
-    push r12
-    push r13
-    push r14
-    push r15
-
-    ; Step 1: Set up the disk read operation
-    mov rdi, 0x1F6       ; Command register port
-    mov rsi, 0x00        ; Dummy value to clear out the port
-    call outb            ; Send command to the port
-
-    ; Step 2: Wait for the disk to be ready
-.wait_for_ready:
-    call inb_asm         ; Read the status register
-    test al, 0x08        ; Check if the DRDY bit is set
-    jz .wait_for_ready    ; Loop until the disk is ready
-
-    ; Step 3: Send the read command
-    mov rdi, 0x1F7       ; Command register port for reading
-    mov rsi, 0x20        ; Read command (e.g., READ_SECTOR)
-    call outb            ; Send read command
-
-    ; Step 4: Read the data from the disk
-    mov rdi, 0x1F0       ; Data register port
-    mov rsi, buffer      ; Buffer to store read data
-    mov rcx, 256         ; Number of words to read (512 bytes)
-.read_data:
-    call inb_asm         ; Read a word from the data register
-    mov [rsi], ax        ; Store the word in the buffer
-    add rsi, 2           ; Move to the next word in the buffer
-    loop .read_data      ; Repeat for the specified number of words
 
-    ; Step 5: Handle errors if necessary
-    ; (Add error handling code based on your requirements)
-
-    ; Step 6: Clean up and finish
-    pop r15
-    pop r14
-    pop r13
-    pop r12
+.restore:
     pop r11
     pop r10
     pop r9
     pop r8
-    pop rbp
     pop rdi
     pop rsi
     pop rdx
     pop rcx
-    pop rbx
     pop rax
 
+    test qword [rsp + 24], 3
+    jz .kernel_exit
+    swapgs
+.kernel_exit:
+    add rsp, 16              ; Drop vector and error code
     iretq
+
+section .data
+
+isr_stub_table:
+%assign i 0
+%rep 256
+    dq isr_stub_%+i
+%assign i i+1
+%endrep
@@ -5,26 +5,22 @@
  */
 
 #include "io.h"
+#include "drivers/console.h"
+#include "drivers/serial.h"
+#include "paging.h"
+#include "syscall.h"
+#include <stddef.h>
 #include <stdint.h>
 
-#define SERIAL_PORT 0x3F8
-#define VGA_MEMORY 0xB8000
-#define VGA_WIDTH 80
-#define VGA_HEIGHT 25
-#define WHITE_ON_BLACK 0x0F
-#define BLACK_ON_WHITE 0xF0
-
-unsigned short *vga_buffer = (unsigned short *)VGA_MEMORY;
-int cursor_x = 0;
-int cursor_y = 0;
+#define STDOUT_FD 1
+#define STDERR_FD 2
 
 // Function prototypes
 void clear_screen ();
 void update_cursor ();
 void echo_input ();
-unsigned char read_serial ();
-void write_serial (unsigned char data);
 void init_memory_mapped_io ();
+static uint64_t sys_write (SYSCALL_PARAMS);
 
 void
 outb (unsigned short port, unsigned char data)
@@ -40,132 +36,132 @@ inb (unsigned short port)
   return result;
 }
 
-unsigned char
-inb_asm (
-    unsigned short port) //  This is a stupid duplicate of inb, i had
-                         // to rename it so its aviable in assembly. fuck...
-{
-  unsigned char result;
-  asm volatile ("inb %1, %0" : "=a"(result) : "Nd"(port));
-  return result;
-}
-
 void
 outw (unsigned short port, unsigned short data)
 {
-  __asm__ volatile ("outw %0, %1" : : "a"(data), "Nd"(port));
+  asm volatile ("outw %0, %1" : : "a"(data), "Nd"(port));
 }
 
 unsigned short
 inw (unsigned short port)
 {
   unsigned short ret;
-  __asm__ volatile ("inw %1, %0" : "=a"(ret) : "Nd"(port));
+  asm volatile ("inw %1, %0" : "=a"(ret) : "Nd"(port));
+  return ret;
+}
+
+void
+outl (unsigned short port, uint32_t data)
+{
+  asm volatile ("outl %0, %1" : : "a"(data), "Nd"(port));
+}
+
+uint32_t
+inl (unsigned short port)
+{
+  uint32_t ret;
+  asm volatile ("inl %1, %0" : "=a"(ret) : "Nd"(port));
   return ret;
 }
 
+// Read count 16-bit words from a port in one string instruction
+void
+insw (unsigned short port, void *buffer, uint32_t count)
+{
+  uint64_t words = count; // rep counts in the full RCX
+  asm volatile ("rep insw"
+                : "+D"(buffer), "+c"(words)
+                : "d"(port)
+                : "memory");
+}
+
+// Write count 16-bit words to a port in one string instruction
+void
+outsw (unsigned short port, const void *buffer, uint32_t count)
+{
+  uint64_t words = count;
+  asm volatile ("rep outsw"
+                : "+S"(buffer), "+c"(words)
+                : "d"(port)
+                : "memory");
+}
+
 void
 init_io ()
 {
-  outb (SERIAL_PORT + 1, 0x00); // Disable all interrupts
-  outb (SERIAL_PORT + 3, 0x80); // Enable DLAB (set baud rate)
-  outb (SERIAL_PORT + 0, 0x03); // Set baud rate to 38400 (lo byte)
-  outb (SERIAL_PORT + 1, 0x00); // (hi byte)
-  outb (SERIAL_PORT + 3, 0x03); // 8 bits, no parity, one stop bit
-  outb (SERIAL_PORT + 2,
-        0xC7); // Enable FIFO, clear them, with 14-byte threshold
-  outb (SERIAL_PORT + 4, 0x0B); // IRQs enabled, RTS/DSR set
-  clear_screen ();              // Clear screen at startup
+  init_serial (SERIAL_DEFAULT_BAUD); // Interrupt-driven COM1
+  clear_screen ();                   // Clear screen at startup
+  register_syscall (SYS_WRITE, sys_write);
+}
+
+// SYS_WRITE: arg1 = fd, arg2 = buffer, arg3 = length. Standard output
+// and standard error both go to the console.
+static uint64_t
+sys_write (SYSCALL_PARAMS)
+{
+  if ((arg1 != STDOUT_FD && arg1 != STDERR_FD)
+      || !paging_user_range (paging_current (), arg2, arg3, 0))
+    return SYSCALL_ERROR;
+
+  console_write ((const char *)arg2, arg3);
+  return arg3;
 }
 
 void
 clear_screen ()
 {
-  for (int y = 0; y < VGA_HEIGHT; y++)
-    {
-      for (int x = 0; x < VGA_WIDTH; x++)
-        {
-          vga_buffer[y * VGA_WIDTH + x]
-              = (WHITE_ON_BLACK << 8) | ' '; // White space
-        }
-    }
-  cursor_x = 0;
-  cursor_y = 0;
-  update_cursor ();
+  console_clear ();
 }
 
 void
 update_cursor ()
 {
-  unsigned short pos = cursor_y * VGA_WIDTH + cursor_x;
-  outb (0x3D4, 0x0F); // Set cursor location high byte
-  outb (0x3D5, (pos >> 8) & 0xFF);
-  outb (0x3D4, 0x0E); // Set cursor location low byte
-  outb (0x3D5, pos & 0xFF);
+  console_flush ();
 }
 
 void
 print_char (char c)
 {
-  if (c == '\n')
-    {
-      cursor_x = 0;
-      cursor_y++;
-    }
-  else if (c == '\b')
-    {
-      if (cursor_x > 0)
-        {
-          cursor_x--;
-        }
-      vga_buffer[cursor_y * VGA_WIDTH + cursor_x]
-          = (WHITE_ON_BLACK << 8) | ' ';
-    }
-  else
-    {
-      vga_buffer[cursor_y * VGA_WIDTH + cursor_x]
-          = (WHITE_ON_BLACK << 8) | c; // White character
-      cursor_x++;
-    }
+  console_putc (c);
+}
 
-  if (cursor_x >= VGA_WIDTH)
-    {
-      cursor_x = 0;
-      cursor_y++;
-    }
+void
+print_string (const char *str)
+{
+  size_t len = 0;
+  while (str[len])
+    len++;
+  console_write (str, len); // One flush for the whole string
+}
 
-  if (cursor_y >= VGA_HEIGHT)
+void
+print_number (uint64_t num)
+{
+  char digits[20];
+  int n = sizeof (digits);
+  do
     {
-      cursor_y = VGA_HEIGHT - 1; // Keep in bounds
-      for (int y = 0; y < VGA_HEIGHT - 1; y++)
-        {
-          for (int x = 0; x < VGA_WIDTH; x++)
-            {
-              vga_buffer[y * VGA_WIDTH + x]
-                  = vga_buffer[(y + 1) * VGA_WIDTH + x]; // Scroll up
-            }
-        }
-      for (int x = 0; x < VGA_WIDTH; x++)
-        {
-          vga_buffer[(VGA_HEIGHT - 1) * VGA_WIDTH + x]
-              = (WHITE_ON_BLACK << 8) | ' '; // Clear last line
-        }
+      digits[--n] = '0' + num % 10;
+      num /= 10;
     }
-
-  update_cursor ();
+  while (num);
+  console_write (digits + n, sizeof (digits) - n);
 }
 
-#define VGA_BUFFER (0xB8000)
-
 void
-print_string (const char *str)
+print_hex (uint64_t num)
 {
-  char *vga_buffer = (char *)VGA_BUFFER;
-  while (*str)
+  char digits[18];
+  int n = sizeof (digits);
+  do
     {
-      *vga_buffer++ = *str++;
-      *vga_buffer++ = 0x07; // Light grey on black
+      digits[--n] = "0123456789ABCDEF"[num & 0xF];
+      num >>= 4;
     }
+  while (num);
+  digits[--n] = 'x';
+  digits[--n] = '0';
+  console_write (digits + n, sizeof (digits) - n);
 }
 
 void
@@ -175,6 +171,7 @@ echo_input ()
     {
       unsigned char c = read_serial (); // Wait for input
       print_char (c);                   // Echo character back to screen
+      update_cursor ();                 // Show it without waiting for '\n'
       write_serial (c); // Send character back through serial port
     }
 }
@@ -186,22 +183,6 @@ delay (int ms)
     ;
 }
 
-unsigned char
-read_serial ()
-{
-  while ((inb (SERIAL_PORT + 5) & 1) == 0)
-    ; // Wait for data
-  return inb (SERIAL_PORT);
-}
-
-void
-write_serial (unsigned char data)
-{
-  while ((inb (SERIAL_PORT + 5) & 0x20) == 0)
-    ; // Wait for the Transmitter Holding Register to be empty
-  outb (SERIAL_PORT, data);
-}
-
 void
 init_memory_mapped_io ()
 {
@@ -14,6 +14,10 @@ void outb (unsigned short port, unsigned char data);
 unsigned char inb (unsigned short port);
 void outw (unsigned short port, unsigned short data);
 unsigned short inw (unsigned short port);
+void outl (unsigned short port, uint32_t data);
+uint32_t inl (unsigned short port);
+void insw (unsigned short port, void *buffer, uint32_t count);
+void outsw (unsigned short port, const void *buffer, uint32_t count);
 void write_memory (uintptr_t address, unsigned char value);
 unsigned char read_memory (uintptr_t address);
 void print_string (const char *str);
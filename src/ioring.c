@@ -0,0 +1,339 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "ioring.h"
+#include "cpu.h"
+#include "drivers/disk.h"
+#include "memory.h"
+#include "paging.h"
+#include "process.h"
+#include "syscall.h"
+#include <stddef.h>
+
+// User address of the first ring page, one page per ring
+#define IORING_USER_BASE 0x00007FFFD0000000ULL
+#define IORING_IDLE_SPINS 1024
+
+_Static_assert (sizeof (struct ioring_shared) <= PAGE_SIZE,
+                "ioring_shared must fit in one page");
+
+/**
+ * Kernel-private ring state
+ * Indices the kernel owns are kept here and only mirrored into the shared
+ * page, so a process cannot make the kernel skip or replay entries. A
+ * ring belongs to the process that set it up, and the buffers in its
+ * entries are addresses in that process's address space.
+ */
+struct ioring
+{
+  struct ioring_shared *shared; // Kernel alias of the ring page
+  uint64_t owner;               // Pid of the process that set it up
+  uint64_t *space;              // Its address space
+  uint32_t sq_head;
+  uint32_t cq_tail;
+  uint32_t flags;
+  uint8_t in_use;
+  volatile uint8_t busy; // The poller is working in space
+};
+
+static struct ioring rings[IORING_MAX_RINGS];
+static uint8_t poller_started = 0;
+
+static int64_t
+ioring_rw (const struct ioring_sqe *sqe)
+{
+  void *buffer = (void *)(uintptr_t)sqe->addr;
+  uint64_t bytes = (uint64_t)sqe->count * SECTOR_SIZE;
+
+  // READ stores into the buffer, so it must be writable by the process
+  if (!paging_user_range (paging_current (), sqe->addr, bytes,
+                          sqe->opcode == IORING_OP_READ))
+    return -1;
+
+  int ret = sqe->opcode == IORING_OP_READ
+                ? disk_read (sqe->lba, sqe->count, buffer)
+                : disk_write (sqe->lba, sqe->count, buffer);
+
+  return ret < 0 ? ret : (int64_t)sqe->count;
+}
+
+static int64_t
+ioring_execute (const struct ioring_sqe *sqe)
+{
+  switch (sqe->opcode)
+    {
+    case IORING_OP_NOP:
+      return 0;
+    case IORING_OP_READ:
+    case IORING_OP_WRITE:
+      return ioring_rw (sqe);
+    case IORING_OP_SYSCALL:
+      // Calls that leave the current context cannot run from a ring
+      if (sqe->lba == SYS_EXIT || sqe->lba == SYS_IORING_ENTER)
+        return -1;
+      return (int64_t)handle_syscall (sqe->lba, sqe->args[0], sqe->args[1],
+                                      sqe->args[2], sqe->args[3], 0, 0);
+    default:
+      return -1;
+    }
+}
+
+/**
+ * @brief Consumes up to max submissions and posts their completions.
+ *
+ * Stops early when the completion queue is full; the remaining entries
+ * stay queued until the process reaps completions.
+ *
+ * @return Number of submissions consumed.
+ */
+static uint32_t
+ioring_process (struct ioring *ring, uint32_t max)
+{
+  struct ioring_shared *shared = ring->shared;
+  uint32_t tail = __atomic_load_n (&shared->sq_tail, __ATOMIC_ACQUIRE);
+  uint32_t pending = tail - ring->sq_head;
+  uint32_t done = 0;
+
+  if (pending > IORING_SQ_ENTRIES)
+    pending = IORING_SQ_ENTRIES;
+  if (pending > max)
+    pending = max;
+
+  while (done < pending)
+    {
+      uint32_t cq_head = __atomic_load_n (&shared->cq_head, __ATOMIC_ACQUIRE);
+      if (ring->cq_tail - cq_head >= IORING_CQ_ENTRIES)
+        break;
+
+      // Copy the entry so the process cannot change it mid-operation
+      struct ioring_sqe sqe
+          = shared->sq[ring->sq_head & (IORING_SQ_ENTRIES - 1)];
+      ring->sq_head++;
+      __atomic_store_n (&shared->sq_head, ring->sq_head, __ATOMIC_RELEASE);
+
+      struct ioring_cqe *cqe
+          = &shared->cq[ring->cq_tail & (IORING_CQ_ENTRIES - 1)];
+      cqe->user_data = sqe.user_data;
+      cqe->result = ioring_execute (&sqe);
+      ring->cq_tail++;
+      __atomic_store_n (&shared->cq_tail, ring->cq_tail, __ATOMIC_RELEASE);
+
+      done++;
+    }
+
+  return done;
+}
+
+// The calling process's ring at a user address, or NULL
+static struct ioring *
+ioring_from_user (uint64_t addr)
+{
+  uint64_t index = (addr - IORING_USER_BASE) / PAGE_SIZE;
+
+  if (addr < IORING_USER_BASE || (addr & (PAGE_SIZE - 1))
+      || index >= IORING_MAX_RINGS || !rings[index].in_use
+      || rings[index].owner != current_process_id ()
+      || rings[index].space != paging_current ())
+    {
+      return NULL;
+    }
+
+  return &rings[index];
+}
+
+/**
+ * @brief Runs one pass over every SQPOLL ring.
+ *
+ * Each ring with pending submissions is processed in its owner's
+ * address space, which stays loaded if the poller blocks on I/O.
+ *
+ * @return Number of submissions consumed.
+ */
+int
+ioring_poll (void)
+{
+  int done = 0;
+
+  for (int i = 0; i < IORING_MAX_RINGS; i++)
+    {
+      struct ioring *ring = &rings[i];
+      uint64_t flags = irq_save ();
+
+      if (!ring->in_use || !(ring->flags & IORING_SETUP_SQPOLL)
+          || __atomic_load_n (&ring->shared->sq_tail, __ATOMIC_ACQUIRE)
+                 == ring->sq_head)
+        {
+          irq_restore (flags);
+          continue;
+        }
+      ring->busy = 1; // Holds off ioring_exit until the batch is done
+      irq_restore (flags);
+
+      uint64_t *own = process_use_space (ring->space);
+      done += ioring_process (ring, IORING_SQ_ENTRIES);
+      process_use_space (own);
+      ring->busy = 0;
+    }
+
+  return done;
+}
+
+static void
+ioring_set_need_wakeup (uint32_t set)
+{
+  uint64_t flags = irq_save ();
+
+  for (int i = 0; i < IORING_MAX_RINGS; i++)
+    {
+      if (!rings[i].in_use || !(rings[i].flags & IORING_SETUP_SQPOLL))
+        continue;
+
+      if (set)
+        rings[i].shared->flags |= IORING_NEED_WAKEUP;
+      else
+        rings[i].shared->flags &= ~IORING_NEED_WAKEUP;
+    }
+
+  irq_restore (flags);
+}
+
+// Kernel poller process for SQPOLL rings
+static void
+ioring_poller (void)
+{
+  uint32_t idle = 0;
+
+  while (1)
+    {
+      if (ioring_poll ())
+        {
+          idle = 0;
+          continue;
+        }
+
+      if (++idle < IORING_IDLE_SPINS)
+        {
+          asm volatile ("pause");
+          continue;
+        }
+
+      // Sleep until the next interrupt; processes call ioring_enter
+      // meanwhile if they cannot wait for the next tick
+      ioring_set_need_wakeup (1);
+      asm volatile ("hlt");
+      ioring_set_need_wakeup (0);
+      idle = 0;
+    }
+}
+
+/**
+ * @brief SYS_IORING_SETUP: creates a ring and maps it into user space.
+ *
+ * @param arg1 IORING_SETUP_* flags.
+ *
+ * @return The user address of the shared ring page, or SYSCALL_ERROR.
+ */
+static uint64_t
+sys_ioring_setup (SYSCALL_PARAMS)
+{
+  for (int i = 0; i < IORING_MAX_RINGS; i++)
+    {
+      if (rings[i].in_use)
+        continue;
+
+      struct ioring_shared *shared = alloc_page ();
+      if (!shared)
+        return SYSCALL_ERROR;
+
+      uint64_t user = IORING_USER_BASE + i * PAGE_SIZE;
+      uint64_t *pml4 = paging_current ();
+      if (paging_map (pml4, user,
+                      paging_virt_to_phys (pml4, (uintptr_t)shared),
+                      PAGE_USER | PAGE_WRITABLE | PAGE_NOCOW)
+          < 0)
+        {
+          free_page (shared);
+          return SYSCALL_ERROR;
+        }
+
+      rings[i].shared = shared;
+      rings[i].owner = current_process_id ();
+      rings[i].space = pml4;
+      rings[i].sq_head = 0;
+      rings[i].cq_tail = 0;
+      rings[i].flags = arg1;
+      rings[i].in_use = 1;
+
+      if ((arg1 & IORING_SETUP_SQPOLL) && !poller_started)
+        {
+          poller_started = 1;
+          create_process (ioring_poller);
+        }
+
+      return user;
+    }
+
+  return SYSCALL_ERROR;
+}
+
+/**
+ * @brief SYS_IORING_ENTER: submits queued entries with one kernel entry.
+ *
+ * @param arg1 User address returned by SYS_IORING_SETUP.
+ * @param arg2 Maximum number of submissions to consume.
+ *
+ * @return Number of submissions consumed, or SYSCALL_ERROR.
+ */
+static uint64_t
+sys_ioring_enter (SYSCALL_PARAMS)
+{
+  struct ioring *ring = ioring_from_user (arg1);
+  if (!ring)
+    return SYSCALL_ERROR;
+
+  return ioring_process (ring, arg2);
+}
+
+/**
+ * @brief Releases the calling process's rings; called as it exits.
+ *
+ * Waits for the poller to finish a batch in the process's address
+ * space before the ring page is unmapped from it and freed.
+ */
+void
+ioring_exit (void)
+{
+  uint64_t flags = irq_save ();
+  uint64_t pid = current_process_id ();
+
+  for (int i = 0; i < IORING_MAX_RINGS; i++)
+    {
+      struct ioring *ring = &rings[i];
+      if (!ring->in_use || ring->owner != pid)
+        continue;
+
+      while (ring->busy)
+        {
+          schedule ();
+          if (ring->busy)
+            asm volatile ("sti; hlt; cli" : : : "memory");
+        }
+
+      paging_unmap (ring->space, IORING_USER_BASE + i * PAGE_SIZE);
+      free_page (ring->shared);
+      ring->shared = NULL;
+      ring->in_use = 0;
+    }
+
+  irq_restore (flags);
+}
+
+void
+init_ioring (void)
+{
+  register_syscall (SYS_IORING_SETUP, sys_ioring_setup);
+  register_syscall (SYS_IORING_ENTER, sys_ioring_enter);
+}
@@ -0,0 +1,116 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef IORING_H
+#define IORING_H
+
+#include <stdint.h>
+
+#define IORING_SQ_ENTRIES 32
+#define IORING_CQ_ENTRIES 64
+#define IORING_MAX_RINGS 8
+
+// Setup flags
+#define IORING_SETUP_SQPOLL (1 << 0) // A kernel poller consumes the SQ
+
+// Shared ring flags, set by the kernel
+#define IORING_NEED_WAKEUP (1 << 0) // Poller is idle, use ioring_enter
+
+// Operations
+#define IORING_OP_NOP 0
+#define IORING_OP_READ 1    // Read count sectors at lba into addr
+#define IORING_OP_WRITE 2   // Write count sectors from addr to lba
+#define IORING_OP_SYSCALL 3 // handle_syscall (lba, args[0..3])
+
+/**
+ * Submission queue entry
+ */
+struct ioring_sqe
+{
+  uint8_t opcode;
+  uint8_t flags;
+  uint16_t reserved;
+  uint32_t count;     // Sector count for READ/WRITE
+  uint64_t lba;       // First sector, or the system call number
+  uint64_t addr;      // Data buffer for READ/WRITE
+  uint64_t args[4];   // System call arguments
+  uint64_t user_data; // Passed back unchanged in the completion
+};
+
+/**
+ * Completion queue entry
+ */
+struct ioring_cqe
+{
+  uint64_t user_data;
+  int64_t result; // Sectors transferred, syscall result or negative error
+};
+
+/**
+ * Ring page shared between a process and the kernel
+ * The process produces at sq_tail and consumes at cq_head, the kernel
+ * consumes at sq_head and produces at cq_tail. Indices run freely and
+ * are masked on access.
+ */
+struct ioring_shared
+{
+  volatile uint32_t sq_head;
+  volatile uint32_t sq_tail;
+  volatile uint32_t cq_head;
+  volatile uint32_t cq_tail;
+  volatile uint32_t flags;
+  uint32_t reserved[3];
+  struct ioring_sqe sq[IORING_SQ_ENTRIES];
+  struct ioring_cqe cq[IORING_CQ_ENTRIES];
+};
+
+void init_ioring (void);
+int ioring_poll (void);
+void ioring_exit (void);
+
+/**
+ * Get the next free submission entry, or NULL if the queue is full
+ * The entry becomes visible to the kernel on ioring_sqe_commit.
+ */
+static inline struct ioring_sqe *
+ioring_sqe_next (struct ioring_shared *ring)
+{
+  uint32_t head = __atomic_load_n (&ring->sq_head, __ATOMIC_ACQUIRE);
+  uint32_t tail = ring->sq_tail;
+
+  if (tail - head >= IORING_SQ_ENTRIES)
+    return 0;
+  return &ring->sq[tail & (IORING_SQ_ENTRIES - 1)];
+}
+
+static inline void
+ioring_sqe_commit (struct ioring_shared *ring)
+{
+  __atomic_store_n (&ring->sq_tail, ring->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Peek at the oldest completion without entering the kernel
+ * @return The completion or NULL if none is pending
+ */
+static inline struct ioring_cqe *
+ioring_cqe_peek (struct ioring_shared *ring)
+{
+  uint32_t tail = __atomic_load_n (&ring->cq_tail, __ATOMIC_ACQUIRE);
+  uint32_t head = ring->cq_head;
+
+  if (head == tail)
+    return 0;
+  return &ring->cq[head & (IORING_CQ_ENTRIES - 1)];
+}
+
+static inline void
+ioring_cqe_seen (struct ioring_shared *ring)
+{
+  __atomic_store_n (&ring->cq_head, ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,568 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "ipc.h"
+#include "cpu.h"
+#include "memory.h"
+#include "paging.h"
+#include "process.h"
+#include "syscall.h"
+#include <stddef.h>
+
+#define BUF_SLOT_SIZE ((uint64_t)IPC_BUF_MAX_PAGES * PAGE_SIZE)
+
+/*
+ * Channels. A channel has two ends, and each end reads from its own
+ * ring that the other end writes to. Handles are channel * 2 + side.
+ *
+ * The rings are bounded multi-producer multi-consumer queues: every
+ * cell carries a sequence number that tells producers and consumers
+ * whose turn it is, so sending and receiving take no lock and an end
+ * may be shared by several processes.
+ *
+ * Large payloads are never copied. Buffers live in fixed slots of
+ * IPC_BUF_MAX_PAGES pages; sending one moves its page table entries to
+ * a free slot and hands the receiver the new address.
+ */
+struct ipc_cell
+{
+  volatile uint32_t seq;
+  struct ipc_msg msg;
+};
+
+struct ipc_ring
+{
+  volatile uint32_t head; // Next cell to consume
+  volatile uint32_t tail; // Next cell to produce
+  // Processes blocked on this ring, one bit per pid
+  volatile uint32_t recv_waiters;
+  volatile uint32_t send_waiters;
+  struct ipc_cell cells[IPC_RING_SIZE];
+};
+
+struct ipc_channel
+{
+  struct ipc_ring rings[2]; // Indexed by the receiving side
+  volatile uint8_t open[2];
+  volatile uint8_t ends; // Ends still open
+  uint8_t in_use;
+};
+
+static struct ipc_channel channels[IPC_MAX_CHANNELS];
+static uint8_t buf_pages[IPC_BUF_SLOTS]; // 0 for a free slot
+
+static inline uintptr_t
+slot_addr (int slot)
+{
+  return IPC_BUF_BASE + slot * BUF_SLOT_SIZE;
+}
+
+// Slot of a buffer address, or -1 if it is not an allocated buffer
+static int
+slot_of (uint64_t addr)
+{
+  if (addr < IPC_BUF_BASE || (addr - IPC_BUF_BASE) % BUF_SLOT_SIZE)
+    return -1;
+
+  uint64_t slot = (addr - IPC_BUF_BASE) / BUF_SLOT_SIZE;
+  if (slot >= IPC_BUF_SLOTS || !buf_pages[slot])
+    return -1;
+  return slot;
+}
+
+static int
+claim_slot (uint32_t pages)
+{
+  for (int i = 0; i < IPC_BUF_SLOTS; i++)
+    {
+      uint8_t free = 0;
+      if (__atomic_compare_exchange_n (&buf_pages[i], &free, pages, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return i;
+    }
+  return -1;
+}
+
+// Moves a buffer's pages to another slot; cannot fail, see init_ipc.
+// The old slot stays reserved until the caller releases it.
+static void
+move_pages (int from, int to)
+{
+  uint64_t *pml4 = paging_current ();
+
+  for (uint32_t i = 0; i < buf_pages[from]; i++)
+    {
+      uintptr_t src = slot_addr (from) + i * PAGE_SIZE;
+      uint64_t *pte = paging_lookup (pml4, src);
+      paging_map (pml4, slot_addr (to) + i * PAGE_SIZE,
+                  *pte & PAGE_ADDR_MASK, PAGE_USER | PAGE_WRITABLE);
+      paging_unmap (pml4, src);
+    }
+}
+
+static void
+free_slot (int slot)
+{
+  uint64_t *pml4 = paging_current ();
+
+  for (uint32_t i = 0; i < buf_pages[slot]; i++)
+    {
+      uintptr_t va = slot_addr (slot) + i * PAGE_SIZE;
+      uint64_t *pte = paging_lookup (pml4, va);
+      void *page = (void *)(uintptr_t)(*pte & PAGE_ADDR_MASK);
+      paging_unmap (pml4, va);
+      free_page (page);
+    }
+  __atomic_store_n (&buf_pages[slot], 0, __ATOMIC_RELEASE);
+}
+
+static void
+copy_msg (struct ipc_msg *dst, const struct ipc_msg *src)
+{
+  dst->tag = src->tag;
+  dst->len = src->len;
+  dst->pages = src->pages;
+  dst->buffer = src->buffer;
+  for (uint32_t i = 0; i < src->len; i++)
+    dst->data[i] = src->data[i];
+}
+
+static void
+ring_reset (struct ipc_ring *ring)
+{
+  ring->head = 0;
+  ring->tail = 0;
+  ring->recv_waiters = 0;
+  ring->send_waiters = 0;
+  for (uint32_t i = 0; i < IPC_RING_SIZE; i++)
+    ring->cells[i].seq = i;
+}
+
+// A cell is free for position pos when its seq is pos
+static int
+ring_push (struct ipc_ring *ring, const struct ipc_msg *msg)
+{
+  uint32_t pos = __atomic_load_n (&ring->tail, __ATOMIC_RELAXED);
+
+  while (1)
+    {
+      struct ipc_cell *cell = &ring->cells[pos & (IPC_RING_SIZE - 1)];
+      uint32_t seq = __atomic_load_n (&cell->seq, __ATOMIC_ACQUIRE);
+      int32_t diff = (int32_t)(seq - pos);
+
+      if (diff < 0)
+        return 0; // Full
+      if (diff > 0)
+        pos = __atomic_load_n (&ring->tail, __ATOMIC_RELAXED);
+      else if (__atomic_compare_exchange_n (&ring->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+        {
+          copy_msg (&cell->msg, msg);
+          __atomic_store_n (&cell->seq, pos + 1, __ATOMIC_RELEASE);
+          return 1;
+        }
+    }
+}
+
+// A cell holds the message for position pos when its seq is pos + 1
+static int
+ring_pop (struct ipc_ring *ring, struct ipc_msg *msg)
+{
+  uint32_t pos = __atomic_load_n (&ring->head, __ATOMIC_RELAXED);
+
+  while (1)
+    {
+      struct ipc_cell *cell = &ring->cells[pos & (IPC_RING_SIZE - 1)];
+      uint32_t seq = __atomic_load_n (&cell->seq, __ATOMIC_ACQUIRE);
+      int32_t diff = (int32_t)(seq - (pos + 1));
+
+      if (diff < 0)
+        return 0; // Empty
+      if (diff > 0)
+        pos = __atomic_load_n (&ring->head, __ATOMIC_RELAXED);
+      else if (__atomic_compare_exchange_n (&ring->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+        {
+          copy_msg (msg, &cell->msg);
+          __atomic_store_n (&cell->seq, pos + IPC_RING_SIZE,
+                            __ATOMIC_RELEASE);
+          return 1;
+        }
+    }
+}
+
+static inline int
+ring_empty (struct ipc_ring *ring)
+{
+  uint32_t pos = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+  return ring->cells[pos & (IPC_RING_SIZE - 1)].seq != pos + 1;
+}
+
+static inline int
+ring_full (struct ipc_ring *ring)
+{
+  uint32_t pos = __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+  return ring->cells[pos & (IPC_RING_SIZE - 1)].seq != pos;
+}
+
+// Wakes every process waiting in the mask; cheap when nobody waits
+static void
+wake_all (volatile uint32_t *waiters)
+{
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  if (!__atomic_load_n (waiters, __ATOMIC_RELAXED))
+    return;
+
+  uint32_t mask = __atomic_exchange_n (waiters, 0, __ATOMIC_SEQ_CST);
+  while (mask)
+    {
+      wake_process (__builtin_ctz (mask));
+      mask &= mask - 1;
+    }
+}
+
+/*
+ * Sleeps until ready (ring) is false or the channel loses its other
+ * end. The waiter bit is published before the re-check, and wake_all
+ * fences before reading it, so a wake-up cannot slip in between.
+ */
+static void
+wait_on (volatile uint32_t *waiters, struct ipc_ring *ring,
+         int (*busy) (struct ipc_ring *), volatile uint8_t *peer_open)
+{
+  uint32_t bit = 1U << current_process_id (); // pid < MAX_PROCESSES
+
+  uint64_t flags = irq_save ();
+  __atomic_or_fetch (waiters, bit, __ATOMIC_SEQ_CST);
+  if (busy (ring) && *peer_open)
+    block_current ();
+  __atomic_and_fetch (waiters, ~bit, __ATOMIC_SEQ_CST);
+  irq_restore (flags);
+}
+
+static struct ipc_channel *
+channel_of (int end)
+{
+  if (end < 0 || end >= IPC_MAX_CHANNELS * 2)
+    return NULL;
+
+  struct ipc_channel *ch = &channels[end / 2];
+  if (!ch->in_use || !ch->open[end % 2])
+    return NULL;
+  return ch;
+}
+
+/**
+ * @brief Creates a channel.
+ *
+ * @param ends Receives the handles of the two ends.
+ *
+ * @return 0 on success, or IPC_ERR_NOMEM if every channel is in use.
+ */
+int
+ipc_channel (int ends[2])
+{
+  uint64_t flags = irq_save ();
+  for (int i = 0; i < IPC_MAX_CHANNELS; i++)
+    {
+      struct ipc_channel *ch = &channels[i];
+      if (ch->in_use)
+        continue;
+
+      ring_reset (&ch->rings[0]);
+      ring_reset (&ch->rings[1]);
+      ch->open[0] = 1;
+      ch->open[1] = 1;
+      ch->ends = 2;
+      ch->in_use = 1;
+      irq_restore (flags);
+
+      ends[0] = i * 2;
+      ends[1] = i * 2 + 1;
+      return 0;
+    }
+  irq_restore (flags);
+  return IPC_ERR_NOMEM;
+}
+
+/**
+ * @brief Sends a message to the other end of a channel.
+ *
+ * Waits while the other end's ring is full unless IPC_NONBLOCK is set.
+ * If msg->buffer is set, the buffer moves to the receiver and its old
+ * address stops being mapped.
+ *
+ * @return 0 on success, or a negative IPC_ERR_* value.
+ */
+int
+ipc_send (int end, const struct ipc_msg *msg, int flags)
+{
+  struct ipc_channel *ch = channel_of (end);
+  if (!ch || msg->len > IPC_INLINE_MAX)
+    return IPC_ERR_INVAL;
+
+  int peer = !(end % 2);
+  struct ipc_ring *ring = &ch->rings[peer];
+  struct ipc_msg out = *msg;
+  int from = -1;
+
+  if (!ch->open[peer])
+    return IPC_ERR_CLOSED;
+
+  if (msg->buffer)
+    {
+      from = slot_of (msg->buffer);
+      if (from < 0)
+        return IPC_ERR_INVAL;
+
+      int to = claim_slot (buf_pages[from]);
+      if (to < 0)
+        return IPC_ERR_NOMEM;
+
+      out.pages = buf_pages[from];
+      move_pages (from, to);
+      out.buffer = slot_addr (to);
+    }
+  else
+    out.pages = 0;
+
+  int ret = 0;
+  while (!ring_push (ring, &out))
+    {
+      if (!ch->open[peer])
+        ret = IPC_ERR_CLOSED;
+      else if (flags & IPC_NONBLOCK)
+        ret = IPC_ERR_AGAIN;
+      else
+        {
+          wait_on (&ring->send_waiters, ring, ring_full, &ch->open[peer]);
+          continue;
+        }
+
+      // Give the buffer back where the sender had it
+      if (from >= 0)
+        {
+          int to = slot_of (out.buffer);
+          move_pages (to, from);
+          __atomic_store_n (&buf_pages[to], 0, __ATOMIC_RELEASE);
+        }
+      return ret;
+    }
+
+  if (from >= 0)
+    __atomic_store_n (&buf_pages[from], 0, __ATOMIC_RELEASE);
+  wake_all (&ring->recv_waiters);
+  return 0;
+}
+
+/**
+ * @brief Receives the next message sent to an end.
+ *
+ * Waits for one unless IPC_NONBLOCK is set. An attached buffer now
+ * belongs to the caller, to send on or release with ipc_buffer_free.
+ *
+ * @return 0 on success, or a negative IPC_ERR_* value. IPC_ERR_CLOSED
+ *         is returned once the other end is closed and the ring is
+ *         drained.
+ */
+int
+ipc_recv (int end, struct ipc_msg *msg, int flags)
+{
+  struct ipc_channel *ch = channel_of (end);
+  if (!ch)
+    return IPC_ERR_INVAL;
+
+  int side = end % 2;
+  struct ipc_ring *ring = &ch->rings[side];
+
+  while (1)
+    {
+      // Sample before popping so a last message is not lost
+      int peer_open = __atomic_load_n (&ch->open[!side], __ATOMIC_ACQUIRE);
+
+      if (ring_pop (ring, msg))
+        {
+          wake_all (&ring->send_waiters);
+          return 0;
+        }
+      if (!peer_open)
+        return IPC_ERR_CLOSED;
+      if (flags & IPC_NONBLOCK)
+        return IPC_ERR_AGAIN;
+
+      wait_on (&ring->recv_waiters, ring, ring_empty, &ch->open[!side]);
+    }
+}
+
+/**
+ * @brief Closes one end of a channel.
+ *
+ * Processes waiting on the other end are woken and see IPC_ERR_CLOSED.
+ * Once both ends are closed, buffers still queued are freed and the
+ * channel is reused. No process may still be using the end.
+ *
+ * @return 0 on success, or IPC_ERR_INVAL.
+ */
+int
+ipc_close (int end)
+{
+  struct ipc_channel *ch = channel_of (end);
+  if (!ch)
+    return IPC_ERR_INVAL;
+
+  int side = end % 2;
+  __atomic_store_n (&ch->open[side], 0, __ATOMIC_RELEASE);
+  wake_all (&ch->rings[!side].recv_waiters); // Peers receiving from us
+  wake_all (&ch->rings[side].send_waiters);  // Peers sending to us
+
+  // The last end to close tears the channel down
+  if (__atomic_sub_fetch (&ch->ends, 1, __ATOMIC_ACQ_REL))
+    return 0;
+
+  struct ipc_msg msg;
+  for (int i = 0; i < 2; i++)
+    {
+      while (ring_pop (&ch->rings[i], &msg))
+        {
+          if (msg.buffer)
+            free_slot (slot_of (msg.buffer));
+        }
+    }
+
+  uint64_t flags = irq_save ();
+  ch->in_use = 0;
+  irq_restore (flags);
+  return 0;
+}
+
+/**
+ * @brief Allocates a page buffer that can be sent without copying.
+ *
+ * @return The buffer, zeroed and mapped for user access, or NULL.
+ */
+void *
+ipc_buffer_alloc (uint32_t pages)
+{
+  if (!pages || pages > IPC_BUF_MAX_PAGES)
+    return NULL;
+
+  int slot = claim_slot (pages);
+  if (slot < 0)
+    return NULL;
+
+  uint64_t *pml4 = paging_current ();
+  for (uint32_t i = 0; i < pages; i++)
+    {
+      void *page = alloc_page ();
+      if (!page)
+        {
+          buf_pages[slot] = i;
+          free_slot (slot);
+          return NULL;
+        }
+      paging_map (pml4, slot_addr (slot) + i * PAGE_SIZE, (uintptr_t)page,
+                  PAGE_USER | PAGE_WRITABLE);
+    }
+  return (void *)slot_addr (slot);
+}
+
+/**
+ * @brief Frees a buffer from ipc_buffer_alloc or a received message.
+ *
+ * @return 0 on success, or IPC_ERR_INVAL.
+ */
+int
+ipc_buffer_free (void *buffer)
+{
+  int slot = slot_of ((uintptr_t)buffer);
+  if (slot < 0)
+    return IPC_ERR_INVAL;
+
+  free_slot (slot);
+  return 0;
+}
+
+// Stores the two end handles at arg1
+static uint64_t
+sys_ipc_channel (SYSCALL_PARAMS)
+{
+  if (!paging_user_range (paging_current (), arg1, 2 * sizeof (int), 1))
+    return SYSCALL_ERROR;
+  return ipc_channel ((int *)arg1) < 0 ? SYSCALL_ERROR : 0;
+}
+
+// arg1 is the end, arg2 the message and arg3 the IPC_* flags; errors
+// are returned as the negative IPC_ERR_* value
+static uint64_t
+sys_ipc_send (SYSCALL_PARAMS)
+{
+  if (!paging_user_range (paging_current (), arg2, sizeof (struct ipc_msg),
+                          0))
+    return (uint64_t)(int64_t)IPC_ERR_INVAL;
+
+  int ret = ipc_send (arg1, (const struct ipc_msg *)arg2, arg3);
+  return ret < 0 ? (uint64_t)(int64_t)ret : 0;
+}
+
+static uint64_t
+sys_ipc_recv (SYSCALL_PARAMS)
+{
+  if (!paging_user_range (paging_current (), arg2, sizeof (struct ipc_msg),
+                          1))
+    return (uint64_t)(int64_t)IPC_ERR_INVAL;
+
+  int ret = ipc_recv (arg1, (struct ipc_msg *)arg2, arg3);
+  return ret < 0 ? (uint64_t)(int64_t)ret : 0;
+}
+
+static uint64_t
+sys_ipc_close (SYSCALL_PARAMS)
+{
+  return ipc_close (arg1) < 0 ? SYSCALL_ERROR : 0;
+}
+
+// Allocates a buffer of arg1 pages and returns its address
+static uint64_t
+sys_ipc_buffer (SYSCALL_PARAMS)
+{
+  void *buffer = ipc_buffer_alloc (arg1);
+  return buffer ? (uint64_t)buffer : SYSCALL_ERROR;
+}
+
+static uint64_t
+sys_ipc_buffer_free (SYSCALL_PARAMS)
+{
+  return ipc_buffer_free ((void *)arg1) < 0 ? SYSCALL_ERROR : 0;
+}
+
+/**
+ * @brief Builds the buffer page tables and registers the system calls.
+ *
+ * Mapping every slot once leaves its page tables in place, so moving
+ * a buffer later only rewrites leaf entries and cannot run out of
+ * memory halfway, and cloned address spaces share the tables.
+ */
+void
+init_ipc (void)
+{
+  uint64_t *pml4 = paging_current ();
+
+  for (uintptr_t va = IPC_BUF_BASE;
+       va < IPC_BUF_BASE + IPC_BUF_SLOTS * BUF_SLOT_SIZE; va += PAGE_SIZE)
+    {
+      paging_map (pml4, va, 0, PAGE_USER);
+      paging_unmap (pml4, va);
+    }
+
+  register_syscall (SYS_IPC_CHANNEL, sys_ipc_channel);
+  register_syscall (SYS_IPC_SEND, sys_ipc_send);
+  register_syscall (SYS_IPC_RECV, sys_ipc_recv);
+  register_syscall (SYS_IPC_CLOSE, sys_ipc_close);
+  register_syscall (SYS_IPC_BUFFER, sys_ipc_buffer);
+  register_syscall (SYS_IPC_BUFFER_FREE, sys_ipc_buffer_free);
+}
@@ -0,0 +1,54 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef IPC_H
+#define IPC_H
+
+#include <stdint.h>
+
+#define IPC_MAX_CHANNELS 16
+#define IPC_RING_SIZE 32 // Messages queued per direction, power of two
+#define IPC_INLINE_MAX 48
+
+// Page buffers for large payloads, shared by every address space
+#define IPC_BUF_BASE 0x00007E0000000000ULL
+#define IPC_BUF_SLOTS 64
+#define IPC_BUF_MAX_PAGES 16
+
+// Flags for ipc_send and ipc_recv
+#define IPC_NONBLOCK (1 << 0) // Fail with IPC_ERR_AGAIN instead of waiting
+
+// Error codes
+#define IPC_ERR_INVAL -1
+#define IPC_ERR_AGAIN -2  // Ring full or empty with IPC_NONBLOCK
+#define IPC_ERR_CLOSED -3 // The other end was closed
+#define IPC_ERR_NOMEM -4
+
+/**
+ * One message
+ * Up to IPC_INLINE_MAX bytes travel in the ring itself. A buffer from
+ * ipc_buffer_alloc can be attached as well; its pages are moved to
+ * the receiver, who gets a new address in buffer and owns it from
+ * then on. The sender loses access to the buffer.
+ */
+struct ipc_msg
+{
+  uint32_t tag;    // Not interpreted by the kernel
+  uint16_t len;    // Bytes used in data
+  uint16_t pages;  // Size of the attached buffer, set by the kernel
+  uint64_t buffer; // Attached buffer, or 0
+  uint8_t data[IPC_INLINE_MAX];
+};
+
+void init_ipc (void);
+int ipc_channel (int ends[2]);
+int ipc_send (int end, const struct ipc_msg *msg, int flags);
+int ipc_recv (int end, struct ipc_msg *msg, int flags);
+int ipc_close (int end);
+void *ipc_buffer_alloc (uint32_t pages);
+int ipc_buffer_free (void *buffer);
+
+#endif
@@ -0,0 +1,170 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "ipcbench.h"
+#include "drivers/timer.h"
+#include "ipc.h"
+#include "klog.h"
+#include "memory.h"
+#include "process.h"
+#include "workqueue.h"
+#include <stddef.h>
+
+static const uint32_t bench_sizes[] = { 8, IPC_INLINE_MAX, PAGE_SIZE,
+                                        4 * PAGE_SIZE,
+                                        IPC_BUF_MAX_PAGES * PAGE_SIZE };
+
+static void bench_all_work (void *arg);
+static struct work bench_work = WORK_INIT (bench_all_work, 0);
+
+static int bench_end = -1; // Our end of the channel to the echo process
+static int echo_end;
+
+// Sends every message straight back, buffers included
+static void
+echo_main (void)
+{
+  struct ipc_msg msg;
+
+  while (ipc_recv (echo_end, &msg, 0) == 0)
+    ipc_send (echo_end, &msg, 0);
+
+  while (1)
+    {
+      asm volatile ("hlt");
+    }
+}
+
+static int
+start_echo (void)
+{
+  int ends[2];
+
+  if (bench_end >= 0)
+    return 0;
+  if (ipc_channel (ends) < 0)
+    return IPC_ERR_NOMEM;
+
+  bench_end = ends[0];
+  echo_end = ends[1];
+  create_process (echo_main);
+  return 0;
+}
+
+/**
+ * @brief Measures round trips of one message size through a channel.
+ *
+ * For page buffers the time to copy the payload both ways is measured
+ * too, which is what the transfer would cost without remapping.
+ *
+ * @return 0 on success, or a negative IPC_ERR_* value.
+ */
+int
+ipcbench_run (uint32_t bytes, struct ipcbench_point *point)
+{
+  struct ipc_msg msg = { 0 };
+  uint32_t pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+  int inline_data = bytes <= IPC_INLINE_MAX;
+  int ret = start_echo ();
+
+  if (ret < 0)
+    return ret;
+  if (!inline_data && pages > IPC_BUF_MAX_PAGES)
+    return IPC_ERR_INVAL;
+
+  if (inline_data)
+    msg.len = bytes;
+  else
+    {
+      msg.buffer = (uint64_t)ipc_buffer_alloc (pages);
+      if (!msg.buffer)
+        return IPC_ERR_NOMEM;
+    }
+
+  uint64_t start = read_tsc ();
+  for (uint32_t i = 0; i < IPCBENCH_ROUNDS; i++)
+    {
+      msg.tag = i;
+      ret = ipc_send (bench_end, &msg, 0);
+      if (ret == 0)
+        ret = ipc_recv (bench_end, &msg, 0);
+      if (ret < 0)
+        break;
+    }
+  uint64_t cycles = read_tsc () - start;
+  uint64_t hz = tsc_frequency ();
+
+  point->copy_ns = 0;
+  if (!inline_data && ret == 0)
+    {
+      void *copy = ipc_buffer_alloc (pages);
+      if (copy)
+        {
+          uint64_t copy_start = read_tsc ();
+          k_memcpy (copy, (void *)msg.buffer, bytes);
+          k_memcpy ((void *)msg.buffer, copy, bytes);
+          point->copy_ns = (read_tsc () - copy_start) * 1000000000 / hz;
+          ipc_buffer_free (copy);
+        }
+    }
+  // On failure the buffer may be queued; it is freed with the channel
+  if (msg.buffer && ret == 0)
+    ipc_buffer_free ((void *)msg.buffer);
+
+  point->bytes = bytes;
+  point->rounds = IPCBENCH_ROUNDS;
+  point->cycles = cycles ? cycles : 1;
+  point->rtt_ns = point->cycles / IPCBENCH_ROUNDS * 1000000000 / hz;
+  point->kib_per_sec
+      = (uint64_t)bytes * 2 * IPCBENCH_ROUNDS / 1024 * hz / point->cycles;
+  return ret;
+}
+
+/**
+ * @brief Runs every message size and logs the results.
+ */
+void
+ipcbench_suite (void)
+{
+  kprintf ("ipcbench: ping-pong, %u round trips\n", IPCBENCH_ROUNDS);
+
+  for (uint32_t s = 0; s < sizeof (bench_sizes) / sizeof (uint32_t); s++)
+    {
+      struct ipcbench_point p;
+      int ret = ipcbench_run (bench_sizes[s], &p);
+      if (ret < 0)
+        {
+          kprintf ("ipcbench: %u B failed with %d\n", bench_sizes[s], ret);
+          return;
+        }
+
+      if (p.bytes <= IPC_INLINE_MAX)
+        kprintf ("ipcbench: %6u B inline: %6lu ns rtt %8lu KiB/s\n",
+                 p.bytes, p.rtt_ns, p.kib_per_sec);
+      else
+        kprintf ("ipcbench: %6u B pages:  %6lu ns rtt %8lu KiB/s, "
+                 "copying %lu ns\n",
+                 p.bytes, p.rtt_ns, p.kib_per_sec, p.copy_ns);
+    }
+}
+
+static void
+bench_all_work (void *arg)
+{
+  ipcbench_suite ();
+}
+
+/**
+ * @brief Benchmarks the channels from a worker thread.
+ *
+ * Safe from interrupt context; results go to the kernel log. The first
+ * run starts the echo process, which then stays around.
+ */
+void
+ipcbench_start (void)
+{
+  queue_work (&bench_work);
+}
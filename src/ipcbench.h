@@ -0,0 +1,33 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef IPCBENCH_H
+#define IPCBENCH_H
+
+#include <stdint.h>
+
+#define IPCBENCH_ROUNDS 1000 // Round trips per point
+
+/**
+ * One benchmark point
+ * A message of one size sent to an echo process and back, rounds
+ * times. Payloads larger than IPC_INLINE_MAX travel as page buffers.
+ */
+struct ipcbench_point
+{
+  uint32_t bytes;
+  uint32_t rounds;
+  uint64_t cycles;
+  uint64_t rtt_ns;      // Per round trip
+  uint64_t kib_per_sec; // Payload moved, both directions
+  uint64_t copy_ns;     // Copying the payload twice instead, 0 if inline
+};
+
+int ipcbench_run (uint32_t bytes, struct ipcbench_point *point);
+void ipcbench_suite (void);
+void ipcbench_start (void);
+
+#endif
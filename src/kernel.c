@@ -3,203 +3,381 @@
  * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
  */
 
+#include "apic.h"
+#include "cpu.h"
+#include "drivers/bcache.h"
 #include "drivers/disk.h"
 #include "drivers/keyboard.h"
+#include "drivers/pci.h"
 #include "drivers/timer.h"
+#include "fpu.h"
+#include "fs.h"
+#include "futex.h"
 #include "gdt.h"
 #include "idt.h"
 #include "io.h"
+#include "ioring.h"
+#include "ipc.h"
+#include "klog.h"
 #include "memory.h"
+#include "mmap.h"
+#include "paging.h"
+#include "process.h"
+#include "syscall.h"
+#include "vtime.h"
+#include "workqueue.h"
 
 #define MAX_PROCESSES 32
-#define STACK_SIZE 4096
+#define STACK_SIZE PAGE_SIZE // One pool page, so reap can free it
 #define PROCESS_READY 1
 #define PROCESS_BLOCKED 0
+#define PROCESS_EXITED 2 // Still holds its resources until reaped
+#define PROCESS_DEAD 3   // Slot free for reuse
+#define TIMER_FREQUENCY 50
+#define IDLE_PID 0 // The boot context, run only when nothing else is ready
 
 // Forward declarations
-void init_process (void);
-extern void register_interrupt_handler (uint64_t n, void (*handler) (void));
+void kernel_timer_update (void);
+extern void switch_context (uint64_t *old_rsp, uint64_t new_rsp);
+extern void task_entry (void);
 
 // Process Control Block structure
 typedef struct
 {
   uint64_t pid;
   uint64_t rsp;
-  uint64_t rbp;
   uint64_t state;
   uint64_t time_slice;
   void *stack;
+  uint64_t kernel_rsp;      // Syscall and ring 3 interrupt stack
+  uint64_t user_return_rsp; // Frame run_user returns to, or 0
+  uint64_t *pml4;           // Address space, loaded on switch
+  struct fpu_state fpu;     // Extended register state, switched by fpu.c
 } PCB;
 
 // System state
 static PCB process_table[MAX_PROCESSES];
 static uint64_t current_pid = 0;
-static uint64_t next_pid = 1;
+static uint64_t slots_used = 1; // Slots handed out, at most MAX_PROCESSES
+static uint64_t *kernel_pml4; // Tables every created process runs on
+static volatile uint8_t need_resched; // A wake or the time slice is due
 
-// Memory management
-#define PAGE_SIZE 4096
-#define HEAP_BLOCKS 1024
-
-typedef struct
-{
-  uint64_t size;
-  uint8_t is_free;
-} memory_block_t;
-
-static memory_block_t *heap_blocks;
-static void *heap_start;
+// Process management
 
-// Initialize memory management system
-void
-init_heap ()
+// Frees what an exited process held; it must not be running
+static void
+reap (PCB *process)
 {
-  heap_start = (void *)0x100000;
-  heap_blocks = (memory_block_t *)heap_start;
-  heap_blocks[0].size = HEAP_BLOCKS * PAGE_SIZE;
-  heap_blocks[0].is_free = 1;
+  if (process->pml4 != kernel_pml4)
+    paging_destroy (process->pml4);
+  process->pml4 = NULL;
+  fpu_free_state (&process->fpu);
+  free_page (process->stack);
+  process->stack = NULL;
+  process->state = PROCESS_DEAD;
 }
 
-// Simple memory allocator
-void *
-kmalloc (size_t size)
+// A free slot, reaping exited processes along the way, or -1
+static int64_t
+free_slot (void)
 {
-  for (int i = 0; i < HEAP_BLOCKS; i++)
+  int64_t found = -1;
+
+  for (uint64_t pid = 1; pid < slots_used; pid++)
     {
-      if (heap_blocks[i].is_free && heap_blocks[i].size >= size)
-        {
-          if (heap_blocks[i].size > size + sizeof (memory_block_t))
-            {
-              uint64_t remaining
-                  = heap_blocks[i].size - size - sizeof (memory_block_t);
-              heap_blocks[i].size = size;
-
-              memory_block_t *next
-                  = (memory_block_t *)((char *)&heap_blocks[i]
-                                       + sizeof (memory_block_t) + size);
-              next->size = remaining;
-              next->is_free = 1;
-            }
-
-          heap_blocks[i].is_free = 0;
-          return (void *)((char *)&heap_blocks[i] + sizeof (memory_block_t));
-        }
+      PCB *process = &process_table[pid];
+      if (process->state == PROCESS_EXITED && pid != current_pid)
+        reap (process);
+      if (process->state == PROCESS_DEAD && found < 0)
+        found = pid;
     }
-  return NULL;
+  if (found < 0 && slots_used < MAX_PROCESSES)
+    found = slots_used;
+  return found;
 }
 
-// Process management
-void
-create_process (void (*start_routine) (void))
+static int64_t
+spawn (void (*start_routine) (void), uint64_t *pml4)
 {
-  if (next_pid >= MAX_PROCESSES)
-    return;
+  int64_t pid = free_slot ();
+  if (pid < 0)
+    return -1;
 
-  PCB *process = &process_table[next_pid];
-  process->pid = next_pid;
-  process->state = PROCESS_READY;
+  PCB *process = &process_table[pid];
+  process->pid = pid;
   process->time_slice = 100;
+  process->pml4 = pml4;
 
-  process->stack = kmalloc (STACK_SIZE);
+  process->stack = alloc_page ();
   if (!process->stack)
-    return;
+    return -1;
 
+  if (fpu_alloc_state (&process->fpu) < 0)
+    {
+      free_page (process->stack);
+      process->stack = NULL;
+      return -1;
+    }
+
+  // Initial frame for switch_context: task_entry as the return address
+  // and the callee-saved registers, with the entry point in r12
   uint64_t *stack_ptr = (uint64_t *)((char *)process->stack + STACK_SIZE);
-  *(--stack_ptr) = (uint64_t)start_routine;
-  *(--stack_ptr) = 0;
+  *(--stack_ptr) = (uint64_t)task_entry;
+  *(--stack_ptr) = 0;                       // rbx
+  *(--stack_ptr) = 0;                       // rbp
+  *(--stack_ptr) = (uint64_t)start_routine; // r12
+  *(--stack_ptr) = 0;                       // r13
+  *(--stack_ptr) = 0;                       // r14
+  *(--stack_ptr) = 0;                       // r15
 
   process->rsp = (uint64_t)stack_ptr;
-  process->rbp = (uint64_t)stack_ptr;
+  process->kernel_rsp = (uint64_t)process->stack + STACK_SIZE;
+  process->user_return_rsp = 0;
 
-  next_pid++;
+  // Only now may the scheduler pick it
+  process->state = PROCESS_READY;
+  if ((uint64_t)pid == slots_used)
+    slots_used++;
+  return pid;
 }
 
-// Simple scheduler
+void
+create_process (void (*start_routine) (void))
+{
+  spawn (start_routine, kernel_pml4);
+}
+
+/**
+ * Start a process on a copy-on-write copy of the caller's address space
+ * The child inherits every private mapping of the caller (see
+ * PAGING_PRIVATE_BASE) without copying it; a page is only copied when
+ * either side writes to it. The child runs start_routine on a fresh
+ * kernel stack, and its address space is freed after it exits.
+ * @return The child's pid, or -1 on failure
+ */
+int64_t
+clone_process (void (*start_routine) (void))
+{
+  uint64_t *pml4 = paging_clone (paging_current ());
+  if (!pml4)
+    return -1;
+
+  uint64_t flags = irq_save ();
+  int64_t pid = spawn (start_routine, pml4);
+  irq_restore (flags);
+
+  if (pid < 0)
+    paging_destroy (pml4);
+  return pid;
+}
+
+/**
+ * Switch to the next ready process, round robin
+ * The idle process only runs when nothing else is ready. Returns at
+ * once if the current process is the only one that can run, including
+ * when it is blocked and the idle process is busy with boot work.
+ */
 void
 schedule ()
 {
-  uint64_t next_process = (current_pid + 1) % next_pid;
+  uint64_t next_process = current_pid;
 
-  while (next_process != current_pid)
+  need_resched = 0;
+  for (uint64_t i = 1; i <= slots_used; i++)
     {
-      if (process_table[next_process].state == PROCESS_READY)
+      uint64_t pid = (current_pid + i) % slots_used;
+      if (pid != IDLE_PID && process_table[pid].state == PROCESS_READY)
         {
-          PCB *old = &process_table[current_pid];
-          PCB *new = &process_table[next_process];
+          next_process = pid;
+          break;
+        }
+    }
+  if (process_table[next_process].state != PROCESS_READY
+      && process_table[IDLE_PID].state == PROCESS_READY)
+    next_process = IDLE_PID;
+  if (next_process == current_pid)
+    return;
 
-          asm volatile ("mov %%rsp, %0" : "=r"(old->rsp));
-          asm volatile ("mov %%rbp, %0" : "=r"(old->rbp));
+  PCB *old = &process_table[current_pid];
+  PCB *new = &process_table[next_process];
 
-          asm volatile ("mov %0, %%rsp" ::"r"(new->rsp));
-          asm volatile ("mov %0, %%rbp" ::"r"(new->rbp));
+  // run_user keeps its state per CPU; it belongs to the process
+  struct cpu_local *cpu = this_cpu ();
+  old->kernel_rsp = cpu->kernel_rsp;
+  old->user_return_rsp = cpu->user_return_rsp;
+  cpu->kernel_rsp = new->kernel_rsp;
+  cpu->user_return_rsp = new->user_return_rsp;
+  tss_set_kernel_stack (new->kernel_rsp);
 
-          current_pid = next_process;
-          return;
-        }
-      next_process = (next_process + 1) % next_pid;
-    }
+  current_pid = next_process;
+  paging_switch (new->pml4);
+  fpu_switch (&old->fpu, &new->fpu);
+  switch_context (&old->rsp, new->rsp);
 }
 
-// System call handler
+/**
+ * Call schedule if a wake or the end of a time slice asked for it
+ * Run on interrupt exit, outside any softirq drain, so woken processes
+ * get the CPU without waiting for the current one's time slice.
+ */
 void
-handle_syscall (uint64_t syscall_number, uint64_t param1, uint64_t param2)
+schedule_pending (void)
 {
-  switch (syscall_number)
+  if (need_resched)
+    schedule ();
+}
+
+uint64_t
+current_process_id (void)
+{
+  return current_pid;
+}
+
+/**
+ * Put the current process to sleep until wake_process
+ * Call with interrupts disabled after checking the wait condition, and
+ * re-check it on return: if nothing else can run, this only waits for the
+ * next interrupt.
+ */
+void
+block_current (void)
+{
+  process_table[current_pid].state = PROCESS_BLOCKED;
+  schedule ();
+
+  if (process_table[current_pid].state == PROCESS_BLOCKED)
     {
-    case 1: // write
-      break;
-    case 2: // read
-      break;
-    case 3: // exit
-      process_table[current_pid].state = PROCESS_BLOCKED;
-      schedule ();
-      break;
+      process_table[current_pid].state = PROCESS_READY;
+      asm volatile ("sti; hlt; cli" : : : "memory");
     }
 }
 
-// Kernel's process scheduler update function
-// This will be called from the assembly timer handler
+// Make a blocked process runnable again; safe from interrupt context
 void
-kernel_timer_update ()
+wake_process (uint64_t pid)
 {
-  static uint64_t ticks = 0;
-  ticks++;
-
-  if (ticks % process_table[current_pid].time_slice == 0)
+  if (pid < slots_used && process_table[pid].state == PROCESS_BLOCKED)
     {
-      schedule ();
+      process_table[pid].state = PROCESS_READY;
+      need_resched = 1;
     }
 }
 
-// Initial process that runs after kernel initialization
+/**
+ * Run the current process in another address space
+ * The scheduler loads it whenever the process runs, until the next
+ * call. Used by kernel processes that work on a user process's memory.
+ * @return The address space the process ran in before
+ */
+uint64_t *
+process_use_space (uint64_t *pml4)
+{
+  uint64_t flags = irq_save ();
+  uint64_t *old = process_table[current_pid].pml4;
+
+  process_table[current_pid].pml4 = pml4;
+  paging_switch (pml4);
+  irq_restore (flags);
+  return old;
+}
+
+/**
+ * End the current process
+ * Its I/O rings are released at once. Its address space, kernel stack
+ * and FPU state are freed once another process runs, the next time a
+ * process is spawned, and its slot is reused. Also where a kernel
+ * process's start routine returns to.
+ */
 void
-init_process ()
+exit_process (void)
 {
+  ioring_exit ();
+  asm volatile ("cli" : : : "memory");
+  process_table[current_pid].state = PROCESS_EXITED;
   while (1)
     {
-      asm volatile ("hlt");
+      schedule (); // Returns only while nothing else can run
+      asm volatile ("sti; hlt; cli" : : : "memory");
     }
 }
 
+// Exit system call
+static uint64_t
+sys_exit (SYSCALL_PARAMS)
+{
+  // Code started through run_user returns to its kernel caller
+  if (this_cpu ()->user_return_rsp)
+    user_return (arg1);
+
+  exit_process ();
+}
+
+// Kernel's process scheduler update function
+// Registered as the IRQ 0 handler; the switch itself happens on
+// interrupt exit
+void
+kernel_timer_update ()
+{
+  static uint64_t ticks = 0;
+  ticks++;
+  vtime_update ();
+  bcache_tick ();
+
+  if (ticks % process_table[current_pid].time_slice == 0)
+    need_resched = 1;
+}
+
 void
 kernel_main ()
 {
   init_gdt ();
   init_idt ();
-  init_memory ();
+  init_syscall ();
+  init_memory (); // init_apic maps its registers with pool pages
+  init_apic ();
   init_io ();
-  init_timer (50);
+  init_timer (TIMER_FREQUENCY);
+  register_interrupt_handler (IRQ (0), kernel_timer_update);
+  init_vtime (calibrate_tsc (), TIMER_FREQUENCY);
   init_keyboard ();
+  init_pci ();
   init_disk ();
-  init_heap ();
+  init_fpu (FPU_POLICY_LAZY);
+
+  init_paging ();
+  kernel_pml4 = paging_current ();
 
-  // Create initial process
-  create_process (init_process);
+  // The boot context becomes process 0
+  process_table[0].state = PROCESS_READY;
+  process_table[0].pml4 = kernel_pml4;
+  process_table[0].time_slice = 100;
+  if (fpu_alloc_state (&process_table[0].fpu) < 0)
+    {
+      print_string ("No page for the boot process's FPU state\n");
+      while (1)
+        {
+          asm volatile ("cli; hlt");
+        }
+    }
+  fpu_switch (NULL, &process_table[0].fpu);
 
-  // Enable interrupts
-  asm volatile ("sti");
+  register_syscall (SYS_EXIT, sys_exit);
+  init_ioring ();
+  init_workqueue ();
+  init_klog ();
+  kprintf ("TSC runs at %lu Hz, %u of %u CPU(s) online\n",
+           tsc_frequency (), cpu_online_count (), cpu_count ());
+  disk_info ();
+  init_fs ();
+  init_mmap ();
+  init_ipc ();
+  init_futex ();
 
+  // The boot context is now the idle process
   while (1)
     {
-      asm volatile ("hlt");
+      asm volatile ("cli" : : : "memory");
+      schedule_pending ();
+      asm volatile ("sti; hlt" : : : "memory");
     }
 }
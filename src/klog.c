@@ -0,0 +1,457 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "klog.h"
+#include "cpu.h"
+#include "drivers/console.h"
+#include "drivers/serial.h"
+#include "drivers/timer.h"
+#include "workqueue.h"
+
+/*
+ * Each CPU logs into its own ring of fixed-size records. A writer formats
+ * its text on the stack, claims the next sequence number with a
+ * compare-and-swap on head, fills the slot and publishes it by storing
+ * the tagged sequence number; nested interrupts on the same CPU simply
+ * claim the following slot. Records are pushed to the serial and VGA
+ * consoles later by a worker thread, which advances tail. Drained records
+ * stay in the ring until the slot is reused, so klog_dump can replay the
+ * recent history after a hang.
+ */
+struct klog_ring
+{
+  struct klog_record records[KLOG_RECORDS];
+  volatile uint32_t head; // Next sequence number to claim
+  volatile uint32_t tail; // Next sequence number to drain
+  uint64_t records_logged;
+  uint64_t dropped;
+} __attribute__ ((aligned (64)));
+
+static struct klog_ring rings[MAX_CPUS];
+
+static void klog_drain_work (void *arg);
+
+static struct work klog_work = WORK_INIT (klog_drain_work, 0);
+static int klog_deferred = 0; // Set once worker threads can drain
+static volatile uint8_t draining = 0;
+
+static const char *const level_names[] = { "ERR", "WARN", "INFO", "DEBUG" };
+
+// Formatter output, truncated to size but counting the full length
+struct fmt_out
+{
+  char *buf;
+  size_t size;
+  size_t len;
+};
+
+static inline void
+fmt_putc (struct fmt_out *out, char c)
+{
+  if (out->len + 1 < out->size)
+    out->buf[out->len] = c;
+  out->len++;
+}
+
+static void
+fmt_number (struct fmt_out *out, uint64_t value, int base, int upper,
+            int negative, int width, char pad, int left)
+{
+  const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+  char tmp[24];
+  int n = 0;
+
+  do
+    {
+      tmp[n++] = digits[value % base];
+      value /= base;
+    }
+  while (value);
+
+  int len = n + negative;
+  if (negative && pad == '0')
+    fmt_putc (out, '-');
+  if (!left)
+    for (; width > len; width--)
+      fmt_putc (out, pad);
+  if (negative && pad != '0')
+    fmt_putc (out, '-');
+  while (n)
+    fmt_putc (out, tmp[--n]);
+  if (left)
+    for (; width > len; width--)
+      fmt_putc (out, ' ');
+}
+
+/**
+ * @brief Formats into a buffer like vsnprintf.
+ *
+ * Supports %d %i %u %x %X %p %s %c and %% with the '-' and '0' flags, a
+ * field width and the l, ll and z length modifiers.
+ *
+ * @return Length the full output would have, excluding the terminator
+ */
+int
+kvsnprintf (char *buf, size_t size, const char *fmt, va_list args)
+{
+  struct fmt_out out = { buf, size, 0 };
+
+  for (; *fmt; fmt++)
+    {
+      if (*fmt != '%')
+        {
+          fmt_putc (&out, *fmt);
+          continue;
+        }
+
+      int left = 0;
+      char pad = ' ';
+      int width = 0;
+      int is_long = 0;
+
+      fmt++;
+      for (;; fmt++)
+        {
+          if (*fmt == '-')
+            left = 1;
+          else if (*fmt == '0')
+            pad = '0';
+          else
+            break;
+        }
+      if (left)
+        pad = ' ';
+      while (*fmt >= '0' && *fmt <= '9')
+        width = width * 10 + (*fmt++ - '0');
+      while (*fmt == 'l' || *fmt == 'z')
+        {
+          is_long = 1;
+          fmt++;
+        }
+
+      switch (*fmt)
+        {
+        case 'd':
+        case 'i':
+          {
+            int64_t value = is_long ? va_arg (args, int64_t)
+                                    : va_arg (args, int);
+            uint64_t magnitude = value < 0 ? -(uint64_t)value : value;
+            fmt_number (&out, magnitude, 10, 0, value < 0, width, pad,
+                        left);
+            break;
+          }
+        case 'u':
+        case 'x':
+        case 'X':
+          {
+            uint64_t value = is_long ? va_arg (args, uint64_t)
+                                     : va_arg (args, unsigned int);
+            fmt_number (&out, value, *fmt == 'u' ? 10 : 16, *fmt == 'X', 0,
+                        width, pad, left);
+            break;
+          }
+        case 'p':
+          fmt_putc (&out, '0');
+          fmt_putc (&out, 'x');
+          fmt_number (&out, (uintptr_t)va_arg (args, void *), 16, 0, 0, 16,
+                      '0', 0);
+          break;
+        case 's':
+          {
+            const char *s = va_arg (args, const char *);
+            if (!s)
+              s = "(null)";
+            int len = 0;
+            while (s[len])
+              len++;
+            if (!left)
+              for (; width > len; width--)
+                fmt_putc (&out, ' ');
+            for (int i = 0; i < len; i++)
+              fmt_putc (&out, s[i]);
+            for (; width > len; width--)
+              fmt_putc (&out, ' ');
+            break;
+          }
+        case 'c':
+          fmt_putc (&out, (char)va_arg (args, int));
+          break;
+        case '%':
+          fmt_putc (&out, '%');
+          break;
+        case '\0':
+          fmt--; // Lone '%' at the end of the format
+          break;
+        default:
+          fmt_putc (&out, '%');
+          fmt_putc (&out, *fmt);
+          break;
+        }
+    }
+
+  if (size)
+    buf[out.len < size ? out.len : size - 1] = '\0';
+  return out.len;
+}
+
+int
+ksnprintf (char *buf, size_t size, const char *fmt, ...)
+{
+  va_list args;
+  va_start (args, fmt);
+  int len = kvsnprintf (buf, size, fmt, args);
+  va_end (args);
+  return len;
+}
+
+// Formats one record as a console line, ending in a newline
+static size_t
+format_record (const struct klog_record *rec, char *line, size_t size)
+{
+  uint64_t hz = tsc_frequency ();
+  const char *level = level_names[rec->level];
+  int len;
+
+  if (hz)
+    len = ksnprintf (line, size, "[%5lu.%06lu] %s: %s", rec->tsc / hz,
+                     (rec->tsc % hz) * 1000000 / hz, level, rec->text);
+  else
+    len = ksnprintf (line, size, "[tsc %lu] %s: %s", rec->tsc, level,
+                     rec->text);
+
+  if ((size_t)len > size - 2)
+    len = size - 2;
+  if (len == 0 || line[len - 1] != '\n')
+    {
+      line[len++] = '\n';
+      line[len] = '\0';
+    }
+  return len;
+}
+
+static inline struct klog_record *
+ring_slot (struct klog_ring *ring, uint32_t seq)
+{
+  return &ring->records[seq % KLOG_RECORDS];
+}
+
+// Oldest undrained record across all CPUs, or NULL when all are drained
+static struct klog_ring *
+oldest_pending (void)
+{
+  struct klog_ring *oldest = NULL;
+  uint64_t oldest_tsc = 0;
+
+  for (uint32_t i = 0; i < MAX_CPUS; i++)
+    {
+      struct klog_ring *ring = &rings[i];
+      uint32_t tail = ring->tail;
+      struct klog_record *rec = ring_slot (ring, tail);
+
+      if (__atomic_load_n (&rec->seq, __ATOMIC_ACQUIRE) != tail + 1)
+        continue;
+      if (!oldest || rec->tsc < oldest_tsc)
+        {
+          oldest = ring;
+          oldest_tsc = rec->tsc;
+        }
+    }
+
+  return oldest;
+}
+
+static void
+drain (void)
+{
+  struct klog_ring *ring;
+  char line[KLOG_TEXT_MAX + 40];
+
+  while ((ring = oldest_pending ()))
+    {
+      struct klog_record rec = *ring_slot (ring, ring->tail);
+      __atomic_store_n (&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+
+      size_t len = format_record (&rec, line, sizeof (line));
+      serial_write (line, len);
+      if (rec.level <= KLOG_CONSOLE_LEVEL)
+        console_write (line, len);
+    }
+}
+
+/**
+ * @brief Pushes every pending record to the consoles.
+ *
+ * Only one caller drains at a time; a caller that finds a drain in
+ * progress returns at once and leaves the records to it.
+ */
+void
+klog_flush (void)
+{
+  while (!__atomic_exchange_n (&draining, 1, __ATOMIC_ACQUIRE))
+    {
+      drain ();
+      __atomic_store_n (&draining, 0, __ATOMIC_RELEASE);
+
+      // A record committed after the last check would otherwise wait
+      // for the next log call
+      if (!oldest_pending ())
+        break;
+    }
+}
+
+static void
+klog_drain_work (void *arg)
+{
+  klog_flush ();
+}
+
+/**
+ * @brief Hands draining over to the worker threads.
+ *
+ * Until this is called records are drained synchronously by the caller.
+ */
+void
+init_klog (void)
+{
+  klog_deferred = 1;
+  queue_work (&klog_work);
+}
+
+/**
+ * @brief Logs a formatted record; safe from interrupt context.
+ *
+ * The caller's CPU must have its per-CPU area set up (init_syscall).
+ */
+void
+kvlog (int level, const char *fmt, va_list args)
+{
+  char text[KLOG_TEXT_MAX];
+  int len = kvsnprintf (text, sizeof (text), fmt, args);
+  if (len >= KLOG_TEXT_MAX)
+    len = KLOG_TEXT_MAX - 1;
+  if (level < KLOG_ERR)
+    level = KLOG_ERR;
+  if (level > KLOG_DEBUG)
+    level = KLOG_DEBUG;
+
+  struct klog_ring *ring = &rings[this_cpu ()->index];
+  uint32_t seq = __atomic_load_n (&ring->head, __ATOMIC_RELAXED);
+  do
+    {
+      if (seq - __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE)
+          >= KLOG_RECORDS)
+        {
+          __atomic_fetch_add (&ring->dropped, 1, __ATOMIC_RELAXED);
+          return;
+        }
+    }
+  while (!__atomic_compare_exchange_n (&ring->head, &seq, seq + 1, 1,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+  struct klog_record *rec = ring_slot (ring, seq);
+  rec->tsc = read_tsc ();
+  rec->level = level;
+  rec->len = len;
+  for (int i = 0; i <= len; i++)
+    rec->text[i] = text[i];
+  __atomic_store_n (&rec->seq, seq + 1, __ATOMIC_RELEASE);
+  __atomic_fetch_add (&ring->records_logged, 1, __ATOMIC_RELAXED);
+
+  if (klog_deferred)
+    queue_work (&klog_work);
+  else
+    klog_flush ();
+}
+
+void
+klog (int level, const char *fmt, ...)
+{
+  va_list args;
+  va_start (args, fmt);
+  kvlog (level, fmt, args);
+  va_end (args);
+}
+
+void
+kprintf (const char *fmt, ...)
+{
+  va_list args;
+  va_start (args, fmt);
+  kvlog (KLOG_INFO, fmt, args);
+  va_end (args);
+}
+
+/**
+ * @brief Replays every record still held in the rings, drained or not.
+ *
+ * Writes with polled serial output and does not touch the drain state,
+ * so it can be used after a hang or from an exception handler.
+ */
+void
+klog_dump (void)
+{
+  uint32_t next[MAX_CPUS];
+  char line[KLOG_TEXT_MAX + 40];
+  size_t len;
+
+  for (uint32_t i = 0; i < MAX_CPUS; i++)
+    {
+      uint32_t head = rings[i].head;
+      next[i] = head > KLOG_RECORDS ? head - KLOG_RECORDS : 0;
+    }
+
+  len = ksnprintf (line, sizeof (line), "--- kernel log ---\n");
+  serial_write (line, len);
+  console_write (line, len);
+
+  while (1)
+    {
+      struct klog_ring *oldest = NULL;
+      uint32_t oldest_cpu = 0;
+
+      for (uint32_t i = 0; i < MAX_CPUS; i++)
+        {
+          struct klog_ring *ring = &rings[i];
+
+          // Skip slots that are still being written or were reused
+          while (next[i] != ring->head
+                 && ring_slot (ring, next[i])->seq != next[i] + 1)
+            next[i]++;
+          if (next[i] == ring->head)
+            continue;
+
+          if (!oldest
+              || ring_slot (ring, next[i])->tsc
+                     < ring_slot (oldest, next[oldest_cpu])->tsc)
+            {
+              oldest = ring;
+              oldest_cpu = i;
+            }
+        }
+
+      if (!oldest)
+        break;
+
+      struct klog_record rec = *ring_slot (oldest, next[oldest_cpu]++);
+      len = format_record (&rec, line, sizeof (line));
+      serial_write (line, len);
+      serial_flush ();
+      console_write (line, len);
+    }
+}
+
+void
+klog_get_stats (klog_stats_t *stats)
+{
+  stats->records = 0;
+  stats->dropped = 0;
+  for (uint32_t i = 0; i < MAX_CPUS; i++)
+    {
+      stats->records += rings[i].records_logged;
+      stats->dropped += rings[i].dropped;
+    }
+}
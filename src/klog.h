@@ -0,0 +1,62 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef KLOG_H
+#define KLOG_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define KLOG_RECORDS 64    // Records kept per CPU; a power of two
+#define KLOG_TEXT_MAX 112  // Formatted text per record, truncated beyond
+
+// Log levels, most severe first
+#define KLOG_ERR 0
+#define KLOG_WARN 1
+#define KLOG_INFO 2
+#define KLOG_DEBUG 3
+
+// Records at or below this level are also shown on the VGA console
+#define KLOG_CONSOLE_LEVEL KLOG_INFO
+
+/**
+ * One log record
+ * Written by the CPU that owns the ring. seq holds the record's sequence
+ * number plus one once the text is complete, so readers can tell a
+ * finished record from one being written or one left over from an
+ * earlier lap of the ring.
+ */
+struct klog_record
+{
+  uint64_t tsc;
+  volatile uint32_t seq;
+  uint8_t level;
+  uint8_t len;
+  char text[KLOG_TEXT_MAX];
+};
+
+// Log statistics
+typedef struct
+{
+  uint64_t records;
+  uint64_t dropped; // Records lost to a full ring
+} klog_stats_t;
+
+void init_klog (void);
+int ksnprintf (char *buf, size_t size, const char *fmt, ...)
+    __attribute__ ((format (printf, 3, 4)));
+int kvsnprintf (char *buf, size_t size, const char *fmt, va_list args);
+void klog (int level, const char *fmt, ...)
+    __attribute__ ((format (printf, 2, 3)));
+void kvlog (int level, const char *fmt, va_list args);
+void kprintf (const char *fmt, ...)
+    __attribute__ ((format (printf, 1, 2)));
+void klog_flush (void);
+void klog_dump (void);
+void klog_get_stats (klog_stats_t *stats);
+
+#endif
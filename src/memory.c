@@ -13,6 +13,7 @@
 #define MAX_ALLOCATION_RETRIES 3
 #define ALIGNMENT 8         // 8-byte alignment
 #define MEMORY_PATTERN 0xAA // Pattern to fill freed memory
+#define PAGE_POOL_PAGES 1024 // 4 MB of page-granular memory
 
 // Memory block metadata
 typedef struct
@@ -37,6 +38,13 @@ static size_t peak_memory_usage = 0;
 static size_t allocation_count = 0;
 static size_t free_count = 0;
 
+// Page pool used for page tables and other page-granular allocations
+static char page_pool[PAGE_POOL_PAGES * PAGE_SIZE]
+    __attribute__ ((aligned (PAGE_SIZE)));
+static uint16_t free_pages[PAGE_POOL_PAGES];
+static int free_page_count = 0;
+static uint16_t page_refs[PAGE_POOL_PAGES]; // Mappings sharing each page
+
 // Forward declarations
 static BlockHeader *find_best_fit (size_t size);
 static void coalesce_free_blocks (void);
@@ -44,28 +52,6 @@ static uint32_t calculate_checksum (BlockHeader *header);
 static bool validate_block (BlockHeader *header);
 static void *align_pointer (void *ptr, size_t alignment);
 
-// Kernel-level memory operations
-static void
-k_memset (void *dest, uint8_t val, size_t len)
-{
-  uint8_t *dst = (uint8_t *)dest;
-  for (size_t i = 0; i < len; i++)
-    {
-      dst[i] = val;
-    }
-}
-
-static void
-k_memcpy (void *dest, const void *src, size_t len)
-{
-  const uint8_t *s = (const uint8_t *)src;
-  uint8_t *d = (uint8_t *)dest;
-  for (size_t i = 0; i < len; i++)
-    {
-      d[i] = s[i];
-    }
-}
-
 // Initialize memory pool with advanced features
 void
 init_memory ()
@@ -87,6 +73,13 @@ init_memory ()
     }
   free_block_count = BLOCK_COUNT;
 
+  // Initialize page pool free stack
+  for (int i = 0; i < PAGE_POOL_PAGES; i++)
+    {
+      free_pages[i] = PAGE_POOL_PAGES - 1 - i;
+    }
+  free_page_count = PAGE_POOL_PAGES;
+
   // Reset statistics
   total_allocated = 0;
   peak_memory_usage = 0;
@@ -301,7 +294,7 @@ get_memory_stats (MemoryStats *stats)
     }
   stats->fragmentation
       = (stats->free_memory > 0)
-            ? (1.0 - (double)largest_free_block / stats->free_memory) * 100
+            ? 100 - (largest_free_block * 100) / stats->free_memory
             : 0;
 }
 
@@ -355,3 +348,60 @@ reallocate_memory (void *ptr, size_t new_size)
 
   return new_ptr;
 }
+
+// Allocate a zeroed page from the page pool
+void *
+alloc_page (void)
+{
+  if (free_page_count == 0)
+    return NULL;
+
+  uint16_t index = free_pages[--free_page_count];
+  char *page = &page_pool[index * PAGE_SIZE];
+  page_refs[index] = 1;
+  k_memset (page, 0, PAGE_SIZE);
+  return page;
+}
+
+// Index of a page in the pool, or -1 if it is not a pool page
+static int
+page_index (const void *page)
+{
+  uintptr_t offset = (uintptr_t)page - (uintptr_t)page_pool;
+
+  if ((uintptr_t)page < (uintptr_t)page_pool
+      || offset >= sizeof (page_pool) || (offset & (PAGE_SIZE - 1)))
+    {
+      return -1;
+    }
+  return offset / PAGE_SIZE;
+}
+
+// Drop a reference to a page, returning it to the pool with the last one
+void
+free_page (void *page)
+{
+  int index = page_index (page);
+  if (index < 0 || page_refs[index] == 0)
+    return;
+
+  if (--page_refs[index] == 0)
+    free_pages[free_page_count++] = index;
+}
+
+// Take another reference to a pool page; other pages are ignored
+void
+page_get (void *page)
+{
+  int index = page_index (page);
+  if (index >= 0 && page_refs[index])
+    page_refs[index]++;
+}
+
+// References held on a pool page, 0 for free or non-pool pages
+uint32_t
+page_refcount (const void *page)
+{
+  int index = page_index (page);
+  return index < 0 ? 0 : page_refs[index];
+}
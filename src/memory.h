@@ -9,6 +9,8 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#define PAGE_SIZE 4096
+
 /**
  * Memory statistics structure
  * Contains information about memory usage and allocation patterns
@@ -63,4 +65,54 @@ void get_memory_stats (MemoryStats *stats);
  */
 void debug_memory_pool (void);
 
+/**
+ * Allocate one zeroed, page-aligned physical page
+ * @return Pointer to the page or NULL if the page pool is exhausted
+ */
+void *alloc_page (void);
+
+/**
+ * Release a reference to a page obtained from alloc_page
+ * The page returns to the pool when its last reference is released.
+ * @param page Pointer to the page to release
+ */
+void free_page (void *page);
+
+/**
+ * Take another reference to a page obtained from alloc_page
+ * Used when a page is shared copy-on-write; each reference is released
+ * with free_page.
+ * @param page Pointer to the page
+ */
+void page_get (void *page);
+
+/**
+ * Get the number of references held on a page
+ * @param page Pointer to the page
+ * @return The count, or 0 if the page is not from the page pool
+ */
+uint32_t page_refcount (const void *page);
+
+/**
+ * Copy len bytes between buffers that do not overlap
+ * rep movsb moves whole cache lines at a time on current CPUs.
+ */
+static inline void
+k_memcpy (void *dest, const void *src, size_t len)
+{
+  asm volatile ("rep movsb"
+                : "+D"(dest), "+S"(src), "+c"(len)
+                :
+                : "memory");
+}
+
+/**
+ * Fill len bytes with val
+ */
+static inline void
+k_memset (void *dest, uint8_t val, size_t len)
+{
+  asm volatile ("rep stosb" : "+D"(dest), "+c"(len) : "a"(val) : "memory");
+}
+
 #endif /* MEMORY_H */
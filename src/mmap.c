@@ -0,0 +1,490 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "mmap.h"
+#include "cpu.h"
+#include "idt.h"
+#include "klog.h"
+#include "memory.h"
+#include "mutex.h"
+#include "paging.h"
+#include "process.h"
+#include "syscall.h"
+#include <stddef.h>
+
+#define PAGE_FAULT_VECTOR 14
+#define PF_PRESENT (1U << 0) // Error code: protection fault, not a miss
+#define PF_WRITE (1U << 1)
+#define PTE_PRIVATE (1ULL << 9) // Software bit: a private copy, not cache
+
+#define SYS_MMAP_PROT_SHIFT 8 // arg4 of SYS_MMAP is prot << 8 | flags
+
+/*
+ * File mappings. Pages are mapped on demand by the page-fault handler,
+ * straight from the page cache, so reading a mapped file copies
+ * nothing.
+ *
+ * Shared mappings map cache pages read-only at first. The first write
+ * faults, dirties the cache page and makes the mapping writable. Writing
+ * the page back, through msync or by the page cache on its own, first
+ * write-protects every mapping of it again, so the next store faults
+ * and dirties it once more.
+ *
+ * Private mappings share cache pages until a write. The write fault
+ * then gives the process its own copy, marked PTE_PRIVATE, which is
+ * freed on munmap.
+ *
+ * Each mapping keeps at most MMAP_WORKING_SET cache pages mapped. Past
+ * that the oldest is unmapped and released, so a file larger than the
+ * page cache can still be streamed through a mapping. All mappings
+ * together hold at most MMAP_PINNED_MAX, taking pages from each other
+ * round robin past that, so that mapped files cannot pin the whole
+ * page cache.
+ */
+struct vm_area
+{
+  uintptr_t start;
+  uintptr_t end;
+  struct fs_inode *inode;
+  uint64_t first_page; // File page mapped at start
+  int prot;
+  int flags;
+  uint64_t owner;
+  struct
+  {
+    uintptr_t va; // 0 for an empty slot
+    struct cached_page *page;
+  } resident[MMAP_WORKING_SET];
+  uint32_t clock; // Next slot to reuse
+};
+
+static struct vm_area areas[MMAP_MAX_AREAS];
+static uintptr_t next_va = MMAP_BASE;
+static struct mutex mmap_mutex = MUTEX_INIT; // Held across faults
+static uint32_t pinned = 0;     // Cache pages held by all mappings
+static uint32_t unpin_clock = 0; // Next slot, over all areas, to take
+
+static struct vm_area *
+find_area (uintptr_t addr)
+{
+  for (int i = 0; i < MMAP_MAX_AREAS; i++)
+    {
+      if (areas[i].inode && addr >= areas[i].start && addr < areas[i].end)
+        return &areas[i];
+    }
+  return NULL;
+}
+
+static inline uintptr_t
+phys_of (const void *virt)
+{
+  return paging_virt_to_phys (paging_current (), (uintptr_t)virt);
+}
+
+// Unmaps one cache-backed page and drops its reference
+static void
+release_slot (struct vm_area *area, uint32_t slot)
+{
+  uintptr_t va = area->resident[slot].va;
+  if (!va)
+    return;
+
+  paging_unmap (paging_current (), va);
+  pagecache_put (area->resident[slot].page);
+  area->resident[slot].va = 0;
+  pinned--;
+}
+
+// Releases the next mapped cache page found, from any mapping
+static void
+unpin_one (void)
+{
+  const uint32_t slots = MMAP_MAX_AREAS * MMAP_WORKING_SET;
+
+  for (uint32_t n = 0; n < slots; n++)
+    {
+      uint32_t i = unpin_clock;
+      unpin_clock = (i + 1) % slots;
+
+      struct vm_area *area = &areas[i / MMAP_WORKING_SET];
+      if (area->inode && area->resident[i % MMAP_WORKING_SET].va)
+        {
+          release_slot (area, i % MMAP_WORKING_SET);
+          return;
+        }
+    }
+}
+
+// Maps a cache page, evicting the oldest one past the working set. The
+// slot is filled first so mmap_page_clean always sees a writable mapping.
+static int
+map_cache_page (struct vm_area *area, uintptr_t va, struct cached_page *page,
+                uint64_t flags)
+{
+  uint32_t slot = area->clock;
+  area->clock = (slot + 1) % MMAP_WORKING_SET;
+  release_slot (area, slot);
+  if (pinned >= MMAP_PINNED_MAX)
+    unpin_one ();
+
+  area->resident[slot].va = va;
+  area->resident[slot].page = page;
+  pinned++;
+  if (paging_map (paging_current (), va, phys_of (page->data),
+                  PAGE_USER | flags)
+      < 0)
+    {
+      area->resident[slot].va = 0;
+      pinned--;
+      pagecache_put (page);
+      return -1;
+    }
+  return 0;
+}
+
+static int
+find_slot (struct vm_area *area, uintptr_t va)
+{
+  for (int i = 0; i < MMAP_WORKING_SET; i++)
+    {
+      if (area->resident[i].va == va)
+        return i;
+    }
+  return -1;
+}
+
+// Replaces a page with a private copy; page may be NULL for zeros
+static int
+map_private_copy (uintptr_t va, const struct cached_page *page)
+{
+  uint64_t *copy = alloc_page ();
+  if (!copy)
+    return -1;
+
+  if (page)
+    {
+      const uint64_t *src = (const uint64_t *)page->data;
+      for (uint32_t i = 0; i < PAGE_SIZE / 8; i++)
+        copy[i] = src[i];
+    }
+
+  if (paging_map (paging_current (), va, phys_of (copy),
+                  PAGE_USER | PAGE_WRITABLE | PTE_PRIVATE)
+      < 0)
+    {
+      free_page (copy);
+      return -1;
+    }
+  return 0;
+}
+
+/**
+ * @brief Write-protects every mapping of a cache page.
+ *
+ * Called by the page cache with interrupts disabled before it writes
+ * the page back. Stores made after that fault and dirty the page again
+ * instead of being lost.
+ */
+void
+mmap_page_clean (struct cached_page *page)
+{
+  for (int i = 0; i < MMAP_MAX_AREAS; i++)
+    {
+      struct vm_area *area = &areas[i];
+      if (!area->inode || !(area->flags & MAP_SHARED))
+        continue;
+
+      for (int s = 0; s < MMAP_WORKING_SET; s++)
+        {
+          if (area->resident[s].va && area->resident[s].page == page)
+            paging_map (paging_current (), area->resident[s].va,
+                        phys_of (page->data), PAGE_USER);
+        }
+    }
+}
+
+/**
+ * @brief Resolves a page fault inside a file mapping.
+ *
+ * May sleep on the mapping lock and on reading the file. The page
+ * fault handler enables interrupts first when the faulting code had
+ * them on; from code running with them off, such as a system call,
+ * the wait is the same as block_current's.
+ *
+ * @return 0 if the access may be retried, -1 if it is not a valid
+ *         access to a mapping.
+ */
+int
+mmap_fault (uintptr_t addr, uint64_t error)
+{
+  int write = (error & PF_WRITE) != 0;
+  int ret = -1;
+
+  mutex_lock (&mmap_mutex);
+  struct vm_area *area = find_area (addr);
+  if (!area || (write && !(area->prot & PROT_WRITE)))
+    goto out;
+
+  uintptr_t va = addr & ~(uintptr_t)(PAGE_SIZE - 1);
+  uint64_t index = area->first_page + (va - area->start) / PAGE_SIZE;
+  int slot = find_slot (area, va);
+
+  if (slot >= 0)
+    {
+      // A write to a cache page mapped read-only
+      struct cached_page *page = area->resident[slot].page;
+      if (!write)
+        ret = 0; // Raced with another fault on the same page
+      else if (area->flags & MAP_PRIVATE)
+        {
+          ret = map_private_copy (va, page);
+          if (ret == 0)
+            {
+              pagecache_put (page);
+              area->resident[slot].va = 0;
+              pinned--;
+            }
+        }
+      else
+        {
+          // Dirtied after mapping, so a writeback in between cannot
+          // clean it with the mapping still writable
+          ret = paging_map (paging_current (), va, phys_of (page->data),
+                            PAGE_USER | PAGE_WRITABLE);
+          if (ret == 0)
+            pagecache_mark_dirty (page);
+        }
+      goto out;
+    }
+
+  if (paging_lookup (paging_current (), va))
+    {
+      ret = 0; // A private copy, already writable
+      goto out;
+    }
+
+  struct cached_page *page;
+  if (fs_get_page (area->inode, index, &page) < 0)
+    goto out;
+
+  if (write && (area->flags & MAP_PRIVATE))
+    {
+      ret = map_private_copy (va, page);
+      pagecache_put (page);
+    }
+  else if (write)
+    {
+      ret = map_cache_page (area, va, page, PAGE_WRITABLE);
+      if (ret == 0)
+        pagecache_mark_dirty (page);
+    }
+  else
+    ret = map_cache_page (area, va, page, 0);
+
+out:
+  mutex_unlock (&mmap_mutex);
+  return ret;
+}
+
+/**
+ * @brief Maps part of a file into the shared address space.
+ *
+ * Nothing is read until the pages are touched. The mapping keeps a
+ * reference to the inode until munmap.
+ *
+ * @param offset File offset of the mapping; a multiple of PAGE_SIZE.
+ * @param length Bytes to map, within the current file size.
+ *
+ * @return The address of the mapping, or NULL.
+ */
+void *
+mmap_file (struct fs_inode *inode, uint64_t offset, uint64_t length,
+           int prot, int flags)
+{
+  if (!inode || !length || (offset & (PAGE_SIZE - 1))
+      || offset > fs_size (inode) || length > fs_size (inode) - offset
+      || (flags != MAP_SHARED && flags != MAP_PRIVATE))
+    return NULL;
+
+  uint64_t size = (length + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+  void *addr = NULL;
+
+  mutex_lock (&mmap_mutex);
+  for (int i = 0; i < MMAP_MAX_AREAS && next_va + size <= MMAP_LIMIT; i++)
+    {
+      struct vm_area *area = &areas[i];
+      if (area->inode)
+        continue;
+
+      area->start = next_va;
+      area->end = next_va + size;
+      area->inode = inode;
+      area->first_page = offset / PAGE_SIZE;
+      area->prot = prot;
+      area->flags = flags;
+      area->owner = current_process_id ();
+      area->clock = 0;
+      for (int s = 0; s < MMAP_WORKING_SET; s++)
+        area->resident[s].va = 0;
+
+      next_va += size;
+      addr = (void *)area->start;
+      break;
+    }
+  mutex_unlock (&mmap_mutex);
+
+  return addr;
+}
+
+/**
+ * @brief Removes a mapping made by mmap_file.
+ *
+ * Writes to a shared mapping stay in the page cache; msync first to
+ * push them out now.
+ *
+ * @return 0 on success, -1 if addr is not the start of a mapping made
+ *         by the calling process.
+ */
+int
+munmap (void *addr)
+{
+  uint64_t *pml4 = paging_current ();
+
+  mutex_lock (&mmap_mutex);
+  struct vm_area *area = find_area ((uintptr_t)addr);
+  if (!area || area->start != (uintptr_t)addr
+      || area->owner != current_process_id ())
+    {
+      mutex_unlock (&mmap_mutex);
+      return -1;
+    }
+
+  for (uint32_t i = 0; i < MMAP_WORKING_SET; i++)
+    release_slot (area, i);
+
+  // What is still mapped now is private copies
+  for (uintptr_t va = area->start; va < area->end; va += PAGE_SIZE)
+    {
+      uint64_t *pte = paging_lookup (pml4, va);
+      if (pte && (*pte & PTE_PRIVATE))
+        {
+          void *copy = (void *)(uintptr_t)(*pte & PAGE_ADDR_MASK);
+          paging_unmap (pml4, va);
+          free_page (copy);
+        }
+    }
+
+  struct fs_inode *inode = area->inode;
+  area->inode = NULL;
+  mutex_unlock (&mmap_mutex);
+
+  fs_close (inode);
+  return 0;
+}
+
+/**
+ * @brief Writes a shared mapping's changes back to the file.
+ *
+ * Writeback makes the pages read-only again (see mmap_page_clean), so
+ * later writes are caught.
+ *
+ * @return 0 on success, -1 for an address outside the calling
+ *         process's mappings, or a negative FS_ERR_*.
+ */
+int
+msync (void *addr)
+{
+  mutex_lock (&mmap_mutex);
+  struct vm_area *area = find_area ((uintptr_t)addr);
+  if (!area || area->owner != current_process_id ())
+    {
+      mutex_unlock (&mmap_mutex);
+      return -1;
+    }
+
+  struct fs_inode *inode = area->inode;
+  int shared = area->flags & MAP_SHARED;
+  mutex_unlock (&mmap_mutex);
+
+  return shared ? fs_fsync (inode) : 0;
+}
+
+static void
+page_fault (struct trap_frame *frame)
+{
+  uintptr_t addr;
+  asm volatile ("mov %%cr2, %0" : "=r"(addr));
+
+  if (paging_cow_fault (addr, frame->error_code) == 0)
+    return;
+
+  // File faults may sleep; the CPU entered with interrupts off
+  if (frame->rflags & RFLAGS_IF)
+    asm volatile ("sti" : : : "memory");
+  int ret = mmap_fault (addr, frame->error_code);
+  asm volatile ("cli" : : : "memory"); // The exit path expects them off
+  if (ret == 0)
+    return;
+
+  klog (KLOG_ERR, "page fault at %p, rip %p, error %lx\n", (void *)addr,
+        (void *)frame->rip, frame->error_code);
+  klog_dump ();
+  while (1)
+    {
+      asm volatile ("cli; hlt");
+    }
+}
+
+// Maps arg1, a path, from file offset arg2 for arg3 bytes; arg4 is
+// prot << 8 | flags
+static uint64_t
+sys_mmap (SYSCALL_PARAMS)
+{
+  struct fs_inode *inode;
+  int prot = (arg4 >> SYS_MMAP_PROT_SHIFT) & 0xFF;
+  int flags = arg4 & 0xFF;
+
+  if (!paging_user_string (paging_current (), arg1, FS_PATH_MAX)
+      || fs_open ((const char *)arg1, 0, &inode) < 0)
+    return SYSCALL_ERROR;
+
+  void *addr = mmap_file (inode, arg2, arg3, prot, flags);
+  if (!addr)
+    {
+      fs_close (inode);
+      return SYSCALL_ERROR;
+    }
+  return (uint64_t)addr;
+}
+
+static uint64_t
+sys_munmap (SYSCALL_PARAMS)
+{
+  return munmap ((void *)arg1) < 0 ? SYSCALL_ERROR : 0;
+}
+
+static uint64_t
+sys_msync (SYSCALL_PARAMS)
+{
+  return msync ((void *)arg1) < 0 ? SYSCALL_ERROR : 0;
+}
+
+/**
+ * @brief Installs the page-fault handler and the mapping system calls.
+ */
+void
+init_mmap (void)
+{
+  // Build the window's tables now so that cloned address spaces share
+  // them instead of copying an empty entry
+  paging_map (paging_current (), MMAP_BASE, 0, PAGE_USER);
+  paging_unmap (paging_current (), MMAP_BASE);
+
+  register_trap_handler (PAGE_FAULT_VECTOR, page_fault);
+  register_syscall (SYS_MMAP, sys_mmap);
+  register_syscall (SYS_MUNMAP, sys_munmap);
+  register_syscall (SYS_MSYNC, sys_msync);
+}
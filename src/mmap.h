@@ -0,0 +1,36 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef MMAP_H
+#define MMAP_H
+
+#include "fs.h"
+#include <stdint.h>
+
+// File mappings; one top-level entry, shared by every address space
+#define MMAP_BASE 0x00007D8000000000ULL
+#define MMAP_LIMIT 0x00007E0000000000ULL
+#define MMAP_MAX_AREAS 32
+#define MMAP_WORKING_SET 32 // Cache pages one mapping keeps mapped
+#define MMAP_PINNED_MAX (PAGECACHE_PAGES / 4) // Held by all mappings
+
+// Protection
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+
+// Mapping types
+#define MAP_SHARED 0x1  // Writes reach the file
+#define MAP_PRIVATE 0x2 // Writes go to private copies
+
+void init_mmap (void);
+void *mmap_file (struct fs_inode *inode, uint64_t offset, uint64_t length,
+                 int prot, int flags);
+int munmap (void *addr);
+int msync (void *addr);
+int mmap_fault (uintptr_t addr, uint64_t error);
+void mmap_page_clean (struct cached_page *page);
+
+#endif
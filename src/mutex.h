@@ -0,0 +1,49 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef MUTEX_H
+#define MUTEX_H
+
+#include "cpu.h"
+#include "process.h"
+#include <stdint.h>
+
+/**
+ * @brief A lock that may be held across sleeping I/O.
+ *
+ * Waiters yield the CPU instead of spinning, so it must not be taken
+ * from interrupt context. It may be taken with interrupts disabled: a
+ * waiter that finds nothing else to run waits for the next interrupt,
+ * which may be the one the holder is blocked on.
+ */
+struct mutex
+{
+  volatile uint8_t locked;
+};
+
+#define MUTEX_INIT { 0 }
+
+static inline void
+mutex_lock (struct mutex *m)
+{
+  uint64_t flags = irq_save ();
+  while (m->locked)
+    {
+      schedule ();
+      if (m->locked)
+        asm volatile ("sti; hlt; cli" : : : "memory");
+    }
+  m->locked = 1;
+  irq_restore (flags);
+}
+
+static inline void
+mutex_unlock (struct mutex *m)
+{
+  __atomic_store_n (&m->locked, 0, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,306 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "pagecache.h"
+#include "cpu.h"
+#include "klog.h"
+#include "memory.h"
+#include "mmap.h"
+#include "mutex.h"
+#include <stddef.h>
+
+#define PAGECACHE_HASH_SIZE (1U << PAGECACHE_HASH_BITS)
+
+/*
+ * Unified page cache: file data lives in whole pages keyed by the
+ * owning mapping and the page's index in it, so reads, writes and
+ * memory mappings all work on the same copy. Pages are reclaimed in
+ * LRU order once nobody holds them, dirty ones after being written back
+ * through their mapping.
+ */
+static struct cached_page pages[PAGECACHE_PAGES];
+static struct cached_page *hash_table[PAGECACHE_HASH_SIZE];
+static struct cached_page *lru_head = NULL; // Most recently used
+static struct cached_page *lru_tail = NULL;
+static struct cached_page *free_list = NULL;
+
+static struct mutex pagecache_mutex = MUTEX_INIT; // Held across I/O
+static pagecache_stats_t stats;
+
+static inline uint32_t
+hash_of (struct page_mapping *mapping, uint64_t index)
+{
+  uint64_t key = index ^ ((uintptr_t)mapping >> 4);
+  return (key * 0x9E3779B97F4A7C15ULL) >> (64 - PAGECACHE_HASH_BITS);
+}
+
+static void
+hash_remove (struct cached_page *page)
+{
+  struct cached_page **link
+      = &hash_table[hash_of (page->mapping, page->index)];
+  while (*link != page)
+    link = &(*link)->hash_next;
+  *link = page->hash_next;
+}
+
+static void
+lru_remove (struct cached_page *page)
+{
+  if (page->prev)
+    page->prev->next = page->next;
+  else
+    lru_head = page->next;
+  if (page->next)
+    page->next->prev = page->prev;
+  else
+    lru_tail = page->prev;
+}
+
+static void
+lru_push (struct cached_page *page)
+{
+  page->prev = NULL;
+  page->next = lru_head;
+  if (lru_head)
+    lru_head->prev = page;
+  else
+    lru_tail = page;
+  lru_head = page;
+}
+
+// Cleaned before writepage sleeps, so a store meanwhile redirties it;
+// stores through a mapping fault again first
+static int
+write_page (struct cached_page *page)
+{
+  uint64_t flags = irq_save ();
+  mmap_page_clean (page);
+  page->dirty = 0;
+  stats.dirty--;
+  irq_restore (flags);
+
+  int ret = page->mapping->ops->writepage (page->mapping, page->index,
+                                           page->data);
+  if (ret == 0)
+    stats.writebacks++;
+  else
+    pagecache_mark_dirty (page);
+  return ret;
+}
+
+static void
+drop_page (struct cached_page *page)
+{
+  hash_remove (page);
+  lru_remove (page);
+  page->mapping->pages--;
+  page->mapping = NULL;
+  page->hash_next = free_list;
+  free_list = page;
+  stats.resident--;
+}
+
+// A free page, evicting the least recently used unheld one if needed
+static struct cached_page *
+reclaim (void)
+{
+  if (!free_list)
+    {
+      struct cached_page *victim = lru_tail;
+      while (victim
+             && (victim->refs || (victim->dirty && write_page (victim) < 0)))
+        victim = victim->prev;
+      if (!victim)
+        return NULL;
+
+      drop_page (victim);
+      stats.evictions++;
+    }
+
+  struct cached_page *page = free_list;
+  free_list = page->hash_next;
+  return page;
+}
+
+/**
+ * @brief Finds a page of a mapping, reading it in on a miss.
+ *
+ * The page comes back with a reference, to be dropped with
+ * pagecache_put. With PAGECACHE_NOREAD a missing page is zeroed instead
+ * of read, for callers about to overwrite all of it.
+ *
+ * @return 0 on success, or a negative error from the backing store or
+ *         -1 if every page is held.
+ */
+int
+pagecache_get (struct page_mapping *mapping, uint64_t index, int flags,
+               struct cached_page **out)
+{
+  mutex_lock (&pagecache_mutex);
+
+  struct cached_page *page = hash_table[hash_of (mapping, index)];
+  while (page && (page->mapping != mapping || page->index != index))
+    page = page->hash_next;
+
+  if (page)
+    {
+      stats.hits++;
+      lru_remove (page);
+      lru_push (page);
+      page->refs++;
+      mutex_unlock (&pagecache_mutex);
+      *out = page;
+      return 0;
+    }
+
+  stats.misses++;
+  page = reclaim ();
+  if (!page)
+    {
+      mutex_unlock (&pagecache_mutex);
+      return -1;
+    }
+
+  uint64_t *words = (uint64_t *)page->data;
+  int ret = 0;
+  if (flags & PAGECACHE_NOREAD)
+    {
+      for (uint32_t i = 0; i < PAGE_SIZE / 8; i++)
+        words[i] = 0;
+    }
+  else
+    ret = mapping->ops->readpage (mapping, index, page->data);
+
+  if (ret < 0)
+    {
+      page->hash_next = free_list;
+      free_list = page;
+      mutex_unlock (&pagecache_mutex);
+      return ret;
+    }
+
+  page->mapping = mapping;
+  page->index = index;
+  page->dirty = 0;
+  page->refs = 1;
+  uint32_t bucket = hash_of (mapping, index);
+  page->hash_next = hash_table[bucket];
+  hash_table[bucket] = page;
+  lru_push (page);
+  mapping->pages++;
+  stats.resident++;
+
+  mutex_unlock (&pagecache_mutex);
+  *out = page;
+  return 0;
+}
+
+// Takes another reference to a page already held
+void
+pagecache_hold (struct cached_page *page)
+{
+  __atomic_add_fetch (&page->refs, 1, __ATOMIC_RELAXED);
+}
+
+void
+pagecache_put (struct cached_page *page)
+{
+  __atomic_sub_fetch (&page->refs, 1, __ATOMIC_RELEASE);
+}
+
+// The page's data changed and must reach the backing store
+void
+pagecache_mark_dirty (struct cached_page *page)
+{
+  uint64_t flags = irq_save ();
+  if (!page->dirty)
+    {
+      page->dirty = 1;
+      stats.dirty++;
+    }
+  irq_restore (flags);
+}
+
+/**
+ * @brief Writes back a mapping's dirty pages; NULL means every mapping.
+ *
+ * @return 0, or the first error from the backing store.
+ */
+int
+pagecache_sync (struct page_mapping *mapping)
+{
+  int ret = 0;
+
+  mutex_lock (&pagecache_mutex);
+  for (uint32_t i = 0; i < PAGECACHE_PAGES; i++)
+    {
+      struct cached_page *page = &pages[i];
+      if (!page->mapping || !page->dirty
+          || (mapping && page->mapping != mapping))
+        continue;
+
+      int err = write_page (page);
+      if (err < 0 && ret == 0)
+        ret = err;
+    }
+  mutex_unlock (&pagecache_mutex);
+
+  return ret;
+}
+
+/**
+ * @brief Writes back and drops every page of a mapping.
+ *
+ * Call before the mapping goes away.
+ *
+ * @return 0, or -1 if a page is still held or could not be written.
+ */
+int
+pagecache_invalidate (struct page_mapping *mapping)
+{
+  int ret = 0;
+
+  mutex_lock (&pagecache_mutex);
+  for (uint32_t i = 0; i < PAGECACHE_PAGES && mapping->pages; i++)
+    {
+      struct cached_page *page = &pages[i];
+      if (page->mapping != mapping)
+        continue;
+
+      if (page->refs || (page->dirty && write_page (page) < 0))
+        ret = -1;
+      else
+        drop_page (page);
+    }
+  mutex_unlock (&pagecache_mutex);
+
+  return ret;
+}
+
+void
+pagecache_get_stats (pagecache_stats_t *stats_out)
+{
+  uint64_t flags = irq_save ();
+  *stats_out = stats;
+  irq_restore (flags);
+}
+
+/**
+ * @brief Allocates the page cache's pages.
+ */
+void
+init_pagecache (void)
+{
+  for (uint32_t i = 0; i < PAGECACHE_PAGES; i++)
+    {
+      pages[i].data = alloc_page ();
+      if (!pages[i].data)
+        break;
+      pages[i].hash_next = free_list;
+      free_list = &pages[i];
+    }
+}
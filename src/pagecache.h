@@ -0,0 +1,83 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include <stdint.h>
+
+#define PAGECACHE_PAGES 128 // 512 KiB of file data
+#define PAGECACHE_HASH_BITS 8
+
+// pagecache_get flags
+#define PAGECACHE_NOREAD 0x1 // The caller fills the whole page itself
+
+struct page_mapping;
+
+/**
+ * Backing store of a mapping
+ * Called with the page cache lock held; they may sleep on I/O but must
+ * not call back into the page cache.
+ */
+struct page_mapping_ops
+{
+  int (*readpage) (struct page_mapping *mapping, uint64_t index,
+                   void *page);
+  int (*writepage) (struct page_mapping *mapping, uint64_t index,
+                    const void *page);
+};
+
+/**
+ * A cached object, such as a file
+ * Pages are keyed by (mapping, index), so the mapping must outlive its
+ * pages; see pagecache_invalidate.
+ */
+struct page_mapping
+{
+  const struct page_mapping_ops *ops;
+  uint32_t pages; // Pages cached right now
+  void *priv;
+};
+
+/**
+ * A cached page
+ * Holders of a reference may use data without the cache lock; a page
+ * with references is never evicted.
+ */
+struct cached_page
+{
+  struct page_mapping *mapping;
+  uint64_t index;
+  uint8_t *data;
+  uint8_t dirty;
+  uint32_t refs;
+  struct cached_page *hash_next;
+  struct cached_page *prev; // LRU order
+  struct cached_page *next;
+};
+
+// Page cache statistics
+typedef struct
+{
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t writebacks;
+  uint32_t resident;
+  uint32_t dirty;
+} pagecache_stats_t;
+
+void init_pagecache (void);
+int pagecache_get (struct page_mapping *mapping, uint64_t index, int flags,
+                   struct cached_page **out);
+void pagecache_hold (struct cached_page *page);
+void pagecache_put (struct cached_page *page);
+void pagecache_mark_dirty (struct cached_page *page);
+int pagecache_sync (struct page_mapping *mapping);
+int pagecache_invalidate (struct page_mapping *mapping);
+void pagecache_get_stats (pagecache_stats_t *stats);
+
+#endif
@@ -0,0 +1,483 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "paging.h"
+#include "cpu.h"
+#include "memory.h"
+#include <stddef.h>
+
+#define PT_ENTRIES 512
+#define PF_WRITE (1U << 1) // Page-fault error code: the access was a write
+#define CR0_WP (1ULL << 16)
+
+// Page table levels are reached through their physical address, so the
+// tables themselves must live in identity-mapped memory.
+static inline uint64_t *
+table_of (uint64_t entry)
+{
+  return (uint64_t *)(uintptr_t)(entry & PAGE_ADDR_MASK);
+}
+
+static inline int
+table_index (uintptr_t virt, int level)
+{
+  return (virt >> (12 + 9 * level)) & (PT_ENTRIES - 1);
+}
+
+static inline void
+invlpg (uintptr_t virt)
+{
+  asm volatile ("invlpg (%0)" : : "r"(virt) : "memory");
+}
+
+/**
+ * @brief Makes read-only pages read-only for the kernel as well.
+ *
+ * Without CR0.WP a kernel write to a copy-on-write page, such as a
+ * system call filling a user buffer, would land in the shared page.
+ */
+void
+init_paging (void)
+{
+  uint64_t cr0;
+  asm volatile ("mov %%cr0, %0" : "=r"(cr0));
+  asm volatile ("mov %0, %%cr0" : : "r"(cr0 | CR0_WP));
+}
+
+/**
+ * @brief Returns the PML4 currently loaded in CR3.
+ */
+uint64_t *
+paging_current (void)
+{
+  uint64_t cr3;
+  asm volatile ("mov %%cr3, %0" : "=r"(cr3));
+  return table_of (cr3);
+}
+
+/**
+ * @brief Walks the page tables down to the PTE for a virtual address.
+ *
+ * @param pml4 The top-level table to walk.
+ * @param virt The virtual address to look up.
+ * @param create Allocate missing intermediate tables when non-zero.
+ * @param flags Flags to propagate to intermediate entries (PAGE_USER).
+ *
+ * @return Pointer to the PTE, or NULL if it does not exist or is covered by
+ *         a large page.
+ */
+static uint64_t *
+walk (uint64_t *pml4, uintptr_t virt, int create, uint64_t flags)
+{
+  uint64_t *table = pml4;
+
+  for (int level = 3; level > 0; level--)
+    {
+      uint64_t *entry = &table[table_index (virt, level)];
+
+      if (!(*entry & PAGE_PRESENT))
+        {
+          if (!create)
+            return NULL;
+
+          void *next = alloc_page ();
+          if (!next)
+            return NULL;
+
+          *entry = (uintptr_t)next | PAGE_PRESENT | PAGE_WRITABLE;
+        }
+      else if (*entry & PAGE_LARGE)
+        {
+          return NULL;
+        }
+
+      // Intermediate levels must allow user access for any user leaf below
+      *entry |= flags & PAGE_USER;
+      table = table_of (*entry);
+    }
+
+  return &table[table_index (virt, 0)];
+}
+
+/**
+ * @brief Maps a single 4 KB page.
+ *
+ * @param pml4 The address space to modify.
+ * @param virt Page-aligned virtual address.
+ * @param phys Page-aligned physical address.
+ * @param flags PAGE_* flags for the leaf entry; PAGE_PRESENT is implied.
+ *
+ * @return 0 on success, or a negative value on error.
+ */
+int
+paging_map (uint64_t *pml4, uintptr_t virt, uintptr_t phys, uint64_t flags)
+{
+  uint64_t *pte = walk (pml4, virt, 1, flags);
+  if (!pte)
+    return -1;
+
+  *pte = (phys & PAGE_ADDR_MASK) | flags | PAGE_PRESENT;
+  invlpg (virt);
+  return 0;
+}
+
+/**
+ * @brief Removes the mapping for a single 4 KB page, if there is one.
+ */
+void
+paging_unmap (uint64_t *pml4, uintptr_t virt)
+{
+  uint64_t *pte = walk (pml4, virt, 0, 0);
+  if (!pte)
+    return;
+
+  *pte = 0;
+  invlpg (virt);
+}
+
+/**
+ * @brief Returns the PTE mapping a virtual address, or NULL if unmapped.
+ */
+uint64_t *
+paging_lookup (uint64_t *pml4, uintptr_t virt)
+{
+  uint64_t *pte = walk (pml4, virt, 0, 0);
+  if (!pte || !(*pte & PAGE_PRESENT))
+    return NULL;
+  return pte;
+}
+
+/**
+ * @brief Checks that a buffer passed in by a process is its to use.
+ *
+ * Every page of [virt, virt + len) must be mapped PAGE_USER, and
+ * writable if write is set. Copy-on-write pages count as writable: a
+ * kernel write to one faults and gets its own copy.
+ *
+ * @return 1 if the whole range is accessible, 0 otherwise.
+ */
+int
+paging_user_range (uint64_t *pml4, uintptr_t virt, size_t len, int write)
+{
+  if (virt + len < virt)
+    return 0;
+
+  uintptr_t end = virt + len;
+  for (uintptr_t page = virt & ~(uintptr_t)(PAGE_SIZE - 1); page < end;
+       page += PAGE_SIZE)
+    {
+      uint64_t *pte = paging_lookup (pml4, page);
+      if (!pte || !(*pte & PAGE_USER))
+        return 0;
+      if (write && !(*pte & (PAGE_WRITABLE | PAGE_COW)))
+        return 0;
+    }
+  return 1;
+}
+
+/**
+ * @brief Checks that a string passed in by a process is its to read.
+ *
+ * @return 1 if a NUL terminator comes within max bytes of str and every
+ *         byte up to it is mapped PAGE_USER, 0 otherwise.
+ */
+int
+paging_user_string (uint64_t *pml4, uintptr_t str, size_t max)
+{
+  for (size_t i = 0; i < max; i++)
+    {
+      uintptr_t addr = str + i;
+      if (addr < str)
+        return 0;
+      if ((i == 0 || (addr & (PAGE_SIZE - 1)) == 0)
+          && !paging_user_range (pml4, addr, 1, 0))
+        return 0;
+      if (*(const volatile char *)addr == '\0')
+        return 1;
+    }
+  return 0;
+}
+
+/**
+ * @brief Translates a virtual address, following large pages.
+ *
+ * @return The physical address, or virt itself when it is not mapped
+ *         through pml4 (identity-mapped boot memory).
+ */
+uintptr_t
+paging_virt_to_phys (uint64_t *pml4, uintptr_t virt)
+{
+  uint64_t *table = pml4;
+
+  for (int level = 3; level >= 0; level--)
+    {
+      uint64_t entry = table[table_index (virt, level)];
+      if (!(entry & PAGE_PRESENT))
+        return virt;
+
+      if (level == 0 || (level < 3 && (entry & PAGE_LARGE)))
+        {
+          uintptr_t span = 1ULL << (12 + 9 * level);
+          return (entry & PAGE_ADDR_MASK & ~(span - 1)) | (virt & (span - 1));
+        }
+
+      table = table_of (entry);
+    }
+
+  return virt;
+}
+
+// Whether virt lies in a large page, which walk cannot descend into
+static int
+large_mapped (uint64_t *pml4, uintptr_t virt)
+{
+  uint64_t *table = pml4;
+
+  for (int level = 3; level > 0; level--)
+    {
+      uint64_t entry = table[table_index (virt, level)];
+      if (!(entry & PAGE_PRESENT))
+        return 0;
+      if (level < 3 && (entry & PAGE_LARGE))
+        return 1;
+      table = table_of (entry);
+    }
+  return 0;
+}
+
+/**
+ * @brief Identity-maps a device register range uncached.
+ *
+ * Ranges the boot page tables already cover with large pages are left as
+ * they are.
+ *
+ * @return The virtual address of the registers, or NULL if a page table
+ *         could not be allocated.
+ */
+void *
+paging_map_mmio (uintptr_t phys, size_t size)
+{
+  uint64_t *pml4 = paging_current ();
+  uintptr_t start = phys & ~(uintptr_t)(PAGE_SIZE - 1);
+
+  for (uintptr_t page = start; page < phys + size; page += PAGE_SIZE)
+    {
+      if (paging_map (pml4, page, page,
+                      PAGE_WRITABLE | PAGE_WRITE_THROUGH | PAGE_CACHE_DISABLE)
+              < 0
+          && !large_mapped (pml4, page))
+        return NULL;
+    }
+
+  return (void *)phys;
+}
+
+// Releases a table and everything below it that the clone referenced
+static void
+destroy_table (uint64_t *table, int level)
+{
+  for (int i = 0; i < PT_ENTRIES; i++)
+    {
+      uint64_t entry = table[i];
+      if (!(entry & PAGE_PRESENT) || (level > 0 && (entry & PAGE_LARGE)))
+        continue;
+
+      if (level == 0)
+        free_page (table_of (entry));
+      else
+        destroy_table (table_of (entry), level - 1);
+    }
+  free_page (table);
+}
+
+// Shares one page with a clone; writable pool pages become copy-on-write
+static uint64_t
+clone_leaf (uint64_t *entry)
+{
+  uint64_t pte = *entry;
+  void *page = table_of (pte);
+
+  page_get (page);
+  if ((pte & (PAGE_WRITABLE | PAGE_COW)) && !(pte & PAGE_NOCOW)
+      && page_refcount (page))
+    {
+      pte = (pte & ~PAGE_WRITABLE) | PAGE_COW;
+      *entry = pte;
+    }
+  return pte;
+}
+
+// Copies a table and the tables below it, sharing the pages they map
+static uint64_t *
+clone_table (uint64_t *table, int level)
+{
+  uint64_t *copy = alloc_page ();
+  if (!copy)
+    return NULL;
+
+  for (int i = 0; i < PT_ENTRIES; i++)
+    {
+      uint64_t entry = table[i];
+      if (!(entry & PAGE_PRESENT))
+        continue;
+
+      if (level == 0)
+        {
+          copy[i] = clone_leaf (&table[i]);
+          continue;
+        }
+      if (entry & PAGE_LARGE)
+        {
+          copy[i] = entry;
+          continue;
+        }
+
+      uint64_t *next = clone_table (table_of (entry), level - 1);
+      if (!next)
+        {
+          destroy_table (copy, level);
+          return NULL;
+        }
+      copy[i] = (uintptr_t)next | (entry & ~PAGE_ADDR_MASK);
+    }
+  return copy;
+}
+
+static inline int
+private_slot (int index)
+{
+  return index >= table_index (PAGING_PRIVATE_BASE, 3)
+         && index <= table_index (PAGING_PRIVATE_END - 1, 3);
+}
+
+/**
+ * @brief Creates a copy-on-write copy of an address space.
+ *
+ * Only PAGING_PRIVATE_BASE..PAGING_PRIVATE_END is copied; the rest of
+ * the top-level entries are shared with pml4. No data is copied: the
+ * pages are shared, and writable ones are write-protected on both
+ * sides and marked PAGE_COW, so the first write to one copies it in
+ * paging_cow_fault. Pages mapped PAGE_NOCOW stay writable and shared.
+ *
+ * @return The new PML4, or NULL when out of pages.
+ */
+uint64_t *
+paging_clone (uint64_t *pml4)
+{
+  uint64_t *copy = alloc_page ();
+  if (!copy)
+    return NULL;
+
+  uint64_t flags = irq_save ();
+  for (int i = 0; i < PT_ENTRIES; i++)
+    {
+      uint64_t entry = pml4[i];
+      if (!private_slot (i) || !(entry & PAGE_PRESENT))
+        {
+          copy[i] = entry;
+          continue;
+        }
+
+      uint64_t *next = clone_table (table_of (entry), 2);
+      if (!next)
+        {
+          irq_restore (flags);
+          paging_destroy (copy);
+          return NULL;
+        }
+      copy[i] = (uintptr_t)next | (entry & ~PAGE_ADDR_MASK);
+    }
+
+  // Drop the writable translations the parent may have cached
+  if (pml4 == paging_current ())
+    paging_switch (NULL);
+  irq_restore (flags);
+
+  return copy;
+}
+
+/**
+ * @brief Frees an address space made by paging_clone.
+ *
+ * Pages still shared with another address space only lose a reference.
+ * The address space must not be loaded.
+ */
+void
+paging_destroy (uint64_t *pml4)
+{
+  for (int i = 0; i < PT_ENTRIES; i++)
+    {
+      if (private_slot (i) && (pml4[i] & PAGE_PRESENT))
+        destroy_table (table_of (pml4[i]), 2);
+    }
+  free_page (pml4);
+}
+
+/**
+ * @brief Loads an address space, or reloads the current one if NULL.
+ *
+ * Reloading flushes every non-global translation.
+ */
+void
+paging_switch (uint64_t *pml4)
+{
+  uint64_t *current = paging_current ();
+
+  if (!pml4)
+    pml4 = current;
+  else if (pml4 == current)
+    return;
+
+  asm volatile ("mov %0, %%cr3" : : "r"((uintptr_t)pml4) : "memory");
+}
+
+/**
+ * @brief Resolves a write fault on a copy-on-write page.
+ *
+ * The last address space using the page keeps it and only gets write
+ * access back; the others get a private copy.
+ *
+ * @return 0 if the write may be retried, -1 if the fault is not a
+ *         copy-on-write fault or no page is left for the copy.
+ */
+int
+paging_cow_fault (uintptr_t virt, uint64_t error)
+{
+  if (!(error & PF_WRITE))
+    return -1;
+
+  uint64_t flags = irq_save ();
+  uint64_t *pte = paging_lookup (paging_current (), virt);
+  if (!pte || !(*pte & PAGE_COW))
+    {
+      irq_restore (flags);
+      return -1;
+    }
+
+  uint64_t *page = table_of (*pte);
+  uint64_t bits = (*pte & ~(PAGE_ADDR_MASK | PAGE_COW)) | PAGE_WRITABLE;
+
+  if (page_refcount (page) > 1)
+    {
+      uint64_t *copy = alloc_page ();
+      if (!copy)
+        {
+          irq_restore (flags);
+          return -1;
+        }
+
+      for (int i = 0; i < PT_ENTRIES; i++)
+        copy[i] = page[i];
+      *pte = (uintptr_t)copy | bits;
+      free_page (page);
+    }
+  else
+    *pte = (uintptr_t)page | bits;
+
+  invlpg (virt);
+  irq_restore (flags);
+  return 0;
+}
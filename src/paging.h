@@ -0,0 +1,45 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef PAGING_H
+#define PAGING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Page table entry flags
+#define PAGE_PRESENT (1ULL << 0)
+#define PAGE_WRITABLE (1ULL << 1)
+#define PAGE_USER (1ULL << 2)
+#define PAGE_WRITE_THROUGH (1ULL << 3)
+#define PAGE_CACHE_DISABLE (1ULL << 4)
+#define PAGE_LARGE (1ULL << 7)
+#define PAGE_COW (1ULL << 10)   // Software: copy on the next write
+#define PAGE_NOCOW (1ULL << 11) // Software: stays shared across clones
+#define PAGE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+// Per-process part of the address space, copied on write by
+// paging_clone. Everything outside it is shared by all address spaces.
+#define PAGING_PRIVATE_BASE 0x00007F0000000000ULL
+#define PAGING_PRIVATE_END 0x0000800000000000ULL
+
+void init_paging (void);
+uint64_t *paging_current (void);
+int paging_map (uint64_t *pml4, uintptr_t virt, uintptr_t phys,
+                uint64_t flags);
+void paging_unmap (uint64_t *pml4, uintptr_t virt);
+uint64_t *paging_lookup (uint64_t *pml4, uintptr_t virt);
+int paging_user_range (uint64_t *pml4, uintptr_t virt, size_t len,
+                       int write);
+int paging_user_string (uint64_t *pml4, uintptr_t str, size_t max);
+uintptr_t paging_virt_to_phys (uint64_t *pml4, uintptr_t virt);
+void *paging_map_mmio (uintptr_t phys, size_t size);
+uint64_t *paging_clone (uint64_t *pml4);
+void paging_destroy (uint64_t *pml4);
+void paging_switch (uint64_t *pml4);
+int paging_cow_fault (uintptr_t virt, uint64_t error);
+
+#endif
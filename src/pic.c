@@ -0,0 +1,83 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "pic.h"
+#include "io.h"
+
+#define PIC1_COMMAND 0x20
+#define PIC1_DATA 0x21
+#define PIC2_COMMAND 0xA0
+#define PIC2_DATA 0xA1
+#define PIC_EOI 0x20
+#define PIC_CASCADE_IRQ 2
+
+#define ICW1_INIT 0x11 // Initialization, ICW4 needed
+#define ICW4_8086 0x01
+
+static void
+pic_chip_eoi (uint64_t vector)
+{
+  if (vector >= IRQ_BASE && vector < IRQ_BASE + IRQ_COUNT)
+    pic_send_eoi (vector - IRQ_BASE);
+}
+
+const struct irq_chip pic_chip = {
+  .eoi = pic_chip_eoi,
+  .mask = pic_mask,
+  .unmask = pic_unmask,
+};
+
+/**
+ * @brief Moves the 8259 vectors away from the CPU exception range.
+ *
+ * All lines start masked except the cascade; they are unmasked as
+ * handlers are registered.
+ */
+void
+pic_remap (uint8_t master_base, uint8_t slave_base)
+{
+  outb (PIC1_COMMAND, ICW1_INIT);
+  outb (PIC2_COMMAND, ICW1_INIT);
+  outb (PIC1_DATA, master_base);
+  outb (PIC2_DATA, slave_base);
+  outb (PIC1_DATA, 1 << PIC_CASCADE_IRQ); // Slave on IRQ 2
+  outb (PIC2_DATA, PIC_CASCADE_IRQ);      // Slave cascade identity
+  outb (PIC1_DATA, ICW4_8086);
+  outb (PIC2_DATA, ICW4_8086);
+
+  outb (PIC1_DATA, ~(1 << PIC_CASCADE_IRQ) & 0xFF);
+  outb (PIC2_DATA, 0xFF);
+}
+
+void
+pic_send_eoi (uint8_t irq)
+{
+  if (irq >= 8)
+    outb (PIC2_COMMAND, PIC_EOI);
+  outb (PIC1_COMMAND, PIC_EOI);
+}
+
+void
+pic_mask (uint8_t irq)
+{
+  uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+  outb (port, inb (port) | (1 << (irq & 7)));
+}
+
+void
+pic_unmask (uint8_t irq)
+{
+  uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+  outb (port, inb (port) & ~(1 << (irq & 7)));
+}
+
+// Mask every line, for when another interrupt controller takes over
+void
+pic_disable (void)
+{
+  outb (PIC1_DATA, 0xFF);
+  outb (PIC2_DATA, 0xFF);
+}
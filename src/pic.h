@@ -0,0 +1,21 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef PIC_H
+#define PIC_H
+
+#include "idt.h"
+#include <stdint.h>
+
+extern const struct irq_chip pic_chip;
+
+void pic_remap (uint8_t master_base, uint8_t slave_base);
+void pic_send_eoi (uint8_t irq);
+void pic_mask (uint8_t irq);
+void pic_unmask (uint8_t irq);
+void pic_disable (void);
+
+#endif
@@ -0,0 +1,22 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef PROCESS_H
+#define PROCESS_H
+
+#include <stdint.h>
+
+void create_process (void (*start_routine) (void));
+int64_t clone_process (void (*start_routine) (void));
+void schedule (void);
+void schedule_pending (void);
+uint64_t current_process_id (void);
+void block_current (void);
+void wake_process (uint64_t pid);
+void exit_process (void) __attribute__ ((noreturn));
+uint64_t *process_use_space (uint64_t *pml4);
+
+#endif
@@ -0,0 +1,93 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "softirq.h"
+#include "cpu.h"
+#include <stddef.h>
+
+// Pending work per CPU. Only its own CPU touches a queue, always with
+// interrupts disabled, so no lock is needed.
+struct softirq_queue
+{
+  struct softirq *head;
+  struct softirq *tail;
+  uint8_t running;
+};
+
+static struct softirq_queue queues[MAX_CPUS];
+
+/**
+ * @brief Queues work to run on this CPU at interrupt exit.
+ *
+ * Raising work that is already pending does nothing.
+ */
+void
+softirq_raise (struct softirq *work)
+{
+  uint64_t flags = irq_save ();
+  struct softirq_queue *queue = &queues[this_cpu ()->index];
+
+  if (!work->pending)
+    {
+      work->pending = 1;
+      work->next = NULL;
+      if (queue->tail)
+        queue->tail->next = work;
+      else
+        queue->head = work;
+      queue->tail = work;
+    }
+
+  irq_restore (flags);
+}
+
+/**
+ * @brief Runs this CPU's pending work; called on interrupt exit.
+ *
+ * Entered with interrupts disabled. Each item runs with interrupts
+ * enabled, so an interrupt arriving meanwhile can raise more work; its
+ * own exit path sees the queue already running, leaves it to us and
+ * does not switch processes.
+ */
+void
+softirq_run (void)
+{
+  struct softirq_queue *queue = &queues[this_cpu ()->index];
+
+  if (queue->running || !queue->head)
+    return;
+
+  queue->running = 1;
+  while (queue->head)
+    {
+      struct softirq *work = queue->head;
+      queue->head = work->next;
+      if (!queue->head)
+        queue->tail = NULL;
+      work->pending = 0;
+
+      asm volatile ("sti" : : : "memory");
+      work->fn (work->arg);
+      asm volatile ("cli" : : : "memory");
+    }
+  queue->running = 0;
+}
+
+/**
+ * @brief Tells whether this CPU is in the middle of running its work.
+ *
+ * An interrupt taken while an item runs must not switch processes:
+ * the queue would stay marked running, and no other process's
+ * interrupts would drain it, until this one got the CPU back.
+ */
+int
+softirq_active (void)
+{
+  uint64_t flags = irq_save ();
+  int running = queues[this_cpu ()->index].running;
+  irq_restore (flags);
+  return running;
+}
@@ -0,0 +1,35 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+
+#include <stdint.h>
+
+/**
+ * Deferred interrupt work
+ * Raised from an interrupt handler and run on the same CPU once the
+ * handler returns, with interrupts enabled. It must not sleep; use
+ * queue_work for that.
+ */
+struct softirq
+{
+  void (*fn) (void *arg);
+  void *arg;
+  struct softirq *next;
+  volatile uint8_t pending;
+};
+
+#define SOFTIRQ_INIT(func, data)                                             \
+  {                                                                          \
+    .fn = (func), .arg = (data), .next = 0, .pending = 0                     \
+  }
+
+void softirq_raise (struct softirq *work);
+void softirq_run (void);
+int softirq_active (void);
+
+#endif
@@ -0,0 +1,38 @@
+[BITS 64]
+
+global switch_context
+global task_entry
+extern exit_process
+
+section .text
+
+; void switch_context (uint64_t *old_rsp, uint64_t new_rsp)
+; Saves the callee-saved registers on the current stack, stores the stack
+; pointer in *old_rsp and resumes the task whose stack is new_rsp. A new
+; task's stack holds the six registers followed by task_entry.
+switch_context:
+    push rbx
+    push rbp
+    push r12
+    push r13
+    push r14
+    push r15
+
+    mov [rdi], rsp
+    mov rsp, rsi
+
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbp
+    pop rbx
+    ret
+
+; First code run by a new task. Switches can happen inside interrupt
+; handlers, so interrupts are enabled here before calling the entry point
+; the creator left in r12. A task whose entry point returns exits.
+task_entry:
+    sti
+    call r12
+    call exit_process
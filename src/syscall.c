@@ -0,0 +1,187 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "syscall.h"
+#include "cpu.h"
+#include "gdt.h"
+#include "idt.h"
+#include "klog.h"
+#include "memory.h"
+#include "paging.h"
+#include "workqueue.h"
+#include <stddef.h>
+
+// RFLAGS bits cleared on SYSCALL entry: TF, IF, DF, AC
+#define SYSCALL_RFLAGS_MASK 0x40700
+
+// User addresses used by the benchmark
+#define BENCH_CODE_ADDR 0x00007FFFE0000000ULL
+#define BENCH_DATA_ADDR (BENCH_CODE_ADDR + 2 * PAGE_SIZE)
+#define BENCH_STACK_ADDR (BENCH_CODE_ADDR + 3 * PAGE_SIZE)
+
+// Read from syscall.asm, indexed by the number in RAX
+syscall_fn_t syscall_table[NR_SYSCALLS];
+
+// syscall_entry.asm
+extern void syscall_entry (void);
+extern void int_syscall_entry (void);
+extern void syscall_bench_user (void);
+
+static void bench_work_fn (void *arg);
+static struct work bench_work = WORK_INIT (bench_work_fn, 0);
+
+static uint64_t
+sys_null (SYSCALL_PARAMS)
+{
+  return 0;
+}
+
+/**
+ * @brief Enables SYSCALL/SYSRET and installs the int 0x80 fallback gate.
+ *
+ * STAR holds the kernel CS in bits 32-47 (SS is CS + 8) and the base for
+ * SYSRET in bits 48-63 (SS is base + 8, CS is base + 16). SFMASK clears
+ * IF on entry so the stack switch cannot be interrupted.
+ */
+void
+init_syscall (void)
+{
+  init_cpu_local ();
+
+  wrmsr (MSR_EFER, rdmsr (MSR_EFER) | EFER_SCE);
+  wrmsr (MSR_STAR, ((uint64_t)KERNEL_CODE_SELECTOR << 32)
+                       | ((uint64_t)(KERNEL_DATA_SELECTOR | 3) << 48));
+  wrmsr (MSR_LSTAR, (uint64_t)syscall_entry);
+  wrmsr (MSR_SFMASK, SYSCALL_RFLAGS_MASK);
+
+  // DPL 3 interrupt gate so user mode may use int 0x80
+  idt_set_entry (SYSCALL_VECTOR, (unsigned long long)int_syscall_entry,
+                 KERNEL_CODE_SELECTOR, 0xEE);
+
+  register_syscall (SYS_NULL, sys_null);
+}
+
+/**
+ * @brief Installs a handler in the system call table.
+ *
+ * @return 0 on success, or a negative value if the number is out of range.
+ */
+int
+register_syscall (uint64_t number, syscall_fn_t handler)
+{
+  if (number >= NR_SYSCALLS)
+    return -1;
+
+  syscall_table[number] = handler;
+  return 0;
+}
+
+/**
+ * @brief Dispatches a system call from C.
+ *
+ * The SYSCALL and int 0x80 entry stubs index syscall_table themselves;
+ * this is the same lookup for callers already running in the kernel.
+ */
+uint64_t
+handle_syscall (uint64_t number, uint64_t arg1, uint64_t arg2, uint64_t arg3,
+                uint64_t arg4, uint64_t arg5, uint64_t arg6)
+{
+  if (number >= NR_SYSCALLS || !syscall_table[number])
+    return SYSCALL_ERROR;
+
+  return syscall_table[number](arg1, arg2, arg3, arg4, arg5, arg6);
+}
+
+/**
+ * @brief Compares null system call cost through SYSCALL and int 0x80.
+ *
+ * syscall_bench_user is position independent, so its pages are aliased
+ * read-only at a user address and run in ring 3 with a private stack and
+ * result page. It reports back through its own page and SYS_EXIT.
+ *
+ * @param iterations Number of calls to make through each entry path.
+ * @param result Filled with total cycles for each path.
+ *
+ * @return 0 on success, or a negative value on error.
+ */
+int
+syscall_benchmark (uint64_t iterations, struct syscall_bench_result *result)
+{
+  if (iterations == 0)
+    return -1;
+
+  uint64_t *pml4 = paging_current ();
+  uintptr_t code = (uintptr_t)syscall_bench_user;
+  uintptr_t code_page = code & ~(uintptr_t)(PAGE_SIZE - 1);
+
+  uint64_t *data = alloc_page ();
+  void *stack = alloc_page ();
+  if (!data || !stack)
+    {
+      free_page (data);
+      free_page (stack);
+      return -1;
+    }
+
+  // The routine is small but may straddle a page boundary
+  for (int i = 0; i < 2; i++)
+    {
+      uintptr_t page = code_page + i * PAGE_SIZE;
+      paging_map (pml4, BENCH_CODE_ADDR + i * PAGE_SIZE,
+                  paging_virt_to_phys (pml4, page), PAGE_USER);
+    }
+  paging_map (pml4, BENCH_DATA_ADDR,
+              paging_virt_to_phys (pml4, (uintptr_t)data),
+              PAGE_USER | PAGE_WRITABLE);
+  paging_map (pml4, BENCH_STACK_ADDR,
+              paging_virt_to_phys (pml4, (uintptr_t)stack),
+              PAGE_USER | PAGE_WRITABLE);
+
+  data[0] = iterations;
+  run_user (BENCH_CODE_ADDR + (code - code_page),
+            BENCH_STACK_ADDR + PAGE_SIZE, BENCH_DATA_ADDR);
+
+  result->iterations = iterations;
+  result->syscall_cycles = data[1];
+  result->int_cycles = data[2];
+
+  for (int i = 0; i < 2; i++)
+    paging_unmap (pml4, BENCH_CODE_ADDR + i * PAGE_SIZE);
+  paging_unmap (pml4, BENCH_DATA_ADDR);
+  paging_unmap (pml4, BENCH_STACK_ADDR);
+  free_page (data);
+  free_page (stack);
+
+  return 0;
+}
+
+static void
+bench_work_fn (void *arg)
+{
+  struct syscall_bench_result r;
+
+  if (syscall_benchmark (SYSCALL_BENCH_ITERATIONS, &r) < 0)
+    {
+      kprintf ("syscallbench: no pages for the user side\n");
+      return;
+    }
+
+  kprintf ("syscallbench: %lu calls, %lu cycles each through SYSCALL, "
+           "%lu through int 0x80\n",
+           r.iterations, r.syscall_cycles / r.iterations,
+           r.int_cycles / r.iterations);
+}
+
+/**
+ * @brief Runs the null system call benchmark from a worker thread.
+ *
+ * Safe from interrupt context; results go to the kernel log.
+ */
+void
+syscall_bench_start (void)
+{
+  queue_work (&bench_work);
+}
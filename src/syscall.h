@@ -0,0 +1,65 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef SYSCALL_H
+#define SYSCALL_H
+
+#include <stdint.h>
+
+#define SYSCALL_VECTOR 0x80
+#define NR_SYSCALLS 64
+#define SYSCALL_ERROR ((uint64_t)-1)
+#define SYSCALL_BENCH_ITERATIONS 100000 // Calls per path for the bench key
+
+// System call numbers
+#define SYS_NULL 0
+#define SYS_WRITE 1
+#define SYS_READ 2
+#define SYS_EXIT 3
+#define SYS_TIME 4
+#define SYS_IORING_SETUP 5
+#define SYS_IORING_ENTER 6
+#define SYS_MMAP 7
+#define SYS_MUNMAP 8
+#define SYS_MSYNC 9
+#define SYS_IPC_CHANNEL 10
+#define SYS_IPC_SEND 11
+#define SYS_IPC_RECV 12
+#define SYS_IPC_CLOSE 13
+#define SYS_IPC_BUFFER 14
+#define SYS_IPC_BUFFER_FREE 15
+#define SYS_FUTEX 16
+
+// Parameter list shared by every system call handler
+#define SYSCALL_PARAMS                                                       \
+  uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5, \
+      uint64_t arg6
+
+typedef uint64_t (*syscall_fn_t) (SYSCALL_PARAMS);
+
+/**
+ * Null system call benchmark results
+ * Cycle counts are totals over all iterations.
+ */
+struct syscall_bench_result
+{
+  uint64_t iterations;
+  uint64_t syscall_cycles; // SYSCALL/SYSRET round trips
+  uint64_t int_cycles;     // int 0x80 / iretq round trips
+};
+
+void init_syscall (void);
+int register_syscall (uint64_t number, syscall_fn_t handler);
+uint64_t handle_syscall (uint64_t number, uint64_t arg1, uint64_t arg2,
+                         uint64_t arg3, uint64_t arg4, uint64_t arg5,
+                         uint64_t arg6);
+uint64_t run_user (uint64_t entry, uint64_t user_stack, uint64_t arg);
+void user_return (uint64_t value);
+int syscall_benchmark (uint64_t iterations,
+                       struct syscall_bench_result *result);
+void syscall_bench_start (void);
+
+#endif
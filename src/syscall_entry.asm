@@ -0,0 +1,192 @@
+[BITS 64]
+
+extern syscall_table
+extern tss
+global syscall_entry
+global int_syscall_entry
+global run_user
+global user_return
+global syscall_bench_user
+
+; Offsets into struct cpu_local (cpu.h)
+%define CPU_KERNEL_RSP 0
+%define CPU_USER_RSP 8
+%define CPU_USER_RETURN_RSP 16
+
+; Offset of RSP0 in struct tss_entry (gdt.c)
+%define TSS_RSP0 4
+
+%define NR_SYSCALLS 64
+%define SYS_NULL 0
+%define SYS_EXIT 3
+%define USER_RFLAGS 0x202
+
+section .text
+
+; SYSCALL entry. RAX holds the number, RDI, RSI, RDX, R10, R8, R9 the
+; arguments. Only the user RIP (RCX), RFLAGS (R11) and RSP are saved: the
+; C handler preserves callee-saved registers, and the remaining
+; caller-saved ones are cleared on the way out instead of restored.
+syscall_entry:
+    swapgs
+    mov [gs:CPU_USER_RSP], rsp
+    mov rsp, [gs:CPU_KERNEL_RSP]
+
+    push qword [gs:CPU_USER_RSP]
+    push rcx
+    push r11
+    sub rsp, 8              ; Keep the stack 16-byte aligned for the call
+
+    mov rcx, r10            ; Fourth argument, C ABI
+    cmp rax, NR_SYSCALLS
+    jae .bad
+    mov rax, [syscall_table + rax * 8]
+    test rax, rax
+    jz .bad
+    call rax
+    jmp .done
+.bad:
+    mov rax, -1
+.done:
+    add rsp, 8
+    pop r11
+    pop rcx
+    pop rsp
+
+    ; Do not leak kernel values through scratch registers
+    xor edi, edi
+    xor esi, esi
+    xor edx, edx
+    xor r8d, r8d
+    xor r9d, r9d
+    xor r10d, r10d
+
+    swapgs
+    o64 sysret
+
+; int 0x80 entry with the same ABI, used for comparison. The CPU already
+; switched to the TSS stack and saved RIP, CS, RFLAGS, RSP and SS.
+int_syscall_entry:
+    test qword [rsp + 8], 3 ; Saved CS, swap GS only when coming from ring 3
+    jz .entered
+    swapgs
+.entered:
+    push rcx
+    push r11
+    sub rsp, 8
+
+    mov rcx, r10
+    cmp rax, NR_SYSCALLS
+    jae .bad
+    mov rax, [syscall_table + rax * 8]
+    test rax, rax
+    jz .bad
+    call rax
+    jmp .done
+.bad:
+    mov rax, -1
+.done:
+    add rsp, 8
+    pop r11
+    pop rcx
+
+    xor edi, edi
+    xor esi, esi
+    xor edx, edx
+    xor r8d, r8d
+    xor r9d, r9d
+    xor r10d, r10d
+
+    test qword [rsp + 8], 3
+    jz .leave
+    swapgs
+.leave:
+    iretq
+
+; uint64_t run_user (uint64_t entry, uint64_t user_stack, uint64_t arg)
+; Runs entry(arg) in ring 3 until it calls user_return through SYS_EXIT.
+run_user:
+    pushfq
+    push rbx
+    push rbp
+    push r12
+    push r13
+    push r14
+    push r15
+    push qword [gs:CPU_KERNEL_RSP]
+
+    mov [gs:CPU_USER_RETURN_RSP], rsp
+    mov rax, rsp
+    and rax, -16
+    mov [gs:CPU_KERNEL_RSP], rax ; System calls run below this frame
+    mov [tss + TSS_RSP0], rax    ; and so do interrupts from ring 3
+
+    cli
+    mov rcx, rdi
+    mov rsp, rsi
+    mov rdi, rdx
+    mov r11, USER_RFLAGS
+    swapgs
+    o64 sysret
+
+; void user_return (uint64_t value)
+; Called from a system call handler, unwinds to the run_user caller.
+user_return:
+    mov rsp, [gs:CPU_USER_RETURN_RSP]
+    mov qword [gs:CPU_USER_RETURN_RSP], 0
+    mov rax, rdi
+
+    pop qword [gs:CPU_KERNEL_RSP]
+    mov rcx, [gs:CPU_KERNEL_RSP]
+    mov [tss + TSS_RSP0], rcx
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbp
+    pop rbx
+    popfq
+    ret
+
+; Ring 3 side of syscall_benchmark. Position independent: it is run from a
+; user alias of this page. RDI points to { iterations, syscall_cycles,
+; int_cycles }.
+syscall_bench_user:
+    mov r12, rdi
+    mov r13, [r12]
+
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    mov r14, rax
+    mov r15, r13
+.syscall_loop:
+    mov eax, SYS_NULL
+    syscall
+    dec r15
+    jnz .syscall_loop
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    sub rax, r14
+    mov [r12 + 8], rax
+
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    mov r14, rax
+    mov r15, r13
+.int_loop:
+    mov eax, SYS_NULL
+    int 0x80
+    dec r15
+    jnz .int_loop
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    sub rax, r14
+    mov [r12 + 16], rax
+
+    mov eax, SYS_EXIT
+    xor edi, edi
+    syscall
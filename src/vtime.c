@@ -0,0 +1,78 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "vtime.h"
+#include "drivers/timer.h"
+#include "memory.h"
+#include "paging.h"
+#include "syscall.h"
+
+static struct vtime_page vtime_page __attribute__ ((aligned (PAGE_SIZE)));
+
+// Fallback for callers that cannot reach the time page
+static uint64_t
+sys_time (SYSCALL_PARAMS)
+{
+  return vtime_now_ns ();
+}
+
+/**
+ * @brief Sets up the shared time page and maps it read-only for user mode.
+ *
+ * Every process currently shares the kernel address space, so one user
+ * mapping at VTIME_USER_ADDR makes the page visible to all of them. The
+ * kernel keeps writing through its own alias.
+ *
+ * @param tsc_hz The calibrated TSC frequency.
+ * @param tick_hz The frequency vtime_update is called at.
+ */
+void
+init_vtime (uint64_t tsc_hz, uint64_t tick_hz)
+{
+  vtime_page.shift = VTIME_SHIFT;
+  vtime_page.mult
+      = tsc_hz ? (1000000000ULL << VTIME_SHIFT) / tsc_hz : 0;
+  vtime_page.tsc_base = read_tsc ();
+  vtime_page.ns_base = 0;
+  vtime_page.ticks = 0;
+  vtime_page.tick_hz = tick_hz;
+  vtime_page.tsc_hz = tsc_hz;
+
+  paging_map (paging_current (), VTIME_USER_ADDR, (uintptr_t)&vtime_page,
+              PAGE_USER);
+
+  register_syscall (SYS_TIME, sys_time);
+}
+
+/**
+ * @brief Advances the time page; called from the timer tick.
+ *
+ * Folds the TSC delta since the last update into ns_base so the reader's
+ * multiplication never sees more than one tick worth of cycles.
+ */
+void
+vtime_update (void)
+{
+  uint64_t tsc = read_tsc ();
+
+  vtime_page.seq++;
+  asm volatile ("" ::: "memory");
+
+  vtime_page.ns_base
+      += ((tsc - vtime_page.tsc_base) * vtime_page.mult) >> vtime_page.shift;
+  vtime_page.tsc_base = tsc;
+  vtime_page.ticks++;
+
+  asm volatile ("" ::: "memory");
+  vtime_page.seq++;
+}
+
+// Kernel-side reader through the kernel alias of the page
+uint64_t
+vtime_now_ns (void)
+{
+  return vtime_read_ns (&vtime_page);
+}
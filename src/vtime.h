@@ -0,0 +1,66 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef VTIME_H
+#define VTIME_H
+
+#include <stdint.h>
+
+// Fixed user address of the read-only time page
+#define VTIME_USER_ADDR 0x00007FFFF0000000ULL
+#define VTIME_SHIFT 24
+
+/**
+ * Shared time page
+ * Written by the kernel on every timer tick, read by anyone without a
+ * syscall. Readers retry while seq is odd or changed under them.
+ */
+struct vtime_page
+{
+  volatile uint32_t seq; // Sequence count, odd while an update is running
+  uint32_t shift;        // TSC to ns conversion shift
+  uint64_t mult;         // TSC to ns conversion multiplier
+  uint64_t tsc_base;     // TSC value at the last update
+  uint64_t ns_base;      // Nanoseconds since boot at the last update
+  uint64_t ticks;        // Timer ticks since boot
+  uint64_t tick_hz;      // Timer tick frequency
+  uint64_t tsc_hz;       // Calibrated TSC frequency
+};
+
+void init_vtime (uint64_t tsc_hz, uint64_t tick_hz);
+void vtime_update (void);
+uint64_t vtime_now_ns (void);
+
+/**
+ * Read nanoseconds since boot from a time page
+ * Safe to call from user mode through VTIME_USER_ADDR.
+ * @param vp Pointer to the time page
+ * @return Nanoseconds since boot
+ */
+static inline uint64_t
+vtime_read_ns (const volatile struct vtime_page *vp)
+{
+  uint32_t seq;
+  uint64_t ns;
+
+  do
+    {
+      seq = vp->seq;
+      asm volatile ("" ::: "memory");
+
+      uint32_t lo, hi;
+      asm volatile ("lfence; rdtsc" : "=a"(lo), "=d"(hi));
+      uint64_t tsc = ((uint64_t)hi << 32) | lo;
+
+      ns = vp->ns_base + (((tsc - vp->tsc_base) * vp->mult) >> vp->shift);
+      asm volatile ("" ::: "memory");
+    }
+  while ((seq & 1) || seq != vp->seq);
+
+  return ns;
+}
+
+#endif
@@ -0,0 +1,91 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#include "workqueue.h"
+#include "cpu.h"
+#include "process.h"
+#include <stddef.h>
+
+static struct work *work_head = NULL;
+static struct work *work_tail = NULL;
+
+// Worker threads and whether each is sleeping for lack of work
+static uint64_t worker_pids[WORKQUEUE_THREADS];
+static volatile uint8_t worker_idle[WORKQUEUE_THREADS];
+static int workers_started = 0;
+
+static void
+worker_main (void)
+{
+  uint64_t flags = irq_save ();
+  int index = workers_started++;
+  worker_pids[index] = current_process_id ();
+  irq_restore (flags);
+
+  while (1)
+    {
+      irq_save ();
+      while (!work_head)
+        {
+          worker_idle[index] = 1;
+          block_current ();
+          worker_idle[index] = 0;
+        }
+
+      struct work *work = work_head;
+      work_head = work->next;
+      if (!work_head)
+        work_tail = NULL;
+      work->pending = 0;
+      asm volatile ("sti" : : : "memory");
+
+      work->fn (work->arg);
+    }
+}
+
+/**
+ * @brief Starts the kernel worker threads.
+ */
+void
+init_workqueue (void)
+{
+  for (int i = 0; i < WORKQUEUE_THREADS; i++)
+    create_process (worker_main);
+}
+
+/**
+ * @brief Queues work for a worker thread; safe from interrupt context.
+ *
+ * Queuing work that is already pending does nothing.
+ */
+void
+queue_work (struct work *work)
+{
+  uint64_t flags = irq_save ();
+
+  if (!work->pending)
+    {
+      work->pending = 1;
+      work->next = NULL;
+      if (work_tail)
+        work_tail->next = work;
+      else
+        work_head = work;
+      work_tail = work;
+
+      for (int i = 0; i < workers_started; i++)
+        {
+          if (worker_idle[i])
+            {
+              worker_idle[i] = 0;
+              wake_process (worker_pids[i]);
+              break;
+            }
+        }
+    }
+
+  irq_restore (flags);
+}
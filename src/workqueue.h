@@ -0,0 +1,34 @@
+// SPDX-LICENSE-Identifier: GPL-3.0
+
+/*
+ * Copyright Rusin Danilo <rusindanilo@gmail.com> VoltagedDebunked
+ */
+
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <stdint.h>
+
+#define WORKQUEUE_THREADS 2
+
+/**
+ * Work item run by a kernel worker thread
+ * Unlike a softirq, the function may block.
+ */
+struct work
+{
+  void (*fn) (void *arg);
+  void *arg;
+  struct work *next;
+  volatile uint8_t pending;
+};
+
+#define WORK_INIT(func, data)                                                \
+  {                                                                          \
+    .fn = (func), .arg = (data), .next = 0, .pending = 0                     \
+  }
+
+void init_workqueue (void);
+void queue_work (struct work *work);
+
+#endif